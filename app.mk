@@ -51,7 +51,10 @@ endif
 App_Cpp_Files := pkcs11/CryptoEntity.cpp pkcs11/pkcs11.cpp pkcs11/TestApp.cpp pkcs11/Attribute.cpp pkcs11/AttributeSerial.cpp pkcs11/Database.cpp
 App_Include_Paths := -Ipkcs11 -I$(SGX_SDK)/include -I$(OPENSSL_PATH)/include
 
-App_C_Flags := $(SGX_COMMON_CFLAGS) -fPIC -Wno-attributes $(App_Include_Paths)
+# Must match the TCSNum the enclave is signed with, see enclave.mk
+ENCLAVE_TCS_NUM ?= 8
+
+App_C_Flags := $(SGX_COMMON_CFLAGS) -fPIC -Wno-attributes $(App_Include_Paths) -DENCLAVE_TCS_NUM=$(ENCLAVE_TCS_NUM)
 
 ifeq ($(SGX_DEBUG), 1)
 	App_C_Flags += -DDEBUG -UNDEBUG -UEDEBUG
@@ -67,7 +70,7 @@ App_Cpp_Flags := $(App_C_Flags) -fpermissive
 App_Link_Flags := $(SGX_COMMON_CFLAGS) -L$(SGX_LIBRARY_PATH) \
     -L$(OPENSSL_PATH)/lib -L$(SGX_SSL_LIB) \
     -Wl,--start-group -lcrypto -lssl -ldl -Wl,--end-group \
-    -lsgx_usgxssl -lsgx_uae_service \
+    -lsgx_usgxssl -lsgx_uae_service -lsgx_uswitchless \
     -l$(Urts_Library_Name) -lpthread -lsqlite3
 
 ifneq ($(SGX_MODE), HW)
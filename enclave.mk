@@ -52,7 +52,7 @@ else
 	Service_Library_Name := sgx_tservice
 endif
 
-Enclave_Cpp_Files := enclave/enclave.cpp enclave/Attribute.cpp enclave/AttributeSerial.cpp enclave/rsa.cpp enclave/ec.cpp enclave/ssss.cpp enclave/arm.cpp
+Enclave_Cpp_Files := enclave/enclave.cpp enclave/Attribute.cpp enclave/AttributeSerial.cpp enclave/rsa.cpp enclave/ec.cpp enclave/ssss.cpp enclave/arm.cpp enclave/keycache.cpp enclave/keyformat.cpp enclave/rsapool.cpp enclave/ecpool.cpp enclave/worker.cpp enclave/arena.cpp enclave/AttributeView.cpp
 Enclave_Include_Paths := -Ipkcs11 -Icryptoki -I$(SGX_SDK)/include -I$(SGX_SDK)/include/libcxx -I$(SGX_SDK)/include/tlibc -I$(SGX_SSL)/include
 
 Enclave_C_Flags := $(SGX_COMMON_CFLAGS) -nostdinc -fvisibility=hidden -fpie -ffunction-sections -fdata-sections -fstack-protector-strong $(Enclave_Include_Paths) -include "tsgxsslio.h"
@@ -60,7 +60,7 @@ Enclave_Cpp_Flags := $(Enclave_C_Flags) -nostdinc++ -std=c++11
 
 Enclave_Link_Flags := $(SGX_COMMON_CFLAGS) -Wl,--no-undefined -nostdlib -nodefaultlibs -nostartfiles \
 	-L$(SGX_SSL_LIB) \
-	-Wl,--whole-archive -lsgx_pthread -lsgx_tsgxssl -Wl,--no-whole-archive -lsgx_tsgxssl_crypto \
+	-Wl,--whole-archive -lsgx_pthread -lsgx_tswitchless -lsgx_tsgxssl -Wl,--no-whole-archive -lsgx_tsgxssl_crypto \
 	-L$(SGX_LIBRARY_PATH) \
 	-Wl,--whole-archive -l$(Trts_Library_Name) -Wl,--no-whole-archive \
 	-Wl,--start-group -lsgx_tstdc -lsgx_tcxx -lsgx_tcrypto -l$(Service_Library_Name) -Wl,--end-group \
@@ -74,6 +74,10 @@ Enclave_Cpp_Objects := $(Enclave_Cpp_Files:.cpp=.o)
 Enclave_Name := PKCS11_crypto_engine.so
 Signed_Enclave_Name := PKCS11_crypto_engine.signed.so
 Enclave_Config_File := enclave/enclave.config.xml
+# Number of enclave threads (TCS), one per concurrent ECALL, switchless worker
+# or the pool worker thread
+ENCLAVE_TCS_NUM ?= 8
+Enclave_Build_Config_File := enclave/enclave.config.build.xml
 
 ifeq ($(SGX_MODE), HW)
     ifeq ($(SGX_DEBUG), 1)
@@ -96,11 +100,11 @@ endif
 .PHONY: all
 
 ifeq ($(Build_Mode), HW_RELEASE)
-all: $(Enclave_Name)
+all: $(Enclave_Name) $(Enclave_Build_Config_File)
 	@echo "The project has been built in release hardware mode."
 	@echo "Please sign the $(Enclave_Name) first with your signing key before you run the $(App_Name) to launch and access the ESigner."
 	@echo "To sign the ESigner use the command:"
-	@echo "   $(SGX_ENCLAVE_SIGNER) sign -key <your key> -ESigner $(Enclave_Name) -out <$(Signed_Enclave_Name)> -config $(Enclave_Config_File)"
+	@echo "   $(SGX_ENCLAVE_SIGNER) sign -key <your key> -ESigner $(Enclave_Name) -out <$(Signed_Enclave_Name)> -config $(Enclave_Build_Config_File)"
 	@echo "You can also sign the ESigner using an external signing tool."
 	@echo "To build the project in simulation mode set SGX_MODE=SIM. To build the project in prerelease mode set SGX_PRERELEASE=1."
 else
@@ -134,11 +138,14 @@ $(Enclave_Name): enclave/crypto_engine_t.o $(Enclave_Cpp_Objects)
 	@$(CXX) $^ -o $@ $(Enclave_Link_Flags)
 	@echo "Linking =>  $@"
 
-$(Signed_Enclave_Name): $(Enclave_Name)
+$(Enclave_Build_Config_File): $(Enclave_Config_File)
+	@sed 's#<TCSNum>[0-9]*</TCSNum>#<TCSNum>$(ENCLAVE_TCS_NUM)</TCSNum>#' $< > $@
+
+$(Signed_Enclave_Name): $(Enclave_Name) $(Enclave_Build_Config_File)
 	@echo "Signing enclave =>  $@"
-	@$(SGX_ENCLAVE_SIGNER) sign -key enclave/crypto_engine_private.pem -enclave $(Enclave_Name) -out $@ -config $(Enclave_Config_File)
+	@$(SGX_ENCLAVE_SIGNER) sign -key enclave/crypto_engine_private.pem -enclave $(Enclave_Name) -out $@ -config $(Enclave_Build_Config_File)
 
 .PHONY: clean
 
 clean:
-	@rm -f $(Enclave_Name) $(Signed_Enclave_Name) $(Enclave_Cpp_Objects) enclave/crypto_engine_t.*
+	@rm -f $(Enclave_Name) $(Signed_Enclave_Name) $(Enclave_Cpp_Objects) $(Enclave_Build_Config_File) enclave/crypto_engine_t.*
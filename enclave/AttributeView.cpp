@@ -0,0 +1,90 @@
+#include <string.h>
+#include "AttributeView.h"
+
+
+AttributeView::AttributeView(const uint8_t *pSerialized, size_t serializedLen):
+        pSerialized(pSerialized), nrAttributes(0), valid(false) {
+    size_t offset = 0;
+
+    if (serializedLen > UINT32_MAX) return;
+    while (offset < serializedLen) {
+        const serializedAttr *p = (const serializedAttr *) (pSerialized + offset);
+        size_t i;
+
+        if (serializedLen - offset < sizeof *p) return;
+        if (p->ulValueLen > serializedLen - offset - sizeof *p) return;
+        // Serialized sets come ordered by type, so this is a single compare
+        // per attribute. A later duplicate replaces an earlier one.
+        for (i = nrAttributes; i > 0 && at(i - 1)->type > p->type; i--);
+        if (i > 0 && at(i - 1)->type == p->type) {
+            offsets[i - 1] = (uint32_t) offset;
+        } else {
+            if (nrAttributes == ATTRIBUTE_VIEW_MAX) return;
+            memmove(offsets + i + 1, offsets + i, (nrAttributes - i) * sizeof *offsets);
+            offsets[i] = (uint32_t) offset;
+            nrAttributes++;
+        }
+        offset += sizeof *p + p->ulValueLen;
+    }
+    valid = true;
+}
+
+
+const serializedAttr *AttributeView::at(size_t i) const {
+    return (const serializedAttr *) (pSerialized + offsets[i]);
+}
+
+
+bool AttributeView::isValid() const {
+    return valid;
+}
+
+
+const serializedAttr *AttributeView::get(CK_ATTRIBUTE_TYPE type) const {
+    size_t lo = 0, hi = valid ? nrAttributes : 0;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const serializedAttr *p = at(mid);
+
+        if (p->type == type) return p;
+        if (p->type < type) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+
+template<typename T>
+const T *AttributeView::getType(CK_ATTRIBUTE_TYPE type) const {
+    const serializedAttr *p = this->get(type);
+    if (p == NULL) return NULL;
+    if (sizeof(T) != p->ulValueLen) return NULL;
+    return (const T *) p->pValue;
+}
+
+template const CK_BBOOL *AttributeView::getType<CK_BBOOL>(CK_ATTRIBUTE_TYPE type) const;
+template const CK_ULONG *AttributeView::getType<CK_ULONG>(CK_ATTRIBUTE_TYPE type) const;
+
+
+template<typename T>
+bool AttributeView::check(CK_ATTRIBUTE_TYPE type, T v) const {
+    const T *p = this->getType<T>(type);
+    return p != NULL && *p == v;
+}
+
+template bool AttributeView::check<CK_ULONG>(CK_ATTRIBUTE_TYPE type, CK_ULONG v) const;
+template bool AttributeView::check<CK_BBOOL>(CK_ATTRIBUTE_TYPE type, CK_BBOOL v) const;
+
+
+template<typename T>
+const T *AttributeView::checkIn(CK_ATTRIBUTE_TYPE type, const T *pVal, size_t nr) const {
+    const T *p = this->getType<T>(type);
+    if (p == NULL) return NULL;
+    for (size_t i = 0; i < nr; i++) {
+        if (*p == pVal[i]) return p;
+    }
+    return NULL;
+}
+
+template const CK_ULONG *AttributeView::checkIn<CK_ULONG>(CK_ATTRIBUTE_TYPE type, const CK_ULONG *pVal, size_t nr) const;
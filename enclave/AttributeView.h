@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pkcs11-interface.h"
+#include "Attribute.h"
+
+// Largest serialized attribute set a view accepts
+#define ATTRIBUTE_VIEW_MAX 128
+
+// Read-only view over serialized attributes. The constructor checks the
+// bounds once and keeps a table of offsets sorted by type, lookups binary
+// search it directly over the input buffer. Nothing is copied or allocated,
+// so the buffer has to outlive the view.
+class AttributeView
+{
+private:
+    const uint8_t *pSerialized;
+    uint32_t offsets[ATTRIBUTE_VIEW_MAX];
+    size_t nrAttributes;
+    bool valid;
+
+    const serializedAttr *at(size_t i) const;
+public:
+    AttributeView(const uint8_t *pSerialized, size_t serializedLen);
+
+    // A malformed set is not valid and every lookup on it fails
+    bool isValid() const;
+    const serializedAttr *get(CK_ATTRIBUTE_TYPE type) const;
+    template<typename T>
+    const T *getType(CK_ATTRIBUTE_TYPE type) const;
+    template<typename T>
+    bool check(CK_ATTRIBUTE_TYPE type, T v) const;
+    template<typename T>
+    const T *checkIn(CK_ATTRIBUTE_TYPE type, const T *pVal, size_t nr) const;
+};
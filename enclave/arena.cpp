@@ -0,0 +1,100 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/crypto.h>
+
+#include "arena.h"
+
+struct arenaOverflow {
+    struct arenaOverflow *next;
+    size_t size;
+};
+
+typedef struct {
+    uint8_t *base;
+    size_t used;
+    size_t overflowBytes;
+    struct arenaOverflow *overflow;
+    unsigned int depth;
+} arena_t;
+
+static __thread arena_t arena;
+static size_t peak = 0;
+static size_t overflows = 0;
+
+
+static void updatePeak(const arena_t *a) {
+    size_t use = a->used + a->overflowBytes;
+    size_t current = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+
+    while (use > current && !__atomic_compare_exchange_n(&peak, &current, use, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+void *arenaAlloc(size_t size) {
+    arena_t *a = &arena;
+    struct arenaOverflow *o;
+    void *p;
+
+    if (size > SIZE_MAX - sizeof *o - ARENA_ALIGN) return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    // Taken on first use, a thread keeps its arena for good
+    if (a->base == NULL) a->base = (uint8_t *) malloc(ARENA_SIZE);
+    if (a->base != NULL && size <= ARENA_SIZE - a->used) {
+        p = a->base + a->used;
+        a->used += size;
+    } else {
+        if ((o = (struct arenaOverflow *) malloc(sizeof *o + size)) == NULL) return NULL;
+        o->next = a->overflow;
+        o->size = size;
+        a->overflow = o;
+        a->overflowBytes += size;
+        __atomic_add_fetch(&overflows, 1, __ATOMIC_RELAXED);
+        p = o + 1;
+    }
+    updatePeak(a);
+    return p;
+}
+
+
+void *arenaCalloc(size_t nmemb, size_t size) {
+    void *p;
+
+    if (size && nmemb > SIZE_MAX / size) return NULL;
+    if ((p = arenaAlloc(nmemb * size)) != NULL) memset(p, 0, nmemb * size);
+    return p;
+}
+
+
+void arenaStats(size_t *pPeak, size_t *pSize, size_t *pOverflows) {
+    *pPeak = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    *pSize = ARENA_SIZE;
+    *pOverflows = __atomic_load_n(&overflows, __ATOMIC_RELAXED);
+}
+
+
+// The outermost scope takes back everything, including what was left
+// behind outside a scope, so the arena starts empty for each ECALL
+ArenaScope::ArenaScope(): mark(arena.used), overflowMark(arena.overflow) {
+    if (arena.depth++ == 0) {
+        mark = 0;
+        overflowMark = NULL;
+    }
+}
+
+
+ArenaScope::~ArenaScope() {
+    arena_t *a = &arena;
+
+    while (a->overflow != overflowMark) {
+        struct arenaOverflow *o = a->overflow;
+        a->overflow = o->next;
+        a->overflowBytes -= o->size;
+        OPENSSL_clear_free(o, sizeof *o + o->size);
+    }
+    if (a->used > mark) {
+        OPENSSL_cleanse(a->base + mark, a->used - mark);
+        a->used = mark;
+    }
+    a->depth--;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <stddef.h>
+
+#define ARENA_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct arenaOverflow;
+
+// Bump allocator for the temporaries of an ECALL. Every enclave thread (TCS)
+// has its own arena. What is taken from it inside an ArenaScope is scrubbed
+// and handed back when the scope ends, so nothing is freed one by one.
+// Requests that do not fit fall back to the heap and are released the same
+// way. Memory taken outside any scope goes when the thread's next outermost
+// scope, the next ECALL, ends.
+void *arenaAlloc(size_t size);
+
+void *arenaCalloc(size_t nmemb, size_t size);
+
+// Largest arena use of a single ECALL on any thread so far, heap fallbacks
+// included, and the number of allocations that did not fit
+void arenaStats(size_t *pPeak, size_t *pSize, size_t *pOverflows);
+
+class ArenaScope
+{
+private:
+    size_t mark;
+    struct arenaOverflow *overflowMark;
+public:
+    ArenaScope();
+    ~ArenaScope();
+};
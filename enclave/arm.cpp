@@ -1,7 +1,13 @@
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
+#include <limits.h>
 #include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
 #include "openssl/rand.h"
 
 #include "sgx_urts.h"
@@ -21,37 +27,121 @@
 #include "../cryptoki/pkcs11.h"
 
 #include "ssss.h"
+#include "keycache.h"
+#include "arm.h"
 
 #define ROOTKEY_LENGTH 32
+#define STATE_KEY_LABEL "PKCS11 SGX operation state"
 #define PRIME "FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF43"
 
 uint8_t rootKey[ROOTKEY_LENGTH];
 CK_BBOOL rootKeySet = CK_FALSE;
 
+// Readers hold the lock from getRootKey() until putRootKey(), the root key
+// functions below take it for writing.
+static pthread_rwlock_t rootKeyLock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Bumped under the write lock whenever rootKey is touched. Every thread
+// keeps a GCM context with the expanded root key and only rebuilds it when
+// the generation it was built for is no longer current.
+static unsigned long rootKeyGeneration = 1;
+static __thread EVP_CIPHER_CTX *gcmCtx = NULL;
+static __thread unsigned long gcmGeneration = 0;
+
 const uint8_t *getRootKey(size_t *length){
     if (length) *length = sizeof rootKey;
+    if (pthread_rwlock_rdlock(&rootKeyLock)) return NULL;
     if (rootKeySet == CK_TRUE) {
         return rootKey;
     }
+    pthread_rwlock_unlock(&rootKeyLock);
+    return NULL;
+}
+
+void putRootKey(void){
+    pthread_rwlock_unlock(&rootKeyLock);
+}
+
+
+static EVP_CIPHER_CTX *rootKeyCipher(const uint8_t *pIV, int enc) {
+    if (gcmCtx == NULL) {
+        if ((gcmCtx = EVP_CIPHER_CTX_new()) == NULL) return NULL;
+        if (!EVP_CipherInit_ex(gcmCtx, EVP_aes_128_gcm(), NULL, NULL, NULL, enc)) goto rootKeyCipher_err;
+    }
+    if (gcmGeneration != rootKeyGeneration) {
+        // The sgx_rijndael128GCM functions used before took the first 16 bytes
+        if (!EVP_CipherInit_ex(gcmCtx, NULL, NULL, rootKey, NULL, enc)) goto rootKeyCipher_err;
+        gcmGeneration = rootKeyGeneration;
+    }
+    if (!EVP_CipherInit_ex(gcmCtx, NULL, NULL, NULL, pIV, enc)) goto rootKeyCipher_err;
+    return gcmCtx;
+rootKeyCipher_err:
+    EVP_CIPHER_CTX_free(gcmCtx);
+    gcmCtx = NULL;
+    gcmGeneration = 0;
     return NULL;
 }
 
 
+int rootKeyEncrypt(
+        const uint8_t *pPlain, size_t plainLength,
+        const uint8_t *pAAD, size_t aadLength,
+        const uint8_t *pIV, uint8_t *pCipher, uint8_t *pTag) {
+    EVP_CIPHER_CTX *ctx;
+    int len;
+
+    if (plainLength > INT_MAX || aadLength > INT_MAX) return -1;
+    if ((ctx = rootKeyCipher(pIV, 1)) == NULL) return -1;
+    if (aadLength && !EVP_CipherUpdate(ctx, NULL, &len, pAAD, (int) aadLength)) return -1;
+    if (!EVP_CipherUpdate(ctx, pCipher, &len, pPlain, (int) plainLength)) return -1;
+    if (!EVP_CipherFinal_ex(ctx, pCipher + len, &len)) return -1;
+    if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, ROOTKEY_GCM_TAG_SIZE, pTag)) return -1;
+    return 0;
+}
+
+
+int rootKeyDecrypt(
+        const uint8_t *pCipher, size_t cipherLength,
+        const uint8_t *pAAD, size_t aadLength,
+        const uint8_t *pIV, const uint8_t *pTag, uint8_t *pPlain) {
+    EVP_CIPHER_CTX *ctx;
+    int len;
+
+    if (cipherLength > INT_MAX || aadLength > INT_MAX) return -1;
+    if ((ctx = rootKeyCipher(pIV, 0)) == NULL) return -1;
+    if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, ROOTKEY_GCM_TAG_SIZE, (void *) pTag)) return -1;
+    if (aadLength && !EVP_CipherUpdate(ctx, NULL, &len, pAAD, (int) aadLength)) return -1;
+    if (!EVP_CipherUpdate(ctx, pPlain, &len, pCipher, (int) cipherLength)) return -1;
+    if (EVP_CipherFinal_ex(ctx, pPlain + len, &len) <= 0) {
+        OPENSSL_cleanse(pPlain, cipherLength);
+        return -1;
+    }
+    return 0;
+}
+
+
 int SetRootKeyShare(int x, const uint8_t *y, size_t y_length, int threshold)
 {
 	static int local_threshold = 0;
 	static int *x_s = NULL;
 	static BIGNUM **y_s = NULL;
 	static int nr_shares = 0;
+	int ret = -4;
 
+	if (pthread_rwlock_wrlock(&rootKeyLock)) return ret;
+	rootKeyGeneration++;
 	if (SGX_SUCCESS != sgx_read_rand(rootKey, ROOTKEY_LENGTH)) goto setRootKeyShare_err;
 	if (x_s == NULL) {
 		local_threshold = threshold;
 	}
-	if (threshold != local_threshold) return -3;
+	ret = -3;
+	if (threshold != local_threshold) goto setRootKeyShare_err;
 	rootKeySet = CK_FALSE;
-	if (threshold < 2) return -1;
-	for (int i=0; i<nr_shares; i++) if (x_s[i] == x) return -2;
+	keyCacheFlush();
+	ret = -1;
+	if (threshold < 2) goto setRootKeyShare_err;
+	ret = -2;
+	for (int i=0; i<nr_shares; i++) if (x_s[i] == x) goto setRootKeyShare_err;
 	x_s = (int *) realloc(x_s, sizeof *x_s * (nr_shares + 1));
 	x_s[nr_shares] = x;
 	y_s = (BIGNUM **) realloc(y_s, sizeof *y_s * (nr_shares + 1));
@@ -59,6 +149,7 @@ int SetRootKeyShare(int x, const uint8_t *y, size_t y_length, int threshold)
 	BN_bin2bn(y, y_length, y_s[nr_shares]);
 	x_s[nr_shares] = x;
 	nr_shares += 1;
+	ret = 0;
 	if (nr_shares == threshold) {
 		BIGNUM *res = BN_new();
 		BIGNUM *prime = NULL;
@@ -69,24 +160,32 @@ int SetRootKeyShare(int x, const uint8_t *y, size_t y_length, int threshold)
 		local_threshold = 0;
 		free(x_s); x_s = NULL;
 		free(y_s); y_s = NULL;
-		return 1;
+		ret = 1;
 	}
 setRootKeyShare_err:
-	return 0;
+	pthread_rwlock_unlock(&rootKeyLock);
+	return ret;
 }
 
 int SetRootKeySealed(const uint8_t *root_key_sealed, size_t root_key_len_sealed){
     uint32_t decrypted_text_length = sizeof rootKey;
 	sgx_status_t stat;
+	int ret = -1;
 
+    if (pthread_rwlock_wrlock(&rootKeyLock)) return -1;
+    rootKeyGeneration++;
     rootKeySet = CK_FALSE;
+    keyCacheFlush();
     if ((SGX_SUCCESS != (stat = sgx_unseal_data(
             (const sgx_sealed_data_t *)root_key_sealed,
             NULL, NULL,
             rootKey, &decrypted_text_length))))
-        return -1;
+        goto setRootKeySealed_err;
     rootKeySet = CK_TRUE;
-    return 0;
+    ret = 0;
+setRootKeySealed_err:
+    pthread_rwlock_unlock(&rootKeyLock);
+    return ret;
 }
 
 int GetSealedRootKeySize(size_t *rootKeyLength){
@@ -96,35 +195,64 @@ int GetSealedRootKeySize(size_t *rootKeyLength){
 
 int GetRootKeySealed(uint8_t *root_key_sealed, size_t root_key_len_sealed, size_t *rootKeyLenSealed){
 	sgx_status_t stat;
-    //static uint8_t rootKey[ROOTKEY_LENGTH];
+	int ret = -1;
 
     if (GetSealedRootKeySize(rootKeyLenSealed)) return -1;
     if (*rootKeyLenSealed > root_key_len_sealed) {
         return -1;
     }
+    if (pthread_rwlock_rdlock(&rootKeyLock)) return -1;
     if ((SGX_SUCCESS != (stat = sgx_seal_data(
             0, NULL, sizeof(rootKey), (const uint8_t *)rootKey, sizeof rootKey, (sgx_sealed_data_t *)root_key_sealed))))
-        return -1;
-    return 0;
+        goto getRootKeySealed_err;
+    ret = 0;
+getRootKeySealed_err:
+    pthread_rwlock_unlock(&rootKeyLock);
+    return ret;
 }
 
 
 int GenerateRootKey(uint8_t *rootKeySealed, size_t root_key_length, size_t *rootKeyLength){
     uint32_t sealedSize;
 	sgx_status_t stat;
+	int ret = -1;
+
+    if (pthread_rwlock_wrlock(&rootKeyLock)) return -1;
+    rootKeyGeneration++;
     rootKeySet = CK_FALSE;
-    if (!RAND_bytes(rootKey, sizeof rootKey)) {
-        return -1;
-    }
+    keyCacheFlush();
+    if (!RAND_bytes(rootKey, sizeof rootKey))
+        goto generateRootKey_err;
     if ((sealedSize = sgx_calc_sealed_data_size(0, sizeof rootKey)) == UINT32_MAX)
-        return -1;
+        goto generateRootKey_err;
     if (sealedSize > root_key_length)
-        return -1;
+        goto generateRootKey_err;
     if ((SGX_SUCCESS != (stat = sgx_seal_data(
             0, NULL, sizeof(rootKey), (const uint8_t *)rootKey, root_key_length, (sgx_sealed_data_t *)rootKeySealed))))
-        return -1;
+        goto generateRootKey_err;
     rootKeySet = CK_TRUE;
-    return 0;
+    ret = 0;
+generateRootKey_err:
+    pthread_rwlock_unlock(&rootKeyLock);
+    return ret;
 }
 
 
+int GetStateKey(uint8_t *key, size_t keyLength){
+    unsigned int macLength;
+    uint8_t mac[EVP_MAX_MD_SIZE];
+    const uint8_t *pRootKey;
+    int ret = -1;
+
+    if (keyLength > SHA256_DIGEST_LENGTH) return -1;
+    if ((pRootKey = getRootKey(NULL)) == NULL) return -1;
+    if (NULL == HMAC(EVP_sha256(), pRootKey, ROOTKEY_LENGTH,
+            (const uint8_t *)STATE_KEY_LABEL, sizeof STATE_KEY_LABEL - 1, mac, &macLength))
+        goto getStateKey_err;
+    memcpy(key, mac, keyLength);
+    ret = 0;
+getStateKey_err:
+    OPENSSL_cleanse(mac, sizeof mac);
+    putRootKey();
+    return ret;
+}
@@ -1,7 +1,26 @@
 #pragma once
 
+// Returns the root key with the root key read lock held, release it with
+// putRootKey(). Returns NULL, without the lock, when no root key is set.
 const uint8_t *getRootKey(size_t *length);
 
+void putRootKey(void);
+
+#define ROOTKEY_GCM_IV_SIZE 12
+#define ROOTKEY_GCM_TAG_SIZE 16
+
+// AES-GCM under the root key. Call with the root key lock held. The
+// expanded key is kept per thread until the root key changes.
+int rootKeyEncrypt(
+        const uint8_t *pPlain, size_t plainLength,
+        const uint8_t *pAAD, size_t aadLength,
+        const uint8_t *pIV, uint8_t *pCipher, uint8_t *pTag);
+
+int rootKeyDecrypt(
+        const uint8_t *pCipher, size_t cipherLength,
+        const uint8_t *pAAD, size_t aadLength,
+        const uint8_t *pIV, const uint8_t *pTag, uint8_t *pPlain);
+
 int SetRootKeyShare(int x, const uint8_t *y, size_t y_length, int threshold);
 
 int GetSealedRootKeySize(size_t *rootKeyLength);
@@ -12,3 +31,7 @@ int GetRootKeySealed(uint8_t *root_key_sealed, size_t root_key_len_sealed, size_
 
 int GenerateRootKey(uint8_t *rootKeySealed, size_t root_key_length, size_t *rootKeyLength);
 
+// HMAC-SHA256 of a fixed label under the root key, the host MACs saved
+// operation states with it. Nothing to store, it follows the root key.
+int GetStateKey(uint8_t *key, size_t keyLength);
+
@@ -1,24 +1,111 @@
 #include "ec.h"
+#include "ecpool.h"
+#include "arena.h"
 #include <openssl/evp.h>
 #include <openssl/x509.h>
+#include <string.h>
+#include <vector>
+
+typedef struct {
+    int nid;
+    EC_GROUP *grp;
+    std::vector<uint8_t> params;
+    CK_ATTRIBUTE paramsAttr;
+} ecCurve_t;
+
+static const int knownCurves[] = {
+    NID_X9_62_prime256v1,
+    NID_secp384r1,
+    NID_secp521r1,
+    NID_secp256k1,
+};
+
+// Built once when the enclave loads, the groups carry the precomputed
+// generator multiples and are only read afterwards.
+static std::vector<ecCurve_t> newCurveRegistry(void) {
+    std::vector<ecCurve_t> registry;
+
+    for (auto nid: knownCurves) {
+        ecCurve_t curve = { nid, NULL };
+        uint8_t *p;
+        int len;
+
+        if ((curve.grp = EC_GROUP_new_by_curve_name(nid)) == NULL) continue;
+        EC_GROUP_set_asn1_flag(curve.grp, OPENSSL_EC_NAMED_CURVE);
+        if (!EC_GROUP_precompute_mult(curve.grp, NULL) ||
+                (len = i2d_ECPKParameters(curve.grp, NULL)) <= 0) {
+            EC_GROUP_free(curve.grp);
+            continue;
+        }
+        curve.params.resize(len);
+        p = curve.params.data();
+        i2d_ECPKParameters(curve.grp, &p);
+        registry.push_back(curve);
+    }
+    for (auto &curve: registry)
+        curve.paramsAttr = { CKA_EC_PARAMS, curve.params.data(), curve.params.size() };
+    return registry;
+}
+
+static const std::vector<ecCurve_t> curveRegistry = newCurveRegistry();
+
+
+static const ecCurve_t *findCurve(int nid) {
+    for (auto &curve: curveRegistry)
+        if (curve.nid == nid) return &curve;
+    return NULL;
+}
+
+
+int ecCurveNid(const uint8_t *params, size_t paramsLength) {
+    EC_GROUP *grp;
+    const uint8_t *endptr = params;
+    int nid;
+
+    for (auto &curve: curveRegistry)
+        if (curve.params.size() == paramsLength && !memcmp(curve.params.data(), params, paramsLength))
+            return curve.nid;
+    if ((grp = d2i_ECPKParameters(NULL, &endptr, paramsLength)) == NULL) return NID_undef;
+    // Explicit parameters are only accepted for a curve that has a name
+    if ((nid = EC_GROUP_get_curve_name(grp)) == NID_undef) {
+        for (auto &curve: curveRegistry) {
+            if (EC_GROUP_cmp(curve.grp, grp, NULL) == 0) {
+                nid = curve.nid;
+                break;
+            }
+        }
+    }
+    EC_GROUP_free(grp);
+    return nid;
+}
+
+
+EC_KEY *ecKeyNew(int nid) {
+    const ecCurve_t *curve;
+    EC_KEY *key;
+
+    if ((curve = findCurve(nid)) == NULL) return EC_KEY_new_by_curve_name(nid);
+    if ((key = EC_KEY_new()) == NULL) return NULL;
+    if (!EC_KEY_set_group(key, curve->grp)) {
+        EC_KEY_free(key);
+        return NULL;
+    }
+    return key;
+}
+
 
 EC_KEY *generateEC(const uint8_t *ec_paramaters, size_t ec_parameters_len) {
-    // EC_PARAM
-    // EC_group_new()
-    // EC_KEY_new_by_curve_name();
     EC_KEY *key = NULL, *ret = NULL;
-	EC_GROUP *pGrp = NULL;
+    int nid;
 
-	const uint8_t *endptr = ec_paramaters;
-    if ((key = EC_KEY_new()) == NULL) goto generateEC_err;
-    if ((pGrp = d2i_ECPKParameters(NULL, &endptr, ec_parameters_len)) == NULL) goto generateEC_err;
-    EC_KEY_set_group(key, pGrp);
+    if ((nid = ecCurveNid(ec_paramaters, ec_parameters_len)) == NID_undef) goto generateEC_err;
+    if ((key = ecKeyNew(nid)) == NULL) goto generateEC_err;
+    EC_KEY_set_asn1_flag(key, OPENSSL_EC_NAMED_CURVE);
     if (!EC_KEY_generate_key(key)) goto generateEC_err;
     ret = key;
     key = NULL;
 generateEC_err:
     if (key) EC_KEY_free(key);
-	if (pGrp) EC_GROUP_free(pGrp);
     return ret;
 }
 
@@ -33,7 +120,7 @@ static CK_ATTRIBUTE defaultPrivateKeyAttr[] = {
 	{CKA_ALWAYS_SENSITIVE, &tr, sizeof(tr)}
 };
 
-static auto defaultPrivateKKeyAttrMap = ATTR(defaultPrivateKeyAttr).map();
+static const auto defaultPrivateKKeyAttrMap = ATTR(defaultPrivateKeyAttr).map();
 
 static CK_OBJECT_CLASS pubObjectClass = CKO_PUBLIC_KEY;
 
@@ -42,7 +129,7 @@ static CK_ATTRIBUTE defaultPublicKeyAttr[] = {
     {CKA_KEY_TYPE, &keyType, sizeof keyType},
 };
 
-static auto defaultPublicKeyAttrMap = ATTR(defaultPublicKeyAttr).map();
+static const auto defaultPublicKeyAttrMap = ATTR(defaultPublicKeyAttr).map();
 
 
 int generateECKeyPair(
@@ -54,17 +141,21 @@ int generateECKeyPair(
     int i2dret;
     EC_KEY *key = NULL;
     CK_ATTRIBUTE_PTR p;
+    const ecCurve_t *curve;
 	uint8_t *pPrivateKeyDER = NULL, *pPublicKeyDER = NULL;
 	EVP_PKEY *evp_pkey = NULL;
 
+    // Merge first, merging may move attributes a kept lookup points to
+    pubAttr.merge(defaultPublicKeyAttrMap);
+    privAttr.merge(defaultPrivateKKeyAttrMap);
     if ((p = pubAttr.get(CKA_EC_PARAMS)) == NULL) return -1;
 	if ((key = generateEC((uint8_t *)p->pValue, p->ulValueLen)) ==NULL)
         return -1;
+    // Always store the named curve, whatever encoding was asked for
+    if ((curve = findCurve(EC_GROUP_get_curve_name(EC_KEY_get0_group(key)))) != NULL)
+        *p = curve->paramsAttr;
 
-    pubAttr.merge(defaultPublicKeyAttrMap);
-    privAttr.merge(defaultPrivateKKeyAttrMap);
-
-	evp_pkey = EVP_PKEY_new();
+    evp_pkey = EVP_PKEY_new();
 	EVP_PKEY_set1_EC_KEY(evp_pkey, key);
     i2dret = i2d_PUBKEY(evp_pkey, NULL);
     if (i2dret < 0) goto generateECKeyPair_err;
@@ -92,80 +183,88 @@ generateECKeyPair_err:
 
 
 
+// The signature lives in the ECALL arena
 static uint8_t *ECDSAsign(
-        const uint8_t *private_key_der, size_t privateKeyDERlength,
+        EC_KEY *key,
         const uint8_t *dgst, int dgstlen,
         unsigned int *siglen)
 {
     uint8_t *sig = NULL, *ret = NULL;
+    BIGNUM *kinv, *r;
+    int done = 0;
 
     const EC_GROUP *grp = NULL;
-    EC_KEY *key;
 
-    if (NULL == (key = d2i_ECPrivateKey(NULL, &private_key_der, privateKeyDERlength))) goto ECDSAsign_err;
+    if (key == NULL) goto ECDSAsign_err;
     grp = EC_KEY_get0_group(key);
 
-    if (!key or !grp) goto ECDSAsign_err;
+    if (!grp) goto ECDSAsign_err;
     *siglen = ECDSA_size(key);
-    if ((sig = (uint8_t *)malloc(*siglen)) == NULL) goto ECDSAsign_err;
-    if (ECDSA_sign(0, dgst, dgstlen, sig, siglen, key) == 0) goto ECDSAsign_err;
+    if ((sig = (uint8_t *)arenaAlloc(*siglen)) == NULL) goto ECDSAsign_err;
+    // With a precomputed (k^-1, r) only s is left to compute
+    if (ecPoolGet(EC_GROUP_get_curve_name(grp), &kinv, &r)) {
+        done = ECDSA_sign_ex(0, dgst, dgstlen, sig, siglen, kinv, r, key);
+        BN_clear_free(kinv);
+        BN_clear_free(r);
+    }
+    if (!done) {
+        *siglen = ECDSA_size(key);
+        if (ECDSA_sign(0, dgst, dgstlen, sig, siglen, key) == 0) goto ECDSAsign_err;
+    }
     ret = sig;
-    sig = NULL;
 ECDSAsign_err:
-    if (key) EC_KEY_free(key);
-    if (sig) free(sig);
     return ret;
 }
 
 
 typedef const EVP_MD* (*md_func_t)(void);
 
-static std::map<CK_MECHANISM_TYPE, md_func_t> allowedSignMechanisms = {
+// For the hash-and-sign mechanisms pData is the digest, hashed by the caller
+static const std::map<CK_MECHANISM_TYPE, md_func_t> allowedSignMechanisms = {
     { CKM_ECDSA_SHA1, EVP_sha1 },
     { CKM_ECDSA, NULL },
 };
 
 
 int ECsign(
-        const uint8_t *private_key_der,
-        size_t privateKeyDERlength,
+        EVP_PKEY *pKey,
         const uint8_t *pData,
         size_t dataLen,
         uint8_t *pSignature,
         size_t *pSignatureLengthOut,
         CK_MECHANISM_TYPE mechanism) {
     auto it = allowedSignMechanisms.find(mechanism);
-	uint8_t *digest = NULL;
 	uint8_t *pSig = NULL;
 	unsigned int siglen;
 	int ret = -1;
-	EVP_MD_CTX *hashctx = NULL;
     if (it == allowedSignMechanisms.end()) goto ECsign_err;
-
-	// Perform SHA1 or not
-	if (it->second != NULL) {
-		int mdSize = EVP_MD_size(it->second());
-		if (mdSize < 0) return -1;
-		digest = (uint8_t *) malloc(mdSize);
-		if (*pSignatureLengthOut < (size_t) mdSize) goto ECsign_err;
-		hashctx = EVP_MD_CTX_new();
-		EVP_DigestInit_ex(hashctx, it->second(), NULL);
-		EVP_DigestUpdate(hashctx, pData, dataLen);
-		EVP_DigestFinal_ex(hashctx, digest, (unsigned int *)&mdSize);
-		pData = digest;
-		dataLen = mdSize;
-	}
+	if (it->second != NULL && dataLen != (size_t) EVP_MD_size(it->second())) goto ECsign_err;
 
 	if (NULL == (pSig = ECDSAsign(
-		private_key_der, privateKeyDERlength,
+		(EC_KEY *) EVP_PKEY_get0_EC_KEY(pKey),
         pData, dataLen, &siglen))) goto ECsign_err;
 	if (siglen > *pSignatureLengthOut) goto ECsign_err;
 	memcpy(pSignature, pSig, siglen);
 	*pSignatureLengthOut = siglen;
 	ret = 0;
 ECsign_err:
-	if (digest) free(digest);
-	if (hashctx) EVP_MD_CTX_free(hashctx);
-	if (pSig) free(pSig);
+	return ret;
+}
+
+
+int ECsign(
+        const uint8_t *private_key_der,
+        size_t privateKeyDERlength,
+        const uint8_t *pData,
+        size_t dataLen,
+        uint8_t *pSignature,
+        size_t *pSignatureLengthOut,
+        CK_MECHANISM_TYPE mechanism) {
+	EVP_PKEY *pKey = NULL;
+	int ret;
+
+	if (NULL == (pKey = d2i_PrivateKey(EVP_PKEY_EC, NULL, &private_key_der, privateKeyDERlength))) return -1;
+	ret = ECsign(pKey, pData, dataLen, pSignature, pSignatureLengthOut, mechanism);
+	EVP_PKEY_free(pKey);
 	return ret;
 }
@@ -1,12 +1,27 @@
 #pragma once
 #include <openssl/ec.h>
+#include <openssl/evp.h>
 #include "Attribute.h"
 
+// Curve of the DER encoded CKA_EC_PARAMS, NID_undef when it has no name
+int ecCurveNid(const uint8_t *params, size_t paramsLength);
+
+// New key on the shared, precomputed group of the curve
+EC_KEY *ecKeyNew(int nid);
+
 int generateECKeyPair(
         uint8_t **ppECPublicKey, size_t *pECPublicKeyLength,
         Attribute &pubAttr,
         uint8_t ** ppECPrivateKey, size_t *pECPrivateKeyLength, Attribute &privAttr);
 
+int ECsign(
+        EVP_PKEY *pKey,
+        const uint8_t *pData,
+        size_t dataLen,
+        uint8_t *pSignature,
+        size_t *pSignatureLengthOut,
+        CK_MECHANISM_TYPE mechanism);
+
 int ECsign(
         const uint8_t *private_key_der,
         size_t privateKeyDERlength,
@@ -0,0 +1,108 @@
+#include <map>
+#include <list>
+#include <pthread.h>
+#include <openssl/ec.h>
+
+#include "shared_values.h"
+#include "ecpool.h"
+#include "ec.h"
+#include "worker.h"
+
+typedef std::pair<BIGNUM *, BIGNUM *> kinvR_t;
+
+typedef struct {
+    size_t depth;
+    // ECDSA_sign_setup wants a key, any key on the curve will do
+    EC_KEY *setupKey;
+    std::list<kinvR_t> pairs;
+} ecPool_t;
+
+static std::map<int, ecPool_t> pools;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void drain(ecPool_t &pool, size_t depth) {
+    while (pool.pairs.size() > depth) {
+        BN_clear_free(pool.pairs.back().first);
+        BN_clear_free(pool.pairs.back().second);
+        pool.pairs.pop_back();
+    }
+}
+
+
+// Adds one pair to the first pool that is short
+static bool ecPoolRefill(void) {
+    BIGNUM *kinv = NULL, *r = NULL;
+    EC_KEY *key;
+    int nid, ok;
+
+    pthread_mutex_lock(&poolLock);
+    auto it = pools.begin();
+    while (it != pools.end() && it->second.pairs.size() >= it->second.depth) it++;
+    if (it == pools.end()) {
+        pthread_mutex_unlock(&poolLock);
+        return false;
+    }
+    nid = it->first;
+    key = it->second.setupKey;
+    EC_KEY_up_ref(key);
+    pthread_mutex_unlock(&poolLock);
+    ok = ECDSA_sign_setup(key, NULL, &kinv, &r);
+    EC_KEY_free(key);
+    pthread_mutex_lock(&poolLock);
+    it = pools.find(nid);
+    if (!ok) {
+        if (it != pools.end()) it->second.depth = it->second.pairs.size();
+    } else if (it != pools.end() && it->second.pairs.size() < it->second.depth) {
+        it->second.pairs.push_back(kinvR_t(kinv, r));
+        kinv = r = NULL;
+    }
+    pthread_mutex_unlock(&poolLock);
+    BN_clear_free(kinv);
+    BN_clear_free(r);
+    return true;
+}
+
+
+int ecPoolConfigure(int nid, size_t depth) {
+    if (depth > MAX_EC_POOL_DEPTH) return -1;
+    pthread_mutex_lock(&poolLock);
+    auto it = pools.find(nid);
+    if (it != pools.end()) {
+        drain(it->second, depth);
+        it->second.depth = depth;
+        if (depth == 0) {
+            EC_KEY_free(it->second.setupKey);
+            pools.erase(it);
+        }
+    } else if (depth) {
+        EC_KEY *key = ecKeyNew(nid);
+        if (key == NULL || !EC_KEY_generate_key(key)) {
+            if (key) EC_KEY_free(key);
+            pthread_mutex_unlock(&poolLock);
+            return -1;
+        }
+        ecPool_t &pool = pools[nid];
+        pool.depth = depth;
+        pool.setupKey = key;
+    }
+    pthread_mutex_unlock(&poolLock);
+    return depth ? workerRegister(ecPoolRefill) : 0;
+}
+
+
+bool ecPoolGet(int nid, BIGNUM **ppKinv, BIGNUM **ppR) {
+    bool ret = false;
+
+    pthread_mutex_lock(&poolLock);
+    auto it = pools.find(nid);
+    if (it != pools.end() && !it->second.pairs.empty()) {
+        *ppKinv = it->second.pairs.front().first;
+        *ppR = it->second.pairs.front().second;
+        it->second.pairs.pop_front();
+        ret = true;
+    }
+    pthread_mutex_unlock(&poolLock);
+    if (ret) workerWake();
+    return ret;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <stddef.h>
+#include <openssl/bn.h>
+
+// Pool of precomputed ECDSA (k^-1, r) pairs per named curve, kept filled by
+// the enclave worker thread. The pairs do not depend on the signing key.
+int ecPoolConfigure(int nid, size_t depth);
+
+// Takes a pair for the curve, false when none is ready. The pair is handed
+// out once; the caller signs with it and frees both with BN_clear_free.
+bool ecPoolGet(int nid, BIGNUM **ppKinv, BIGNUM **ppR);
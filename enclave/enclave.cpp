@@ -21,38 +21,87 @@
 #include "ec.h"
 #include "Attribute.h"
 #include "AttributeSerial.h"
+#include "AttributeView.h"
 #include "ssss.h"
 #include "arm.h"
+#include "keycache.h"
+#include "arena.h"
+#include "keyformat.h"
+#include "rsapool.h"
+#include "ecpool.h"
+#include "signbatch.h"
+#include "shared_values.h"
+
+// Wraps the private key under the root key: tag | iv | ciphertext, with the
+// serialized attributes as AAD. Call with the root key lock held.
+static int encryptObject(
+        const uint8_t *pPrivateKey, size_t privateKeyLength,
+        const uint8_t *pSerializedAttr, size_t serializedAttrLen,
+        uint8_t *pWrapped, size_t wrappedLength, size_t *pWrappedLengthOut) {
+
+    if ((privateKeyLength + SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE) > wrappedLength) return -1;
+	if (SGX_SUCCESS != sgx_read_rand(pWrapped + SGX_AESGCM_MAC_SIZE, SGX_AESGCM_IV_SIZE)) return -1;
+	if (rootKeyEncrypt(
+		pPrivateKey, privateKeyLength,
+		pSerializedAttr, serializedAttrLen,
+		pWrapped + SGX_AESGCM_MAC_SIZE,
+		pWrapped + SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE,
+		pWrapped)) return -1;
+    *pWrappedLengthOut = privateKeyLength + SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE;
+    return 0;
+}
 
-int SGXgenerateKeyPair(
+
+// Converts a freshly generated DER private key to the packed key format.
+// Keys without a packed form are kept in DER.
+static void packGeneratedKey(uint8_t **ppPrivKey, size_t *pPrivKeyLength, int type) {
+	const uint8_t *endptr = *ppPrivKey;
+	uint8_t *pPacked;
+	size_t packedLength;
+	EVP_PKEY *pKey;
+
+	if ((pKey = d2i_PrivateKey(type, NULL, &endptr, (long) *pPrivKeyLength)) == NULL) return;
+	if (packPrivateKey(pKey, &pPacked, &packedLength) == 0) {
+		OPENSSL_clear_free(*ppPrivKey, *pPrivKeyLength);
+		*ppPrivKey = pPacked;
+		*pPrivKeyLength = packedLength;
+	}
+	EVP_PKEY_free(pKey);
+}
+
+
+static int generateKeyPair(
         uint8_t *pPublicKeyDER, size_t PublicKeyDERLength, size_t *pPublicKeyLengthOut,
 		uint8_t *pPublicSerializedAttr, size_t publicSerializedAttrLen, size_t *publicSerializedAttrLenOut,
         uint8_t *PrivateKey, size_t PrivateKeyLength, size_t *PrivateKeyLengthOut,
 		uint8_t *pPrivSerializedAttr, size_t privSerializedAttrLen, size_t *privSerializedAttrLenOut) {
 
 	CK_KEY_TYPE *pKeyType;
-    uint8_t *pPrivKeyDER = NULL, *pPubKeyDER = NULL;
-    size_t privKeyDERLength = 0, pubKeyDERLength = 0;
+    uint8_t *pPrivKey = NULL, *pPubKeyDER = NULL;
+    size_t privKeyLength = 0, pubKeyDERLength = 0;
     const uint8_t *rootKey;
 	int ret = -1;
 
     if ((rootKey = getRootKey(NULL)) == NULL) return -1;
+    putRootKey();
 
-	AttributeSerial pubAttr = AttributeSerial(pPublicSerializedAttr, publicSerializedAttrLen);
-	AttributeSerial privAttr = AttributeSerial(pPrivSerializedAttr, privSerializedAttrLen);
+	AttributeSerial pubAttr(pPublicSerializedAttr, publicSerializedAttrLen, arenaCalloc);
+	AttributeSerial privAttr(pPrivSerializedAttr, privSerializedAttrLen, arenaCalloc);
 	if ((pKeyType = pubAttr.getType<CK_KEY_TYPE>(CKA_KEY_TYPE)) == NULL) return -1;
 	switch (*pKeyType) {
 	 	case CKK_RSA:
             if (generateRSAKeyPair(
                     &pPubKeyDER, &pubKeyDERLength, pubAttr,
-                    &pPrivKeyDER, &privKeyDERLength, privAttr))
+                    &pPrivKey, &privKeyLength, privAttr))
                 return -1;
+            packGeneratedKey(&pPrivKey, &privKeyLength, EVP_PKEY_RSA);
             break;
 	 	case CKK_EC:
             if ((ret=generateECKeyPair(
                     &pPubKeyDER,  &pubKeyDERLength, pubAttr,
-                    &pPrivKeyDER, &privKeyDERLength, privAttr)))
+                    &pPrivKey, &privKeyLength, privAttr)))
                 return ret;
+            packGeneratedKey(&pPrivKey, &privKeyLength, EVP_PKEY_EC);
 	 		break;
 	 	default:
 	 		return -1;
@@ -67,27 +116,38 @@ int SGXgenerateKeyPair(
 	memcpy(pPublicKeyDER, pPubKeyDER, pubKeyDERLength);
 	*pPublicKeyLengthOut = pubKeyDERLength;
 
-    if ((privKeyDERLength  + SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE) > PrivateKeyLength) goto SGXGenerateKeyPair_err;
-
-    *PrivateKeyLengthOut = privKeyDERLength + SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE;
-
-	if (SGX_SUCCESS != sgx_read_rand(PrivateKey + SGX_AESGCM_MAC_SIZE, SGX_AESGCM_IV_SIZE)) goto SGXGenerateKeyPair_err;
-
-	if (SGX_SUCCESS != sgx_rijndael128GCM_encrypt(
-		(sgx_aes_gcm_128bit_key_t *) rootKey,
-		pPrivKeyDER, privKeyDERLength,
-		PrivateKey + SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE,
-		PrivateKey + SGX_AESGCM_MAC_SIZE,
-		SGX_AESGCM_IV_SIZE,
-		pPrivSerializedAttr, *privSerializedAttrLenOut,
-		(sgx_aes_gcm_128bit_tag_t *) (PrivateKey))) goto SGXGenerateKeyPair_err;
+    if ((rootKey = getRootKey(NULL)) == NULL) goto SGXGenerateKeyPair_err;
+	ret = encryptObject(pPrivKey, privKeyLength,
+		pPrivSerializedAttr, *privSerializedAttrLenOut, PrivateKey, PrivateKeyLength, PrivateKeyLengthOut);
+    putRootKey();
+	if (ret) goto SGXGenerateKeyPair_err;
 
 	ret = 0;
 SGXGenerateKeyPair_err:
-    if (pPrivKeyDER && privKeyDERLength) OPENSSL_clear_free(pPrivKeyDER, privKeyDERLength);
+    if (pPrivKey && privKeyLength) OPENSSL_clear_free(pPrivKey, privKeyLength);
     return ret;
 }
 
+int SGXgenerateKeyPair(
+        uint8_t *pPublicKeyDER, size_t PublicKeyDERLength, size_t *pPublicKeyLengthOut,
+		uint8_t *pPublicSerializedAttr, size_t publicSerializedAttrLen, size_t *publicSerializedAttrLenOut,
+        uint8_t *PrivateKey, size_t PrivateKeyLength, size_t *PrivateKeyLengthOut,
+		uint8_t *pPrivSerializedAttr, size_t privSerializedAttrLen, size_t *privSerializedAttrLenOut) {
+    ArenaScope scope;
+
+    // Malformed attribute sets throw
+    try {
+        return generateKeyPair(
+            pPublicKeyDER, PublicKeyDERLength, pPublicKeyLengthOut,
+            pPublicSerializedAttr, publicSerializedAttrLen, publicSerializedAttrLenOut,
+            PrivateKey, PrivateKeyLength, PrivateKeyLengthOut,
+            pPrivSerializedAttr, privSerializedAttrLen, privSerializedAttrLenOut);
+    }
+    catch (std::exception &) {
+        return -1;
+    }
+}
+
 
 CK_ULONG supportedKeyTypes[] = {
 	CKK_RSA,
@@ -95,38 +155,115 @@ CK_ULONG supportedKeyTypes[] = {
 };
 
 
-uint8_t *decryptObject(
+// The plaintext lives in the ECALL arena. Call with the root key lock held.
+static uint8_t *decryptObject(
         const uint8_t *private_key_ciphered,
         size_t private_key_ciphered_length,
 	    size_t *pPrivateKeyDERlength,
         const uint8_t *pSerializedAttr,
         size_t serializedAttrLen){
-	const uint8_t *rootkey;
 	uint8_t *ret = NULL;
 
-    if ((rootkey=getRootKey(NULL)) == NULL) return ret;
-
 	if (private_key_ciphered_length < (SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE)) return ret;
 	*pPrivateKeyDERlength = private_key_ciphered_length - (SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE);
 
 
-	if (NULL == (ret = (uint8_t *)malloc(*pPrivateKeyDERlength))) return ret;
-	if (SGX_SUCCESS == sgx_rijndael128GCM_decrypt(
-            (sgx_aes_gcm_128bit_key_t *) rootkey,
+	if (NULL == (ret = (uint8_t *)arenaAlloc(*pPrivateKeyDERlength))) return ret;
+	if (0 == rootKeyDecrypt(
             private_key_ciphered + SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE,
             *pPrivateKeyDERlength,
-            ret,
-            private_key_ciphered + SGX_AESGCM_MAC_SIZE,
-            SGX_AESGCM_IV_SIZE,
             pSerializedAttr, serializedAttrLen,
-            (sgx_aes_gcm_128bit_tag_t *) private_key_ciphered)) {
+            private_key_ciphered + SGX_AESGCM_MAC_SIZE,
+            private_key_ciphered,
+            ret)) {
         return ret;
     }
-    free(ret);
     return NULL;
 }
 
 
+typedef struct {
+	const uint8_t *pWrapped;
+	size_t wrappedLength;
+	const uint8_t *pAttr;
+	size_t attrLength;
+	// EVP_PKEY_NONE skips the entry
+	int type;
+	EVP_PKEY *pKey;
+} key_load_t;
+
+// Sets pKey of every entry to a referenced private key, NULL when it could
+// not be loaded. Keys are taken from the key cache where possible; the rest
+// are unwrapped back to back under a single root key lock with the thread's
+// expanded root key, and only then parsed.
+static void loadPrivateKeys(key_load_t *pLoads, size_t nrLoads) {
+	uint8_t (*pIds)[KEY_CACHE_ID_SIZE];
+	uint8_t **ppPlain;
+	size_t *pPlainLength;
+	size_t nrMissing = 0;
+	// The unwrapped keys are scrubbed as soon as they are parsed
+	ArenaScope scope;
+
+	pIds = (uint8_t (*)[KEY_CACHE_ID_SIZE]) arenaAlloc(nrLoads * KEY_CACHE_ID_SIZE);
+	ppPlain = (uint8_t **) arenaCalloc(nrLoads, sizeof *ppPlain);
+	pPlainLength = (size_t *) arenaCalloc(nrLoads, sizeof *pPlainLength);
+	for (size_t i = 0; i < nrLoads; i++) pLoads[i].pKey = NULL;
+	if (pIds == NULL || ppPlain == NULL || pPlainLength == NULL) return;
+
+	for (size_t i = 0; i < nrLoads; i++) {
+		key_load_t *pLoad = pLoads + i;
+
+		if (pLoad->type == EVP_PKEY_NONE) continue;
+		if (keyCacheId(pLoad->pWrapped, pLoad->wrappedLength, pLoad->pAttr, pLoad->attrLength, pIds[i])) {
+			pLoad->type = EVP_PKEY_NONE;
+			continue;
+		}
+		if ((pLoad->pKey = keyCacheGet(pIds[i])) != NULL) {
+			if (EVP_PKEY_id(pLoad->pKey) != pLoad->type) {
+				EVP_PKEY_free(pLoad->pKey);
+				pLoad->pKey = NULL;
+			}
+			continue;
+		}
+		// Missing, marked by the length
+		pPlainLength[i] = 1;
+		nrMissing++;
+	}
+	if (nrMissing == 0) return;
+
+	// The root key stays locked until the keys are cached, so a root key
+	// change cannot slip in between and leave a stale entry behind.
+	if (getRootKey(NULL) == NULL) return;
+	for (size_t i = 0; i < nrLoads; i++) {
+		if (pPlainLength[i] == 0) continue;
+		ppPlain[i] = decryptObject(pLoads[i].pWrapped, pLoads[i].wrappedLength,
+			pPlainLength + i, pLoads[i].pAttr, pLoads[i].attrLength);
+	}
+	for (size_t i = 0; i < nrLoads; i++) {
+		if (ppPlain[i] == NULL) continue;
+		pLoads[i].pKey = unpackPrivateKey(ppPlain[i], pPlainLength[i], pLoads[i].type);
+		if (pLoads[i].pKey) keyCachePut(pIds[i], pLoads[i].pKey, pPlainLength[i]);
+	}
+	putRootKey();
+}
+
+
+// Returns a referenced private key, taken from the key cache when the
+// wrapped object was unwrapped before.
+static EVP_PKEY *loadPrivateKey(
+        const uint8_t *private_key_ciphered,
+        size_t private_key_ciphered_length,
+        const uint8_t *pSerializedAttr,
+        size_t serializedAttrLen,
+        int type) {
+	key_load_t load = {
+		private_key_ciphered, private_key_ciphered_length, pSerializedAttr, serializedAttrLen, type, NULL };
+
+	loadPrivateKeys(&load, 1);
+	return load.pKey;
+}
+
+
 int SGXDecrypt(
         const uint8_t *private_key_ciphered,
         size_t private_key_ciphered_length,
@@ -142,15 +279,11 @@ int SGXDecrypt(
     int ret = -1;
     int to_len = -1;
 	EVP_PKEY *pKey = NULL;
-	size_t privateKeyDERlength;
-	uint8_t *private_key_der = NULL;
-	CK_ULONG *pKeyType;
-	CK_BBOOL *pDecrypt;
+	const CK_ULONG *pKeyType;
+	const CK_BBOOL *pDecrypt;
+	ArenaScope scope;
 
-	AttributeSerial attr = AttributeSerial(pSerializedAttr, serializedAttrLen);
-
-    if (NULL == (private_key_der = decryptObject(
-        private_key_ciphered, private_key_ciphered_length, &privateKeyDERlength, pSerializedAttr, serializedAttrLen))) goto SGXDecrypt_err;
+	AttributeView attr = AttributeView(pSerializedAttr, serializedAttrLen);
 
 	if (attr.check<CK_ULONG>(CKA_CLASS, CKO_PRIVATE_KEY) == false) goto SGXDecrypt_err;
 	if ((pKeyType = attr.checkIn(CKA_KEY_TYPE, supportedKeyTypes, sizeof supportedKeyTypes / sizeof *supportedKeyTypes)) == NULL) goto SGXDecrypt_err;
@@ -160,7 +293,9 @@ int SGXDecrypt(
 
 	switch (*pKeyType) {
 		case CKK_RSA:
-			if ((to = DecryptRsa(private_key_der, privateKeyDERlength, ciphertext, ciphertext_length, RSA_PKCS1_PADDING, &to_len)) == NULL) {
+			if (NULL == (pKey = loadPrivateKey(
+				private_key_ciphered, private_key_ciphered_length, pSerializedAttr, serializedAttrLen, EVP_PKEY_RSA))) goto SGXDecrypt_err;
+			if ((to = DecryptRsa(pKey, ciphertext, ciphertext_length, RSA_PKCS1_PADDING, &to_len)) == NULL) {
 				goto SGXDecrypt_err;
 			}
 			break;
@@ -172,66 +307,236 @@ int SGXDecrypt(
     *plainTextLength = to_len;
     ret = 0;
 SGXDecrypt_err:
-	if (to) free(to);
-	if (private_key_der) free(private_key_der);
     if (pKey) EVP_PKEY_free(pKey);
     return ret;
 }
 
 
+int SGXMigrateKey(
+        const uint8_t *private_key_ciphered,
+        size_t private_key_ciphered_length,
+        const uint8_t *pSerializedAttr,
+        size_t serializedAttrLen,
+        uint8_t *pMigrated,
+        size_t migratedLength,
+        size_t *pMigratedLengthOut) {
+	uint8_t id[KEY_CACHE_ID_SIZE];
+	uint8_t *private_key = NULL, *pPacked = NULL;
+	size_t privateKeyLength = 0, packedLength = 0;
+	EVP_PKEY *pKey = NULL;
+	const CK_ULONG *pKeyType;
+	int ret = -1;
+	ArenaScope scope;
+
+	AttributeView attr = AttributeView(pSerializedAttr, serializedAttrLen);
+
+	if ((pKeyType = attr.checkIn(CKA_KEY_TYPE, supportedKeyTypes, sizeof supportedKeyTypes / sizeof *supportedKeyTypes)) == NULL) return ret;
+	*pMigratedLengthOut = 0;
+	if (getRootKey(NULL) == NULL) return ret;
+	ret -= 1;
+	if (NULL == (private_key = decryptObject(
+		private_key_ciphered, private_key_ciphered_length, &privateKeyLength, pSerializedAttr, serializedAttrLen))) goto SGXMigrateKey_err;
+	ret = 0;
+	// Already in the current format
+	if (isPackedKey(private_key, privateKeyLength)) goto SGXMigrateKey_err;
+	ret = -3;
+	if (NULL == (pKey = unpackPrivateKey(private_key, privateKeyLength, *pKeyType == CKK_RSA ? EVP_PKEY_RSA : EVP_PKEY_EC))) goto SGXMigrateKey_err;
+	// Keys without a packed form stay as they are
+	ret = 0;
+	if (packPrivateKey(pKey, &pPacked, &packedLength)) goto SGXMigrateKey_err;
+	ret = -4;
+	if (encryptObject(pPacked, packedLength,
+		pSerializedAttr, serializedAttrLen, pMigrated, migratedLength, pMigratedLengthOut)) goto SGXMigrateKey_err;
+	if (0 == keyCacheId(pMigrated, *pMigratedLengthOut, pSerializedAttr, serializedAttrLen, id))
+		keyCachePut(id, pKey, packedLength);
+	ret = 0;
+SGXMigrateKey_err:
+	putRootKey();
+	if (ret) *pMigratedLengthOut = 0;
+	if (pPacked) OPENSSL_clear_free(pPacked, packedLength);
+	if (pKey) EVP_PKEY_free(pKey);
+	return ret;
+}
+
+
 typedef int (* signFunc_t)(
-        const uint8_t *private_key_der,
-        size_t privateKeyDERlength,
+        EVP_PKEY *pKey,
         const uint8_t *pData,
         size_t dataLen,
         uint8_t *pSignature,
         size_t *pSignatureLengthOut,
         CK_MECHANISM_TYPE mechanism);
 
-int SGXSign(
-         const uint8_t *private_key_ciphered, size_t private_key_ciphered_length,
-         const uint8_t *pSerializedKeyAttr, size_t serializedKeyAttrLength,
-         const uint8_t *pData, size_t dataLen,
-         uint8_t *pSignature, size_t signatureLength, size_t *pSignatureLenOut,
-         CK_MECHANISM_TYPE mechanism){
-
-    uint8_t *private_key_der;
-    size_t privateKeyDERlength;
-    int ret = -1;
-    CK_OBJECT_CLASS *pObjectClass;
-    CK_KEY_TYPE *pKeyType;
-	signFunc_t sf;
-
-	AttributeSerial attr = AttributeSerial(pSerializedKeyAttr, serializedKeyAttrLength);
+// Checks the key attributes and returns the key type together with the sign
+// function for it, EVP_PKEY_NONE when the key cannot sign.
+static int signingKeyType(
+        const uint8_t *pSerializedKeyAttr, size_t serializedKeyAttrLength,
+        signFunc_t *pSignFunc) {
+    const CK_OBJECT_CLASS *pObjectClass;
+    const CK_KEY_TYPE *pKeyType;
 
-    if (NULL == (private_key_der = decryptObject(
-        private_key_ciphered, private_key_ciphered_length, &privateKeyDERlength, pSerializedKeyAttr, serializedKeyAttrLength))) goto SGXSign_err;
+	AttributeView attr = AttributeView(pSerializedKeyAttr, serializedKeyAttrLength);
 
     pObjectClass = attr.getType<CK_OBJECT_CLASS>(CKA_CLASS);
-    if (pObjectClass == NULL || *pObjectClass != CKO_PRIVATE_KEY) goto SGXSign_err;
+    if (pObjectClass == NULL || *pObjectClass != CKO_PRIVATE_KEY) return EVP_PKEY_NONE;
 
     pKeyType = attr.getType<CK_KEY_TYPE>(CKA_KEY_TYPE);
-	if (pKeyType == NULL) goto SGXSign_err;
+	if (pKeyType == NULL) return EVP_PKEY_NONE;
 
 	switch (*pKeyType){
 	 	case CKK_RSA:
-			sf = SignRSA;
-            break;
+			*pSignFunc = SignRSA;
+			return EVP_PKEY_RSA;
 	 	case CKK_EC:
-			sf = ECsign;
-			break;
+			*pSignFunc = ECsign;
+			return EVP_PKEY_EC;
 	 	default:
-	 		goto SGXSign_err;
+	 		return EVP_PKEY_NONE;
+	}
+}
+
+
+// Returns the referenced private key together with the sign function for
+// its type.
+static EVP_PKEY *loadSigningKey(
+        const uint8_t *private_key_ciphered, size_t private_key_ciphered_length,
+        const uint8_t *pSerializedKeyAttr, size_t serializedKeyAttrLength,
+        signFunc_t *pSignFunc) {
+	int type;
+
+	if ((type = signingKeyType(pSerializedKeyAttr, serializedKeyAttrLength, pSignFunc)) == EVP_PKEY_NONE) return NULL;
+	return loadPrivateKey(
+		private_key_ciphered, private_key_ciphered_length, pSerializedKeyAttr, serializedKeyAttrLength, type);
+}
+
+
+int SGXSign(
+         const uint8_t *private_key_ciphered, size_t private_key_ciphered_length,
+         const uint8_t *pSerializedKeyAttr, size_t serializedKeyAttrLength,
+         const uint8_t *pData, size_t dataLen,
+         uint8_t *pSignature, size_t signatureLength, size_t *pSignatureLenOut,
+         CK_MECHANISM_TYPE mechanism){
+
+    int ret = -1;
+	int required;
+	signFunc_t sf;
+	EVP_PKEY *pKey = NULL;
+	ArenaScope scope;
+
+	if (NULL == (pKey = loadSigningKey(
+		private_key_ciphered, private_key_ciphered_length, pSerializedKeyAttr, serializedKeyAttrLength, &sf))) goto SGXSign_err;
+	if ((required = EVP_PKEY_size(pKey)) <= 0) goto SGXSign_err;
+	// Also answers a length query, made with no buffer at all
+	if ((size_t) required > signatureLength) {
+		*pSignatureLenOut = required;
+		ret = SGX_SIGN_BUFFER_TOO_SMALL;
+		goto SGXSign_err;
 	}
 	*pSignatureLenOut = signatureLength;
-	ret = sf(
-			private_key_der, privateKeyDERlength, pData, dataLen,
-			pSignature, pSignatureLenOut, mechanism);
+	ret = sf(pKey, pData, dataLen, pSignature, pSignatureLenOut, mechanism);
 SGXSign_err:
+	if (pKey) EVP_PKEY_free(pKey);
     return ret;
 }
 
 
+static bool inBuffer(uint64_t offset, uint64_t length, size_t bufferLength) {
+	return offset <= bufferLength && length <= bufferLength - offset;
+}
+
+
+int SGXSignBatch(
+        const uint8_t *pRequest, size_t requestLength,
+        uint8_t *pResponse, size_t responseLength, size_t *pResponseLengthOut) {
+	const sign_batch_header_t *pHeader;
+	const sign_batch_key_t *pKeys;
+	const sign_batch_item_t *pItems;
+	sign_batch_result_t *pResults;
+	key_load_t *pLoads = NULL;
+	signFunc_t *pSignFunc = NULL;
+	uint64_t offset;
+	int ret = -1;
+	ArenaScope scope;
+
+	if (requestLength < sizeof *pHeader) return ret;
+	pHeader = (const sign_batch_header_t *) pRequest;
+	ret -= 1;
+	if (pHeader->nrItems > MAX_SIGN_BATCH_ITEMS || pHeader->nrKeys > pHeader->nrItems) return ret;
+	ret -= 1;
+	if (!inBuffer(sizeof *pHeader,
+			(uint64_t) pHeader->nrKeys * sizeof *pKeys + (uint64_t) pHeader->nrItems * sizeof *pItems, requestLength)) return ret;
+	pKeys = (const sign_batch_key_t *) (pRequest + sizeof *pHeader);
+	pItems = (const sign_batch_item_t *) (pKeys + pHeader->nrKeys);
+	ret -= 1;
+	if (!inBuffer(0, (uint64_t) pHeader->nrItems * sizeof *pResults, responseLength)) return ret;
+	pResults = (sign_batch_result_t *) pResponse;
+
+	ret -= 1;
+	pLoads = (key_load_t *) arenaCalloc(pHeader->nrKeys + 1, sizeof *pLoads);
+	pSignFunc = (signFunc_t *) arenaCalloc(pHeader->nrKeys + 1, sizeof *pSignFunc);
+	if (pLoads == NULL || pSignFunc == NULL) goto SGXSignBatch_err;
+
+	// All keys are loaded up front, the ones not cached in a single pass
+	for (uint32_t k = 0; k < pHeader->nrKeys; k++) {
+		key_load_t *pLoad = pLoads + k;
+
+		pLoad->type = EVP_PKEY_NONE;
+		if (!inBuffer(pKeys[k].keyOffset, pKeys[k].keyLength, requestLength)
+				|| !inBuffer(pKeys[k].attrOffset, pKeys[k].attrLength, requestLength)) continue;
+		pLoad->pWrapped = pRequest + pKeys[k].keyOffset;
+		pLoad->wrappedLength = pKeys[k].keyLength;
+		pLoad->pAttr = pRequest + pKeys[k].attrOffset;
+		pLoad->attrLength = pKeys[k].attrLength;
+		pLoad->type = signingKeyType(pLoad->pAttr, pLoad->attrLength, pSignFunc + k);
+	}
+	loadPrivateKeys(pLoads, pHeader->nrKeys);
+
+	// Signatures are packed after the result table
+	offset = (uint64_t) pHeader->nrItems * sizeof *pResults;
+	for (uint32_t i = 0; i < pHeader->nrItems; i++) {
+		const sign_batch_item_t *pItem = pItems + i;
+		sign_batch_result_t *pResult = pResults + i;
+		uint32_t k = pItem->keyIndex;
+		size_t siglen;
+		int required;
+		// Per item temporaries do not pile up over the batch
+		ArenaScope itemScope;
+
+		pResult->signatureOffset = 0;
+		pResult->signatureLength = 0;
+		pResult->status = SIGN_BATCH_KEY_INVALID;
+		if (k >= pHeader->nrKeys || pLoads[k].pKey == NULL) continue;
+
+		pResult->status = SIGN_BATCH_FAILED;
+		if (!inBuffer(pItem->dataOffset, pItem->dataLength, requestLength)) continue;
+		if (!inBuffer(offset, pItem->signatureLength, responseLength)) continue;
+		required = EVP_PKEY_size(pLoads[k].pKey);
+		if (required <= 0) continue;
+		if ((uint32_t) required > pItem->signatureLength) {
+			pResult->status = SIGN_BATCH_BUFFER_TOO_SMALL;
+			pResult->signatureLength = required;
+			continue;
+		}
+		siglen = pItem->signatureLength;
+		if (pSignFunc[k](pLoads[k].pKey,
+				pRequest + pItem->dataOffset, pItem->dataLength,
+				pResponse + offset, &siglen, pItem->mechanism)) continue;
+		pResult->status = SIGN_BATCH_OK;
+		pResult->signatureOffset = offset;
+		pResult->signatureLength = siglen;
+		offset += siglen;
+	}
+	*pResponseLengthOut = offset;
+	ret = 0;
+SGXSignBatch_err:
+	if (pLoads) {
+		for (uint32_t k = 0; k < pHeader->nrKeys; k++)
+			if (pLoads[k].pKey) EVP_PKEY_free(pLoads[k].pKey);
+	}
+	return ret;
+}
+
+
 int SGXGenerateRandom(uint8_t *random, size_t random_length){
     int ret = -1;
 	if (SGX_SUCCESS != sgx_read_rand(random, random_length)) goto generateRandom_err;
@@ -258,8 +563,41 @@ int SGXSetRootKeySealed(const uint8_t *root_key_sealed, size_t root_key_len_seal
 }
 
 
+int SGXGetStateKey(uint8_t *key, size_t keyLength){
+	return GetStateKey(key, keyLength);
+}
+
+
 int SGXSetRootKeyShare(int x, const uint8_t *y, size_t y_length, int threshold)
 {
 	return SetRootKeyShare(x, y, y_length, threshold);
 }
 
+
+
+int SGXConfigureKeyCache(size_t maxEntries, size_t maxBytes)
+{
+	return keyCacheConfigure(maxEntries, maxBytes);
+}
+
+
+int SGXConfigureRSAPool(size_t bits, const uint8_t *exponent, size_t exponentLength, size_t depth)
+{
+	return rsaPoolConfigure(bits, exponentLength ? exponent : NULL, exponentLength, depth);
+}
+
+
+int SGXConfigureECPool(const char *curve, size_t depth)
+{
+	int nid = OBJ_sn2nid(curve);
+
+	if (nid == NID_undef) return -1;
+	return ecPoolConfigure(nid, depth);
+}
+
+
+int SGXGetArenaStats(size_t *pPeak, size_t *pSize, size_t *pOverflows)
+{
+	arenaStats(pPeak, pSize, pOverflows);
+	return 0;
+}
@@ -0,0 +1,113 @@
+#include <cstring>
+#include <map>
+#include <list>
+#include <array>
+#include <iterator>
+#include <pthread.h>
+#include <openssl/sha.h>
+#include <openssl/crypto.h>
+
+#include "sgx_tcrypto.h"
+
+#include "shared_values.h"
+#include "keycache.h"
+
+typedef std::array<uint8_t, KEY_CACHE_ID_SIZE> keyId_t;
+
+typedef struct {
+    keyId_t id;
+    EVP_PKEY *pKey;
+    size_t cost;
+} keyCacheEntry_t;
+
+static std::list<keyCacheEntry_t> lru;
+static std::map<keyId_t, std::list<keyCacheEntry_t>::iterator> cacheIndex;
+static size_t maxEntries = DEFAULT_KEY_CACHE_ENTRIES;
+static size_t maxBytes = DEFAULT_KEY_CACHE_BYTES;
+static size_t usedBytes = 0;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+int keyCacheId(
+        const uint8_t *pWrapped, size_t wrappedLength,
+        const uint8_t *pAAD, size_t aadLength,
+        uint8_t *pId) {
+    SHA256_CTX ctx;
+
+    if (wrappedLength < SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE) return -1;
+    if (!SHA256_Init(&ctx)) return -1;
+    // tag and iv
+    if (!SHA256_Update(&ctx, pWrapped, SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE)) return -1;
+    if (!SHA256_Update(&ctx, pAAD, aadLength)) return -1;
+    if (!SHA256_Final(pId, &ctx)) return -1;
+    return 0;
+}
+
+
+static void evict(std::list<keyCacheEntry_t>::iterator it) {
+    cacheIndex.erase(it->id);
+    usedBytes -= it->cost;
+    EVP_PKEY_free(it->pKey);
+    lru.erase(it);
+}
+
+
+static void shrink(void) {
+    while (!lru.empty() && (lru.size() > maxEntries || usedBytes > maxBytes)) {
+        evict(std::prev(lru.end()));
+    }
+}
+
+
+EVP_PKEY *keyCacheGet(const uint8_t *pId) {
+    keyId_t id;
+
+    EVP_PKEY *pKey = NULL;
+
+    memcpy(id.data(), pId, id.size());
+    pthread_mutex_lock(&cacheLock);
+    auto it = cacheIndex.find(id);
+    if (it != cacheIndex.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        if (1 == EVP_PKEY_up_ref(it->second->pKey)) pKey = it->second->pKey;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return pKey;
+}
+
+
+void keyCachePut(const uint8_t *pId, EVP_PKEY *pKey, size_t cost) {
+    keyId_t id;
+
+    memcpy(id.data(), pId, id.size());
+    pthread_mutex_lock(&cacheLock);
+    if (maxEntries == 0 || cost > maxBytes) goto keyCachePut_out;
+    {
+        auto it = cacheIndex.find(id);
+        if (it != cacheIndex.end()) evict(it->second);
+    }
+    if (1 != EVP_PKEY_up_ref(pKey)) goto keyCachePut_out;
+    lru.push_front({id, pKey, cost});
+    cacheIndex[id] = lru.begin();
+    usedBytes += cost;
+    shrink();
+keyCachePut_out:
+    pthread_mutex_unlock(&cacheLock);
+}
+
+
+int keyCacheConfigure(size_t entries, size_t bytes) {
+    pthread_mutex_lock(&cacheLock);
+    maxEntries = entries;
+    maxBytes = bytes;
+    shrink();
+    pthread_mutex_unlock(&cacheLock);
+    return 0;
+}
+
+
+void keyCacheFlush(void) {
+    pthread_mutex_lock(&cacheLock);
+    while (!lru.empty()) evict(lru.begin());
+    pthread_mutex_unlock(&cacheLock);
+}
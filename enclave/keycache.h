@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <openssl/evp.h>
+
+#define KEY_CACHE_ID_SIZE 32
+
+// Cache of unwrapped private keys. Entries are identified by a hash over
+// the GCM tag, IV and AAD of the wrapped object, so a hit implies the same
+// (tag, iv, attributes) triple was authenticated before.
+int keyCacheId(
+        const uint8_t *pWrapped, size_t wrappedLength,
+        const uint8_t *pAAD, size_t aadLength,
+        uint8_t *pId);
+
+EVP_PKEY *keyCacheGet(const uint8_t *pId);
+
+void keyCachePut(const uint8_t *pId, EVP_PKEY *pKey, size_t cost);
+
+int keyCacheConfigure(size_t maxEntries, size_t maxBytes);
+
+void keyCacheFlush(void);
@@ -0,0 +1,188 @@
+#include <cstring>
+#include <stdlib.h>
+#include <openssl/bn.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+
+#include "keyformat.h"
+#include "ec.h"
+
+// Largest component, 8192 bit RSA
+#define MAX_KEY_FORMAT_WIDTH 1024
+
+#define RSA_COMPONENTS 8
+
+
+bool isPackedKey(const uint8_t *pKeyData, size_t keyDataLength) {
+    uint32_t magic;
+
+    if (keyDataLength < sizeof(key_format_header_t)) return false;
+    memcpy(&magic, pKeyData, sizeof magic);
+    return magic == KEY_FORMAT_MAGIC;
+}
+
+
+static uint8_t *newPacked(size_t length, uint16_t type, size_t width, int nid) {
+    key_format_header_t header = { KEY_FORMAT_MAGIC, KEY_FORMAT_VERSION, type, (uint32_t) width, (uint32_t) nid };
+    uint8_t *pPacked;
+
+    if ((pPacked = (uint8_t *) malloc(length)) == NULL) return NULL;
+    memcpy(pPacked, &header, sizeof header);
+    return pPacked;
+}
+
+
+static int packRSA(const RSA *rsa, uint8_t **ppPacked, size_t *pPackedLength) {
+    const BIGNUM *bn[RSA_COMPONENTS];
+    size_t width = RSA_size(rsa), half = (width + 1) / 2;
+    size_t length = sizeof(key_format_header_t) + 3 * width + 5 * half;
+    uint8_t *pPacked, *p;
+
+    RSA_get0_key(rsa, &bn[0], &bn[1], &bn[2]);
+    RSA_get0_factors(rsa, &bn[3], &bn[4]);
+    RSA_get0_crt_params(rsa, &bn[5], &bn[6], &bn[7]);
+    if (width > MAX_KEY_FORMAT_WIDTH) return -1;
+    if ((pPacked = newPacked(length, KEY_FORMAT_RSA, width, 0)) == NULL) return -1;
+    p = pPacked + sizeof(key_format_header_t);
+    for (int i = 0; i < RSA_COMPONENTS; i++) {
+        size_t w = i < 3 ? width : half;
+        // Multi prime keys or odd sized factors stay in DER
+        if (bn[i] == NULL || BN_bn2binpad(bn[i], p, w) < 0) goto packRSA_err;
+        p += w;
+    }
+    *ppPacked = pPacked;
+    *pPackedLength = length;
+    return 0;
+packRSA_err:
+    OPENSSL_clear_free(pPacked, length);
+    return -1;
+}
+
+
+static int packEC(const EC_KEY *ec, uint8_t **ppPacked, size_t *pPackedLength) {
+    const EC_GROUP *grp;
+    const BIGNUM *d;
+    const EC_POINT *pub;
+    size_t width, length;
+    uint8_t *pPacked;
+    int nid;
+
+    if ((grp = EC_KEY_get0_group(ec)) == NULL) return -1;
+    // Only named curves, explicit parameters stay in DER
+    if ((nid = EC_GROUP_get_curve_name(grp)) == NID_undef) return -1;
+    if ((d = EC_KEY_get0_private_key(ec)) == NULL) return -1;
+    if ((pub = EC_KEY_get0_public_key(ec)) == NULL) return -1;
+    width = (EC_GROUP_get_degree(grp) + 7) / 8;
+    if (width > MAX_KEY_FORMAT_WIDTH) return -1;
+    length = sizeof(key_format_header_t) + 3 * width + 1;
+    if ((pPacked = newPacked(length, KEY_FORMAT_EC, width, nid)) == NULL) return -1;
+    if (BN_bn2binpad(d, pPacked + sizeof(key_format_header_t), width) < 0) goto packEC_err;
+    if (EC_POINT_point2oct(grp, pub, POINT_CONVERSION_UNCOMPRESSED,
+            pPacked + sizeof(key_format_header_t) + width, 2 * width + 1, NULL) != 2 * width + 1) goto packEC_err;
+    *ppPacked = pPacked;
+    *pPackedLength = length;
+    return 0;
+packEC_err:
+    OPENSSL_clear_free(pPacked, length);
+    return -1;
+}
+
+
+int packPrivateKey(EVP_PKEY *pKey, uint8_t **ppPacked, size_t *pPackedLength) {
+    switch (EVP_PKEY_id(pKey)) {
+        case EVP_PKEY_RSA:
+            return packRSA(EVP_PKEY_get0_RSA(pKey), ppPacked, pPackedLength);
+        case EVP_PKEY_EC:
+            return packEC(EVP_PKEY_get0_EC_KEY(pKey), ppPacked, pPackedLength);
+    }
+    return -1;
+}
+
+
+static EVP_PKEY *unpackRSA(const key_format_header_t *pHeader, const uint8_t *p, size_t length) {
+    BIGNUM *bn[RSA_COMPONENTS] = { NULL };
+    size_t width = pHeader->width, half = (width + 1) / 2;
+    EVP_PKEY *pKey = NULL;
+    RSA *rsa = NULL;
+    int i;
+
+    if (length != 3 * width + 5 * half) return NULL;
+    for (i = 0; i < RSA_COMPONENTS; i++) {
+        size_t w = i < 3 ? width : half;
+        if ((bn[i] = BN_bin2bn(p, w, NULL)) == NULL) goto unpackRSA_err;
+        p += w;
+    }
+    if ((rsa = RSA_new()) == NULL) goto unpackRSA_err;
+    // RSA takes ownership of the numbers it accepted
+    if (!RSA_set0_key(rsa, bn[0], bn[1], bn[2])) goto unpackRSA_err;
+    bn[0] = bn[1] = bn[2] = NULL;
+    if (!RSA_set0_factors(rsa, bn[3], bn[4])) goto unpackRSA_err;
+    bn[3] = bn[4] = NULL;
+    if (!RSA_set0_crt_params(rsa, bn[5], bn[6], bn[7])) goto unpackRSA_err;
+    bn[5] = bn[6] = bn[7] = NULL;
+    if ((pKey = EVP_PKEY_new()) == NULL) goto unpackRSA_err;
+    if (!EVP_PKEY_assign_RSA(pKey, rsa)) goto unpackRSA_err;
+    return pKey;
+unpackRSA_err:
+    for (i = 0; i < RSA_COMPONENTS; i++) BN_clear_free(bn[i]);
+    if (rsa) RSA_free(rsa);
+    if (pKey) EVP_PKEY_free(pKey);
+    return NULL;
+}
+
+
+static EVP_PKEY *unpackEC(const key_format_header_t *pHeader, const uint8_t *p, size_t length) {
+    size_t width = pHeader->width;
+    EVP_PKEY *pKey = NULL;
+    EC_KEY *ec = NULL;
+    EC_POINT *pub = NULL;
+    BIGNUM *d = NULL;
+    const EC_GROUP *grp;
+
+    if (length != 3 * width + 1) return NULL;
+    if ((ec = ecKeyNew(pHeader->nid)) == NULL) return NULL;
+    grp = EC_KEY_get0_group(ec);
+    if ((size_t) (EC_GROUP_get_degree(grp) + 7) / 8 != width) goto unpackEC_err;
+    if ((d = BN_bin2bn(p, width, NULL)) == NULL) goto unpackEC_err;
+    if (!EC_KEY_set_private_key(ec, d)) goto unpackEC_err;
+    if ((pub = EC_POINT_new(grp)) == NULL) goto unpackEC_err;
+    if (!EC_POINT_oct2point(grp, pub, p + width, 2 * width + 1, NULL)) goto unpackEC_err;
+    if (!EC_KEY_set_public_key(ec, pub)) goto unpackEC_err;
+    if ((pKey = EVP_PKEY_new()) == NULL) goto unpackEC_err;
+    if (!EVP_PKEY_assign_EC_KEY(pKey, ec)) goto unpackEC_err;
+    ec = NULL;
+unpackEC_err:
+    BN_clear_free(d);
+    if (pub) EC_POINT_free(pub);
+    if (ec) {
+        EC_KEY_free(ec);
+        if (pKey) EVP_PKEY_free(pKey);
+        pKey = NULL;
+    }
+    return pKey;
+}
+
+
+EVP_PKEY *unpackPrivateKey(const uint8_t *pKeyData, size_t keyDataLength, int type) {
+    key_format_header_t header;
+    const uint8_t *endptr = pKeyData;
+
+    if (!isPackedKey(pKeyData, keyDataLength))
+        return d2i_PrivateKey(type, NULL, &endptr, (long) keyDataLength);
+
+    memcpy(&header, pKeyData, sizeof header);
+    if (header.version != KEY_FORMAT_VERSION) return NULL;
+    if (header.width == 0 || header.width > MAX_KEY_FORMAT_WIDTH) return NULL;
+    pKeyData += sizeof header;
+    keyDataLength -= sizeof header;
+    switch (header.type) {
+        case KEY_FORMAT_RSA:
+            if (type != EVP_PKEY_RSA) return NULL;
+            return unpackRSA(&header, pKeyData, keyDataLength);
+        case KEY_FORMAT_EC:
+            if (type != EVP_PKEY_EC) return NULL;
+            return unpackEC(&header, pKeyData, keyDataLength);
+    }
+    return NULL;
+}
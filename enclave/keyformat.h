@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <openssl/evp.h>
+#include "shared_values.h"
+
+// Format of the private key inside the wrapped object. The key components
+// are stored as fixed width big endian numbers, so loading a key needs no
+// ASN.1 parsing:
+//
+// RSA: header | n, e, d (width) | p, q, dmp1, dmq1, iqmp ((width + 1) / 2)
+// EC:  header | private scalar (width) | uncompressed public point (2 * width + 1)
+//
+// Objects wrapped before this format hold a DER key, which never starts
+// with the magic. KEY_FORMAT_VERSION is in shared_values.h, the library
+// marks migrated objects with it.
+//
+// Montgomery contexts are not part of the format, OpenSSL has no API to
+// import them. The enclave key cache keeps them for hot keys instead.
+#define KEY_FORMAT_MAGIC 0x4b584753
+
+#define KEY_FORMAT_RSA 1
+#define KEY_FORMAT_EC 2
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    uint32_t width;
+    // Curve of an EC key
+    uint32_t nid;
+} key_format_header_t;
+
+bool isPackedKey(const uint8_t *pKeyData, size_t keyDataLength);
+
+int packPrivateKey(EVP_PKEY *pKey, uint8_t **ppPacked, size_t *pPackedLength);
+
+// Loads a packed or DER private key of the given EVP_PKEY type
+EVP_PKEY *unpackPrivateKey(const uint8_t *pKeyData, size_t keyDataLength, int type);
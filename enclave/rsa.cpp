@@ -1,6 +1,8 @@
 #include <map>
 #include "rsa.h"
 #include "arm.h"
+#include "rsapool.h"
+#include "arena.h"
 
 #include "sgx_tseal.h"
 #include "sgx_trts.h"
@@ -62,7 +64,7 @@ static CK_ATTRIBUTE defaultPrivateKeyAttr[] = {
 
 
 
-static auto defaultPrivateKKeyAttrMap = ATTR(defaultPrivateKeyAttr).map();
+static const auto defaultPrivateKKeyAttrMap = ATTR(defaultPrivateKeyAttr).map();
 
 static CK_OBJECT_CLASS pubObjectClass = CKO_PUBLIC_KEY;
 
@@ -71,15 +73,14 @@ CK_ATTRIBUTE defaultPublicKeyAttr[] = {
     {CKA_KEY_TYPE, &keyType, sizeof keyType},
 };
 
-static auto defaultPublicKeyAttrMap = ATTR(defaultPublicKeyAttr).map();
+static const auto defaultPublicKeyAttrMap = ATTR(defaultPublicKeyAttr).map();
 
 
 int generateRSAKeyPair(
         uint8_t **ppRSAPublicKey, size_t *pRSAPublicKeyLength, Attribute &pubAttr,
         uint8_t ** ppRSAPrivateKey, size_t *pRSAPrivateKeyLength, Attribute &privAttr){
 
-    CK_ATTRIBUTE_PTR attr_modulus_bits = pubAttr.get(CKA_MODULUS_BITS);
-    CK_ATTRIBUTE_PTR attr_public_exponent = pubAttr.get(CKA_PUBLIC_EXPONENT);
+    CK_ATTRIBUTE_PTR attr_modulus_bits, attr_public_exponent;
     int ret = -1;
     RSA *rsa_key = NULL;
     int privateKeyDERlength, publicKeyDERlength;
@@ -93,6 +94,12 @@ int generateRSAKeyPair(
     bool priv_decrypt = privAttr.check(CKA_DECRYPT, tr);
     bool priv_sign = privAttr.check(CKA_SIGN, tr);
 
+    // Merge first, merging may move attributes a kept lookup points to
+    pubAttr.merge(defaultPublicKeyAttrMap);
+    privAttr.merge(defaultPrivateKKeyAttrMap);
+    attr_modulus_bits = pubAttr.get(CKA_MODULUS_BITS);
+    attr_public_exponent = pubAttr.get(CKA_PUBLIC_EXPONENT);
+
 
 	ret -= 1;
     if (attr_modulus_bits == NULL || attr_modulus_bits->ulValueLen != sizeof(CK_ULONG)) goto generateRSAKeyPair_err;
@@ -111,7 +118,8 @@ int generateRSAKeyPair(
     }
 
     ret -= 1;
-	if ((rsa_key = generateRSA(modulus_bits, exponent, exponentLength)) == NULL) goto generateRSAKeyPair_err;
+	if ((rsa_key = rsaPoolGet(modulus_bits, exponent, exponentLength)) == NULL &&
+        (rsa_key = generateRSA(modulus_bits, exponent, exponentLength)) == NULL) goto generateRSAKeyPair_err;
 
     if ((publicKeyDERlength = getRSAder(rsa_key, &pRSAPublicKeyDER, i2d_PUBKEY)) < 0) goto generateRSAKeyPair_err;
     if ((privateKeyDERlength = getRSAder(rsa_key, &pRSAPrivateKeyDER, i2d_PrivateKey)) <= 0) goto generateRSAKeyPair_err;
@@ -120,9 +128,6 @@ int generateRSAKeyPair(
 	*pRSAPrivateKeyLength = privateKeyDERlength;
 
 
-    pubAttr.merge(defaultPublicKeyAttrMap);
-    privAttr.merge(defaultPrivateKKeyAttrMap);
-
 	*ppRSAPublicKey = pRSAPublicKeyDER;
 	*ppRSAPrivateKey = pRSAPrivateKeyDER;
 
@@ -137,27 +142,34 @@ generateRSAKeyPair_err:
 }
 
 
+uint8_t *DecryptRsa(
+        EVP_PKEY *pKey,
+        const uint8_t *ciphertext, size_t ciphertext_length,
+        int padding, int *to_len){
+    RSA *rsa = NULL;
+    uint8_t *ret = NULL;
+
+	if (NULL == (rsa = (RSA *) EVP_PKEY_get0_RSA(pKey))) return NULL;
+    if ((ret = (uint8_t *)arenaAlloc(RSA_size(rsa))) == NULL) return NULL;
+    if (-1 == (*to_len = RSA_private_decrypt(ciphertext_length, ciphertext, ret, rsa, padding))) return NULL;
+    return ret;
+}
+
+
 uint8_t *DecryptRsa(
         uint8_t *private_key_der, size_t privateKeyDERlength,
         const uint8_t *ciphertext, size_t ciphertext_length,
         int padding, int *to_len){
 	const uint8_t *endptr;
 	EVP_PKEY *pKey = NULL;
-    RSA *rsa = NULL;
     uint8_t *ret = NULL;
 
 	endptr = (const uint8_t *) private_key_der;
 	if ((pKey = d2i_PrivateKey(EVP_PKEY_RSA, &pKey, &endptr, (long) privateKeyDERlength)) == NULL){
 		return NULL;
     }
-	if (NULL == (rsa = EVP_PKEY_get1_RSA(pKey))) goto DecryptRSA_err;
-    if ((ret = (uint8_t *)malloc(RSA_size(rsa))) == NULL) goto DecryptRSA_err;
-    if (-1 == (*to_len = RSA_private_decrypt(ciphertext_length, ciphertext, ret, rsa, padding))){
-		return NULL;
-	}
-DecryptRSA_err:
-    if (rsa) free(rsa);
-    if (pKey) EVP_PKEY_free(pKey);
+    ret = DecryptRsa(pKey, ciphertext, ciphertext_length, padding, to_len);
+    EVP_PKEY_free(pKey);
     return ret;
 }
 
@@ -169,36 +181,32 @@ struct mechanismType {
     md_func_t mdf;
 } mechanismType_t;
 
-static std::map<CK_MECHANISM_TYPE, mechanismType> allowedSignMechanisms = {
+// For the hash-and-sign mechanisms pData is the digest, hashed by the caller
+static const std::map<CK_MECHANISM_TYPE, mechanismType> allowedSignMechanisms = {
     { CKM_RSA_PKCS, { RSA_PKCS1_PADDING, NULL }},
     { CKM_SHA1_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha1 }},
     { CKM_SHA256_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha256 }},
     { CKM_SHA384_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha384 }},
-    { CKM_SHA512_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha256 }},
+    { CKM_SHA512_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha512 }},
 };
 
 int SignRSA(
-        const uint8_t *private_key_der,
-        size_t privateKeyDERlength,
+        EVP_PKEY *pKey,
         const uint8_t *pData,
         size_t dataLen,
         uint8_t *pSignature,
         size_t *pSignatureLengthOut,
         CK_MECHANISM_TYPE mechanism) {
 
-    EVP_PKEY *pKey = NULL;
     auto it = allowedSignMechanisms.find(mechanism);
-	const uint8_t *endptr;
 	size_t outLen;
 	int ret = -1;
 	EVP_PKEY_CTX* ctx = NULL;
 
     if (it == allowedSignMechanisms.end()) return -1;
+    if (EVP_PKEY_id(pKey) != EVP_PKEY_RSA) return -1;
+    if (it->second.mdf != NULL && dataLen != (size_t) EVP_MD_size(it->second.mdf())) return -1;
 
-	endptr = (const uint8_t *) private_key_der;
-	if ((pKey = d2i_PrivateKey(EVP_PKEY_RSA, &pKey, &endptr, (long) privateKeyDERlength)) == NULL){
-		return ret;
-    }
 	ctx = EVP_PKEY_CTX_new(pKey, NULL);
 	if (0 >= EVP_PKEY_sign_init(ctx)) goto SignRSA_err;
 	if (0 >= EVP_PKEY_CTX_set_rsa_padding(ctx, it->second.padding)) goto SignRSA_err;
@@ -210,6 +218,28 @@ int SignRSA(
     ret = 0;
 SignRSA_err:
 	if (ctx) EVP_PKEY_CTX_free(ctx);
-	if (pKey) EVP_PKEY_free(pKey);
+    return ret;
+}
+
+
+int SignRSA(
+        const uint8_t *private_key_der,
+        size_t privateKeyDERlength,
+        const uint8_t *pData,
+        size_t dataLen,
+        uint8_t *pSignature,
+        size_t *pSignatureLengthOut,
+        CK_MECHANISM_TYPE mechanism) {
+
+    EVP_PKEY *pKey = NULL;
+	const uint8_t *endptr;
+	int ret;
+
+	endptr = (const uint8_t *) private_key_der;
+	if ((pKey = d2i_PrivateKey(EVP_PKEY_RSA, &pKey, &endptr, (long) privateKeyDERlength)) == NULL){
+		return -1;
+    }
+	ret = SignRSA(pKey, pData, dataLen, pSignature, pSignatureLengthOut, mechanism);
+	EVP_PKEY_free(pKey);
     return ret;
 }
@@ -2,6 +2,7 @@
 #include <map>
 #include "openssl/rsa.h"
 #include "openssl/bn.h"
+#include "openssl/evp.h"
 
 #define CK_PTR *
 #define CK_DEFINE_FUNCTION(returnType, name) returnType name
@@ -24,6 +25,12 @@ int generateRSAKeyPair(
         Attribute &pubAttr,
         uint8_t ** ppRSAPrivateKey, size_t *pRSAPrivateKeyLength, Attribute &privAttr);
 
+// The plaintext lives in the ECALL arena
+uint8_t *DecryptRsa(
+        EVP_PKEY *pKey,
+        const uint8_t *ciphertext, size_t ciphertext_length,
+        int padding, int *to_len);
+
 uint8_t *DecryptRsa(
         uint8_t *private_key_der, size_t privateKeyDERlength,
         const uint8_t *ciphertext, size_t ciphertext_length,
@@ -35,6 +42,14 @@ int EncryptRSA(
         uint8_t* ciphertext, size_t ciphertext_length,
         size_t* cipherTextLength, int padding);
 
+int SignRSA(
+        EVP_PKEY *pKey,
+        const uint8_t *pData,
+        size_t dataLen,
+        uint8_t *pSignature,
+        size_t *pSignatureLengthOut,
+        CK_MECHANISM_TYPE mechanism);
+
 int SignRSA(
         const uint8_t *private_key_der,
         size_t privateKeyDERlength,
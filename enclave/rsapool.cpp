@@ -0,0 +1,119 @@
+#include <map>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <openssl/bn.h>
+
+#include "shared_values.h"
+#include "rsa.h"
+#include "rsapool.h"
+#include "worker.h"
+
+typedef std::pair<size_t, std::vector<uint8_t>> poolId_t;
+
+typedef struct {
+    size_t depth;
+    std::list<RSA *> keys;
+} rsaPool_t;
+
+static std::map<poolId_t, rsaPool_t> pools;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// The exponent is stored without leading zeros
+static int poolId(size_t bits, const uint8_t *exponent, size_t exponentLength, poolId_t &id) {
+    BIGNUM *bne;
+    int ret = -1;
+
+    if ((bne = BN_new()) == NULL) return -1;
+    if (exponent == NULL) {
+        if (BN_set_word(bne, RSA_F4) != 1) goto poolId_err;
+    } else {
+        if (BN_bin2bn(exponent, exponentLength, bne) == NULL) goto poolId_err;
+    }
+    if (BN_is_zero(bne)) goto poolId_err;
+    id.first = bits;
+    id.second.resize(BN_num_bytes(bne));
+    BN_bn2bin(bne, id.second.data());
+    ret = 0;
+poolId_err:
+    BN_free(bne);
+    return ret;
+}
+
+
+static void drain(rsaPool_t &pool, size_t depth) {
+    while (pool.keys.size() > depth) {
+        RSA_free(pool.keys.back());
+        pool.keys.pop_back();
+    }
+}
+
+
+// Adds one key to the first pool that is short, the lock is released
+// while generating
+static bool rsaPoolRefill(void) {
+    pthread_mutex_lock(&poolLock);
+    auto it = pools.begin();
+    while (it != pools.end() && it->second.keys.size() >= it->second.depth) it++;
+    if (it == pools.end()) {
+        pthread_mutex_unlock(&poolLock);
+        return false;
+    }
+    poolId_t id = it->first;
+    pthread_mutex_unlock(&poolLock);
+    RSA *rsa = generateRSA(id.first, id.second.data(), id.second.size());
+    pthread_mutex_lock(&poolLock);
+    it = pools.find(id);
+    if (rsa == NULL) {
+        // Do not retry a pool that cannot be generated
+        if (it != pools.end()) it->second.depth = it->second.keys.size();
+    } else if (it != pools.end() && it->second.keys.size() < it->second.depth) {
+        it->second.keys.push_back(rsa);
+    } else {
+        RSA_free(rsa);
+    }
+    pthread_mutex_unlock(&poolLock);
+    return true;
+}
+
+
+int rsaPoolConfigure(size_t bits, const uint8_t *exponent, size_t exponentLength, size_t depth) {
+    poolId_t id;
+
+    if (depth > MAX_RSA_POOL_DEPTH) return -1;
+    if (bits < 2048 || bits > 4096) return -1;
+    if (poolId(bits, exponent, exponentLength, id)) return -1;
+    pthread_mutex_lock(&poolLock);
+    if (depth == 0) {
+        auto it = pools.find(id);
+        if (it != pools.end()) {
+            drain(it->second, 0);
+            pools.erase(it);
+        }
+    } else {
+        rsaPool_t &pool = pools[id];
+        pool.depth = depth;
+        drain(pool, depth);
+    }
+    pthread_mutex_unlock(&poolLock);
+    return depth ? workerRegister(rsaPoolRefill) : 0;
+}
+
+
+RSA *rsaPoolGet(size_t bits, const uint8_t *exponent, size_t exponentLength) {
+    RSA *rsa = NULL;
+    poolId_t id;
+
+    if (poolId(bits, exponent, exponentLength, id)) return NULL;
+    pthread_mutex_lock(&poolLock);
+    auto it = pools.find(id);
+    if (it != pools.end() && !it->second.keys.empty()) {
+        rsa = it->second.keys.front();
+        it->second.keys.pop_front();
+    }
+    pthread_mutex_unlock(&poolLock);
+    if (rsa) workerWake();
+    return rsa;
+}
+
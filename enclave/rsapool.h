@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <openssl/rsa.h>
+
+// Pool of pre-generated RSA keys per (modulus bits, public exponent), kept
+// filled by the enclave worker thread. A NULL exponent stands for RSA_F4.
+int rsaPoolConfigure(size_t bits, const uint8_t *exponent, size_t exponentLength, size_t depth);
+
+// Takes a key from the pool, NULL when none is ready
+RSA *rsaPoolGet(size_t bits, const uint8_t *exponent, size_t exponentLength);
@@ -44,7 +44,7 @@ void printhex(const char *s, const uint8_t *buf, unsigned long length){
 void printAttr(uint8_t *pAttr, size_t attrLen){
     size_t nrAttributes;
 
-    AttributeSerial a = AttributeSerial(pAttr, attrLen);
+    AttributeSerial a(pAttr, attrLen);
     CK_ATTRIBUTE_PTR attr = a.attributes(nrAttributes);
     printf("\n");
     for (size_t i=0; i<nrAttributes; i++) {
@@ -6,6 +6,7 @@
 
 #include "../Attribute.h"
 #include "../AttributeSerial.h"
+#include "shared_values.h"
 
 #define CK_PTR *
 #define CK_DEFINE_FUNCTION(returnType, name) returnType name
@@ -22,6 +23,10 @@
 #define MAX_ATTR_SIZE 2028
 
 #include "../ec.h"
+#include "../ecpool.h"
+#include <unistd.h>
+#include "signbatch.h"
+#include <openssl/x509.h>
 
 
 extern CK_BBOOL rootKeySet;
@@ -103,6 +108,143 @@ void test_signEC(void){
 }
 
 
+void test_signECDigest(void){
+	uint8_t *privKey=NULL;
+	size_t privKeyLength;
+    uint8_t digest[20] = {0x11, 0x22}, sig[72];
+    size_t sigLen = sizeof(sig);
+    Attribute privAttr = Attribute();
+
+    CU_ASSERT_FATAL(0 == generate_ec_keypair(&privKey, &privKeyLength, &privAttr));
+    // The caller hashes, only a SHA1 sized digest is accepted
+    CU_ASSERT_FATAL(0 > ECsign(privKey, privKeyLength, digest, sizeof(digest) - 1, sig, &sigLen, CKM_ECDSA_SHA1));
+    CU_ASSERT_FATAL(0 == ECsign(privKey, privKeyLength, digest, sizeof(digest), sig, &sigLen, CKM_ECDSA_SHA1));
+}
+
+void test_ecPool(void){
+	uint8_t *privKey=NULL;
+	size_t privKeyLength;
+    uint8_t digest[32] = {0x11, 0x22}, sig[72];
+    size_t sigLen;
+    BIGNUM *kinv = NULL, *r = NULL;
+    Attribute privAttr = Attribute();
+    bool ready = false;
+
+    CU_ASSERT_FATAL(0 > SGXConfigureECPool("no-such-curve", 4));
+    CU_ASSERT_FATAL(0 == SGXConfigureECPool("prime256v1", 4));
+    // Filled in the background
+    for (int i = 0; i < 100 && !ready; i++) {
+        if (!(ready = ecPoolGet(NID_X9_62_prime256v1, &kinv, &r))) usleep(10000);
+    }
+    CU_ASSERT_FATAL(ready);
+    BN_clear_free(kinv);
+    BN_clear_free(r);
+
+    CU_ASSERT_FATAL(0 == generate_ec_keypair(&privKey, &privKeyLength, &privAttr));
+    EVP_PKEY *pKey = d2i_PrivateKey(EVP_PKEY_EC, NULL, (const uint8_t **) &privKey, privKeyLength);
+    CU_ASSERT_FATAL(pKey != NULL);
+    // Signatures from the pool must verify and use a fresh pair every time
+    uint8_t first[72];
+    size_t firstLen = 0;
+    for (int i = 0; i < 8; i++) {
+        sigLen = sizeof sig;
+        CU_ASSERT_FATAL(0 == ECsign(pKey, digest, sizeof digest, sig, &sigLen, CKM_ECDSA));
+        CU_ASSERT_FATAL(1 == ECDSA_verify(0, digest, sizeof digest, sig, sigLen, (EC_KEY *) EVP_PKEY_get0_EC_KEY(pKey)));
+        if (i == 0) {
+            memcpy(first, sig, sigLen);
+            firstLen = sigLen;
+        } else {
+            CU_ASSERT_FATAL(sigLen != firstLen || memcmp(first, sig, sigLen) != 0);
+        }
+    }
+    EVP_PKEY_free(pKey);
+
+    CU_ASSERT_FATAL(0 == SGXConfigureECPool("prime256v1", 0));
+    CU_ASSERT_FATAL(!ecPoolGet(NID_X9_62_prime256v1, &kinv, &r));
+}
+
+
+
+void test_ecCurveRegistry(void){
+    EC_GROUP *grp;
+    EC_KEY *key;
+    uint8_t explicitParams[512], *p = explicitParams;
+    int len;
+    uint8_t *pubKey = NULL, *privKey = NULL;
+    size_t pubKeyLength, privKeyLength;
+    CK_ATTRIBUTE_PTR pParams;
+
+    CU_ASSERT_FATAL((grp = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1)) != NULL);
+    EC_GROUP_set_asn1_flag(grp, OPENSSL_EC_EXPLICIT_CURVE);
+    CU_ASSERT_FATAL((len = i2d_ECPKParameters(grp, NULL)) > 0 && len <= (int) sizeof explicitParams);
+    i2d_ECPKParameters(grp, &p);
+    EC_GROUP_free(grp);
+
+    CU_ASSERT(ecCurveNid(CKA_EC_PARAM_PRIME_256V1, sizeof CKA_EC_PARAM_PRIME_256V1) == NID_X9_62_prime256v1);
+    CU_ASSERT(ecCurveNid(explicitParams, len) == NID_X9_62_prime256v1);
+    // Explicit parameters of an unnamed curve, here a changed order, are refused
+    explicitParams[len - 20] ^= 1;
+    CU_ASSERT(ecCurveNid(explicitParams, len) == NID_undef);
+    explicitParams[len - 20] ^= 1;
+
+    CU_ASSERT_FATAL((key = generateEC(explicitParams, len)) != NULL);
+    CU_ASSERT(EC_GROUP_get_curve_name(EC_KEY_get0_group(key)) == NID_X9_62_prime256v1);
+    CU_ASSERT(EC_GROUP_get_asn1_flag(EC_KEY_get0_group(key)) & OPENSSL_EC_NAMED_CURVE);
+    EC_KEY_free(key);
+
+    CK_ATTRIBUTE template_[] = {
+        {CKA_KEY_TYPE, &keyType, sizeof keyType},
+        {CKA_EC_PARAMS, explicitParams, (CK_ULONG) len},
+    };
+    Attribute pub = ATTR(template_);
+    Attribute priv = Attribute();
+    CU_ASSERT_FATAL(0 == generateECKeyPair(&pubKey, &pubKeyLength, pub, &privKey, &privKeyLength, priv));
+    // The key is stored with the named curve
+    CU_ASSERT_FATAL((pParams = pub.get(CKA_EC_PARAMS)) != NULL);
+    CU_ASSERT(pParams->ulValueLen == sizeof CKA_EC_PARAM_PRIME_256V1);
+    CU_ASSERT(0 == memcmp(pParams->pValue, CKA_EC_PARAM_PRIME_256V1, sizeof CKA_EC_PARAM_PRIME_256V1));
+    free(pubKey);
+    free(privKey);
+
+    // Keys stored with explicit parameters before still sign, next to the
+    // precomputed pairs of the named curve
+    uint8_t digest[32] = {0x33}, sig[72];
+    size_t sigLen = sizeof sig;
+    EVP_PKEY *pKey;
+    CU_ASSERT_FATAL(0 == SGXConfigureECPool("prime256v1", 4));
+    {
+        // The same curve built from its parameters has no name
+        EC_GROUP *named = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
+        BIGNUM *cp = BN_new(), *ca = BN_new(), *cb = BN_new(), *gx = BN_new(), *gy = BN_new();
+        EC_POINT *g;
+        CU_ASSERT_FATAL(EC_GROUP_get_curve(named, cp, ca, cb, NULL));
+        CU_ASSERT_FATAL(EC_POINT_get_affine_coordinates(named, EC_GROUP_get0_generator(named), gx, gy, NULL));
+        CU_ASSERT_FATAL((grp = EC_GROUP_new_curve_GFp(cp, ca, cb, NULL)) != NULL);
+        CU_ASSERT_FATAL((g = EC_POINT_new(grp)) != NULL);
+        CU_ASSERT_FATAL(EC_POINT_set_affine_coordinates(grp, g, gx, gy, NULL));
+        CU_ASSERT_FATAL(EC_GROUP_set_generator(grp, g, EC_GROUP_get0_order(named), EC_GROUP_get0_cofactor(named)));
+        EC_POINT_free(g);
+        EC_GROUP_free(named);
+        BN_free(cp);
+        BN_free(ca);
+        BN_free(cb);
+        BN_free(gx);
+        BN_free(gy);
+    }
+    CU_ASSERT_FATAL(EC_GROUP_get_curve_name(grp) == NID_undef);
+    CU_ASSERT_FATAL((key = EC_KEY_new()) != NULL);
+    CU_ASSERT_FATAL(EC_KEY_set_group(key, grp));
+    CU_ASSERT_FATAL(EC_KEY_generate_key(key));
+    EC_GROUP_free(grp);
+    CU_ASSERT_FATAL((pKey = EVP_PKEY_new()) != NULL);
+    CU_ASSERT_FATAL(EVP_PKEY_assign_EC_KEY(pKey, key));
+    CU_ASSERT(0 == ECsign(pKey, digest, sizeof digest, sig, &sigLen, CKM_ECDSA));
+    CU_ASSERT(1 == ECDSA_verify(0, digest, sizeof digest, sig, sigLen, (EC_KEY *) EVP_PKEY_get0_EC_KEY(pKey)));
+    EVP_PKEY_free(pKey);
+    CU_ASSERT_FATAL(0 == SGXConfigureECPool("prime256v1", 0));
+}
+
+
 void test_SGXSignEC(void){
 	uint8_t pubkey[2048], privkey[2048];
 	size_t pubkeyLength, privkeyLength;
@@ -134,6 +276,91 @@ void test_SGXSignEC(void){
 
     ret = SGXSign(privkey, privkeyLength, pPrivSerializedAttr, privSerializedAttrLenOut, data, sizeof(data), sig, sizeof(sig), &sigLen, mechanism);
     CU_ASSERT_FATAL(ret == 0);
+
+    // A length query signs nothing
+    sigLen = 0;
+    ret = SGXSign(privkey, privkeyLength, pPrivSerializedAttr, privSerializedAttrLenOut, data, sizeof(data), NULL, 0, &sigLen, mechanism);
+    CU_ASSERT_FATAL(ret == SGX_SIGN_BUFFER_TOO_SMALL);
+    CU_ASSERT_FATAL(sigLen == sizeof(sig));
+}
+
+
+
+void test_SGXSignBatchEC(void){
+	uint8_t pubkey[2048], privkey[2048];
+	size_t pubkeyLength, privkeyLength;
+    uint8_t *pPublicKeySerializedAttr=NULL;
+    size_t publicKeySerializedLen=0;
+    size_t publicKeySerializedLenOut = MAX_ATTR_SIZE;
+    uint8_t *pPrivSerializedAttr=NULL;
+    size_t privSerializedAttrLen=0;
+    size_t privSerializedAttrLenOut = MAX_ATTR_SIZE;
+    int ret;
+
+    rootKeySet = CK_TRUE;
+
+    Attribute priv = Attribute(privateECKeyTemplate, privateECKeyTemplateLength);
+    pPrivSerializedAttr = priv.serialize(&privSerializedAttrLen);
+    pPrivSerializedAttr  = (uint8_t *) realloc(pPrivSerializedAttr, MAX_ATTR_SIZE);
+
+    Attribute pub = Attribute(publicECKeyTemplate, publicECKeyTemplateLength);
+    pPublicKeySerializedAttr = pub.serialize(&publicKeySerializedLen);
+    pPublicKeySerializedAttr  = (uint8_t *) realloc(pPublicKeySerializedAttr, MAX_ATTR_SIZE);
+
+	ret = SGXgenerateKeyPair(pubkey, sizeof pubkey, &pubkeyLength, pPublicKeySerializedAttr, publicKeySerializedLen, &publicKeySerializedLenOut, privkey, sizeof privkey, &privkeyLength, pPrivSerializedAttr, privSerializedAttrLen, &privSerializedAttrLenOut);
+    CU_ASSERT_FATAL(0 == ret);
+
+    // Two good items, one with too little room and one with an unknown key
+    uint8_t data[] = {0x01, 0x02, 0x03, 0x04};
+    uint8_t request[4096], response[4096];
+    size_t responseLength = 0;
+    sign_batch_header_t *pHeader = (sign_batch_header_t *) request;
+    sign_batch_key_t *pKey = (sign_batch_key_t *) (pHeader + 1);
+    sign_batch_item_t *pItem = (sign_batch_item_t *) (pKey + 1);
+    sign_batch_result_t *pResult = (sign_batch_result_t *) response;
+    size_t offset = (uint8_t *) (pItem + 4) - request;
+
+    pHeader->nrKeys = 1;
+    pHeader->nrItems = 4;
+    pKey->keyOffset = offset;
+    pKey->keyLength = privkeyLength;
+    memcpy(request + offset, privkey, privkeyLength);
+    offset += privkeyLength;
+    pKey->attrOffset = offset;
+    pKey->attrLength = privSerializedAttrLenOut;
+    memcpy(request + offset, pPrivSerializedAttr, privSerializedAttrLenOut);
+    offset += privSerializedAttrLenOut;
+    memcpy(request + offset, data, sizeof data);
+    for (int i = 0; i < 4; i++) {
+        pItem[i].keyIndex = i == 3 ? 1 : 0;
+        pItem[i].signatureLength = i == 2 ? 8 : 72;
+        pItem[i].mechanism = CKM_ECDSA;
+        pItem[i].dataOffset = offset;
+        pItem[i].dataLength = sizeof data;
+    }
+    offset += sizeof data;
+
+    ret = SGXSignBatch(request, offset, response, sizeof response, &responseLength);
+    CU_ASSERT_FATAL(ret == 0);
+    CU_ASSERT_FATAL(pResult[0].status == SIGN_BATCH_OK);
+    CU_ASSERT_FATAL(pResult[1].status == SIGN_BATCH_OK);
+    CU_ASSERT_FATAL(pResult[2].status == SIGN_BATCH_BUFFER_TOO_SMALL);
+    CU_ASSERT_FATAL(pResult[2].signatureLength >= 64);
+    CU_ASSERT_FATAL(pResult[3].status == SIGN_BATCH_KEY_INVALID);
+    CU_ASSERT_FATAL(pResult[1].signatureOffset + pResult[1].signatureLength <= responseLength);
+
+    const uint8_t *endptr = pubkey;
+    EVP_PKEY *pPubKey = d2i_PUBKEY(NULL, &endptr, pubkeyLength);
+    CU_ASSERT_FATAL(pPubKey != NULL);
+    for (int i = 0; i < 2; i++) {
+        CU_ASSERT_FATAL(1 == ECDSA_verify(0, data, sizeof data,
+            response + pResult[i].signatureOffset, pResult[i].signatureLength,
+            (EC_KEY *) EVP_PKEY_get0_EC_KEY(pPubKey)));
+    }
+    EVP_PKEY_free(pPubKey);
+
+    // Truncated request
+    CU_ASSERT_FATAL(SGXSignBatch(request, sizeof *pHeader + 1, response, sizeof response, &responseLength) < 0);
 }
 
 
@@ -144,6 +371,10 @@ CU_pSuite ec_suite(void){
     CU_add_test(pSuite, "generateEC", test_generateEC);
     CU_add_test(pSuite, "generateECKeyPair", test_generateECKeyPair);
     CU_add_test(pSuite, "signEC", test_signEC);
+    CU_add_test(pSuite, "signECDigest", test_signECDigest);
+    CU_add_test(pSuite, "ecPool", test_ecPool);
+    CU_add_test(pSuite, "ecCurveRegistry", test_ecCurveRegistry);
     CU_add_test(pSuite, "SGXsignEC", test_SGXSignEC);
+    CU_add_test(pSuite, "SGXSignBatchEC", test_SGXSignBatchEC);
     return pSuite;
 }
@@ -18,6 +18,9 @@
 #endif
 
 #include "../../cryptoki/pkcs11.h"
+#include "../arena.h"
+#include "../arm.h"
+#include "../AttributeView.h"
 
 
 extern CK_BBOOL rootKeySet;
@@ -63,9 +66,131 @@ void test_SGXSetRootKeyShare(void)
 }
 
 
+void test_rootKeyCipher(void)
+{
+	uint8_t plain[40] = {0x11, 0x22}, cipher[sizeof plain], decrypted[sizeof plain];
+	uint8_t iv[ROOTKEY_GCM_IV_SIZE] = {0x5a}, tag[ROOTKEY_GCM_TAG_SIZE], aad[4] = {0x01};
+	uint8_t sealed[1024];
+	size_t sealedLength;
+
+	CU_ASSERT_FATAL(0 == GenerateRootKey(sealed, sizeof sealed, &sealedLength));
+	CU_ASSERT_FATAL(getRootKey(NULL) != NULL);
+	CU_ASSERT_FATAL(0 == rootKeyEncrypt(plain, sizeof plain, aad, sizeof aad, iv, cipher, tag));
+	CU_ASSERT(0 == rootKeyDecrypt(cipher, sizeof cipher, aad, sizeof aad, iv, tag, decrypted));
+	CU_ASSERT(0 == memcmp(plain, decrypted, sizeof plain));
+	// The attributes are authenticated
+	aad[0] ^= 1;
+	CU_ASSERT(0 != rootKeyDecrypt(cipher, sizeof cipher, aad, sizeof aad, iv, tag, decrypted));
+	aad[0] ^= 1;
+	putRootKey();
+
+	// A new root key replaces the expanded one
+	CU_ASSERT_FATAL(0 == GenerateRootKey(sealed, sizeof sealed, &sealedLength));
+	CU_ASSERT_FATAL(getRootKey(NULL) != NULL);
+	CU_ASSERT(0 != rootKeyDecrypt(cipher, sizeof cipher, aad, sizeof aad, iv, tag, decrypted));
+	putRootKey();
+}
+
+
+void test_attributeView(void)
+{
+	CK_OBJECT_CLASS objectClass = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE keyType = CKK_EC;
+	CK_BBOOL tr = CK_TRUE;
+	CK_ULONG keyTypes[] = { CKK_RSA, CKK_EC };
+	uint8_t label[] = "view";
+	CK_ATTRIBUTE attributes[] = {
+		{CKA_CLASS, &objectClass, sizeof objectClass},
+		{CKA_KEY_TYPE, &keyType, sizeof keyType},
+		{CKA_SIGN, &tr, sizeof tr},
+		{CKA_LABEL, label, sizeof label},
+	};
+	uint8_t *pSerialized, reordered[512];
+	size_t serializedLen, first;
+
+	pSerialized = ATTR(attributes).serialize(&serializedLen);
+	CU_ASSERT_FATAL(pSerialized != NULL);
+
+	AttributeView view = AttributeView(pSerialized, serializedLen);
+	CU_ASSERT_FATAL(view.isValid());
+	CU_ASSERT(view.check<CK_ULONG>(CKA_CLASS, CKO_PRIVATE_KEY));
+	CU_ASSERT(!view.check<CK_ULONG>(CKA_CLASS, CKO_PUBLIC_KEY));
+	CU_ASSERT(view.checkIn(CKA_KEY_TYPE, keyTypes, 2) != NULL);
+	CU_ASSERT(view.checkIn(CKA_KEY_TYPE, keyTypes, 1) == NULL);
+	CU_ASSERT(view.check<CK_BBOOL>(CKA_SIGN, CK_TRUE));
+	CU_ASSERT(view.getType<CK_BBOOL>(CKA_DECRYPT) == NULL);
+	// The size has to match the type
+	CU_ASSERT(view.getType<CK_ULONG>(CKA_SIGN) == NULL);
+	CU_ASSERT(view.get(CKA_LABEL) != NULL && view.get(CKA_LABEL)->ulValueLen == sizeof label);
+	// Values are read in place
+	CU_ASSERT((const uint8_t *) view.get(CKA_LABEL)->pValue > pSerialized);
+	CU_ASSERT((const uint8_t *) view.get(CKA_LABEL)->pValue < pSerialized + serializedLen);
+
+	// Truncated sets are refused as a whole
+	AttributeView truncated = AttributeView(pSerialized, serializedLen - 1);
+	CU_ASSERT(!truncated.isValid());
+	CU_ASSERT(truncated.get(CKA_CLASS) == NULL);
+
+	// Out of order sets still resolve, here CKA_CLASS moved to the end
+	first = sizeof(serializedAttr) + sizeof objectClass;
+	CU_ASSERT_FATAL(serializedLen <= sizeof reordered);
+	memcpy(reordered, pSerialized + first, serializedLen - first);
+	memcpy(reordered + serializedLen - first, pSerialized, first);
+	AttributeView unordered = AttributeView(reordered, serializedLen);
+	CU_ASSERT_FATAL(unordered.isValid());
+	CU_ASSERT(unordered.check<CK_ULONG>(CKA_CLASS, CKO_PRIVATE_KEY));
+	CU_ASSERT(unordered.check<CK_ULONG>(CKA_KEY_TYPE, CKK_EC));
+	free(pSerialized);
+}
+
+
+void test_arena(void)
+{
+	uint8_t *p, *q;
+	size_t peak, size, overflows, overflowsBefore;
+
+	arenaStats(&peak, &size, &overflowsBefore);
+	{
+		ArenaScope scope;
+		CU_ASSERT_FATAL((p = (uint8_t *) arenaAlloc(100)) != NULL);
+		CU_ASSERT(((uintptr_t) p % ARENA_ALIGN) == 0);
+		memset(p, 0xa5, 100);
+		{
+			ArenaScope inner;
+			CU_ASSERT_FATAL((q = (uint8_t *) arenaAlloc(10)) != NULL);
+			CU_ASSERT(q >= p + 100);
+			// Does not fit, taken from the heap
+			CU_ASSERT_FATAL(arenaAlloc(ARENA_SIZE) != NULL);
+		}
+		// The inner scope handed its memory back
+		CU_ASSERT(arenaAlloc(10) == q);
+		CU_ASSERT(p[99] == 0xa5);
+	}
+	// and everything is scrubbed at the end
+	CU_ASSERT(p[0] == 0 && p[99] == 0);
+	arenaStats(&peak, &size, &overflows);
+	CU_ASSERT(size == ARENA_SIZE);
+	CU_ASSERT(peak >= 100 + ARENA_SIZE);
+	CU_ASSERT(overflows == overflowsBefore + 1);
+
+	// Taken outside a scope, released by the next one
+	CU_ASSERT_FATAL((q = (uint8_t *) arenaAlloc(10)) != NULL);
+	CU_ASSERT_FATAL(arenaAlloc(ARENA_SIZE) != NULL);
+	{
+		ArenaScope scope;
+	}
+	{
+		ArenaScope scope;
+		CU_ASSERT(arenaAlloc(10) == q);
+	}
+}
+
 
 CU_pSuite enclave_suite(void){
     CU_pSuite pSuite = CU_add_suite("Enclave", NULL, NULL);
     CU_add_test(pSuite, "SGXSetRootKeyShare", test_SGXSetRootKeyShare);
+    CU_add_test(pSuite, "rootKeyCipher", test_rootKeyCipher);
+    CU_add_test(pSuite, "attributeView", test_attributeView);
+    CU_add_test(pSuite, "arena", test_arena);
     return pSuite;
 }
@@ -22,8 +22,16 @@
 
 #include "../../cryptoki/pkcs11.h"
 #include "stubs.h"
+#include "../rsa.h"
+#include "../keycache.h"
+#include "../rsapool.h"
+#include "../arm.h"
+#include "shared_values.h"
+#include <unistd.h>
+#include "sgx_tcrypto.h"
 
 extern CK_BBOOL rootKeySet;
+extern uint8_t rootKey[];
 
 
 static CK_BBOOL tr = CK_TRUE;
@@ -76,7 +84,7 @@ void test_generateRSAKeyPair(){
     CU_ASSERT_FATAL(MAX_ATTR_SIZE != publicKeySerializedLenOut);
     CU_ASSERT_FATAL(MAX_ATTR_SIZE != privSerializedAttrLenOut);
     size_t nrAttributes= 0;
-    AttributeSerial pubAttr = AttributeSerial(pPublicKeySerializedAttr, publicKeySerializedLen);
+    AttributeSerial pubAttr(pPublicKeySerializedAttr, publicKeySerializedLen);
     CK_ATTRIBUTE_PTR pPublicAttr = pubAttr.attributes(nrAttributes);
     CU_ASSERT_FATAL(pPublicAttr != NULL);
 	ret = SGXgenerateKeyPair(pubkey, 10, &pubkeyLength, pPublicKeySerializedAttr, publicKeySerializedLen, &publicKeySerializedLenOut, privkey, 10, &privkeyLength, pPrivSerializedAttr, privSerializedAttrLen, &privSerializedAttrLenOut);
@@ -132,6 +140,83 @@ void test_SGXcrypt(){
     CU_ASSERT_FATAL(ret == 0);
 	CU_ASSERT(plainTextLength == sizeof plaintext);
 	CU_ASSERT(0 == memcmp(plaintext, exp_plaintext, sizeof plaintext));
+
+    // Generated keys are in the packed format already
+    uint8_t migrated[4096];
+    size_t migratedLength;
+    ret = SGXMigrateKey(privkey, privkeyLength, pPrivSerializedAttr, privSerializedAttrLenOut, migrated, sizeof migrated, &migratedLength);
+    CU_ASSERT_FATAL(ret == 0);
+    CU_ASSERT_FATAL(migratedLength == 0);
+}
+
+
+// A private key wrapped as DER, the way keys were stored before the packed
+// key format, is rewrapped once and keeps working.
+void test_SGXMigrateKey(){
+	uint8_t wrapped[4096], migrated[4096], again[4096];
+	uint8_t plaintext[16] = {0x11, 0x12}, decrypted[16];
+	uint8_t ciphertext[256];
+	uint8_t *pDER = NULL, *pPub = NULL, *pSerialized;
+	size_t derLength, pubLength, serializedLength, wrappedLength, migratedLength, againLength, plainTextLength;
+	const uint8_t *endptr;
+	int ret;
+
+    rootKeySet = CK_TRUE;
+
+    Attribute pubAttr = Attribute(publicRSAKeyTemplate, publicRSAKeyTemplateLength);
+    Attribute privAttr = Attribute(privateRSAKeyTemplate, privateRSAKeyTemplateLength);
+    CU_ASSERT_FATAL(0 == generateRSAKeyPair(&pPub, &pubLength, pubAttr, &pDER, &derLength, privAttr));
+    pSerialized = privAttr.serialize(&serializedLength);
+
+    wrappedLength = derLength + SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE;
+    memset(wrapped + SGX_AESGCM_MAC_SIZE, 0x5a, SGX_AESGCM_IV_SIZE);
+    CU_ASSERT_FATAL(getRootKey(NULL) != NULL);
+    CU_ASSERT_FATAL(0 == rootKeyEncrypt(pDER, derLength, pSerialized, serializedLength,
+        wrapped + SGX_AESGCM_MAC_SIZE, wrapped + SGX_AESGCM_MAC_SIZE + SGX_AESGCM_IV_SIZE, wrapped));
+    putRootKey();
+
+    ret = SGXMigrateKey(wrapped, wrappedLength, pSerialized, serializedLength, migrated, sizeof migrated, &migratedLength);
+    CU_ASSERT_FATAL(ret == 0);
+    CU_ASSERT_FATAL(migratedLength > 0);
+    ret = SGXMigrateKey(migrated, migratedLength, pSerialized, serializedLength, again, sizeof again, &againLength);
+    CU_ASSERT_FATAL(ret == 0);
+    CU_ASSERT_FATAL(againLength == 0);
+
+    endptr = pPub;
+	EVP_PKEY *pPKey = d2i_PUBKEY(NULL, &endptr, (long) pubLength);
+    CU_ASSERT_FATAL(pPKey != NULL);
+    ret = RSA_public_encrypt(sizeof(plaintext), plaintext, ciphertext, (RSA *) EVP_PKEY_get0_RSA(pPKey), RSA_PKCS1_PADDING);
+    CU_ASSERT_FATAL(ret != -1);
+    keyCacheFlush();
+    CU_ASSERT_FATAL(0 == SGXDecrypt(migrated, migratedLength, pSerialized, serializedLength,
+        ciphertext, ret, decrypted, sizeof decrypted, &plainTextLength));
+	CU_ASSERT_FATAL(plainTextLength == sizeof plaintext);
+	CU_ASSERT_FATAL(0 == memcmp(plaintext, decrypted, sizeof plaintext));
+    EVP_PKEY_free(pPKey);
+    free(pSerialized);
+    free(pDER);
+    free(pPub);
+}
+
+
+void test_rsaPool(){
+    const uint8_t exponent[] = {0x00, 0x01, 0x00, 0x01};
+    RSA *rsa = NULL;
+
+    CU_ASSERT_FATAL(0 > rsaPoolConfigure(2048, NULL, 0, MAX_RSA_POOL_DEPTH + 1));
+    CU_ASSERT_FATAL(0 > rsaPoolConfigure(1024, NULL, 0, 1));
+    CU_ASSERT_FATAL(NULL == rsaPoolGet(2048, NULL, 0));
+    CU_ASSERT_FATAL(0 == rsaPoolConfigure(2048, NULL, 0, 1));
+    // Filled in the background
+    for (int i = 0; i < 300 && rsa == NULL; i++) {
+        if ((rsa = rsaPoolGet(2048, exponent, sizeof exponent)) == NULL) usleep(100000);
+    }
+    CU_ASSERT_FATAL(rsa != NULL);
+    CU_ASSERT_FATAL(RSA_bits(rsa) == 2048);
+    CU_ASSERT_FATAL(BN_get_word(RSA_get0_e(rsa)) == RSA_F4);
+    RSA_free(rsa);
+    CU_ASSERT_FATAL(0 == rsaPoolConfigure(2048, NULL, 0, 0));
+    CU_ASSERT_FATAL(NULL == rsaPoolGet(2048, NULL, 0));
 }
 
 
@@ -141,5 +226,7 @@ CU_pSuite rsa_suite(void){
     CU_pSuite pSuite = CU_add_suite("RSA", NULL, NULL);
     CU_add_test(pSuite, "SGXcrypt", test_SGXcrypt);
     CU_add_test(pSuite, "generateRSAKeyPair", test_generateRSAKeyPair);
+    CU_add_test(pSuite, "SGXMigrateKey", test_SGXMigrateKey);
+    CU_add_test(pSuite, "rsaPool", test_rsaPool);
     return pSuite;
 }
@@ -0,0 +1,57 @@
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+
+#include "worker.h"
+
+static std::vector<refillFunc_t> refills;
+static pthread_mutex_t workerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workerCond = PTHREAD_COND_INITIALIZER;
+static bool workerStarted = false;
+static bool woken = false;
+
+
+static void *work(void *arg) {
+    pthread_mutex_lock(&workerLock);
+    while (true) {
+        while (!woken) pthread_cond_wait(&workerCond, &workerLock);
+        // A wake up from here on is seen in the next round
+        woken = false;
+        std::vector<refillFunc_t> current = refills;
+        pthread_mutex_unlock(&workerLock);
+        bool busy = true;
+        while (busy) {
+            busy = false;
+            for (auto refill: current) busy |= refill();
+        }
+        pthread_mutex_lock(&workerLock);
+    }
+    return arg;
+}
+
+
+int workerRegister(refillFunc_t refill) {
+    int ret = -1;
+
+    pthread_mutex_lock(&workerLock);
+    if (!workerStarted) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, work, NULL)) goto workerRegister_err;
+        workerStarted = true;
+    }
+    if (std::find(refills.begin(), refills.end(), refill) == refills.end()) refills.push_back(refill);
+    woken = true;
+    pthread_cond_signal(&workerCond);
+    ret = 0;
+workerRegister_err:
+    pthread_mutex_unlock(&workerLock);
+    return ret;
+}
+
+
+void workerWake(void) {
+    pthread_mutex_lock(&workerLock);
+    woken = true;
+    pthread_cond_signal(&workerCond);
+    pthread_mutex_unlock(&workerLock);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// Background enclave thread shared by the precomputation pools. It calls
+// the registered refill functions while any of them reports work done and
+// sleeps until woken otherwise.
+typedef bool (*refillFunc_t)(void);
+
+int workerRegister(refillFunc_t refill);
+
+void workerWake(void);
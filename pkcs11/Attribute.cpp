@@ -20,12 +20,15 @@ uint8_t *Attribute::serialize(size_t *pDataLen){
     uint8_t *pData = NULL;
     size_t attrSize;
 
+    *pDataLen = 0;
+    for (auto  it=attrMap.begin(); it != attrMap.end(); it++)
+        *pDataLen += it->second->ulValueLen + sizeof it->second->type + sizeof it->second->ulValueLen;
+    if ((pData = (uint8_t *) malloc(*pDataLen)) == NULL)
+        return NULL;
     *pDataLen = 0;
     for (auto  it=attrMap.begin(); it != attrMap.end(); it++) {
         CK_ATTRIBUTE_PTR pAttr=it->second;;
         attrSize = pAttr->ulValueLen + sizeof pAttr->type + sizeof pAttr->ulValueLen;
-        if ((pData = (uint8_t *) realloc(pData, *pDataLen + attrSize)) == NULL)
-            return NULL;
         serializedAttr *a = (serializedAttr *) (pData + *pDataLen);
         a->type = pAttr->type;
         a->ulValueLen = pAttr->ulValueLen;
@@ -100,7 +103,7 @@ T *Attribute::checkIn(CK_ATTRIBUTE_TYPE type, T *pVal, size_t nr) {
 template CK_ULONG *Attribute::checkIn<CK_ULONG>(CK_ATTRIBUTE_TYPE type, CK_ULONG *pVal, size_t nr);
 
 
-void  Attribute::merge(std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> b){
+void  Attribute::merge(const std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> &b){
 	this->attrMap.insert(b.begin(), b.end());
 }
 
@@ -21,8 +21,8 @@ public:
     Attribute(CK_ATTRIBUTE_PTR pAttr, size_t nrAttributes);
     Attribute(std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> attrMap);
 
-    CK_ATTRIBUTE_PTR attributes(CK_ULONG& attributeCnt);
-    CK_ATTRIBUTE_PTR get(CK_ATTRIBUTE_TYPE type);
+    virtual CK_ATTRIBUTE_PTR attributes(CK_ULONG& attributeCnt);
+    virtual CK_ATTRIBUTE_PTR get(CK_ATTRIBUTE_TYPE type);
     template<typename T>
     T* getType(CK_ATTRIBUTE_TYPE);
     void add(CK_ATTRIBUTE_PTR pAtrribute);
@@ -35,14 +35,14 @@ public:
     template<typename T>
     T *checkIn(CK_ATTRIBUTE_TYPE type, T *pVal, size_t nr);
 
-    void merge(std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> map);
-    void merge(CK_ATTRIBUTE_PTR pAttr, size_t nrAttributes);
-    std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> map();
+    virtual void merge(const std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> &map);
+    virtual void merge(CK_ATTRIBUTE_PTR pAttr, size_t nrAttributes);
+    virtual std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> map();
 
-    uint8_t *serialize(size_t *pDataLen);
+    virtual uint8_t *serialize(size_t *pDataLen);
     int serialize(uint8_t *pData, size_t dataLen, size_t *pDataLen);
 
-    ~Attribute();
+    virtual ~Attribute();
 };
 
 #endif
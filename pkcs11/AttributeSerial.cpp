@@ -1,37 +1,128 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
 #include "AttributeSerial.h"
 
-AttributeSerial :: AttributeSerial(const uint8_t *pSerialized, size_t serializedLen): Attribute() {
-    int nrAttributes = 0;
+AttributeSerial :: AttributeSerial(const uint8_t *pSerialized, size_t serializedLen, void *(*alloc)(size_t nmemb, size_t size)): Attribute(), alloc(alloc) {
     size_t attrLen;
-    CK_ATTRIBUTE_PTR pAttr=NULL;
-    std::map<CK_ATTRIBUTE_TYPE, serializedAttr *> serAttrMap;
+    CK_ATTRIBUTE attr;
 
-    for (; serializedLen > 0;) {
-        serializedAttr *pSerAttr = (serializedAttr *)pSerialized;
-        serAttrMap[pSerAttr->type] = pSerAttr;
+    // Serialized sets come ordered by type; a later duplicate replaces an
+    // earlier one
+    for (size_t len = serializedLen; len > 0;) {
+        const serializedAttr *pSerAttr = (const serializedAttr *)pSerialized;
+        if (len < sizeof *pSerAttr) throw std::runtime_error("Invalid attributes");
         attrLen = sizeof *pSerAttr + pSerAttr->ulValueLen;
-        if (pSerAttr->ulValueLen > serializedLen || attrLen > serializedLen)
+        if (pSerAttr->ulValueLen > len || attrLen > len)
             throw std::runtime_error("Invalid attributes");
+        attr.type = pSerAttr->type;
+        attr.ulValueLen = pSerAttr->ulValueLen;
+        attr.pValue = (CK_VOID_PTR) pSerAttr->pValue;
+        this->insert(&attr, true);
         pSerialized += attrLen;
-        serializedLen -= attrLen;
-        nrAttributes++;
+        len -= attrLen;
     }
-    this->allocated = (CK_ATTRIBUTE_PTR) calloc(nrAttributes * sizeof *this->allocated, 1);
-    int idx=0;
-    for (auto it=serAttrMap.begin(); it != serAttrMap.end(); it++) {
-        serializedAttr *pSerAttr = it->second;
-        pAttr = this->allocated + idx;
-        pAttr->type = pSerAttr->type;
-        pAttr->ulValueLen = pSerAttr->ulValueLen;
-        pAttr->pValue = pSerAttr->pValue;
-        this->attrMap[pAttr->type] = pAttr;
-        idx++;
+}
+
+AttributeSerial::~AttributeSerial() {
+    if (this->table != this->fixedTable && this->alloc == NULL) free(this->table);
+}
+
+CK_ATTRIBUTE_PTR AttributeSerial::lowerBound(CK_ATTRIBUTE_TYPE type) {
+    size_t lo = 0, hi = this->nrAttributes;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (this->table[mid].type < type) lo = mid + 1;
+        else hi = mid;
     }
+    return this->table + lo;
+}
+
+// Doubles the table. A table from alloc is not given back here, its owner
+// takes it all back at once.
+void AttributeSerial::grow() {
+    CK_ATTRIBUTE_PTR pTable;
+    size_t size = 2 * this->tableSize;
+
+    if (this->alloc) pTable = (CK_ATTRIBUTE_PTR) this->alloc(size, sizeof *pTable);
+    else pTable = (CK_ATTRIBUTE_PTR) calloc(size, sizeof *pTable);
+    if (pTable == NULL) throw std::runtime_error("Too many attributes");
+    memcpy(pTable, this->table, this->nrAttributes * sizeof *pTable);
+    if (this->table != this->fixedTable && this->alloc == NULL) free(this->table);
+    this->table = pTable;
+    this->tableSize = size;
 }
 
+void AttributeSerial::insert(const CK_ATTRIBUTE *pAttr, bool replace) {
+    CK_ATTRIBUTE_PTR p = this->lowerBound(pAttr->type);
+    CK_ATTRIBUTE_PTR end = this->table + this->nrAttributes;
 
+    if (p != end && p->type == pAttr->type) {
+        if (replace) *p = *pAttr;
+        return;
+    }
+    if (this->nrAttributes == this->tableSize) {
+        size_t i = p - this->table;
+        this->grow();
+        p = this->table + i;
+        end = this->table + this->nrAttributes;
+    }
+    memmove(p + 1, p, (end - p) * sizeof *p);
+    *p = *pAttr;
+    this->nrAttributes++;
+}
 
-AttributeSerial::~AttributeSerial() {
-    if (this->allocated) free(this->allocated);
+CK_ATTRIBUTE_PTR AttributeSerial::attributes(CK_ULONG& attributeCnt) {
+    attributeCnt = this->nrAttributes;
+    return this->table;
+}
+
+CK_ATTRIBUTE_PTR AttributeSerial::get(CK_ATTRIBUTE_TYPE type) {
+    CK_ATTRIBUTE_PTR p = this->lowerBound(type);
+
+    if (p == this->table + this->nrAttributes || p->type != type) return NULL;
+    return p;
+}
+
+void AttributeSerial::merge(const std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> &b) {
+    for (auto it = b.begin(); it != b.end(); it++)
+        this->insert(it->second, false);
+}
+
+void AttributeSerial::merge(CK_ATTRIBUTE_PTR pAttr, size_t nrAttributes) {
+    // Within pAttr the last of a type counts, as for Attribute
+    for (size_t i = nrAttributes; i-- > 0;)
+        this->insert(pAttr + i, false);
+}
+
+std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> AttributeSerial::map() {
+    std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> m;
+
+    for (size_t i = 0; i < this->nrAttributes; i++)
+        m.emplace_hint(m.end(), this->table[i].type, this->table + i);
+    return m;
+}
+
+// The values may live in the buffer the result is copied back to, so the
+// set is serialized into a separate allocation first
+uint8_t *AttributeSerial::serialize(size_t *pDataLen) {
+    uint8_t *pData;
+    serializedAttr *a;
+
+    *pDataLen = 0;
+    for (size_t i = 0; i < this->nrAttributes; i++)
+        *pDataLen += sizeof *a + this->table[i].ulValueLen;
+    if ((pData = (uint8_t *) malloc(*pDataLen ? *pDataLen : 1)) == NULL)
+        return NULL;
+    *pDataLen = 0;
+    for (size_t i = 0; i < this->nrAttributes; i++) {
+        a = (serializedAttr *) (pData + *pDataLen);
+        a->type = this->table[i].type;
+        a->ulValueLen = this->table[i].ulValueLen;
+        memcpy(a->pValue, this->table[i].pValue, a->ulValueLen);
+        *pDataLen += sizeof *a + a->ulValueLen;
+    }
+    return pData;
 }
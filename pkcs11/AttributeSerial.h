@@ -3,12 +3,38 @@
 #include "pkcs11-interface.h"
 #include "Attribute.h"
 
+// Attribute set, merged defaults included, a serial set holds without
+// allocating
+#define ATTRIBUTE_SERIAL_MAX 32
+
+// Attributes of a serialized blob, kept in a table sorted by type. The
+// values point into the blob. Up to ATTRIBUTE_SERIAL_MAX attributes lookups
+// and merges do not touch the heap; past that the table moves to memory
+// from alloc, which is left to its owner (the enclave arena), or to the heap
+// when there is no alloc.
 class AttributeSerial: public Attribute
 {
 private:
-    CK_ATTRIBUTE_PTR allocated=NULL;
+    CK_ATTRIBUTE fixedTable[ATTRIBUTE_SERIAL_MAX];
+    CK_ATTRIBUTE_PTR table = fixedTable;
+    size_t tableSize = ATTRIBUTE_SERIAL_MAX;
+    size_t nrAttributes = 0;
+    void *(*alloc)(size_t nmemb, size_t size);
+
+    CK_ATTRIBUTE_PTR lowerBound(CK_ATTRIBUTE_TYPE type);
+    void grow();
+    void insert(const CK_ATTRIBUTE *pAttr, bool replace);
 public:
-    AttributeSerial(const uint8_t *pSerialized, size_t serializedLen);
+    AttributeSerial(const uint8_t *pSerialized, size_t serializedLen, void *(*alloc)(size_t nmemb, size_t size) = NULL);
     ~AttributeSerial();
-};
+    AttributeSerial(const AttributeSerial &) = delete;
+    AttributeSerial &operator=(const AttributeSerial &) = delete;
 
+    CK_ATTRIBUTE_PTR attributes(CK_ULONG& attributeCnt) override;
+    CK_ATTRIBUTE_PTR get(CK_ATTRIBUTE_TYPE type) override;
+    void merge(const std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> &map) override;
+    void merge(CK_ATTRIBUTE_PTR pAttr, size_t nrAttributes) override;
+    std::map<CK_ATTRIBUTE_TYPE, CK_ATTRIBUTE_PTR> map() override;
+    uint8_t *serialize(size_t *pDataLen) override;
+    using Attribute::serialize;
+};
@@ -2,14 +2,29 @@
 #include <exception>
 #include <stdexcept>
 #include <sqlite3.h>
+#include <sgx_uswitchless.h>
+#include <thread>
+#include <vector>
 #include "CryptoEntity.h"
 #include "Attribute.h"
+#include "signbatch.h"
 
-CryptoEntity::CryptoEntity() {
+CryptoEntity::CryptoEntity(const SwitchlessConfig *pSwitchless, size_t nrThreads, bool noThreads) : noThreads(noThreads) {
 	sgx_status_t ret = SGX_ERROR_UNEXPECTED;
 	sgx_launch_token_t launch_token = { 0 };
 	int updated = 0;
 
+	// More ECALLs at once than the enclave has TCS for would only fail
+	// with SGX_ERROR_OUT_OF_TCS
+	if (nrThreads > ENCLAVE_TCS_NUM) {
+		fprintf(stderr, "PKCS_SGX_THREADS=%lu exceeds the %d TCS of the enclave\n", nrThreads, ENCLAVE_TCS_NUM);
+		nrThreads = ENCLAVE_TCS_NUM;
+	}
+	// Switchless workers keep a TCS each
+	size_t trustedWorkers = pSwitchless ? pSwitchless->trustedWorkers : 0;
+	nrSlots = nrThreads > trustedWorkers + 1 ? nrThreads - trustedWorkers : 1;
+	freeSlots = nrSlots;
+
 	// Step 1: try to retrieve the launch token saved by last transaction
 	//         if there is no token, then create a new one.
 	auto fp = fopen(this->kTokenFile, "rb");
@@ -27,8 +42,22 @@ CryptoEntity::CryptoEntity() {
 		}
 	}
 
-	// Step 2: call sgx_create_enclave to initialize an enclave instance
-	ret = sgx_create_enclave(this->kEnclaveFile, SGX_DEBUG_FLAG, &launch_token, &updated, &this->enclave_id_, NULL);
+	// Step 2: call sgx_create_enclave to initialize an enclave instance,
+	//         with worker threads for the switchless ECALLs when asked for
+	if (pSwitchless && pSwitchless->trustedWorkers) {
+		sgx_uswitchless_config_t us_config = SGX_USWITCHLESS_CONFIG_INITIALIZER;
+		const void *enclave_ex_p[32] = { 0 };
+
+		us_config.num_tworkers = pSwitchless->trustedWorkers;
+		us_config.num_uworkers = pSwitchless->untrustedWorkers;
+		us_config.retries_before_fallback = pSwitchless->retriesBeforeFallback;
+		us_config.retries_before_sleep = pSwitchless->retriesBeforeSleep;
+		enclave_ex_p[SGX_CREATE_ENCLAVE_EX_SWITCHLESS_BIT_IDX] = (const void *)&us_config;
+		ret = sgx_create_enclave_ex(this->kEnclaveFile, SGX_DEBUG_FLAG, &launch_token, &updated, &this->enclave_id_, NULL,
+			SGX_CREATE_ENCLAVE_EX_SWITCHLESS, enclave_ex_p);
+	} else {
+		ret = sgx_create_enclave(this->kEnclaveFile, SGX_DEBUG_FLAG, &launch_token, &updated, &this->enclave_id_, NULL);
+	}
 	if (ret != SGX_SUCCESS) {
         printf("%s:%i ret=0x%x\n", __FILE__, __LINE__, ret);
 		throw std::runtime_error("Failed to create enclave.");
@@ -53,95 +82,271 @@ CryptoEntity::CryptoEntity() {
 #define MAX_ATTR_BUF 8192
 
 
+// Enclave output whose size is only known afterwards lands here first. The
+// buffer is per thread and only ever grows, so it is allocated once.
+static uint8_t *scratch(size_t length) {
+	static thread_local std::vector<uint8_t> buffer;
+	if (buffer.size() < length) buffer.resize(length);
+	return buffer.data();
+}
+
+
+static uint8_t *copyOut(const uint8_t *pData, size_t length) {
+	uint8_t *pCopy = (uint8_t *) malloc(length);
+	if (pCopy != NULL) memcpy(pCopy, pData, length);
+	return pCopy;
+}
+
+
 void CryptoEntity::KeyGeneration(uint8_t **pPublicKey, size_t *pPublicKeyLength, uint8_t **publicSerializedAttr, size_t *pPubAttrLen, uint8_t **pPrivateKey, size_t *pPrivateKeyLength, uint8_t **privSerializedAttr, size_t *pPrivAttrLen) {
 	sgx_status_t stat;
     int ret;
 
-    *pPrivateKeyLength = MAX_KEY_BUF;
-    *pPublicKeyLength = MAX_KEY_BUF;
-
-    *pPublicKey = (uint8_t *)calloc(*pPublicKeyLength, 1);
-    *pPrivateKey = (uint8_t *)calloc(*pPrivateKeyLength, 1);
-
-    if (*pPubAttrLen > MAX_ATTR_BUF || *pPrivAttrLen > MAX_ATTR_BUF) return;
+    *pPublicKey = NULL;
+    *pPrivateKey = NULL;
+    if (*pPubAttrLen > MAX_ATTR_BUF || *pPrivAttrLen > MAX_ATTR_BUF)
+		throw std::runtime_error("Key generation failed\n");
 
-    *publicSerializedAttr = (uint8_t *) realloc(*publicSerializedAttr, MAX_ATTR_BUF);
-    size_t pubAttrLen = *pPubAttrLen;
+    // The attributes go in and come back out through the same buffer
+    uint8_t *pub = scratch(2 * MAX_KEY_BUF + 2 * MAX_ATTR_BUF);
+    uint8_t *priv = pub + MAX_KEY_BUF;
+    uint8_t *pubAttr = priv + MAX_KEY_BUF;
+    uint8_t *privAttr = pubAttr + MAX_ATTR_BUF;
+    size_t pubAttrLen = *pPubAttrLen, privAttrLen = *pPrivAttrLen;
+    memcpy(pubAttr, *publicSerializedAttr, pubAttrLen);
+    memcpy(privAttr, *privSerializedAttr, privAttrLen);
     *pPubAttrLen = MAX_ATTR_BUF;
-    *privSerializedAttr = (uint8_t *) realloc(*privSerializedAttr, MAX_ATTR_BUF);
-    size_t privAttrLen = *pPrivAttrLen;
     *pPrivAttrLen = MAX_ATTR_BUF;
 
-	stat = SGXgenerateKeyPair(
-        this->enclave_id_, &ret,
-         *pPublicKey, *pPublicKeyLength, pPublicKeyLength,
-         *publicSerializedAttr, pubAttrLen, pPubAttrLen,
-         *pPrivateKey, *pPrivateKeyLength,  pPrivateKeyLength,
-         *privSerializedAttr, privAttrLen, pPrivAttrLen);
+	{
+		Slot slot(this);
+		stat = SGXgenerateKeyPair(
+			this->enclave_id_, &ret,
+			 pub, MAX_KEY_BUF, pPublicKeyLength,
+			 pubAttr, pubAttrLen, pPubAttrLen,
+			 priv, MAX_KEY_BUF, pPrivateKeyLength,
+			 privAttr, privAttrLen, pPrivAttrLen);
+	}
 	if (stat != SGX_SUCCESS || ret != 0) {
         printf("%s:%i ret=%lx\n", __FILE__, __LINE__, (unsigned long)ret);
+		throw std::runtime_error("Key generation failed\n");
+	}
+	// One allocation of the final size for each result
+	uint8_t *pubAttrOut = copyOut(pubAttr, *pPubAttrLen);
+	uint8_t *privAttrOut = copyOut(privAttr, *pPrivAttrLen);
+	*pPublicKey = copyOut(pub, *pPublicKeyLength);
+	*pPrivateKey = copyOut(priv, *pPrivateKeyLength);
+	if (pubAttrOut == NULL || privAttrOut == NULL || *pPublicKey == NULL || *pPrivateKey == NULL) {
+		free(pubAttrOut);
+		free(privAttrOut);
 		free(*pPublicKey);
 		free(*pPrivateKey);
-		throw new std::exception;
+		*pPublicKey = *pPrivateKey = NULL;
+		throw std::runtime_error("Key generation out of memory\n");
 	}
-	*pPublicKey = (uint8_t *)realloc(*pPublicKey, *pPublicKeyLength);
-	*pPrivateKey = (uint8_t *)realloc(*pPrivateKey, *pPrivateKeyLength);
-
-    *publicSerializedAttr = (uint8_t *)realloc(*publicSerializedAttr, *pPubAttrLen);
-    *privSerializedAttr = (uint8_t *)realloc(*privSerializedAttr, *pPrivAttrLen);
+	free(*publicSerializedAttr);
+	free(*privSerializedAttr);
+	*publicSerializedAttr = pubAttrOut;
+	*privSerializedAttr = privAttrOut;
 }
 
-uint8_t *CryptoEntity::Sign(const uint8_t *key, size_t keyLength, uint8_t *pAttribute, size_t attributeLen, const uint8_t *pData, size_t dataLen, size_t *pSignatureLen, CK_MECHANISM_TYPE mechanism){
+bool CryptoEntity::Sign(const uint8_t *key, size_t keyLength, const uint8_t *pAttribute, size_t attributeLen, const uint8_t *pData, size_t dataLen, uint8_t *pSignature, size_t *pSignatureLen, CK_MECHANISM_TYPE mechanism){
 	sgx_status_t stat;
     int retval;
-    uint8_t *sig;
-	size_t siglen = 2048;
+	size_t signatureLength = pSignature ? *pSignatureLen : 0;
 
-    sig = (uint8_t *) malloc(siglen);
-	*pSignatureLen = siglen;
+	Slot slot(this);
 	stat = SGXSign(
             this->enclave_id_,
             &retval,
 			key, keyLength,
             pAttribute, attributeLen,
 			pData, dataLen,
-		    sig,
-			siglen,
+		    pSignature,
+			signatureLength,
             pSignatureLen,
 			mechanism);
-	if (stat != SGX_SUCCESS || retval != 0) {
-		free(sig);
+	if (stat != SGX_SUCCESS || (retval != 0 && retval != SGX_SIGN_BUFFER_TOO_SMALL)) {
         printf("%s:%i retval=0x%x\n", __FILE__, __LINE__, retval);
 		throw std::runtime_error("Sign failed\n");
     }
-	return sig;
+	return retval == 0;
 }
 
-uint8_t* CryptoEntity::RSADecrypt(const uint8_t *key, size_t keyLength, uint8_t *pAttribute, size_t attributeLen, const uint8_t* cipherData, size_t cipherDataLength, size_t* plainLength) {
+void CryptoEntity::signBatch(const SignBatchKey *pKeys, size_t nrKeys, SignBatchItem *pItems, size_t nrItems){
 	sgx_status_t stat;
-    int max_rsa_size = 1024;
+    int retval;
+    sign_batch_header_t *pHeader;
+    sign_batch_key_t *pKey;
+    sign_batch_item_t *pItem;
+    sign_batch_result_t *pResult;
+    uint8_t *pRequest = NULL, *pResponse = NULL;
+    size_t requestLength, responseLength, responseLengthOut = 0, offset;
+
+    if (nrItems > MAX_SIGN_BATCH_ITEMS || nrKeys > nrItems)
+        throw std::runtime_error("Sign batch too large\n");
+
+    requestLength = sizeof *pHeader + nrKeys * sizeof *pKey + nrItems * sizeof *pItem;
+    responseLength = nrItems * sizeof *pResult;
+    for (size_t i = 0; i < nrKeys; i++)
+        requestLength += pKeys[i].keyLength + pKeys[i].attributeLen;
+    for (size_t i = 0; i < nrItems; i++) {
+        requestLength += pItems[i].dataLen;
+        responseLength += pItems[i].signatureLen < MAX_SIGN_BATCH_SIGNATURE ? pItems[i].signatureLen : MAX_SIGN_BATCH_SIGNATURE;
+    }
+    if ((pRequest = (uint8_t *) malloc(requestLength)) == NULL || (pResponse = (uint8_t *) malloc(responseLength)) == NULL) {
+        free(pRequest);
+        throw std::runtime_error("Sign batch out of memory\n");
+    }
+
+    pHeader = (sign_batch_header_t *) pRequest;
+    pHeader->nrKeys = nrKeys;
+    pHeader->nrItems = nrItems;
+    pKey = (sign_batch_key_t *) (pHeader + 1);
+    pItem = (sign_batch_item_t *) (pKey + nrKeys);
+    offset = (uint8_t *) (pItem + nrItems) - pRequest;
+    for (size_t i = 0; i < nrKeys; i++) {
+        pKey[i].keyOffset = offset;
+        pKey[i].keyLength = pKeys[i].keyLength;
+        memcpy(pRequest + offset, pKeys[i].pKey, pKeys[i].keyLength);
+        offset += pKeys[i].keyLength;
+        pKey[i].attrOffset = offset;
+        pKey[i].attrLength = pKeys[i].attributeLen;
+        memcpy(pRequest + offset, pKeys[i].pAttribute, pKeys[i].attributeLen);
+        offset += pKeys[i].attributeLen;
+    }
+    for (size_t i = 0; i < nrItems; i++) {
+        pItem[i].keyIndex = pItems[i].keyIndex;
+        pItem[i].signatureLength = pItems[i].signatureLen < MAX_SIGN_BATCH_SIGNATURE ? pItems[i].signatureLen : MAX_SIGN_BATCH_SIGNATURE;
+        pItem[i].mechanism = pItems[i].mechanism;
+        pItem[i].dataOffset = offset;
+        pItem[i].dataLength = pItems[i].dataLen;
+        memcpy(pRequest + offset, pItems[i].pData, pItems[i].dataLen);
+        offset += pItems[i].dataLen;
+    }
 
-	uint8_t* plainData = (uint8_t*)malloc(max_rsa_size * sizeof(uint8_t));
+	Slot slot(this);
+	stat = SGXSignBatch(
+            this->enclave_id_,
+            &retval,
+            pRequest, requestLength,
+            pResponse, responseLength, &responseLengthOut);
+    free(pRequest);
+	if (stat != SGX_SUCCESS || retval != 0 || responseLengthOut > responseLength) {
+		free(pResponse);
+        printf("%s:%i retval=0x%x\n", __FILE__, __LINE__, retval);
+		throw std::runtime_error("Sign batch failed\n");
+    }
+
+    pResult = (sign_batch_result_t *) pResponse;
+    for (size_t i = 0; i < nrItems; i++) {
+        pItems[i].status = pResult[i].status;
+        if (pResult[i].status == SIGN_BATCH_OK) {
+            if (pResult[i].signatureOffset + pResult[i].signatureLength > responseLengthOut
+                    || pResult[i].signatureLength > pItems[i].signatureLen) {
+                pItems[i].status = SIGN_BATCH_FAILED;
+                continue;
+            }
+            memcpy(pItems[i].pSignature, pResponse + pResult[i].signatureOffset, pResult[i].signatureLength);
+        }
+        if (pResult[i].status == SIGN_BATCH_OK || pResult[i].status == SIGN_BATCH_BUFFER_TOO_SMALL)
+            pItems[i].signatureLen = pResult[i].signatureLength;
+    }
+    free(pResponse);
+}
+
+// Large batches are split over the enclave thread slots and signed in
+// parallel, every part carrying the full key table. Without threads of our
+// own the parts are signed one after another.
+void CryptoEntity::SignBatch(const SignBatchKey *pKeys, size_t nrKeys, SignBatchItem *pItems, size_t nrItems){
+    size_t nrParts = nrItems / SIGN_BATCH_MIN_ITEMS_PER_THREAD;
+    std::vector<std::thread> threads;
+    bool failed = false;
+
+    if (nrParts > nrSlots) nrParts = nrSlots;
+    if (nrParts < 2) return signBatch(pKeys, nrKeys, pItems, nrItems);
+
+    for (size_t i = 0, first = 0; i < nrParts; i++) {
+        size_t n = nrItems / nrParts + (i < nrItems % nrParts ? 1 : 0);
+        if (noThreads) {
+            signBatch(pKeys, nrKeys, pItems + first, n);
+            first += n;
+            continue;
+        }
+        threads.push_back(std::thread([=, &failed]() {
+            try {
+                signBatch(pKeys, nrKeys, pItems + first, n);
+            }
+            catch (std::runtime_error) {
+                std::lock_guard<std::mutex> lock(slotLock);
+                failed = true;
+            }
+        }));
+        first += n;
+    }
+    for (auto &t : threads) t.join();
+    if (failed) throw std::runtime_error("Sign batch failed\n");
+}
+
+// The plaintext is never longer than the ciphertext, that much is taken as
+// the length required when there is no buffer.
+bool CryptoEntity::RSADecrypt(const uint8_t *key, size_t keyLength, const uint8_t *pAttribute, size_t attributeLen, const uint8_t *cipherData, size_t cipherDataLength, uint8_t *pPlain, size_t *pPlainLen) {
+	sgx_status_t stat;
     int retval;
+	uint8_t *plain = pPlain;
+	size_t plainLength = *pPlainLen;
+
+	if (pPlain == NULL) {
+		*pPlainLen = cipherDataLength;
+		return false;
+	}
+	if (plainLength < cipherDataLength) {
+		plain = scratch(cipherDataLength);
+		plainLength = cipherDataLength;
+	}
+	Slot slot(this);
 	stat = SGXDecrypt(
             this->enclave_id_,
             &retval,
 			key, keyLength,
             pAttribute, attributeLen,
 			cipherData, cipherDataLength,
-			plainData, max_rsa_size, plainLength);
+			plain, plainLength, &plainLength);
 	if (stat != SGX_SUCCESS || retval != 0) {
         printf("%s:%i retval=0x%x\n", __FILE__, __LINE__, retval);
 		throw std::runtime_error("Decryption failed\n");
     }
-	plainData = (uint8_t *)realloc(plainData, *plainLength);
-	return plainData;
+	if (plain != pPlain) {
+		if (plainLength > *pPlainLen) {
+			*pPlainLen = plainLength;
+			return false;
+		}
+		memcpy(pPlain, plain, plainLength);
+	}
+	*pPlainLen = plainLength;
+	return true;
+}
+
+uint8_t *CryptoEntity::MigrateKey(const uint8_t *key, size_t keyLength, const uint8_t *pAttribute, size_t attributeLen, size_t *pMigratedLength) {
+	sgx_status_t stat;
+    int retval;
+    uint8_t *migrated = scratch(MAX_KEY_BUF);
+
+	Slot slot(this);
+	stat = SGXMigrateKey(this->enclave_id_, &retval, key, keyLength, pAttribute, attributeLen, migrated, MAX_KEY_BUF, pMigratedLength);
+	if (stat != SGX_SUCCESS || retval != 0)
+		throw std::runtime_error("Key migration failed\n");
+    if (*pMigratedLength == 0) return NULL;
+    if ((migrated = copyOut(migrated, *pMigratedLength)) == NULL)
+		throw std::runtime_error("Key migration failed\n");
+	return migrated;
 }
 
 int CryptoEntity::GenerateRandom(uint8_t *random, size_t random_length) {
 	sgx_status_t stat;
     int retval;
 
+	Slot slot(this);
 	stat = SGXGenerateRandom(
             this->enclave_id_,
             &retval,
@@ -157,6 +362,7 @@ size_t CryptoEntity::GetSealedRootKeySize() {
     int retval = -2;
     size_t rootKeySealedLength;
 
+	Slot slot(this);
 	stat = SGXGetSealedRootKeySize(this->enclave_id_, &retval, &rootKeySealedLength);
 	if (stat != SGX_SUCCESS || retval) {
 		throw std::runtime_error("Getting root key size failed failed\n");
@@ -168,6 +374,7 @@ int CryptoEntity::GenerateRootKey(uint8_t *rootKeySealed, size_t *rootKeySealedL
 	sgx_status_t stat;
     int retval;
     size_t sealedRootKeySize;
+	Slot slot(this);
 	stat = SGXGetSealedRootKeySize(this->enclave_id_, &retval, &sealedRootKeySize);
 	if (stat != SGX_SUCCESS || retval) return 1;
     if (sealedRootKeySize > *rootKeySealedLength) return 2;
@@ -179,6 +386,7 @@ int CryptoEntity::GenerateRootKey(uint8_t *rootKeySealed, size_t *rootKeySealedL
 int CryptoEntity::RestoreRootKey(uint8_t *rootKeySealed, size_t rootKeySealedLength){
 	sgx_status_t stat;
     int retval;
+	Slot slot(this);
 	stat = SGXSetRootKeySealed(this->enclave_id_, &retval, rootKeySealed, rootKeySealedLength);
 	if (stat != SGX_SUCCESS || retval !=0) {
 		return 1;
@@ -186,6 +394,92 @@ int CryptoEntity::RestoreRootKey(uint8_t *rootKeySealed, size_t rootKeySealedLen
     return 0;
 }
 
+int CryptoEntity::GetStateKey(uint8_t *key, size_t keyLength){
+	sgx_status_t stat;
+    int retval;
+	Slot slot(this);
+	stat = SGXGetStateKey(this->enclave_id_, &retval, key, keyLength);
+	if (stat != SGX_SUCCESS || retval !=0) {
+		return 1;
+	}
+    return 0;
+}
+
+int CryptoEntity::ConfigureKeyCache(size_t maxEntries, size_t maxBytes){
+	sgx_status_t stat;
+    int retval;
+	Slot slot(this);
+	stat = SGXConfigureKeyCache(this->enclave_id_, &retval, maxEntries, maxBytes);
+	if (stat != SGX_SUCCESS || retval !=0) {
+		return 1;
+	}
+    return 0;
+}
+
+int CryptoEntity::ConfigureRSAPool(size_t bits, const uint8_t *exponent, size_t exponentLength, size_t depth){
+	sgx_status_t stat;
+    int retval;
+	{
+		Slot slot(this);
+		stat = SGXConfigureRSAPool(this->enclave_id_, &retval, bits, exponent, exponentLength, depth);
+	}
+	if (stat != SGX_SUCCESS || retval !=0) {
+		return 1;
+	}
+	reservePoolThread(depth);
+    return 0;
+}
+
+int CryptoEntity::ConfigureECPool(const char *curve, size_t depth){
+	sgx_status_t stat;
+    int retval;
+	{
+		Slot slot(this);
+		stat = SGXConfigureECPool(this->enclave_id_, &retval, curve, depth);
+	}
+	if (stat != SGX_SUCCESS || retval !=0) {
+		return 1;
+	}
+	reservePoolThread(depth);
+    return 0;
+}
+
+int CryptoEntity::GetArenaStats(size_t *pPeak, size_t *pSize, size_t *pOverflows){
+	sgx_status_t stat;
+    int retval;
+	Slot slot(this);
+	stat = SGXGetArenaStats(this->enclave_id_, &retval, pPeak, pSize, pOverflows);
+	if (stat != SGX_SUCCESS || retval !=0) {
+		return 1;
+	}
+    return 0;
+}
+
+// The enclave pool worker keeps a TCS for itself once started
+void CryptoEntity::reservePoolThread(size_t depth){
+	std::lock_guard<std::mutex> lock(slotLock);
+	if (depth == 0 || poolThread) return;
+	poolThread = true;
+	if (nrSlots > 1) {
+		nrSlots--;
+		freeSlots--;
+	}
+}
+
+CryptoEntity::Slot::Slot(CryptoEntity *entity): entity(entity) {
+	std::unique_lock<std::mutex> lock(entity->slotLock);
+	entity->slotFree.wait(lock, [entity]{ return entity->freeSlots > 0; });
+	entity->freeSlots--;
+}
+
+CryptoEntity::Slot::~Slot() {
+	{
+		std::lock_guard<std::mutex> lock(entity->slotLock);
+		entity->freeSlots++;
+	}
+	entity->slotFree.notify_one();
+}
+
 CryptoEntity::~CryptoEntity() {
 	sgx_destroy_enclave(this->enclave_id_);
 }
@@ -4,6 +4,8 @@
 
 #include <sgx_urts.h>
 #include <string>
+#include <mutex>
+#include <condition_variable>
 #include "crypto_engine_u.h"
 #include "shared_values.h"
 
@@ -19,6 +21,33 @@
 
 #include "../cryptoki/pkcs11.h"
 
+typedef struct {
+    // Trusted worker threads serving switchless ECALLs, 0 disables them
+    uint32_t trustedWorkers;
+    uint32_t untrustedWorkers;
+    uint32_t retriesBeforeFallback;
+    uint32_t retriesBeforeSleep;
+} SwitchlessConfig;
+
+typedef struct {
+    const uint8_t *pKey;
+    size_t keyLength;
+    const uint8_t *pAttribute;
+    size_t attributeLen;
+} SignBatchKey;
+
+typedef struct {
+    size_t keyIndex;
+    CK_MECHANISM_TYPE mechanism;
+    const uint8_t *pData;
+    size_t dataLen;
+    // In: size of pSignature, out: signature length, or the length required
+    // when status is SIGN_BATCH_BUFFER_TOO_SMALL
+    uint8_t *pSignature;
+    size_t signatureLen;
+    int status;
+} SignBatchItem;
+
 class CryptoEntity {
 private:
 #ifdef _WIN32
@@ -28,18 +57,47 @@ private:
 #endif
 	const char* kTokenFile = "token";
 	sgx_enclave_id_t enclave_id_;
+	// ECALLs wait for a free slot, so no more run at once than the
+	// enclave has thread slots (TCS) for.
+	size_t nrSlots;
+	size_t freeSlots;
+	bool poolThread = false;
+	// CKF_LIBRARY_CANT_CREATE_OS_THREADS, no threads of our own then
+	bool noThreads;
+	void reservePoolThread(size_t depth);
+	std::mutex slotLock;
+	std::condition_variable slotFree;
+	class Slot {
+		CryptoEntity *entity;
+	public:
+		Slot(CryptoEntity *entity);
+		~Slot();
+	};
+	void signBatch(const SignBatchKey *pKeys, size_t nrKeys, SignBatchItem *pItems, size_t nrItems);
 public:
-	CryptoEntity();
+	CryptoEntity(const SwitchlessConfig *pSwitchless = NULL, size_t nrThreads = 1, bool noThreads = false);
     void KeyGeneration(uint8_t **pPublicKey, size_t *pPublicKeyLength, uint8_t **publicSerializedAttr, size_t *pPubAttrLen, uint8_t **pPrivateKey, size_t *pPrivateKeyLength, uint8_t **privSerializedAttr, size_t *pPrivAttrLen);
 	// void RSAInitEncrypt(uint8_t* key, size_t length);
 
-	uint8_t *Sign(const uint8_t *key, size_t keyLength, uint8_t *pAttribute, size_t attributeLen, const uint8_t *pData, size_t dataLen, size_t *pSignatureLen, CK_MECHANISM_TYPE mechanism);
-	uint8_t* RSADecrypt(const uint8_t *key, size_t keyLength, const uint8_t* cipherData, size_t cipherDataLength, size_t* plainLength);
-    uint8_t* RSADecrypt(const uint8_t *key, size_t keyLength, uint8_t *pAttribute, size_t attributeLen, const uint8_t* cipherData, size_t cipherDataLength, size_t* plainLength);
+	// Sign and RSADecrypt write into the caller's buffer, its size is passed
+	// in *pSignatureLen or *pPlainLen and the length written comes back there.
+	// When the buffer is NULL or too small they return false with the length
+	// required instead. Failures throw.
+	bool Sign(const uint8_t *key, size_t keyLength, const uint8_t *pAttribute, size_t attributeLen, const uint8_t *pData, size_t dataLen, uint8_t *pSignature, size_t *pSignatureLen, CK_MECHANISM_TYPE mechanism);
+	void SignBatch(const SignBatchKey *pKeys, size_t nrKeys, SignBatchItem *pItems, size_t nrItems);
+    bool RSADecrypt(const uint8_t *key, size_t keyLength, const uint8_t *pAttribute, size_t attributeLen, const uint8_t *cipherData, size_t cipherDataLength, uint8_t *pPlain, size_t *pPlainLen);
+    // Returns the object rewrapped in the current key format, NULL when it
+    // already is.
+    uint8_t *MigrateKey(const uint8_t *key, size_t keyLength, const uint8_t *pAttribute, size_t attributeLen, size_t *pMigratedLength);
     int GenerateRandom(uint8_t *random, size_t random_length);
     size_t GetSealedRootKeySize();
     int GenerateRootKey(uint8_t *rootKeySealed, size_t *rootKeySealedLength);
     int RestoreRootKey(uint8_t *rootKeySealed, size_t rootKeySealedLength);
+    int GetStateKey(uint8_t *key, size_t keyLength);
+    int ConfigureKeyCache(size_t maxEntries, size_t maxBytes);
+    int ConfigureRSAPool(size_t bits, const uint8_t *exponent, size_t exponentLength, size_t depth);
+    int ConfigureECPool(const char *curve, size_t depth);
+    int GetArenaStats(size_t *pPeak, size_t *pSize, size_t *pOverflows);
 	~CryptoEntity();
 };
 
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <chrono>
 #include <sqlite3.h>
 
 #include "pkcs11-interface.h"
@@ -14,7 +15,7 @@
 #define CREATE_DB \
 	"CREATE TABLE RootKey(value BLOB);" \
     "CREATE TABLE Token(slotID INTEGER, label BLOB, soPIN BLOB, userPIN BLOB);" \
-	"CREATE TABLE Object(ID INTEGER NOT NULL PRIMARY KEY, objectClass INTEGER, value BLOB);" \
+	"CREATE TABLE Object(ID INTEGER NOT NULL PRIMARY KEY, objectClass INTEGER, value BLOB, attributes BLOB, keyFormat INTEGER);" \
 	"CREATE TABLE Attribute(" \
          "ID INTEGER" \
          ", attributeType INTEGER" \
@@ -23,8 +24,71 @@
     ");"
 
 
-Database::Database(const char * pDbFileName) {
+static const char *statementSql[] = {
+    "INSERT INTO RootKey(value) VALUES(?);",
+    "SELECT value FROM RootKey LIMIT 1;",
+    "DELETE FROM Object WHERE id=?;",
+    "DELETE FROM Attribute WHERE objectID=?;",
+    "SELECT value, attributes, keyFormat FROM Object WHERE ID=?",
+    "SELECT attributeType, value FROM Attribute WHERE objectID=? ORDER BY id",
+    "SELECT ID FROM Object WHERE ID>? ORDER BY ID LIMIT ?",
+    "SELECT label, soPIN, userPIN FROM Token WHERE slotID=?",
+    "UPDATE Token SET userPIN=? WHERE slotID=?;",
+    "INSERT INTO Token(slotID, label, soPIN)  VALUES(?,?,?);",
+    "UPDATE Token SET label=? WHERE slotId=?",
+    "UPDATE Object SET value=?, keyFormat=? WHERE ID=?;",
+    "UPDATE Object SET keyFormat=? WHERE ID=?;",
+    "INSERT INTO Object(objectClass, value, attributes, keyFormat) VALUES(?, ?, ?, ?);",
+    "INSERT INTO Attribute(ID, attributeType, value, objectID) VALUES(?,?,?,?);",
+    "BEGIN",
+    "COMMIT",
+    "ROLLBACK",
+    "PRAGMA data_version;",
+};
+
+
+// A cached statement locked for the caller, reset with its bindings cleared
+// when the caller is done. Declared ahead of any goto in the methods.
+class Database::Statement {
+    sqlite3 *db;
+    CachedStatement& cached;
+    const char *sql;
+    std::lock_guard<std::mutex> lock;
+public:
+    Statement(Database *d, int index) : db(d->db), cached(d->statements[index]), sql(statementSql[index]), lock(cached.lock) {}
+    Statement(Database *d, CachedStatement& c) : db(d->db), cached(c), sql(NULL), lock(cached.lock) {}
+    bool prepared() { return cached.pStmt != NULL; }
+    sqlite3_stmt *get(const char *pSql = NULL) {
+        if (cached.pStmt == NULL && SQLITE_OK != sqlite3_prepare_v3(db, pSql ? pSql : sql, -1, SQLITE_PREPARE_PERSISTENT, &cached.pStmt, NULL)) {
+            fprintf(stderr,"SQL error: %s\n", sqlite3_errmsg(db));
+            cached.pStmt = NULL;
+        }
+        return cached.pStmt;
+    }
+    ~Statement() {
+        if (cached.pStmt == NULL) return;
+        sqlite3_reset(cached.pStmt);
+        sqlite3_clear_bindings(cached.pStmt);
+    }
+};
+
+
+// Runs a statement without parameters or results, BEGIN and the like
+static int run(sqlite3_stmt *pStmt) {
+    return pStmt != NULL && SQLITE_DONE == sqlite3_step(pStmt) ? 0 : -1;
+}
+
+
+static int64_t steadyNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+Database::Database(const char * pDbFileName, unsigned int versionIntervalMs) {
     struct stat st;
+    this->versionInterval = (int64_t) versionIntervalMs * 1000000;
+    // Due at the first call
+    this->sampledAt = steadyNow() - this->versionInterval - 1;
     this->newlyCreated = true ? stat(pDbFileName, &st) < 0 : false;
 
     if (SQLITE_OK != sqlite3_open(pDbFileName, &this->db)) {
@@ -35,23 +99,38 @@ Database::Database(const char * pDbFileName) {
         if (SQLITE_OK != sqlite3_exec(db, sql, NULL, 0, NULL)) {
             throw std::runtime_error("Cannot create DB");
         }
+    } else if (SQLITE_OK != sqlite3_exec(db, "SELECT attributes FROM Object LIMIT 0;", NULL, 0, NULL)) {
+        // Created before the serialized attributes were stored
+        if (SQLITE_OK != sqlite3_exec(db, "ALTER TABLE Object ADD COLUMN attributes BLOB;", NULL, 0, NULL)) {
+            throw std::runtime_error("Cannot upgrade DB");
+        }
     };
+    if (SQLITE_OK != sqlite3_exec(db, "SELECT keyFormat FROM Object LIMIT 0;", NULL, 0, NULL)) {
+        // Created before private keys were marked with their wrapped format
+        if (SQLITE_OK != sqlite3_exec(db, "ALTER TABLE Object ADD COLUMN keyFormat INTEGER;", NULL, 0, NULL)) {
+            throw std::runtime_error("Cannot upgrade DB");
+        }
+    }
+    if (SQLITE_OK != sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS AttributeObject ON Attribute(objectID);", NULL, 0, NULL)) {
+        throw std::runtime_error("Cannot upgrade DB");
+    }
 }
 
 int Database::SetRootKey(uint8_t *rootKey, size_t rootKeyLength){
+    std::lock_guard<std::recursive_mutex> write(writeLock);
+    Statement stmt(this, SET_ROOT_KEY);
 	sqlite3_stmt *pStmt;
-    char sql[] = "INSERT INTO RootKey(value) VALUES(?);";
     int rc;
 	printf("rootKeyLength=%lu\n", rootKeyLength);
-    if (SQLITE_OK != sqlite3_prepare_v2(this->db, sql, -1, &pStmt, NULL))
+    if (NULL == (pStmt = stmt.get()))
         return -1;
     if (SQLITE_OK != sqlite3_bind_blob(pStmt, 1, rootKey, rootKeyLength, SQLITE_STATIC))
         return -1;
     if (SQLITE_DONE != (rc = sqlite3_step(pStmt))) {
         return -1;
     }
-    sqlite3_finalize(pStmt);
-    sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+    Statement commit(this, COMMIT);
+    run(commit.get());
     return 0;
 }
 
@@ -67,44 +146,63 @@ getBlob_err:
 
 
 uint8_t *Database::GetRootKey(size_t& rootKeyLength) {
+    Statement stmt(this, GET_ROOT_KEY);
 	sqlite3_stmt *pStmt;
-    char sql[] = "SELECT value FROM RootKey LIMIT 1;";
     uint8_t *ret = NULL;
-    if (SQLITE_OK != sqlite3_prepare_v2(db, sql, -1, &pStmt, NULL))
+    if (NULL == (pStmt = stmt.get()))
         return ret;
     if (SQLITE_ROW != sqlite3_step(pStmt))
         return ret;
-    if (NULL == (ret = getBlob(pStmt, 0, rootKeyLength)))
-        return NULL;
-    sqlite3_finalize(pStmt);
-    return ret;
+    return getBlob(pStmt, 0, rootKeyLength);
 }
 
 int Database::deleteObject(CK_OBJECT_HANDLE hObject) {
+    std::lock_guard<std::recursive_mutex> write(writeLock);
+    Statement stmtO(this, DELETE_OBJECT), stmtA(this, DELETE_ATTRIBUTES);
+	sqlite3_stmt *pStmt;
+    bool rollback = true;
     int ret = -1;
-    std::string s = std::to_string(hObject);
-    std::string sql = \
-        "DELETE FROM Object WHERE id=" + s + ";"
-        "DELETE FROM Attribute WHERE objectID=" + s + ";";
 
-    if (SQLITE_OK != sqlite3_exec(this->db, sql.c_str(), 0, 0, NULL))
+    {
+        Statement begin(this, BEGIN);
+        if (0 != run(begin.get()))
+            return ret;
+    }
+    if (NULL == (pStmt = stmtO.get()) || SQLITE_OK != sqlite3_bind_int64(pStmt, 1, (sqlite3_int64) hObject))
+        goto deleteObject_err;
+    if (SQLITE_DONE != sqlite3_step(pStmt))
         goto deleteObject_err;
+    if (NULL == (pStmt = stmtA.get()) || SQLITE_OK != sqlite3_bind_int64(pStmt, 1, (sqlite3_int64) hObject))
+        goto deleteObject_err;
+    if (SQLITE_DONE != sqlite3_step(pStmt))
+        goto deleteObject_err;
+    {
+        Statement commit(this, COMMIT);
+        if (0 != run(commit.get()))
+            goto deleteObject_err;
+    }
+    writes++;
+    rollback = false;
     ret = 0;
 deleteObject_err:
+    if (rollback == true) {
+        Statement abort(this, ROLLBACK);
+        run(abort.get());
+    }
     return ret;
 }
 
-int Database::getObject(CK_OBJECT_HANDLE hObject, uint8_t **ppValue, size_t& valueLen, CK_ATTRIBUTE **ppAttribute, CK_ULONG& ulAttrCount) {
+int Database::getObject(CK_OBJECT_HANDLE hObject, uint8_t **ppValue, size_t& valueLen, CK_ATTRIBUTE **ppAttribute, CK_ULONG& ulAttrCount, uint8_t **ppSerialized, size_t& serializedLen, int& keyFormat) {
+    Statement stmtO(this, GET_OBJECT), stmtA(this, GET_ATTRIBUTES);
     int rc;
     int res = -1;
 	sqlite3_stmt *pStmt = NULL;
     CK_ATTRIBUTE *pAttribute = NULL;
-    const char *sql = "SELECT value FROM Object WHERE ID=?";
 
-    if (ppValue == NULL || ppAttribute == NULL)
+    if (ppValue == NULL || ppAttribute == NULL || ppSerialized == NULL)
         goto getObject_err;
     res -= 1;
-    if (SQLITE_OK != sqlite3_prepare_v2(this->db, sql, -1, &pStmt, NULL)) {
+    if (NULL == (pStmt = stmtO.get())) {
         goto getObject_err;
     }
     res -= 1;
@@ -124,9 +222,16 @@ int Database::getObject(CK_OBJECT_HANDLE hObject, uint8_t **ppValue, size_t& val
     res -= 1;
     memcpy(*ppValue, sqlite3_column_blob(pStmt,0), valueLen);
     res -= 1;
-    sqlite3_finalize(pStmt);
-    sql = "SELECT attributeType, value FROM Attribute WHERE objectID=? ORDER BY id";
-    if (SQLITE_OK != sqlite3_prepare_v2(this->db, sql, -1, &pStmt, NULL)) {
+    *ppSerialized = NULL;
+    serializedLen = 0;
+    if (sqlite3_column_type(pStmt, 1) != SQLITE_NULL) {
+        if (NULL == (*ppSerialized = getBlob(pStmt, 1, serializedLen))) {
+            goto getObject_err;
+        }
+    }
+    keyFormat = sqlite3_column_int(pStmt, 2);
+    res -= 1;
+    if (NULL == (pStmt = stmtA.get())) {
         goto getObject_err;
     }
     res -= 1;
@@ -149,81 +254,92 @@ int Database::getObject(CK_OBJECT_HANDLE hObject, uint8_t **ppValue, size_t& val
     *ppAttribute = pAttribute;
     res = 0;
 getObject_err:
-    if (pStmt) sqlite3_finalize(pStmt);
     return res;
 }
 
 
 
-CK_OBJECT_HANDLE *Database::getObjectIds(CK_ATTRIBUTE *pTemplate, CK_ULONG ulCount, int& nrFound) {
+// Returns the next matching handles after hAfter in handle order, so a
+// search can be continued without keeping a statement open between calls.
+int Database::findObjects(CK_ATTRIBUTE *pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE hAfter, CK_OBJECT_HANDLE *phObject, CK_ULONG ulMaxObjectCount, CK_ULONG& ulObjectCount) {
     int rc;
-    CK_OBJECT_HANDLE *res = NULL;
+    int ret = -1;
     CK_ULONG i=0;
-    int found = 0;
-
-    nrFound = -1;
+    int param = 1;
 	sqlite3_stmt *pStmt = NULL;
-    if (NULL == pTemplate) {
-        std::string sql = "SELECT ID FROM Object";
-        if (SQLITE_OK != sqlite3_prepare_v2(this->db, sql.c_str(), -1, &pStmt, NULL)) {
-            goto getObjectIds_err;
-        }
+    std::string sql;
+    CachedStatement *pCached;
+
+    if (NULL == pTemplate || 0 == ulCount) {
+        pCached = &statements[FIND_ALL];
     } else {
-        std::string sql = "SELECT Object.id,COUNT(Object.id) FROM Object JOIN Attribute ON Object.id=objectID ";
+        // Templates of the same length share one statement
+        std::lock_guard<std::mutex> lock(findStatementsLock);
+        pCached = &findStatements[ulCount];
+    }
+    Statement stmt(this, *pCached);
+
+    ulObjectCount = 0;
+    if (NULL == pTemplate || 0 == ulCount) {
+        sql = statementSql[FIND_ALL];
+    } else if (!stmt.prepared()) {
+        // Grouping on the indexed objectID lets the rows stream in order
+        sql = "SELECT objectID,COUNT(objectID) FROM Attribute WHERE objectID>? AND (";
         for (CK_ULONG i=0; i<ulCount; i++) {
-            if (i==0)
-                sql.append(" WHERE ");
-            else
+            if (i!=0)
                 sql.append(" OR ");
-            sql.append(" (AttributeType=?  AND Attribute.value=?) ");
-        }
-        sql.append(" GROUP BY Object.id");
-        sql.append(" HAVING COUNT(Object.id) = ?");
-        if (SQLITE_OK != sqlite3_prepare_v2(this->db, sql.c_str(), -1, &pStmt, NULL)) {
-            goto getObjectIds_err;
+            sql.append(" (AttributeType=?  AND value=?) ");
         }
+        sql.append(") GROUP BY objectID");
+        sql.append(" HAVING COUNT(objectID) = ?");
+        sql.append(" ORDER BY objectID LIMIT ?");
+    }
+    if (NULL == (pStmt = stmt.get(sql.c_str()))) {
+        goto findObjects_err;
+    }
+    ret -= 1;
+    if (SQLITE_OK != sqlite3_bind_int64(pStmt, param++, (sqlite3_int64) hAfter))
+        goto findObjects_err;
+    ret -= 1;
+    if (NULL != pTemplate && 0 != ulCount) {
         for (i=0; i<ulCount; i++) {
-            if (SQLITE_OK != sqlite3_bind_int(pStmt, (i * 2) + 1, pTemplate[i].type))
-                goto getObjectIds_err;
-            if (SQLITE_OK != sqlite3_bind_blob(pStmt, (i *2) + 2, pTemplate[i].pValue, pTemplate[i].ulValueLen, SQLITE_STATIC))
-                goto getObjectIds_err;
+            if (SQLITE_OK != sqlite3_bind_int(pStmt, param++, pTemplate[i].type))
+                goto findObjects_err;
+            if (SQLITE_OK != sqlite3_bind_blob(pStmt, param++, pTemplate[i].pValue, pTemplate[i].ulValueLen, SQLITE_STATIC))
+                goto findObjects_err;
         }
-        if (SQLITE_OK != sqlite3_bind_int(pStmt, (i * 2) + 1, ulCount))
-            goto getObjectIds_err;
+        if (SQLITE_OK != sqlite3_bind_int(pStmt, param++, ulCount))
+            goto findObjects_err;
     }
+    ret -= 1;
+    if (SQLITE_OK != sqlite3_bind_int64(pStmt, param++, (sqlite3_int64) ulMaxObjectCount))
+        goto findObjects_err;
+    ret -= 1;
 
     while (SQLITE_ROW == (rc = sqlite3_step(pStmt))){
-        found++;
-        if (NULL == (res = (CK_OBJECT_HANDLE *)realloc(res, sizeof *res * found))) {
-           if (res) free(res);
-           goto getObjectIds_err;
-        }
-        res[found - 1] = (CK_OBJECT_HANDLE) sqlite3_column_int(pStmt, 0);
+        phObject[ulObjectCount++] = (CK_OBJECT_HANDLE) sqlite3_column_int64(pStmt, 0);
     }
     if (SQLITE_DONE != rc) {
-        if (res) free(res);
-        goto getObjectIds_err;
+        goto findObjects_err;
     }
-    nrFound = found;
-getObjectIds_err:
-    if (pStmt) sqlite3_finalize(pStmt);
-    return res;
+    ret = 0;
+findObjects_err:
+    return ret;
 }
 
 
 int Database::getToken(CK_SLOT_ID slotID, uint8_t **ppLabel, size_t& labelLength, uint8_t **ppSOpin, size_t& SOpinLength, uint8_t **ppUserPIN, size_t& userPINlength)
 {
+    Statement stmt(this, GET_TOKEN);
     int ret = -1, rc;
 	sqlite3_stmt *pStmt = NULL;
-    const char *sql = "SELECT label, soPIN, userPIN FROM Token WHERE slotID=?";
     *ppLabel = *ppSOpin = *ppUserPIN = NULL;
-    if (SQLITE_OK != sqlite3_prepare_v2(this->db, sql, -1, &pStmt, NULL))
+    if (NULL == (pStmt = stmt.get()))
         goto getToken_err;
     if (SQLITE_OK != sqlite3_bind_int(pStmt, 1, (int) slotID))
         goto getToken_err;
     rc = sqlite3_step(pStmt);
     if (rc == SQLITE_DONE) {
-        sqlite3_finalize(pStmt);
         return 0;
     }
     if (rc != SQLITE_ROW) goto getToken_err;
@@ -234,27 +350,23 @@ int Database::getToken(CK_SLOT_ID slotID, uint8_t **ppLabel, size_t& labelLength
     if (ppUserPIN && NULL == (*ppUserPIN = getBlob(pStmt, 2, userPINlength)))
         goto getToken_err;
     if (SQLITE_DONE != (rc = sqlite3_step(pStmt))) goto getToken_err;
-    ret = 1;
-    goto getToken_ok;
+    return 1;
 getToken_err:
     if (*ppLabel) free(*ppLabel);
     if (*ppSOpin) free(*ppSOpin);
     if (*ppUserPIN) free(*ppUserPIN);
     *ppLabel = *ppSOpin = *ppUserPIN = NULL;
-getToken_ok:
-    if (pStmt) sqlite3_finalize(pStmt);
     return ret;
 }
 
 
 int Database::updateUserPin(CK_SLOT_ID slotID, uint8_t *pUserPin, size_t userPinLength) {
+    std::lock_guard<std::recursive_mutex> write(writeLock);
+    Statement stmt(this, UPDATE_USER_PIN);
     int ret = -1;
 	sqlite3_stmt *pStmt = NULL;
-    const char *sql = "UPDATE Token SET userPIN=? WHERE slotID=?;";
-    if (SQLITE_OK != sqlite3_prepare_v2(this->db, sql, -1, &pStmt, NULL)) {
-        fprintf(stderr,"SQL error: %s\n", sqlite3_errmsg(this->db));
+    if (NULL == (pStmt = stmt.get()))
         goto setUserPIN_err;
-    }
     if (SQLITE_OK != sqlite3_bind_blob(pStmt, 1, pUserPin, userPinLength, SQLITE_STATIC))
         goto setUserPIN_err;
     if (SQLITE_OK != sqlite3_bind_int(pStmt, 2, slotID))
@@ -262,20 +374,18 @@ int Database::updateUserPin(CK_SLOT_ID slotID, uint8_t *pUserPin, size_t userPin
     if (SQLITE_DONE != sqlite3_step(pStmt)) goto setUserPIN_err;
     ret = 0;
 setUserPIN_err:
-    if (pStmt) sqlite3_finalize(pStmt);
     return ret;
 }
 
 
 int Database::initToken(CK_SLOT_ID slotID, uint8_t *pLabel, size_t labelLength, uint8_t *pSOpin, size_t SOpinLength, uint8_t *pUserPin, size_t userPinLength) {
+    std::lock_guard<std::recursive_mutex> write(writeLock);
+    Statement stmt(this, INIT_TOKEN);
     int ret = -1;
 	sqlite3_stmt *pStmt = NULL;
-    const char *sql = "INSERT INTO Token(slotID, label, soPIN)  VALUES(?,?,?);";
 
-    if (SQLITE_OK != sqlite3_prepare_v2(this->db, sql, -1, &pStmt, NULL)) {
-        fprintf(stderr,"SQL error: %s\n", sqlite3_errmsg(this->db));
+    if (NULL == (pStmt = stmt.get()))
         goto initToken_err;
-    }
     if (SQLITE_OK != sqlite3_bind_int(pStmt, 1, slotID))
         goto initToken_err;
     ret -=1;
@@ -284,33 +394,28 @@ int Database::initToken(CK_SLOT_ID slotID, uint8_t *pLabel, size_t labelLength,
     if (SQLITE_OK != sqlite3_bind_blob(pStmt, 3, pSOpin, SOpinLength, SQLITE_STATIC))
         goto initToken_err;
     if (SQLITE_DONE != sqlite3_step(pStmt)) goto initToken_err;
-    sqlite3_finalize(pStmt);
-    pStmt = NULL;
     if (NULL != pUserPin && 0 != this->updateUserPin(slotID, pUserPin, userPinLength))
         goto initToken_err;
     ret = 0;
 initToken_err:
-    if (pStmt) sqlite3_finalize(pStmt);
     return ret;
 }
 
 
 
 int Database::updateToken(CK_SLOT_ID slotID, uint8_t *pLabel, size_t labelLength){
+    std::lock_guard<std::recursive_mutex> write(writeLock);
+    Statement stmt(this, UPDATE_TOKEN);
     int ret = -1;
 	sqlite3_stmt *pStmt = NULL;
-    const char *sql = "UPDATE Token SET label=? WHERE slotId=?";
-    if (SQLITE_OK != sqlite3_prepare_v2(this->db, sql, -1, &pStmt, NULL)) {
-        fprintf(stderr,"SQL error: %s\n", sqlite3_errmsg(this->db));
+    if (NULL == (pStmt = stmt.get()))
         goto updateToken_err;
-    }
     if (SQLITE_OK != sqlite3_bind_blob(pStmt, 1, pLabel, labelLength, SQLITE_STATIC))
         goto updateToken_err;
     if (SQLITE_OK != sqlite3_bind_int(pStmt, 2, slotID))
         goto updateToken_err;
     ret = 0;
 updateToken_err:
-    if (pStmt) sqlite3_finalize(pStmt);
     return ret;
 }
 
@@ -318,19 +423,62 @@ updateToken_err:
 
 
 
-int Database::setObject(CK_KEY_TYPE type, CK_BYTE_PTR pValue, CK_ULONG ulValueLen, CK_ATTRIBUTE *pAttribute, CK_ULONG ulAttributeCount) {
+int Database::updateObjectValue(CK_OBJECT_HANDLE hObject, CK_BYTE_PTR pValue, CK_ULONG ulValueLen, int keyFormat) {
+    std::lock_guard<std::recursive_mutex> write(writeLock);
+    Statement stmt(this, UPDATE_OBJECT_VALUE);
+    int ret = -1;
+	sqlite3_stmt *pStmt = NULL;
+    if (NULL == (pStmt = stmt.get()))
+        goto updateObjectValue_err;
+    if (SQLITE_OK != sqlite3_bind_blob(pStmt, 1, pValue, ulValueLen, SQLITE_STATIC))
+        goto updateObjectValue_err;
+    if (SQLITE_OK != sqlite3_bind_int(pStmt, 2, keyFormat))
+        goto updateObjectValue_err;
+    if (SQLITE_OK != sqlite3_bind_int(pStmt, 3, (int) hObject))
+        goto updateObjectValue_err;
+    if (SQLITE_DONE != sqlite3_step(pStmt)) goto updateObjectValue_err;
+    writes++;
+    ret = 0;
+updateObjectValue_err:
+    return ret;
+}
+
+
+int Database::setKeyFormat(CK_OBJECT_HANDLE hObject, int keyFormat) {
+    std::lock_guard<std::recursive_mutex> write(writeLock);
+    Statement stmt(this, SET_KEY_FORMAT);
+    int ret = -1;
+	sqlite3_stmt *pStmt = NULL;
+    if (NULL == (pStmt = stmt.get()))
+        goto setKeyFormat_err;
+    if (SQLITE_OK != sqlite3_bind_int(pStmt, 1, keyFormat))
+        goto setKeyFormat_err;
+    if (SQLITE_OK != sqlite3_bind_int(pStmt, 2, (int) hObject))
+        goto setKeyFormat_err;
+    if (SQLITE_DONE != sqlite3_step(pStmt)) goto setKeyFormat_err;
+    writes++;
+    ret = 0;
+setKeyFormat_err:
+    return ret;
+}
+
+
+int Database::setObject(CK_KEY_TYPE type, CK_BYTE_PTR pValue, CK_ULONG ulValueLen, CK_ATTRIBUTE *pAttribute, CK_ULONG ulAttributeCount, const uint8_t *pSerialized, size_t serializedLen, int keyFormat) {
+    std::lock_guard<std::recursive_mutex> write(writeLock);
+    Statement stmt(this, SET_OBJECT), stmtA(this, SET_ATTRIBUTE);
     bool rollback = true;
-	sqlite3_stmt *pStmt, *pStmtA = NULL;
+	sqlite3_stmt *pStmt, *pStmtA;
     rollback = true;
-    char sql[] = "INSERT INTO Object(objectClass, value) VALUES(?, ?);";
-    char sqlA[] = "INSERT INTO Attribute(ID, attributeType, value, objectID) VALUES(?,?,?,?);";
     int ret = -1, id;
     CK_ULONG i;
     int rc;
-    if (SQLITE_OK != sqlite3_exec(db, "BEGIN", 0, 0, 0))
-        goto setObject_err;
+    {
+        Statement begin(this, BEGIN);
+        if (0 != run(begin.get()))
+            goto setObject_err;
+    }
     ret -=1;
-    if (SQLITE_OK != sqlite3_prepare_v2(this->db, sql, -1, &pStmt, NULL))
+    if (NULL == (pStmt = stmt.get()))
         goto setObject_err;
     ret -=1;
     if (SQLITE_OK != sqlite3_bind_int(pStmt, 1, type))
@@ -339,13 +487,19 @@ int Database::setObject(CK_KEY_TYPE type, CK_BYTE_PTR pValue, CK_ULONG ulValueLe
     if (SQLITE_OK != sqlite3_bind_blob(pStmt, 2, pValue, ulValueLen, SQLITE_STATIC))
         goto setObject_err;
     ret -=1;
+    if (SQLITE_OK != sqlite3_bind_blob(pStmt, 3, pSerialized, serializedLen, SQLITE_STATIC))
+        goto setObject_err;
+    ret -=1;
+    if (SQLITE_OK != sqlite3_bind_int(pStmt, 4, keyFormat))
+        goto setObject_err;
+    ret -=1;
     if (SQLITE_DONE != (rc = sqlite3_step(pStmt)))
         goto setObject_err;
     ret -=1;
     id = sqlite3_last_insert_rowid(this->db);
+    if (NULL == (pStmtA = stmtA.get()))
+        goto setObject_err;
     for  (i=0; i<ulAttributeCount; i++, pAttribute++) {
-        if (SQLITE_OK != sqlite3_prepare_v2(this->db, sqlA, -1, &pStmtA, NULL))
-            goto setObject_err;
         if (SQLITE_OK != sqlite3_bind_int(pStmtA, 1, i))
             goto setObject_err;
         if (SQLITE_OK != sqlite3_bind_int(pStmtA, 2, pAttribute->type))
@@ -356,26 +510,61 @@ int Database::setObject(CK_KEY_TYPE type, CK_BYTE_PTR pValue, CK_ULONG ulValueLe
             goto setObject_err;
         if (SQLITE_DONE != (rc = sqlite3_step(pStmtA)))
             goto setObject_err;
-        sqlite3_finalize(pStmtA);
-        pStmtA = NULL;
+        sqlite3_reset(pStmtA);
     }
-    sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+    ret -=1;
+    {
+        Statement commit(this, COMMIT);
+        if (0 != run(commit.get()))
+            goto setObject_err;
+    }
+    writes++;
     rollback = false;
     ret = id;
 setObject_err:
-    if (pStmtA) sqlite3_finalize(pStmtA);
-    if (pStmt) sqlite3_finalize(pStmt);
-    if (rollback == true) sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    if (rollback == true) {
+        Statement abort(this, ROLLBACK);
+        run(abort.get());
+    }
     return ret;
 }
 
 
 
+// data_version only moves for commits of other connections. It is read at
+// most once per versionInterval, by one caller, the others get the last
+// value meanwhile.
+uint64_t Database::version() {
+    int64_t now = steadyNow(), at = sampledAt.load(std::memory_order_relaxed);
+    uint64_t ret = 0;
+
+    if (now - at < versionInterval || !sampledAt.compare_exchange_strong(at, now, std::memory_order_relaxed))
+        return sampledVersion.load(std::memory_order_acquire);
+    {
+        Statement stmt(this, DATA_VERSION);
+        sqlite3_stmt *pStmt = NULL;
+
+        if (NULL == (pStmt = stmt.get()))
+            goto version_err;
+        if (SQLITE_ROW != sqlite3_step(pStmt))
+            goto version_err;
+        ret = (uint64_t) sqlite3_column_int64(pStmt, 0);
+    }
+version_err:
+    sampledVersion.store(ret, std::memory_order_release);
+    return ret;
+}
+
+
 bool Database::IsNewDatabase(){
     return this->newlyCreated;
 }
 
 Database::~Database() {
+    for (int i = 0; i < NR_STATEMENTS; i++)
+        sqlite3_finalize(statements[i].pStmt);
+    for (auto& it : findStatements)
+        sqlite3_finalize(it.second.pStmt);
     sqlite3_close(this->db);
 }
 
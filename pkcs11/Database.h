@@ -3,14 +3,46 @@
 #define _DATABASE_H_
 
 #include <stdint.h>
+#include <atomic>
+#include <map>
+#include <mutex>
 #include <sqlite3.h>
 
 class Database {
 private:
     sqlite3 *db=NULL;
     bool newlyCreated=true;
+    std::atomic<uint64_t> writes{0};
+    // Last data_version read and when, in steady clock nanoseconds
+    std::atomic<uint64_t> sampledVersion{0};
+    std::atomic<int64_t> sampledAt{0};
+    int64_t versionInterval;
+    // The connection and its transaction are shared by all threads, writes
+    // take this from BEGIN until COMMIT or ROLLBACK
+    std::recursive_mutex writeLock;
+    // Statements are prepared on first use and kept for the connection, a
+    // statement serves one caller at a time
+    struct CachedStatement {
+        sqlite3_stmt *pStmt = NULL;
+        std::mutex lock;
+    };
+    class Statement;
+    enum {
+        SET_ROOT_KEY, GET_ROOT_KEY,
+        DELETE_OBJECT, DELETE_ATTRIBUTES, GET_OBJECT, GET_ATTRIBUTES, FIND_ALL,
+        GET_TOKEN, UPDATE_USER_PIN, INIT_TOKEN, UPDATE_TOKEN,
+        UPDATE_OBJECT_VALUE, SET_KEY_FORMAT, SET_OBJECT, SET_ATTRIBUTE,
+        BEGIN, COMMIT, ROLLBACK, DATA_VERSION,
+        NR_STATEMENTS
+    };
+    CachedStatement statements[NR_STATEMENTS];
+    // findObjects builds its SQL from the number of template attributes
+    std::map<CK_ULONG, CachedStatement> findStatements;
+    std::mutex findStatementsLock;
 public:
-	Database(const char *pDbFileName);
+    // Commits of other connections show in version() within
+    // versionIntervalMs
+	Database(const char *pDbFileName, unsigned int versionIntervalMs = 0);
     bool IsNewDatabase();
     int SetRootKey(uint8_t *rootKey, size_t rootKeyLength);
     uint8_t *GetRootKey(size_t& rootKeyLength);
@@ -18,10 +50,21 @@ public:
     int initToken(CK_SLOT_ID slotID, uint8_t *pLabel, size_t labelLength, uint8_t *pSOpin, size_t SOpinLength, uint8_t *pUserPIN, size_t userPINlength);
     int updateToken(CK_SLOT_ID slotID, uint8_t *pLabel, size_t labelLength);
     int updateUserPin(CK_SLOT_ID slotID, uint8_t *pUserPin, size_t userPinLength);
-    int setObject(CK_KEY_TYPE type, CK_BYTE_PTR pValue, CK_ULONG ulValueLen, CK_ATTRIBUTE *pAttributes, CK_ULONG ulAttributeCount);
+    // keyFormat is the KEY_FORMAT_VERSION a private key was wrapped in, 0
+    // for objects without a wrapped key or stored before the marker
+    int setObject(CK_KEY_TYPE type, CK_BYTE_PTR pValue, CK_ULONG ulValueLen, CK_ATTRIBUTE *pAttributes, CK_ULONG ulAttributeCount, const uint8_t *pSerialized, size_t serializedLen, int keyFormat);
+    int updateObjectValue(CK_OBJECT_HANDLE hObject, CK_BYTE_PTR pValue, CK_ULONG ulValueLen, int keyFormat);
+    int setKeyFormat(CK_OBJECT_HANDLE hObject, int keyFormat);
     int deleteObject(CK_OBJECT_HANDLE hObject);
-    int getObject(CK_OBJECT_HANDLE hObject, uint8_t **ppValue, size_t& valueLen, CK_ATTRIBUTE **ppAttribute, CK_ULONG& ulAttrCount);
-    CK_OBJECT_HANDLE *getObjectIds(CK_ATTRIBUTE *pTemlate, CK_ULONG ulCount, int& nrFound);
+    // ppSerialized gets the attributes as authenticated by the enclave, NULL
+    // for objects stored without them
+    int getObject(CK_OBJECT_HANDLE hObject, uint8_t **ppValue, size_t& valueLen, CK_ATTRIBUTE **ppAttribute, CK_ULONG& ulAttrCount, uint8_t **ppSerialized, size_t& serializedLen, int& keyFormat);
+    int findObjects(CK_ATTRIBUTE *pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE hAfter, CK_OBJECT_HANDLE *phObject, CK_ULONG ulMaxObjectCount, CK_ULONG& ulObjectCount);
+    // Changes when another connection commits, 0 when unknown
+    uint64_t version();
+    // Writes through this connection so far. A record read while the count
+    // moved may predate a write and is not to be cached.
+    uint64_t writeCount() { return writes.load(std::memory_order_acquire); }
 	~Database();
 };
 
@@ -62,5 +62,8 @@ typedef enum
 	PKCS11_CK_OPERATION_DECRYPT,
     PKCS11_CK_OPERATION_SIGN,
     PKCS11_CK_OPERATION_VERIFY,
+    PKCS11_CK_OPERATION_MESSAGE_SIGN,
+    PKCS11_CK_OPERATION_MESSAGE_VERIFY,
+    PKCS11_CK_OPERATION_DIGEST,
 }PKCS_OPERATION;
 
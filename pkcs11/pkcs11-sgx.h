@@ -0,0 +1,89 @@
+#pragma once
+
+// Vendor extensions of the SGX PKCS#11 module. Include after pkcs11.h.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct CK_SGX_SIGN_BATCH_ITEM {
+    CK_OBJECT_HANDLE hKey;
+    CK_MECHANISM_TYPE mechanism;
+    CK_BYTE_PTR pData;
+    CK_ULONG ulDataLen;
+    CK_BYTE_PTR pSignature;
+    // In: size of pSignature, out: signature length
+    CK_ULONG ulSignatureLen;
+    CK_RV rv;
+} CK_SGX_SIGN_BATCH_ITEM;
+
+typedef CK_SGX_SIGN_BATCH_ITEM CK_PTR CK_SGX_SIGN_BATCH_ITEM_PTR;
+
+// Signs every item in a single enclave transition. Each key is unwrapped
+// once, however many items use it. The per item result is stored in rv;
+// the function itself only fails when the batch could not be processed.
+// With pSignature NULL_PTR only ulSignatureLen is returned.
+CK_DECLARE_FUNCTION(CK_RV, C_SGX_SignBatch)(
+    CK_SESSION_HANDLE hSession,
+    CK_SGX_SIGN_BATCH_ITEM_PTR pItems,
+    CK_ULONG ulCount);
+
+typedef struct CK_SGX_ENCLAVE_STATS {
+    // Peak use by a single ECALL of the per thread arena for enclave
+    // temporaries, allocations that did not fit included, against its size.
+    // Together with the number of enclave threads this sizes HeapMaxSize.
+    CK_ULONG ulArenaPeak;
+    CK_ULONG ulArenaSize;
+    CK_ULONG ulArenaOverflows;
+} CK_SGX_ENCLAVE_STATS;
+
+typedef CK_SGX_ENCLAVE_STATS CK_PTR CK_SGX_ENCLAVE_STATS_PTR;
+
+CK_DECLARE_FUNCTION(CK_RV, C_SGX_GetEnclaveStats)(
+    CK_SGX_ENCLAVE_STATS_PTR pStats);
+
+// Single call sign and decrypt with a key. There is no Init or Final and
+// the session keeps no operation state, so any number of them may run on
+// one session at the same time, next to an operation it has active. The
+// mechanisms are those of C_SignInit and C_DecryptInit. With pSignature or
+// pData NULL_PTR only the length is returned; the operation is still done.
+CK_DECLARE_FUNCTION(CK_RV, C_SGX_SignDirect)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey,
+    CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen,
+    CK_BYTE_PTR pSignature,
+    CK_ULONG_PTR pulSignatureLen);
+
+CK_DECLARE_FUNCTION(CK_RV, C_SGX_DecryptDirect)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey,
+    CK_BYTE_PTR pEncryptedData,
+    CK_ULONG ulEncryptedDataLen,
+    CK_BYTE_PTR pData,
+    CK_ULONG_PTR pulDataLen);
+
+#define CK_SGX_FUNCTION_LIST_VERSION_MAJOR 1
+#define CK_SGX_FUNCTION_LIST_VERSION_MINOR 0
+
+// The vendor functions, for callers that load the module without
+// resolving its symbols one by one.
+typedef struct CK_SGX_FUNCTION_LIST {
+    CK_VERSION version;
+    CK_DECLARE_FUNCTION_POINTER(CK_RV, C_SGX_SignBatch)(CK_SESSION_HANDLE, CK_SGX_SIGN_BATCH_ITEM_PTR, CK_ULONG);
+    CK_DECLARE_FUNCTION_POINTER(CK_RV, C_SGX_GetEnclaveStats)(CK_SGX_ENCLAVE_STATS_PTR);
+    CK_DECLARE_FUNCTION_POINTER(CK_RV, C_SGX_SignDirect)(CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+    CK_DECLARE_FUNCTION_POINTER(CK_RV, C_SGX_DecryptDirect)(CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+} CK_SGX_FUNCTION_LIST;
+
+typedef CK_SGX_FUNCTION_LIST CK_PTR CK_SGX_FUNCTION_LIST_PTR;
+typedef CK_SGX_FUNCTION_LIST_PTR CK_PTR CK_SGX_FUNCTION_LIST_PTR_PTR;
+
+CK_DECLARE_FUNCTION(CK_RV, C_SGX_GetFunctionList)(
+    CK_SGX_FUNCTION_LIST_PTR_PTR ppFunctionList);
+
+#ifdef __cplusplus
+}
+#endif
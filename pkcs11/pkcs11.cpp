@@ -1,11 +1,23 @@
 #include <sstream>
 #include <iostream>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <new>
+#include <memory>
+#include <pthread.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <openssl/crypto.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
 #include <openssl/rsa.h>
+#include <openssl/ec.h>
 #include <openssl/x509.h>
 
 #include "pkcs11-interface.h"
@@ -13,6 +25,9 @@
 #include "Attribute.h"
 #include "AttributeSerial.h"
 #include "Database.h"
+#include "pkcs11-sgx.h"
+#include "pkcs11-v3.h"
+#include "signbatch.h"
 
 
 CK_SLOT_ID PKCS11_SLOT_ID = 1;
@@ -22,6 +37,9 @@ CK_SESSION_HANDLE PKCS11_SESSION_ID = 1;
 CK_ULONG pkcs11_SGX_session_state = CKS_RO_PUBLIC_SESSION;
 CryptoEntity *crypto=NULL;
 Database *db=NULL;
+// Authenticates saved operation states, the enclave derives it from the root
+// key so every process on the same database gets the same one
+static uint8_t stateKey[SHA256_DIGEST_LENGTH];
 
 
 CK_FUNCTION_LIST functionList = {
@@ -31,6 +49,44 @@ CK_FUNCTION_LIST functionList = {
 #undef CK_PKCS11_FUNCTION_INFO
 };
 
+CK_FUNCTION_LIST_2_20 functionList2 = {
+    { 2, 20 },
+#define CK_PKCS11_FUNCTION_INFO(name) name,
+#include "../cryptoki/pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+};
+
+CK_FUNCTION_LIST_3_0 functionList3 = {
+    { 3, 0 },
+#define CK_PKCS11_FUNCTION_INFO(name) name,
+#include "../cryptoki/pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+    C_GetInterfaceList,
+    C_GetInterface,
+    C_LoginUser,
+    C_SessionCancel,
+    C_MessageEncryptInit,
+    C_EncryptMessage,
+    C_EncryptMessageBegin,
+    C_EncryptMessageNext,
+    C_MessageEncryptFinal,
+    C_MessageDecryptInit,
+    C_DecryptMessage,
+    C_DecryptMessageBegin,
+    C_DecryptMessageNext,
+    C_MessageDecryptFinal,
+    C_MessageSignInit,
+    C_SignMessage,
+    C_SignMessageBegin,
+    C_SignMessageNext,
+    C_MessageSignFinal,
+    C_MessageVerifyInit,
+    C_VerifyMessage,
+    C_VerifyMessageBegin,
+    C_VerifyMessageNext,
+    C_MessageVerifyFinal,
+};
+
 #define RSA_MIN_KEY_SIZE 1024
 #define RSA_MAX_KEY_SIZE 8192
 
@@ -76,32 +132,492 @@ typedef struct pkcs11_object {
 	CK_ATTRIBUTE_PTR pAttributes;
     uint8_t *pValue;
     size_t valueLength;
+    // The attributes as authenticated when the value was wrapped
+    uint8_t *pSerialized;
+    size_t serializedLength;
+    // KEY_FORMAT_VERSION of a wrapped private key, 0 until it is migrated
+    int keyFormat;
 } pkcs11_object_t;
 
+typedef struct object_record {
+    CK_OBJECT_HANDLE hObject;
+    uint64_t version;
+    std::atomic<long> refs;
+    pkcs11_object_t object;
+    // Owner and siblings of a session object
+    struct pkcs11_session *owner;
+    struct object_record *prev, *next;
+} object_record_t;
+
+// Running hash of a multi-part operation. The low level contexts have
+// public fields, C_GetOperationState writes those out one by one.
+typedef struct {
+    int type;
+    union {
+        SHA_CTX sha1;
+        SHA256_CTX sha256;
+        SHA512_CTX sha512;
+    } ctx;
+} hash_state_t;
+
 typedef struct pkcs11_session {
     CK_ULONG slotID;
     CK_ULONG flags;
+    // A search continues after the last handle returned, only the
+    // template is kept.
     struct {
-        CK_OBJECT_HANDLE_PTR  hObject;
-        CK_ULONG ulObjectCount;
+        CK_ATTRIBUTE_PTR pTemplate;
+        CK_ULONG ulCount;
+        CK_OBJECT_HANDLE hLast;
     } FindObject;
     CK_OBJECT_HANDLE handle;
     PKCS_OPERATION operation;
-    pkcs11_object_t operationObject;
+    object_record_t *operationRecord;
     CK_MECHANISM_TYPE operationMechanismType;
 	uint8_t *part;
 	CK_ULONG partLen;
+    // Key and running digest of a sign, verify or digest operation, a
+    // hash-and-sign verify runs in mdCtx instead of hash
+    CK_OBJECT_HANDLE operationKeyHandle;
+    hash_state_t hash;
+    EVP_MD_CTX *mdCtx;
+    const EVP_MD *operationMd;
+    // Public key and its prepared context of a verify or encrypt operation
+    EVP_PKEY *operationKey;
+    EVP_PKEY_CTX *operationCtx;
+    object_record_t *sessionObjects;
+    // A message of a message based operation is in progress
+    CK_BBOOL inMessage;
 } pkcs11_session_t;
 
-std::map<CK_SESSION_HANDLE, pkcs11_session_t> sessions;
-static CK_ULONG sessionHandleCnt = 0;
 
-static pkcs11_session_t *get_session(CK_SESSION_HANDLE handle) {
+static void freeObject(pkcs11_object_t *o)
+{
+    if (o->pAttributes) {
+        for (CK_ULONG i = 0; i < o->ulAttributeCount; i++) free(o->pAttributes[i].pValue);
+        free(o->pAttributes);
+    }
+    if (o->pValue) free(o->pValue);
+    if (o->pSerialized) free(o->pSerialized);
+    memset(o, 0, sizeof *o);
+}
+
+
+// Mutexes as negotiated in C_Initialize, the application callbacks when it
+// supplies them without CKF_OS_LOCKING_OK and pthread mutexes otherwise.
+static CK_RV osCreateMutex(CK_VOID_PTR_PTR ppMutex) {
+    pthread_mutex_t *m = (pthread_mutex_t *) malloc(sizeof *m);
+    if (m == NULL) return CKR_HOST_MEMORY;
+    if (pthread_mutex_init(m, NULL)) {
+        free(m);
+        return CKR_GENERAL_ERROR;
+    }
+    *ppMutex = m;
+    return CKR_OK;
+}
+
+static CK_RV osDestroyMutex(CK_VOID_PTR pMutex) {
+    if (pthread_mutex_destroy((pthread_mutex_t *) pMutex)) return CKR_MUTEX_BAD;
+    free(pMutex);
+    return CKR_OK;
+}
+
+static CK_RV osLockMutex(CK_VOID_PTR pMutex) {
+    return pthread_mutex_lock((pthread_mutex_t *) pMutex) ? CKR_MUTEX_BAD : CKR_OK;
+}
+
+static CK_RV osUnlockMutex(CK_VOID_PTR pMutex) {
+    return pthread_mutex_unlock((pthread_mutex_t *) pMutex) ? CKR_MUTEX_NOT_LOCKED : CKR_OK;
+}
+
+static const CK_C_INITIALIZE_ARGS osLocking = {
+    osCreateMutex, osDestroyMutex, osLockMutex, osUnlockMutex, CKF_OS_LOCKING_OK, NULL
+};
+static CK_C_INITIALIZE_ARGS lockFunctions = osLocking;
+
+class LibraryMutex {
+    CK_VOID_PTR pMutex = NULL;
+public:
+    CK_RV create() { return lockFunctions.CreateMutex(&pMutex); }
+    void destroy() {
+        if (pMutex) lockFunctions.DestroyMutex(pMutex);
+        pMutex = NULL;
+    }
+    CK_RV lock() { return lockFunctions.LockMutex(pMutex); }
+    CK_RV unlock() { return lockFunctions.UnlockMutex(pMutex); }
+};
+
+
+// Holds a LibraryMutex for a scope. When the application's LockMutex fails
+// the mutex is not held and rv() has the error to fail the call with;
+// unlock() lets the holder release it early and see how UnlockMutex went.
+// Releasing the state of a closed session or of the library is not
+// refused, it goes on either way.
+class LibraryLock {
+    LibraryMutex &mutex;
+    CK_RV lockRv;
+    bool held;
+public:
+    explicit LibraryLock(LibraryMutex &m): mutex(m), lockRv(m.lock()), held(lockRv == CKR_OK) {}
+    LibraryLock(const LibraryLock &) = delete;
+    LibraryLock &operator=(const LibraryLock &) = delete;
+    ~LibraryLock() { if (held) mutex.unlock(); }
+    CK_RV rv() const { return lockRv; }
+    CK_RV unlock() {
+        if (!held) return lockRv;
+        held = false;
+        return mutex.unlock();
+    }
+};
+
+
+// Object records read from the database, shared by the cache and the
+// operations using them. A record is never modified. Writing an object
+// here forgets its record; a commit of another process retires all of
+// them once the database version is next sampled.
+static std::list<object_record_t *> objectLru;
+static std::unordered_map<CK_OBJECT_HANDLE, std::list<object_record_t *>::iterator> objectIndex;
+static size_t maxObjects = DEFAULT_OBJECT_CACHE_ENTRIES;
+static LibraryMutex objectsLock;
+
+
+static void objectCachePut(object_record_t *r) {
+    if (r && --r->refs == 0) {
+        freeObject(&r->object);
+        delete r;
+    }
+}
+
+
+// Called with objectsLock held
+static void evictObject(std::list<object_record_t *>::iterator it) {
+    objectIndex.erase((*it)->hObject);
+    objectCachePut(*it);
+    objectLru.erase(it);
+}
+
+
+// Session objects (CKA_TOKEN false) never reach the database. They get
+// handles above any database row id and are linked into the session that
+// created them, which destroys them when it is closed.
+#define SESSION_OBJECT_FLAG ((CK_OBJECT_HANDLE) 1 << 31)
+#define isSessionObject(h) (((h) & SESSION_OBJECT_FLAG) != 0)
+
+static std::map<CK_OBJECT_HANDLE, object_record_t *> sessionObjectIndex;
+static CK_OBJECT_HANDLE lastSessionObject = 0;
+static LibraryMutex sessionObjectsLock;
+
+static CK_RV forgetPublicKey(CK_OBJECT_HANDLE hObject);
+
+
+static object_record_t *sessionObjectGet(CK_OBJECT_HANDLE hObject) {
+    LibraryLock lock(sessionObjectsLock);
+    if (lock.rv() != CKR_OK) return NULL;
+    auto it = sessionObjectIndex.find(hObject);
+    if (it == sessionObjectIndex.end()) return NULL;
+    it->second->refs++;
+    return it->second;
+}
+
+
+// Called with sessionObjectsLock held
+static void unlinkSessionObject(object_record_t *r) {
+    if (r->prev) r->prev->next = r->next;
+    else r->owner->sessionObjects = r->next;
+    if (r->next) r->next->prev = r->prev;
+    r->prev = r->next = NULL;
+    sessionObjectIndex.erase(r->hObject);
+}
+
+
+static CK_RV destroySessionObject(CK_OBJECT_HANDLE hObject) {
+    object_record_t *r;
+    CK_RV rv, rvForget;
+    {
+        LibraryLock lock(sessionObjectsLock);
+        if ((rv = lock.rv()) != CKR_OK) return rv;
+        auto it = sessionObjectIndex.find(hObject);
+        if (it == sessionObjectIndex.end()) return CKR_OBJECT_HANDLE_INVALID;
+        r = it->second;
+        unlinkSessionObject(r);
+        rv = lock.unlock();
+    }
+    rvForget = forgetPublicKey(hObject);
+    objectCachePut(r);
+    return rv != CKR_OK ? rv : rvForget;
+}
+
+
+static void releaseSessionObjects(pkcs11_session_t *s) {
+    object_record_t *r;
+    for (;;) {
+        {
+            LibraryLock lock(sessionObjectsLock);
+            if ((r = s->sessionObjects) == NULL) return;
+            unlinkSessionObject(r);
+        }
+        forgetPublicKey(r->hObject);
+        objectCachePut(r);
+    }
+}
+
+
+// Returns the session objects matching the template after hAfter in handle order
+static CK_RV findSessionObjects(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE hAfter, CK_OBJECT_HANDLE_PTR phObject, CK_ULONG ulMaxObjectCount, CK_ULONG& ulObjectCount) {
+    LibraryLock lock(sessionObjectsLock);
+
+    ulObjectCount = 0;
+    if (lock.rv() != CKR_OK) return lock.rv();
+    for (auto it = sessionObjectIndex.upper_bound(hAfter); it != sessionObjectIndex.end() && ulObjectCount < ulMaxObjectCount; it++) {
+        pkcs11_object_t *o = &it->second->object;
+        CK_ULONG i;
+        for (i = 0; i < ulCount; i++) {
+            CK_ATTRIBUTE_PTR pAttr = NULL;
+            for (CK_ULONG j = 0; j < o->ulAttributeCount && pAttr == NULL; j++)
+                if (o->pAttributes[j].type == pTemplate[i].type) pAttr = &o->pAttributes[j];
+            if (pAttr == NULL || pAttr->ulValueLen != pTemplate[i].ulValueLen ||
+                memcmp(pAttr->pValue, pTemplate[i].pValue, pAttr->ulValueLen) != 0) break;
+        }
+        if (i == ulCount) phObject[ulObjectCount++] = it->first;
+    }
+    return lock.unlock();
+}
+
+
+// Returns a reference to the current record of an object, NULL when it
+// can not be read.
+static object_record_t *objectCacheGet(CK_OBJECT_HANDLE hObject) {
+    if (isSessionObject(hObject)) return sessionObjectGet(hObject);
+    uint64_t version = db->version(), writes = db->writeCount();
+    object_record_t *r;
+
+    {
+        LibraryLock lock(objectsLock);
+        if (lock.rv() != CKR_OK) return NULL;
+        auto it = objectIndex.find(hObject);
+        if (it != objectIndex.end()) {
+            r = *it->second;
+            if (version != 0 && r->version == version) {
+                objectLru.splice(objectLru.begin(), objectLru, it->second);
+                r->refs++;
+                return r;
+            }
+            evictObject(it->second);
+        }
+    }
+    if ((r = new (std::nothrow) object_record_t()) == NULL) return NULL;
+    r->hObject = hObject;
+    r->version = version;
+    r->refs = 1;
+    pkcs11_object_t *o = &r->object;
+    if (db->getObject(hObject, &o->pValue, o->valueLength, &o->pAttributes, o->ulAttributeCount, &o->pSerialized, o->serializedLength, o->keyFormat)) {
+        objectCachePut(r);
+        return NULL;
+    }
+    if (o->pSerialized == NULL && o->ulAttributeCount > 0) {
+        // Stored before the serialized attributes were kept
+        Attribute attr = Attribute(o->pAttributes, o->ulAttributeCount);
+        if ((o->pSerialized = attr.serialize(&o->serializedLength)) == NULL) {
+            objectCachePut(r);
+            return NULL;
+        }
+    }
+    LibraryLock lock(objectsLock);
+    if (lock.rv() != CKR_OK) {
+        objectCachePut(r);
+        return NULL;
+    }
+    // A local write forgets the handle after writing, a record read before
+    // that must not come back afterwards
+    if (version != 0 && maxObjects > 0 && db->writeCount() == writes && objectIndex.count(hObject) == 0) {
+        r->refs++;
+        objectLru.push_front(r);
+        objectIndex[hObject] = objectLru.begin();
+        while (objectLru.size() > maxObjects) evictObject(std::prev(objectLru.end()));
+    }
+    return r;
+}
+
+
+static CK_RV objectCacheForget(CK_OBJECT_HANDLE hObject) {
+    LibraryLock lock(objectsLock);
+    if (lock.rv() != CKR_OK) return lock.rv();
+    auto it = objectIndex.find(hObject);
+    if (it != objectIndex.end()) evictObject(it->second);
+    return lock.unlock();
+}
+
+
+static void objectCacheFlush(void) {
+    LibraryLock lock(objectsLock);
+    while (!objectLru.empty()) evictObject(objectLru.begin());
+}
+
+
+// Sessions live in chunks of slots that are allocated on demand and only
+// freed by C_Finalize, so a slot address stays valid once handed out. A
+// handle carries the slot index and the generation of the slot, a lookup
+// compares it against the handle the slot was last opened with and takes
+// a reference without a lock. Opening and closing serialize on
+// sessionsLock. An open session holds one reference, each call using it
+// one more; the state of a closed session is released, and the slot
+// reused, when the last reference goes.
+#define SESSION_INDEX_BITS 20
+#define SESSION_INDEX_MASK ((1UL << SESSION_INDEX_BITS) - 1)
+#define SESSION_CHUNK_BITS 10
+#define SESSION_CHUNK (1 << SESSION_CHUNK_BITS)
+#define MAX_SESSION_CHUNKS 64
+#define MAX_SESSION_COUNT (MAX_SESSION_CHUNKS * SESSION_CHUNK)
+#define MAX_RW_SESSION_COUNT MAX_SESSION_COUNT
+
+typedef struct session_slot {
+    std::atomic<CK_SESSION_HANDLE> handle;
+    std::atomic<CK_ULONG> refs;
+    CK_ULONG index;
+    CK_ULONG generation;
+    pkcs11_session_t session;
+} session_slot_t;
+
+static std::atomic<session_slot_t *> sessionChunks[MAX_SESSION_CHUNKS];
+static std::vector<CK_ULONG> freeSessions;
+static CK_ULONG sessionSlotsUsed = 0;
+static LibraryMutex sessionsLock;
+
+static session_slot_t *get_session_slot(CK_ULONG index) {
+    if (index >= MAX_SESSION_COUNT) return NULL;
+    session_slot_t *chunk = sessionChunks[index >> SESSION_CHUNK_BITS].load(std::memory_order_acquire);
+    return chunk ? &chunk[index & (SESSION_CHUNK - 1)] : NULL;
+}
+
+static session_slot_t *find_session(CK_SESSION_HANDLE handle) {
+    session_slot_t *slot;
+
+    if ((handle & SESSION_INDEX_MASK) == 0) return NULL;
+    if ((slot = get_session_slot((handle & SESSION_INDEX_MASK) - 1)) == NULL) return NULL;
+    return slot->handle.load(std::memory_order_acquire) == handle ? slot : NULL;
+}
+
+// Called with sessionsLock held
+static void releaseSession(session_slot_t *slot) {
+    pkcs11_session_t *s = &slot->session;
+
+    if (s->FindObject.pTemplate) free(s->FindObject.pTemplate);
+    objectCachePut(s->operationRecord);
+    if (s->part) free(s->part);
+    if (s->operationKey) EVP_PKEY_free(s->operationKey);
+    if (s->operationCtx) EVP_PKEY_CTX_free(s->operationCtx);
+    if (s->mdCtx) EVP_MD_CTX_free(s->mdCtx);
+    releaseSessionObjects(s);
+    memset(s, 0, sizeof *s);
+    freeSessions.push_back(slot->index);
+}
+
+static void put_session(session_slot_t *slot) {
+    if (slot->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    LibraryLock lock(sessionsLock);
+    releaseSession(slot);
+}
+
+static session_slot_t *get_session(CK_SESSION_HANDLE handle) {
+    session_slot_t *slot;
+    CK_ULONG refs;
+
+    if ((slot = find_session(handle)) == NULL) return NULL;
+    // A slot without references is being released and must stay so
+    refs = slot->refs.load(std::memory_order_relaxed);
+    do {
+        if (refs == 0) return NULL;
+    } while (!slot->refs.compare_exchange_weak(refs, refs + 1, std::memory_order_acquire));
+    // Closed, and maybe reopened, before the reference was taken
+    if (slot->handle.load(std::memory_order_acquire) != handle) {
+        put_session(slot);
+        return NULL;
+    }
+    return slot;
+}
+
+// The session of a call, held until the call returns
+class SessionRef {
+    session_slot_t *slot = NULL;
+public:
+    SessionRef() {}
+    SessionRef(const SessionRef &) = delete;
+    SessionRef &operator=(const SessionRef &) = delete;
+    SessionRef &operator=(session_slot_t *p) {
+        if (slot) put_session(slot);
+        slot = p;
+        return *this;
+    }
+    operator pkcs11_session_t *() const { return slot ? &slot->session : NULL; }
+    pkcs11_session_t *operator->() const { return &slot->session; }
+    ~SessionRef() { if (slot) put_session(slot); }
+};
+
+static CK_RV newSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_SESSION_HANDLE_PTR phSession) {
+    CK_ULONG index;
+    session_slot_t *slot;
+    LibraryLock lock(sessionsLock);
+
+    if (lock.rv() != CKR_OK) return lock.rv();
+    if (!freeSessions.empty()) {
+        index = freeSessions.back();
+        freeSessions.pop_back();
+    } else {
+        if (sessionSlotsUsed == MAX_SESSION_COUNT) return CKR_SESSION_COUNT;
+        index = sessionSlotsUsed;
+        if ((index & (SESSION_CHUNK - 1)) == 0) {
+            session_slot_t *chunk = new (std::nothrow) session_slot_t[SESSION_CHUNK]();
+            if (chunk == NULL) return CKR_HOST_MEMORY;
+            sessionChunks[index >> SESSION_CHUNK_BITS].store(chunk, std::memory_order_release);
+        }
+        sessionSlotsUsed++;
+    }
+    slot = get_session_slot(index);
+    slot->index = index;
+    slot->generation++;
+    slot->session = {slotID, flags};
+    slot->refs.store(1, std::memory_order_relaxed);
+    *phSession = (slot->generation << SESSION_INDEX_BITS) | (index + 1);
+    slot->handle.store(*phSession, std::memory_order_release);
+    return lock.unlock();
+}
+
+// Called with sessionsLock held, drops the reference of the open session
+static void closeSlot(session_slot_t *slot) {
+    slot->handle.store(0, std::memory_order_release);
+    if (slot->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) releaseSession(slot);
+}
+
+static CK_RV closeSession(CK_SESSION_HANDLE handle) {
+    LibraryLock lock(sessionsLock);
+    session_slot_t *slot;
+
+    if (lock.rv() != CKR_OK) return lock.rv();
+    if ((slot = find_session(handle)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+    closeSlot(slot);
+    return lock.unlock();
+}
+
+static CK_RV closeSessions(CK_SLOT_ID slotID, bool allSlots) {
+    LibraryLock lock(sessionsLock);
 
-    // Find session handle
-    std::map<CK_SESSION_HANDLE, pkcs11_session_t>::iterator iter = sessions.find(handle);
+    if (lock.rv() != CKR_OK) return lock.rv();
+    for (CK_ULONG i = 0; i < sessionSlotsUsed; i++) {
+        session_slot_t *slot = get_session_slot(i);
+        if (slot->handle.load(std::memory_order_relaxed) == 0) continue;
+        if (allSlots || slot->session.slotID == slotID) closeSlot(slot);
+    }
+    return lock.unlock();
+}
 
-    return iter != sessions.end() ? &iter->second : NULL;
+static void freeSessionTable() {
+    closeSessions(0, true);
+    for (CK_ULONG i = 0; i < MAX_SESSION_CHUNKS; i++) {
+        delete[] sessionChunks[i].load(std::memory_order_relaxed);
+        sessionChunks[i].store(NULL, std::memory_order_relaxed);
+    }
+    freeSessions.clear();
+    sessionSlotsUsed = 0;
 }
 
 template <typename T>
@@ -150,26 +666,368 @@ digestMessage_err:
 
 
 
+// Private keys wrapped before the packed key format are rewrapped by the
+// enclave the first time they are used. The object is then marked with the
+// current format, so no process asks the enclave about it again.
+//
+// Returns the record to continue with, a new one when the object changed.
+// The reference to r is handed over.
+static object_record_t *migrateObject(object_record_t *r)
+{
+    uint8_t *migrated;
+    size_t migratedLength;
+    int rc;
+    CK_OBJECT_HANDLE hObject = r->hObject;
+    pkcs11_object_t *o = &r->object;
+
+    // Session objects are wrapped with the current root key
+    if (isSessionObject(hObject)) return r;
+    if (o->keyFormat >= KEY_FORMAT_VERSION) return r;
+    Attribute attr = Attribute(o->pAttributes, o->ulAttributeCount);
+    CK_OBJECT_CLASS_PTR pObjectClass = attr.getType<CK_OBJECT_CLASS>(CKA_CLASS);
+    if (pObjectClass == NULL || *pObjectClass != CKO_PRIVATE_KEY) return r;
+    try {
+        migrated = crypto->MigrateKey(o->pValue, o->valueLength, o->pSerialized, o->serializedLength, &migratedLength);
+    }
+    catch (std::runtime_error) {
+        // Left to the operation itself to report
+        return r;
+    }
+    if (migrated) {
+        rc = db->updateObjectValue(hObject, migrated, migratedLength, KEY_FORMAT_VERSION);
+        free(migrated);
+    } else {
+        // Already packed, or a key without a packed form
+        rc = db->setKeyFormat(hObject, KEY_FORMAT_VERSION);
+    }
+    if (rc) return r;
+    objectCachePut(r);
+    if (objectCacheForget(hObject) != CKR_OK) return NULL;
+    return objectCacheGet(hObject);
+}
+
+
+// Shared group per curve with the generator multiples precomputed, so a
+// verification only has to do the work for the public key point.
+static std::map<int, EC_GROUP *> curveGroups;
+static LibraryMutex curveGroupsLock;
+
+
+static const EC_GROUP *curveGroup(int nid) {
+	LibraryLock lock(curveGroupsLock);
+	EC_GROUP *grp;
+
+	if (nid == NID_undef || lock.rv() != CKR_OK) return NULL;
+	auto it = curveGroups.find(nid);
+	if (it != curveGroups.end()) return it->second;
+	if ((grp = EC_GROUP_new_by_curve_name(nid)) == NULL) return NULL;
+	if (!EC_GROUP_precompute_mult(grp, NULL)) {
+		EC_GROUP_free(grp);
+		return NULL;
+	}
+	curveGroups[nid] = grp;
+	return grp;
+}
+
+
+static void freeCurveGroups(void) {
+	LibraryLock lock(curveGroupsLock);
+	for (auto it: curveGroups) EC_GROUP_free(it.second);
+	curveGroups.clear();
+}
+
+
+// Parses a public key object. EC keys are rebuilt on the shared group of
+// their curve so a verification uses the precomputed generator multiples.
+static EVP_PKEY *parsePublicKey(pkcs11_object_t *o)
+{
+	const uint8_t *endptr = o->pValue;
+	EVP_PKEY *pKey, *pECKey = NULL;
+	const EC_KEY *pub;
+	const EC_GROUP *grp;
+	EC_KEY *key = NULL;
+
+	if (NULL == (pKey = d2i_PUBKEY(NULL, &endptr, o->valueLength))) return NULL;
+	if (EVP_PKEY_id(pKey) != EVP_PKEY_EC) return pKey;
+	if ((pub = EVP_PKEY_get0_EC_KEY(pKey)) == NULL) goto parsePublicKey_err;
+	// Explicit parameters have no curve name, such a key keeps its own group
+	if ((grp = curveGroup(EC_GROUP_get_curve_name(EC_KEY_get0_group(pub)))) == NULL) return pKey;
+	if ((key = EC_KEY_new()) == NULL) goto parsePublicKey_err;
+	if (!EC_KEY_set_group(key, grp)) goto parsePublicKey_err;
+	if (!EC_KEY_set_public_key(key, EC_KEY_get0_public_key(pub))) goto parsePublicKey_err;
+	if ((pECKey = EVP_PKEY_new()) == NULL) goto parsePublicKey_err;
+	if (!EVP_PKEY_assign_EC_KEY(pECKey, key)) {
+		EVP_PKEY_free(pECKey);
+		pECKey = NULL;
+		goto parsePublicKey_err;
+	}
+	key = NULL;
+parsePublicKey_err:
+	EC_KEY_free(key);
+	EVP_PKEY_free(pKey);
+	return pECKey;
+}
+
+
+// Parsed public keys by object handle, valid as long as the database is at
+// the version they were read at and the object is not written here. Each
+// entry carries contexts set up for a raw verify and, for RSA, a PKCS#1
+// encrypt that operations duplicate.
+typedef struct {
+    CK_OBJECT_HANDLE hObject;
+    uint64_t version;
+    EVP_PKEY *pKey;
+    EVP_PKEY_CTX *pVerifyCtx;
+    EVP_PKEY_CTX *pEncryptCtx;
+} publicKeyEntry_t;
+
+static std::list<publicKeyEntry_t> publicKeyLru;
+static std::unordered_map<CK_OBJECT_HANDLE, std::list<publicKeyEntry_t>::iterator> publicKeyIndex;
+static size_t maxPublicKeys = DEFAULT_PUBLIC_KEY_CACHE_ENTRIES;
+static LibraryMutex publicKeysLock;
+
+
+static void freePublicKeyEntry(publicKeyEntry_t *e) {
+    if (e->pVerifyCtx) EVP_PKEY_CTX_free(e->pVerifyCtx);
+    if (e->pEncryptCtx) EVP_PKEY_CTX_free(e->pEncryptCtx);
+    if (e->pKey) EVP_PKEY_free(e->pKey);
+}
+
+
+// Called with publicKeysLock held
+static void evictPublicKey(std::list<publicKeyEntry_t>::iterator it) {
+    publicKeyIndex.erase(it->hObject);
+    freePublicKeyEntry(&*it);
+    publicKeyLru.erase(it);
+}
+
+
+static CK_RV newPublicKeyEntry(CK_OBJECT_HANDLE hObject, uint64_t version, publicKeyEntry_t *e) {
+    object_record_t *r;
+    CK_RV rv = CKR_KEY_HANDLE_INVALID;
+
+    memset(e, 0, sizeof *e);
+    e->hObject = hObject;
+    e->version = version;
+    if ((r = objectCacheGet(hObject)) == NULL) return rv;
+    {
+        Attribute attr = Attribute(r->object.pAttributes, r->object.ulAttributeCount);
+        CK_OBJECT_CLASS_PTR pObjectClass = attr.getType<CK_OBJECT_CLASS>(CKA_CLASS);
+        if (pObjectClass == NULL || *pObjectClass != CKO_PUBLIC_KEY) goto newPublicKeyEntry_err;
+    }
+    if ((e->pKey = parsePublicKey(&r->object)) == NULL) goto newPublicKeyEntry_err;
+    rv = CKR_DEVICE_ERROR;
+    if ((e->pVerifyCtx = EVP_PKEY_CTX_new(e->pKey, NULL)) == NULL) goto newPublicKeyEntry_err;
+    if (1 != EVP_PKEY_verify_init(e->pVerifyCtx)) goto newPublicKeyEntry_err;
+    if (EVP_PKEY_id(e->pKey) == EVP_PKEY_RSA) {
+        if (0 >= EVP_PKEY_CTX_set_rsa_padding(e->pVerifyCtx, RSA_PKCS1_PADDING)) goto newPublicKeyEntry_err;
+        if ((e->pEncryptCtx = EVP_PKEY_CTX_new(e->pKey, NULL)) == NULL) goto newPublicKeyEntry_err;
+        if (1 != EVP_PKEY_encrypt_init(e->pEncryptCtx)) goto newPublicKeyEntry_err;
+        if (0 >= EVP_PKEY_CTX_set_rsa_padding(e->pEncryptCtx, RSA_PKCS1_PADDING)) goto newPublicKeyEntry_err;
+    }
+    rv = CKR_OK;
+newPublicKeyEntry_err:
+    if (rv != CKR_OK) freePublicKeyEntry(e);
+    objectCachePut(r);
+    return rv;
+}
+
+
+// Called with publicKeysLock held when e is in the cache
+static CK_RV refPublicKey(const publicKeyEntry_t *e, bool encrypt, EVP_PKEY **ppKey, EVP_PKEY_CTX **ppCtx) {
+    EVP_PKEY_CTX *pTemplate = encrypt ? e->pEncryptCtx : e->pVerifyCtx;
+
+    if (pTemplate == NULL) return CKR_KEY_TYPE_INCONSISTENT;
+    if ((*ppCtx = EVP_PKEY_CTX_dup(pTemplate)) == NULL) return CKR_HOST_MEMORY;
+    if (1 != EVP_PKEY_up_ref(e->pKey)) {
+        EVP_PKEY_CTX_free(*ppCtx);
+        *ppCtx = NULL;
+        return CKR_DEVICE_ERROR;
+    }
+    *ppKey = e->pKey;
+    return CKR_OK;
+}
+
+
+// Returns a reference to the key of a public key object and a copy of its
+// verify or encrypt context, the caller frees both.
+static CK_RV getPublicKey(CK_OBJECT_HANDLE hObject, bool encrypt, EVP_PKEY **ppKey, EVP_PKEY_CTX **ppCtx) {
+    uint64_t version = db->version(), writes = db->writeCount();
+    publicKeyEntry_t e;
+    CK_RV rv;
+
+    *ppKey = NULL;
+    *ppCtx = NULL;
+    {
+        LibraryLock lock(publicKeysLock);
+        if ((rv = lock.rv()) != CKR_OK) return rv;
+        auto it = publicKeyIndex.find(hObject);
+        if (it != publicKeyIndex.end()) {
+            if (version != 0 && it->second->version == version) {
+                publicKeyLru.splice(publicKeyLru.begin(), publicKeyLru, it->second);
+                return refPublicKey(&*it->second, encrypt, ppKey, ppCtx);
+            }
+            evictPublicKey(it->second);
+        }
+    }
+    if ((rv = newPublicKeyEntry(hObject, version, &e)) != CKR_OK) return rv;
+    rv = refPublicKey(&e, encrypt, ppKey, ppCtx);
+    {
+        LibraryLock lock(publicKeysLock);
+        if (lock.rv() == CKR_OK && version != 0 && maxPublicKeys > 0 && db->writeCount() == writes && publicKeyIndex.count(hObject) == 0) {
+            publicKeyLru.push_front(e);
+            publicKeyIndex[hObject] = publicKeyLru.begin();
+            while (publicKeyLru.size() > maxPublicKeys) evictPublicKey(std::prev(publicKeyLru.end()));
+            return rv;
+        }
+    }
+    freePublicKeyEntry(&e);
+    return rv;
+}
+
+
+static CK_RV forgetPublicKey(CK_OBJECT_HANDLE hObject) {
+    LibraryLock lock(publicKeysLock);
+    if (lock.rv() != CKR_OK) return lock.rv();
+    auto it = publicKeyIndex.find(hObject);
+    if (it != publicKeyIndex.end()) evictPublicKey(it->second);
+    return lock.unlock();
+}
+
+
+static void freePublicKeys(void) {
+    LibraryLock lock(publicKeysLock);
+    while (!publicKeyLru.empty()) evictPublicKey(publicKeyLru.begin());
+}
+
+
+// PKCS_SGX_RSA_POOL lists the enclave RSA key pools as
+// bits:depth[:exponent],... e.g. "3072:8,4096:4:65537"
+static int configureRSAPools(const std::string &pools)
+{
+    std::istringstream ss(pools);
+    std::string pool;
+
+    while (std::getline(ss, pool, ',')) {
+        std::istringstream ps(pool);
+        size_t bits, depth;
+        unsigned long exponent = RSA_F4;
+        uint8_t e[sizeof exponent];
+        char sep;
+
+        if (!(ps >> bits >> sep) || sep != ':' || !(ps >> depth)) return -1;
+        if (ps >> sep && (sep != ':' || !(ps >> exponent))) return -1;
+        for (size_t i = 0; i < sizeof e; i++) e[i] = (uint8_t) (exponent >> (8 * (sizeof e - 1 - i)));
+        if (crypto->ConfigureRSAPool(bits, e, sizeof e, depth)) return -1;
+    }
+    return 0;
+}
+
+
+// PKCS_SGX_EC_POOL lists the enclave ECDSA precomputation pools as
+// curve:depth,... e.g. "prime256v1:256"
+static int configureECPools(const std::string &pools)
+{
+    std::istringstream ss(pools);
+    std::string pool;
+
+    while (std::getline(ss, pool, ',')) {
+        size_t sep = pool.find(':');
+        size_t depth;
+
+        if (sep == std::string::npos) return -1;
+        std::istringstream ps(pool.substr(sep + 1));
+        if (!(ps >> depth)) return -1;
+        if (crypto->ConfigureECPool(pool.substr(0, sep).c_str(), depth)) return -1;
+    }
+    return 0;
+}
+
+
+static CK_RV configureLocking(CK_C_INITIALIZE_ARGS_PTR pArgs)
+{
+    lockFunctions = osLocking;
+    if (pArgs == NULL) return CKR_OK;
+    if (pArgs->pReserved != NULL) return CKR_ARGUMENTS_BAD;
+    int nrFunctions = (pArgs->CreateMutex != NULL) + (pArgs->DestroyMutex != NULL) +
+        (pArgs->LockMutex != NULL) + (pArgs->UnlockMutex != NULL);
+    if (nrFunctions != 0 && nrFunctions != 4) return CKR_ARGUMENTS_BAD;
+    // With CKF_OS_LOCKING_OK the native locking is preferred
+    if (nrFunctions == 4 && !(pArgs->flags & CKF_OS_LOCKING_OK)) {
+        lockFunctions = *pArgs;
+    }
+    return CKR_OK;
+}
+
+
+static CK_RV createLibraryMutexes()
+{
+    CK_RV rv;
+
+    if ((rv = sessionsLock.create()) != CKR_OK) return rv;
+    if ((rv = publicKeysLock.create()) != CKR_OK) return rv;
+    if ((rv = objectsLock.create()) != CKR_OK) return rv;
+    if ((rv = sessionObjectsLock.create()) != CKR_OK) return rv;
+    return curveGroupsLock.create();
+}
+
+
+static void destroyLibraryMutexes()
+{
+    sessionsLock.destroy();
+    publicKeysLock.destroy();
+    objectsLock.destroy();
+    sessionObjectsLock.destroy();
+    curveGroupsLock.destroy();
+}
+
+
 CK_DEFINE_FUNCTION(CK_RV, C_Initialize)(CK_VOID_PTR pInitArgs)
 {
+    CK_C_INITIALIZE_ARGS_PTR pArgs = (CK_C_INITIALIZE_ARGS_PTR) pInitArgs;
+    CK_RV rv;
+
 	if (crypto != NULL)
         return CKR_CRYPTOKI_ALREADY_INITIALIZED;
 
+    if ((rv = configureLocking(pArgs)) != CKR_OK)
+        return rv;
+    if ((rv = createLibraryMutexes()) != CKR_OK) {
+        destroyLibraryMutexes();
+        return rv;
+    }
+
+    SwitchlessConfig switchless = {
+        GetEnv<uint32_t>((const char *)"PKCS_SGX_SWITCHLESS_TWORKERS", DEFAULT_SWITCHLESS_TWORKERS),
+        GetEnv<uint32_t>((const char *)"PKCS_SGX_SWITCHLESS_UWORKERS", DEFAULT_SWITCHLESS_UWORKERS),
+        GetEnv<uint32_t>((const char *)"PKCS_SGX_SWITCHLESS_RETRIES_FALLBACK", DEFAULT_SWITCHLESS_RETRIES_FALLBACK),
+        GetEnv<uint32_t>((const char *)"PKCS_SGX_SWITCHLESS_RETRIES_SLEEP", DEFAULT_SWITCHLESS_RETRIES_SLEEP),
+    };
+    std::string rsaPools = GetEnv<std::string>((const char *)"PKCS_SGX_RSA_POOL", "");
+    std::string ecPools = GetEnv<std::string>((const char *)"PKCS_SGX_EC_POOL", "");
+    // Switchless workers and the enclave pool worker are threads of our own
+    if (pArgs && (pArgs->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS) &&
+            (switchless.trustedWorkers || switchless.untrustedWorkers || !rsaPools.empty() || !ecPools.empty())) {
+        destroyLibraryMutexes();
+        return CKR_NEED_TO_CREATE_THREADS;
+    }
 	try {
-		crypto = new CryptoEntity();
+		crypto = new CryptoEntity(&switchless, GetEnv<size_t>((const char *)"PKCS_SGX_THREADS", DEFAULT_ENCLAVE_THREADS),
+			pArgs && (pArgs->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS));
 	}
 	catch (std::runtime_error) {
+        destroyLibraryMutexes();
 		return CKR_DEVICE_ERROR;
 	}
     // Set the slots, slots are simulated
     // Should be environment variable configurable
     max_slots =  GetEnv<int>((const char *)"PKCS_SGX_MAX_SLOTS", DEFAULT_NR_SLOTS);
-    const char *dbFileName = GetEnv<std::string>((const char *)"PKCS_DB_NAME", DEFAULT_DB_NAME).c_str();
+    std::string dbFileName = GetEnv<std::string>((const char *)"PKCS_DB_NAME", DEFAULT_DB_NAME);
 	try {
-		db = new Database(dbFileName);
+		db = new Database(dbFileName.c_str(), GetEnv<unsigned int>((const char *)"PKCS_SGX_DB_VERSION_INTERVAL_MS", DEFAULT_DB_VERSION_INTERVAL_MS));
 	}
 	catch (std::runtime_error) {
-		return CKR_DEVICE_ERROR;
+		goto C_Initialize_err;
 	}
     if (db->IsNewDatabase()) {
         size_t rootKeyLength = crypto->GetSealedRootKeySize();
@@ -178,36 +1036,63 @@ CK_DEFINE_FUNCTION(CK_RV, C_Initialize)(CK_VOID_PTR pInitArgs)
             crypto->GenerateRootKey(rootKey, &rootKeyLength);
         }
         catch (std::runtime_error) {
-            return CKR_DEVICE_ERROR;
+            goto C_Initialize_err;
         }
         if (db->SetRootKey(rootKey, rootKeyLength)) {
-            return CKR_DEVICE_ERROR;
+            goto C_Initialize_err;
         }
     } else {
 		size_t rootKeyLength;
         uint8_t *rootKey;
+        int failed;
 
 		if (NULL == (rootKey = db->GetRootKey(rootKeyLength)))
-            return CKR_DEVICE_ERROR;
+            goto C_Initialize_err;
         try {
-            if (crypto->RestoreRootKey(rootKey, rootKeyLength)) {
-                return CKR_DEVICE_ERROR;
-            }
+            failed = crypto->RestoreRootKey(rootKey, rootKeyLength);
 		}
         catch (std::runtime_error) {
-            return CKR_DEVICE_ERROR;
+            failed = 1;
         }
         free(rootKey);
+        if (failed)
+            goto C_Initialize_err;
     }
+    if (crypto->GetStateKey(stateKey, sizeof stateKey))
+        goto C_Initialize_err;
+    if (crypto->ConfigureKeyCache(
+            GetEnv<size_t>((const char *)"PKCS_SGX_KEY_CACHE_ENTRIES", DEFAULT_KEY_CACHE_ENTRIES),
+            GetEnv<size_t>((const char *)"PKCS_SGX_KEY_CACHE_BYTES", DEFAULT_KEY_CACHE_BYTES)))
+        goto C_Initialize_err;
+    maxObjects = GetEnv<size_t>((const char *)"PKCS_SGX_OBJECT_CACHE_ENTRIES", DEFAULT_OBJECT_CACHE_ENTRIES);
+    maxPublicKeys = GetEnv<size_t>((const char *)"PKCS_SGX_PUBLIC_KEY_CACHE_ENTRIES", DEFAULT_PUBLIC_KEY_CACHE_ENTRIES);
+    if (configureRSAPools(rsaPools))
+        goto C_Initialize_err;
+    if (configureECPools(ecPools))
+        goto C_Initialize_err;
 	return CKR_OK;
+
+C_Initialize_err:
+    delete(db);
+    db = NULL;
+    delete(crypto);
+    crypto = NULL;
+    destroyLibraryMutexes();
+	return CKR_DEVICE_ERROR;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_Finalize)(CK_VOID_PTR pReserved)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
     delete(db);
+    db = NULL;
     delete(crypto);
     crypto = NULL;
+    freeSessionTable();
+    freePublicKeys();
+    objectCacheFlush();
+    freeCurveGroups();
+    destroyLibraryMutexes();
 	return CKR_OK;
 }
 
@@ -267,9 +1152,6 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetSlotInfo)(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pIn
 	return CKR_OK;
 }
 
-#define MAX_SESSION_COUNT 100
-#define MAX_RW_SESSION_COUNT 100
-
 CK_DEFINE_FUNCTION(CK_RV, C_GetTokenInfo)(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
@@ -286,12 +1168,20 @@ CK_MECHANISM_TYPE mechanismList[] = {
     // RSA
     CKM_RSA_PKCS_KEY_PAIR_GEN,
     CKM_RSA_PKCS,
+    CKM_SHA1_RSA_PKCS,
     CKM_SHA256_RSA_PKCS,
     CKM_SHA384_RSA_PKCS,
     CKM_SHA512_RSA_PKCS,
     // EC
     CKM_EC_KEY_PAIR_GEN,
     CKM_ECDSA,
+    CKM_ECDSA_SHA1,
+    // Digest
+    CKM_SHA_1,
+    CKM_SHA224,
+    CKM_SHA256,
+    CKM_SHA384,
+    CKM_SHA512,
 };
 
 
@@ -321,6 +1211,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetMechanismInfo)(CK_SLOT_ID slotID, CK_MECHANISM_TY
     switch (type) {
         case CKM_RSA_PKCS:
         case CKM_RSA_PKCS_KEY_PAIR_GEN:
+        case CKM_SHA1_RSA_PKCS:
         case CKM_SHA256_RSA_PKCS:
         case CKM_SHA384_RSA_PKCS:
         case CKM_SHA512_RSA_PKCS:
@@ -331,9 +1222,19 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetMechanismInfo)(CK_SLOT_ID slotID, CK_MECHANISM_TY
             pInfo->ulMaxKeySize = RSA_MAX_KEY_SIZE;
             break;
         case CKM_EC_KEY_PAIR_GEN:
+        case CKM_ECDSA:
+        case CKM_ECDSA_SHA1:
             pInfo->ulMinKeySize = EC_MIN_KEY_SIZE;
             pInfo->ulMaxKeySize = EC_MAX_KEY_SIZE;
             break;
+        case CKM_SHA_1:
+        case CKM_SHA224:
+        case CKM_SHA256:
+        case CKM_SHA384:
+        case CKM_SHA512:
+            pInfo->ulMinKeySize = 0;
+            pInfo->ulMaxKeySize = 0;
+            break;
         default:
             return CKR_MECHANISM_INVALID;
     }
@@ -384,7 +1285,7 @@ InitToken_err:
 CK_DEFINE_FUNCTION(CK_RV, C_InitPIN)(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
@@ -392,7 +1293,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_InitPIN)(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR
 
 CK_DEFINE_FUNCTION(CK_RV, C_SetPIN)(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldLen, CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen)
 {
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
@@ -410,10 +1311,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_OpenSession)(CK_SLOT_ID slotID, CK_FLAGS flags, CK_V
 	if (NULL == phSession)
 		return CKR_ARGUMENTS_BAD;
     CK_FLAGS rflags = flags & CKF_RW_SESSION ? CKS_RW_PUBLIC_SESSION : CKS_RO_PUBLIC_SESSION;
-    sessions[sessionHandleCnt] = {slotID, rflags};
-    *phSession = sessionHandleCnt;
-    sessionHandleCnt++;
-	return CKR_OK;
+	return newSession(slotID, rflags, phSession);
 }
 
 
@@ -421,22 +1319,23 @@ CK_DEFINE_FUNCTION(CK_RV, C_CloseSession)(CK_SESSION_HANDLE hSession)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
-    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
-    sessions.erase(hSession);
-	return CKR_OK;
+	return closeSession(hSession);
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_CloseAllSessions)(CK_SLOT_ID slotID)
 {
-	sessions.clear();
-	return CKR_OK;
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+	if (slotID >= max_slots)
+		return CKR_SLOT_ID_INVALID;
+
+	return closeSessions(slotID, false);
 }
 
 
 CK_DEFINE_FUNCTION(CK_RV, C_GetSessionInfo)(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo)
 {
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 	pInfo->slotID = s->slotID;
 	pInfo->flags = s->flags;
@@ -444,49 +1343,314 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetSessionInfo)(CK_SESSION_HANDLE hSession, CK_SESSI
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetOperationState)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG_PTR pulOperationStateLen)
+static CK_RV signInit(pkcs11_session_t *s, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey);
+static CK_RV verifyInit(pkcs11_session_t *s, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey);
+static CK_RV digestInit(pkcs11_session_t *s, CK_MECHANISM_PTR pMechanism);
+
+#define OPERATION_STATE_MAGIC 0x53475331
+#define OPERATION_STATE_VERSION 1
+
+static void storeBE32(uint8_t *p, uint32_t v)
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
 }
 
-
-CK_DEFINE_FUNCTION(CK_RV, C_SetOperationState)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG ulOperationStateLen, CK_OBJECT_HANDLE hEncryptionKey, CK_OBJECT_HANDLE hAuthenticationKey)
+static void storeBE64(uint8_t *p, uint64_t v)
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+    storeBE32(p, v >> 32);
+    storeBE32(p + 4, (uint32_t) v);
 }
 
+static uint32_t loadBE32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
 
-CK_DEFINE_FUNCTION(CK_RV, C_Login)(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
+static uint64_t loadBE64(const uint8_t *p)
 {
-    pkcs11_session_t *s;
-    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+    return (uint64_t) loadBE32(p) << 32 | loadBE32(p + 4);
+}
 
-    // Do not require any PIN
-    switch (userType) {
-        case CKU_SO:
-            break;
-        case CKU_USER:
-            break;
+// Midstate of a running hash of the given digest type, taken from the public
+// fields of its OpenSSL context: the chaining words, the bit count Nl/Nh,
+// the number of pending bytes and the pending bytes, all big-endian. ctx is
+// the SHA_CTX, SHA256_CTX or SHA512_CTX of type. Returns the length
+// written, out may be NULL to ask for it, and 0 for an unknown type.
+static size_t hashSerialize(int type, const void *ctx, uint8_t *out)
+{
+    switch (type) {
+        case NID_sha1: {
+            const SHA_CTX *c = (const SHA_CTX *) ctx;
+            const SHA_LONG h[] = { c->h0, c->h1, c->h2, c->h3, c->h4, c->Nl, c->Nh };
+            if (out) {
+                for (size_t i = 0; i < sizeof h / sizeof *h; i++) storeBE32(out + 4 * i, h[i]);
+                storeBE32(out + sizeof h, c->num);
+                memcpy(out + sizeof h + 4, c->data, c->num);
+            }
+            return sizeof h + 4 + c->num;
+        }
+        case NID_sha224:
+        case NID_sha256: {
+            const SHA256_CTX *c = (const SHA256_CTX *) ctx;
+            if (out) {
+                for (size_t i = 0; i < 8; i++) storeBE32(out + 4 * i, c->h[i]);
+                storeBE32(out + 32, c->Nl);
+                storeBE32(out + 36, c->Nh);
+                storeBE32(out + 40, c->num);
+                memcpy(out + 44, c->data, c->num);
+            }
+            return 44 + c->num;
+        }
+        case NID_sha384:
+        case NID_sha512: {
+            const SHA512_CTX *c = (const SHA512_CTX *) ctx;
+            if (out) {
+                for (size_t i = 0; i < 8; i++) storeBE64(out + 8 * i, c->h[i]);
+                storeBE64(out + 64, c->Nl);
+                storeBE64(out + 72, c->Nh);
+                storeBE32(out + 80, c->num);
+                memcpy(out + 84, c->u.p, c->num);
+            }
+            return 84 + c->num;
+        }
         default:
-            return CKR_USER_TYPE_INVALID;
+            return 0;
     }
-	return CKR_OK;
 }
 
-
-CK_DEFINE_FUNCTION(CK_RV, C_Logout)(CK_SESSION_HANDLE hSession)
+// Loads what hashSerialize wrote into ctx, initialized for type before. The
+// pending byte count must agree with the bit count.
+static int hashDeserialize(int type, void *ctx, const uint8_t *in, size_t inLen)
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+    uint32_t num;
+
+    switch (type) {
+        case NID_sha1: {
+            SHA_CTX *c = (SHA_CTX *) ctx;
+            if (inLen < 32 || (num = loadBE32(in + 28)) >= SHA_CBLOCK || inLen != 32 + num) return -1;
+            c->h0 = loadBE32(in);
+            c->h1 = loadBE32(in + 4);
+            c->h2 = loadBE32(in + 8);
+            c->h3 = loadBE32(in + 12);
+            c->h4 = loadBE32(in + 16);
+            c->Nl = loadBE32(in + 20);
+            c->Nh = loadBE32(in + 24);
+            if ((c->Nl >> 3) % SHA_CBLOCK != num) return -1;
+            c->num = num;
+            memcpy(c->data, in + 32, num);
+            return 0;
+        }
+        case NID_sha224:
+        case NID_sha256: {
+            SHA256_CTX *c = (SHA256_CTX *) ctx;
+            if (inLen < 44 || (num = loadBE32(in + 40)) >= SHA256_CBLOCK || inLen != 44 + num) return -1;
+            for (size_t i = 0; i < 8; i++) c->h[i] = loadBE32(in + 4 * i);
+            c->Nl = loadBE32(in + 32);
+            c->Nh = loadBE32(in + 36);
+            if ((c->Nl >> 3) % SHA256_CBLOCK != num) return -1;
+            c->num = num;
+            memcpy(c->data, in + 44, num);
+            return 0;
+        }
+        case NID_sha384:
+        case NID_sha512: {
+            SHA512_CTX *c = (SHA512_CTX *) ctx;
+            if (inLen < 84 || (num = loadBE32(in + 80)) >= SHA512_CBLOCK || inLen != 84 + num) return -1;
+            for (size_t i = 0; i < 8; i++) c->h[i] = loadBE64(in + 8 * i);
+            c->Nl = loadBE64(in + 64);
+            c->Nh = loadBE64(in + 72);
+            if ((c->Nl >> 3) % SHA512_CBLOCK != num) return -1;
+            c->num = num;
+            memcpy(c->u.p, in + 84, num);
+            return 0;
+        }
+        default:
+            return -1;
+    }
 }
 
+// A saved operation state is, big-endian: magic, version, operation (4
+// bytes each), mechanism, key handle (8 bytes each), the length and
+// midstate of the running hash, the length and data buffered by a raw
+// mechanism, then an HMAC-SHA256 of all of it under stateKey. It holds no
+// secrets, the private key stays in the key object.
+#define OPERATION_STATE_HEADER (4 + 4 + 4 + 8 + 8 + 4)
 
-CK_DEFINE_FUNCTION(CK_RV, C_CreateObject)(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phObject)
+
+// The SHA context of the running hash. A verify hashes inside its
+// EVP_DigestVerify context, OpenSSL 1.1 keeps the SHA context there as the
+// md_data; NULL where it does not.
+static void *operationHash(pkcs11_session_t *s, uint32_t operation)
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	if (operation == PKCS11_CK_OPERATION_VERIFY)
+		return s->mdCtx ? EVP_MD_CTX_md_data(s->mdCtx) : NULL;
+	return &s->hash.ctx;
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_CopyObject)(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phNewObject)
+CK_DEFINE_FUNCTION(CK_RV, C_GetOperationState)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG_PTR pulOperationStateLen)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (NULL == pulOperationStateLen)
+		return CKR_ARGUMENTS_BAD;
+
+	switch (s->operation) {
+		case PKCS11_CK_OPERATION_NONE:
+			return CKR_OPERATION_NOT_INITIALIZED;
+		case PKCS11_CK_OPERATION_SIGN:
+		case PKCS11_CK_OPERATION_VERIFY:
+		case PKCS11_CK_OPERATION_DIGEST:
+			break;
+		default:
+			return CKR_STATE_UNSAVEABLE;
+	}
+	if (s->partLen > UINT32_MAX)
+		return CKR_STATE_UNSAVEABLE;
+	void *hash = NULL;
+	if (s->operationMd && NULL == (hash = operationHash(s, s->operation)))
+		return CKR_STATE_UNSAVEABLE;
+	size_t hashLen = hash ? hashSerialize(EVP_MD_type(s->operationMd), hash, NULL) : 0;
+	CK_ULONG stateLen = OPERATION_STATE_HEADER + hashLen + 4 + s->partLen + SHA256_DIGEST_LENGTH;
+	if (NULL == pOperationState) {
+		*pulOperationStateLen = stateLen;
+		return CKR_OK;
+	}
+	if (*pulOperationStateLen < stateLen) {
+		*pulOperationStateLen = stateLen;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	uint8_t *p = pOperationState;
+	storeBE32(p, OPERATION_STATE_MAGIC);
+	storeBE32(p + 4, OPERATION_STATE_VERSION);
+	storeBE32(p + 8, s->operation);
+	storeBE64(p + 12, s->operationMechanismType);
+	storeBE64(p + 20, s->operationKeyHandle);
+	storeBE32(p + 28, hashLen);
+	p += OPERATION_STATE_HEADER;
+	if (hashLen) p += hashSerialize(EVP_MD_type(s->operationMd), hash, p);
+	storeBE32(p, s->partLen);
+	p += 4;
+	if (s->partLen) memcpy(p, s->part, s->partLen);
+	if (NULL == HMAC(EVP_sha256(), stateKey, sizeof stateKey, pOperationState, stateLen - SHA256_DIGEST_LENGTH,
+			pOperationState + stateLen - SHA256_DIGEST_LENGTH, NULL))
+		return CKR_DEVICE_ERROR;
+	*pulOperationStateLen = stateLen;
+	return CKR_OK;
+}
+
+
+// The operation is set up again from the saved mechanism and key, a non-zero
+// hAuthenticationKey takes the place of the saved key handle.
+CK_DEFINE_FUNCTION(CK_RV, C_SetOperationState)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG ulOperationStateLen, CK_OBJECT_HANDLE hEncryptionKey, CK_OBJECT_HANDLE hAuthenticationKey)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (NULL == pOperationState)
+		return CKR_ARGUMENTS_BAD;
+	if (CK_INVALID_HANDLE != hEncryptionKey)
+		return CKR_KEY_NOT_NEEDED;
+
+	uint8_t mac[SHA256_DIGEST_LENGTH];
+	if (ulOperationStateLen < OPERATION_STATE_HEADER + 4 + sizeof mac)
+		return CKR_SAVED_STATE_INVALID;
+	if (NULL == HMAC(EVP_sha256(), stateKey, sizeof stateKey, pOperationState, ulOperationStateLen - sizeof mac, mac, NULL))
+		return CKR_DEVICE_ERROR;
+	if (CRYPTO_memcmp(mac, pOperationState + ulOperationStateLen - sizeof mac, sizeof mac))
+		return CKR_SAVED_STATE_INVALID;
+
+	const uint8_t *p = pOperationState;
+	CK_ULONG left = ulOperationStateLen - sizeof mac - OPERATION_STATE_HEADER;
+	if (OPERATION_STATE_MAGIC != loadBE32(p) || OPERATION_STATE_VERSION != loadBE32(p + 4))
+		return CKR_SAVED_STATE_INVALID;
+	uint32_t operation = loadBE32(p + 8);
+	CK_MECHANISM mechanism = { (CK_MECHANISM_TYPE) loadBE64(p + 12), NULL, 0 };
+	CK_OBJECT_HANDLE hKey = CK_INVALID_HANDLE != hAuthenticationKey ? hAuthenticationKey : (CK_OBJECT_HANDLE) loadBE64(p + 20);
+	uint32_t hashLen = loadBE32(p + 28);
+	if (hashLen > left - 4)
+		return CKR_SAVED_STATE_INVALID;
+	const uint8_t *pHash = p + OPERATION_STATE_HEADER;
+	uint32_t partLen = loadBE32(pHash + hashLen);
+	const uint8_t *pPart = pHash + hashLen + 4;
+	if (partLen != left - 4 - hashLen)
+		return CKR_SAVED_STATE_INVALID;
+
+	CK_RV rv;
+	// Whatever was going on in the session is abandoned
+	s->operation = PKCS11_CK_OPERATION_NONE;
+	switch (operation) {
+		case PKCS11_CK_OPERATION_SIGN:
+			rv = signInit(s, &mechanism, hKey);
+			break;
+		case PKCS11_CK_OPERATION_VERIFY:
+			rv = verifyInit(s, &mechanism, hKey);
+			break;
+		case PKCS11_CK_OPERATION_DIGEST:
+			rv = digestInit(s, &mechanism);
+			break;
+		default:
+			return CKR_SAVED_STATE_INVALID;
+	}
+	if (rv != CKR_OK) return rv;
+	if (s->operationMd) {
+		void *hash = operationHash(s, operation);
+		if (NULL == hash || hashDeserialize(EVP_MD_type(s->operationMd), hash, pHash, hashLen))
+			return CKR_SAVED_STATE_INVALID;
+	} else if (hashLen) {
+		return CKR_SAVED_STATE_INVALID;
+	}
+	if (s->part) free(s->part);
+	s->part = NULL;
+	s->partLen = 0;
+	if (partLen) {
+		if (NULL == (s->part = (uint8_t *) malloc(partLen)))
+			return CKR_HOST_MEMORY;
+		memcpy(s->part, pPart, partLen);
+		s->partLen = partLen;
+	}
+	s->operation = (PKCS_OPERATION) operation;
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_Login)(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+    // Do not require any PIN
+    switch (userType) {
+        case CKU_SO:
+            break;
+        case CKU_USER:
+            break;
+        default:
+            return CKR_USER_TYPE_INVALID;
+    }
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_Logout)(CK_SESSION_HANDLE hSession)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_CreateObject)(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phObject)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_CopyObject)(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phNewObject)
 {
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
@@ -498,58 +1662,53 @@ CK_DEFINE_FUNCTION(CK_RV, C_DestroyObject)(CK_SESSION_HANDLE hSession, CK_OBJECT
 
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
+    if (isSessionObject(hObject)) return destroySessionObject(hObject);
     if (0 > (err = db->deleteObject(hObject))) {
         return CKR_OBJECT_HANDLE_INVALID;
     }
-	return CKR_OK;
+    CK_RV rv = forgetPublicKey(hObject), rvForget = objectCacheForget(hObject);
+	return rv != CKR_OK ? rv : rvForget;
 }
 
 
 CK_DEFINE_FUNCTION(CK_RV, C_GetObjectSize)(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ULONG_PTR pulSize)
 {
-	uint8_t *pValue = NULL;
-	size_t valueLength;
-	CK_ATTRIBUTE *pAttributes = NULL;
-	CK_ULONG attributeCount;
-    int rc;
+	object_record_t *r;
 
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
-    if (0 > (rc =db->getObject(hObject, &pValue, valueLength, &pAttributes, attributeCount))) {
+    if ((r = objectCacheGet(hObject)) == NULL) {
         return CKR_DEVICE_ERROR;
     }
-	*pulSize = valueLength;
+	*pulSize = r->object.valueLength;
+	objectCachePut(r);
 	return CKR_OK;
 }
 
 
 CK_DEFINE_FUNCTION(CK_RV, C_GetAttributeValue)(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
 {
-	uint8_t *pValue = NULL;
-	size_t valueLength;
-	CK_ATTRIBUTE *pAttributes = NULL;
-	CK_ULONG attributeCount;
-    int rc;
+	object_record_t *r;
 
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
-    if (0 > (rc =db->getObject(hObject, &pValue, valueLength, &pAttributes, attributeCount))) {
+    if ((r = objectCacheGet(hObject)) == NULL) {
         return CKR_DEVICE_ERROR;
     }
 
+	Attribute attr = Attribute(r->object.pAttributes, r->object.ulAttributeCount);
 	while(ulCount--) {
-		Attribute attr = Attribute(pAttributes, attributeCount);
 		CK_ATTRIBUTE *pAttr = attr.get(pTemplate->type);
-		if (pTemplate->pValue == NULL) {
+		if (pTemplate->pValue == NULL || pAttr == NULL) {
 			pTemplate->ulValueLen = pAttr == NULL ? CK_UNAVAILABLE_INFORMATION : pAttr->ulValueLen;
 		} else {
 			if (pTemplate->ulValueLen >= pAttr->ulValueLen) {
@@ -560,6 +1719,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetAttributeValue)(CK_SESSION_HANDLE hSession, CK_OB
 		}
 		pTemplate++;
 	}
+	objectCachePut(r);
 	return CKR_OK;
 }
 
@@ -570,24 +1730,44 @@ CK_DEFINE_FUNCTION(CK_RV, C_SetAttributeValue)(CK_SESSION_HANDLE hSession, CK_OB
 }
 
 
+// Copies a template into a single allocation
+static CK_ATTRIBUTE_PTR copyTemplate(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+    size_t size = sizeof *pTemplate * ulCount;
+    CK_ATTRIBUTE_PTR pCopy;
+    uint8_t *p;
+
+    for (CK_ULONG i = 0; i < ulCount; i++) size += pTemplate[i].ulValueLen;
+    if ((pCopy = (CK_ATTRIBUTE_PTR) malloc(size ? size : 1)) == NULL) return NULL;
+    p = (uint8_t *) (pCopy + ulCount);
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        pCopy[i] = pTemplate[i];
+        if (pTemplate[i].ulValueLen) memcpy(p, pTemplate[i].pValue, pTemplate[i].ulValueLen);
+        pCopy[i].pValue = p;
+        p += pTemplate[i].ulValueLen;
+    }
+    return pCopy;
+}
+
+
 CK_DEFINE_FUNCTION(CK_RV, C_FindObjectsInit)(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
 	if (PKCS11_CK_OPERATION_NONE != s->operation)
 		return CKR_OPERATION_ACTIVE;
+	if (NULL == pTemplate && ulCount > 0)
+		return CKR_ARGUMENTS_BAD;
 
-    if (s->FindObject.hObject != NULL) free(s->FindObject.hObject);
-    s->operation = PKCS11_CK_OPERATION_FIND;
-    int nrItems = 0;
-    s->FindObject.hObject = db->getObjectIds(pTemplate, ulCount, nrItems);
-    if (nrItems < 0) {
-        return CKR_DEVICE_ERROR;
+    if (s->FindObject.pTemplate) free(s->FindObject.pTemplate);
+    if ((s->FindObject.pTemplate = copyTemplate(pTemplate, ulCount)) == NULL) {
+        return CKR_HOST_MEMORY;
     }
-    s->FindObject.ulObjectCount = nrItems;
+    s->FindObject.ulCount = ulCount;
+    s->FindObject.hLast = 0;
     s->operation = PKCS11_CK_OPERATION_FIND;
 	return CKR_OK;
 }
@@ -597,17 +1777,31 @@ CK_DEFINE_FUNCTION(CK_RV, C_FindObjects)(CK_SESSION_HANDLE hSession, CK_OBJECT_H
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
     if (PKCS11_CK_OPERATION_FIND != s->operation)
         return CKR_OPERATION_NOT_INITIALIZED;
 
-    if (NULL == phObject) {
-        *pulObjectCount = s->FindObject.ulObjectCount;
-    } else {
-        memcpy(phObject, s->FindObject.hObject, std::min(ulMaxObjectCount, s->FindObject.ulObjectCount) * sizeof *phObject);
+    if (NULL == phObject || NULL == pulObjectCount)
+        return CKR_ARGUMENTS_BAD;
+
+    CK_ULONG ulFound = 0;
+    *pulObjectCount = 0;
+    if (ulMaxObjectCount == 0) return CKR_OK;
+    // Token objects come first, their handles are below the session objects
+    if (!isSessionObject(s->FindObject.hLast)) {
+        if (db->findObjects(s->FindObject.pTemplate, s->FindObject.ulCount, s->FindObject.hLast, phObject, ulMaxObjectCount, *pulObjectCount)) {
+            return CKR_DEVICE_ERROR;
+        }
     }
+    CK_RV rv = findSessionObjects(s->FindObject.pTemplate, s->FindObject.ulCount, s->FindObject.hLast, phObject + *pulObjectCount, ulMaxObjectCount - *pulObjectCount, ulFound);
+    if (rv != CKR_OK) {
+        *pulObjectCount = 0;
+        return rv;
+    }
+    *pulObjectCount += ulFound;
+    if (*pulObjectCount > 0) s->FindObject.hLast = phObject[*pulObjectCount - 1];
     return CKR_OK;
 }
 
@@ -615,13 +1809,14 @@ CK_DEFINE_FUNCTION(CK_RV, C_FindObjectsFinal)(CK_SESSION_HANDLE hSession)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
 
     if (NULL == (s = get_session(hSession))) return CKR_SESSION_HANDLE_INVALID;
 
-    if (s->FindObject.hObject) free(s->FindObject.hObject);
-    s->FindObject.hObject = NULL;
-    s->FindObject.ulObjectCount = 0;
+    if (s->FindObject.pTemplate) free(s->FindObject.pTemplate);
+    s->FindObject.pTemplate = NULL;
+    s->FindObject.ulCount = 0;
+    s->FindObject.hLast = 0;
 
     if (PKCS11_CK_OPERATION_FIND != s->operation) {
         return CKR_OPERATION_NOT_INITIALIZED;
@@ -634,7 +1829,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_EncryptInit)(CK_SESSION_HANDLE hSession, CK_MECHANIS
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
 	if (PKCS11_CK_OPERATION_NONE != s->operation)
@@ -655,14 +1850,10 @@ CK_DEFINE_FUNCTION(CK_RV, C_EncryptInit)(CK_SESSION_HANDLE hSession, CK_MECHANIS
 		return CKR_MECHANISM_INVALID;
 	}
 
-    pkcs11_object_t *o = &s->operationObject;
-    if (o->pValue) free(o->pValue);
-    if (o->pAttributes) free(o->pAttributes);
-    memset(o, 0, sizeof *o);
-    int rc;
-    if (0 > (rc =db->getObject(hKey, &o->pValue, o->valueLength, &o->pAttributes, o->ulAttributeCount))) {
-        return CKR_DEVICE_ERROR;
-    }
+    CK_RV rv;
+    if (s->operationKey) EVP_PKEY_free(s->operationKey);
+    if (s->operationCtx) EVP_PKEY_CTX_free(s->operationCtx);
+    if ((rv = getPublicKey(hKey, true, &s->operationKey, &s->operationCtx)) != CKR_OK) return rv;
 	s->operation = PKCS11_CK_OPERATION_ENCRYPT;
     s->operationMechanismType = CKM_RSA_PKCS;
 	return CKR_OK;
@@ -673,16 +1864,11 @@ CK_DEFINE_FUNCTION(CK_RV, C_Encrypt)(CK_SESSION_HANDLE hSession,
 	CK_BYTE_PTR pData, CK_ULONG ulDataLen,
 	CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen) {
 
-    int len;
-	CK_RV ret = CKR_DEVICE_ERROR;
-    RSA *rsa = NULL;
-    EVP_PKEY *pKey = NULL;
-	int padding = RSA_PKCS1_PADDING;
-	const uint8_t *endptr;
+	size_t len;
 
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
 	if (PKCS11_CK_OPERATION_ENCRYPT != s->operation)
@@ -697,37 +1883,16 @@ CK_DEFINE_FUNCTION(CK_RV, C_Encrypt)(CK_SESSION_HANDLE hSession,
 	if (NULL == pulEncryptedDataLen)
 		return CKR_ARGUMENTS_BAD;
 
-    Attribute attr = Attribute(s->operationObject.pAttributes, s->operationObject.ulAttributeCount);
-
-	if (*attr.getType<CK_OBJECT_CLASS>(CKA_CLASS) != CKO_PUBLIC_KEY) return CKR_KEY_HANDLE_INVALID;
-
-	CK_KEY_TYPE *pKeyType;
-    pKeyType = attr.getType<CK_KEY_TYPE>(CKA_KEY_TYPE);
-	switch (*pKeyType) {
-		case CKK_RSA:
-			if (NULL == (pKey = EVP_PKEY_new())) goto C_Encrypt_err;
-			endptr = s->operationObject.pValue;
-			if (NULL == (pKey = d2i_PUBKEY(&pKey, &endptr, s->operationObject.valueLength))) goto C_Encrypt_err;
-			if (NULL == (rsa = EVP_PKEY_get1_RSA(pKey))) goto C_Encrypt_err;
-
-			if (*pulEncryptedDataLen < (CK_ULONG) RSA_size(rsa)) goto C_Encrypt_err;
-
-			if (( len = RSA_public_encrypt(
-					ulDataLen, (uint8_t*)pData, (uint8_t*)pEncryptedData, rsa, padding)) < 0)
-				goto C_Encrypt_err;
+	if (*pulEncryptedDataLen < (CK_ULONG) EVP_PKEY_size(s->operationKey))
+		return CKR_DEVICE_ERROR;
 
-			*pulEncryptedDataLen = (CK_ULONG)len;
-			ret = CKR_OK;
-			s->operation = PKCS11_CK_OPERATION_NONE;
-			break;
-		default:
-			return CKR_KEY_HANDLE_INVALID;
-	}
-C_Encrypt_err:
-    if (rsa) RSA_free(rsa);
-	if (pKey) EVP_PKEY_free(pKey);
+	len = *pulEncryptedDataLen;
+	if (1 != EVP_PKEY_encrypt(s->operationCtx, pEncryptedData, &len, pData, ulDataLen))
+		return CKR_DEVICE_ERROR;
 
-    return ret;
+	*pulEncryptedDataLen = (CK_ULONG) len;
+	s->operation = PKCS11_CK_OPERATION_NONE;
+	return CKR_OK;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_EncryptUpdate)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
@@ -740,24 +1905,8 @@ CK_DEFINE_FUNCTION(CK_RV, C_EncryptFinal)(CK_SESSION_HANDLE hSession, CK_BYTE_PT
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+static CK_RV checkDecryptKey(CK_MECHANISM_PTR pMechanism, pkcs11_object_t *o)
 {
-	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
-
-    pkcs11_session_t *s;
-    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
-
-	if (PKCS11_CK_OPERATION_NONE != s->operation)
-		return CKR_OPERATION_ACTIVE;
-
-	if (NULL == pMechanism)
-		return CKR_ARGUMENTS_BAD;
-
-    pkcs11_object_t *o = &s->operationObject;
-    if (db->getObject(hKey, &o->pValue, o->valueLength, &o->pAttributes, o->ulAttributeCount)) {
-        return CKR_DEVICE_ERROR;
-    }
-
     Attribute a = Attribute(o->pAttributes, o->ulAttributeCount);
     CK_OBJECT_CLASS_PTR pObjectClass = a.getType<CK_OBJECT_CLASS>(CKA_CLASS);
     CK_KEY_TYPE *pKeyType = a.getType<CK_KEY_TYPE>(CKA_KEY_TYPE);
@@ -767,7 +1916,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(CK_SESSION_HANDLE hSession, CK_MECHANIS
         case CKM_RSA_PKCS: {
                 if ((NULL != pMechanism->pParameter) || (0 != pMechanism->ulParameterLen))
                     return CKR_MECHANISM_PARAM_INVALID;
-                if (*pObjectClass != CKO_PRIVATE_KEY || *pKeyType != CKK_RSA)
+                if (pObjectClass == NULL || pKeyType == NULL || *pObjectClass != CKO_PRIVATE_KEY || *pKeyType != CKK_RSA)
                     return CKR_OBJECT_HANDLE_INVALID;
             }
             break;
@@ -775,15 +1924,60 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(CK_SESSION_HANDLE hSession, CK_MECHANIS
         default:
             return CKR_MECHANISM_INVALID;
 	}
+    return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_NONE != s->operation)
+		return CKR_OPERATION_ACTIVE;
+
+	if (NULL == pMechanism)
+		return CKR_ARGUMENTS_BAD;
+
+    objectCachePut(s->operationRecord);
+    if ((s->operationRecord = objectCacheGet(hKey)) == NULL) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+    if ((s->operationRecord = migrateObject(s->operationRecord)) == NULL) {
+        return CKR_DEVICE_ERROR;
+    }
+    CK_RV rv = checkDecryptKey(pMechanism, &s->operationRecord->object);
+    if (rv != CKR_OK) return rv;
 	s->operation = PKCS11_CK_OPERATION_DECRYPT;
 	return CKR_OK;
 }
 
+static CK_RV decryptWithKey(object_record_t *r, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+    pkcs11_object_t *o = &r->object;
+    size_t dataLength = *pulDataLen;
+
+	try {
+		if (!crypto->RSADecrypt(o->pValue, o->valueLength, o->pSerialized, o->serializedLength, pEncryptedData, ulEncryptedDataLen, pData, &dataLength)) {
+            *pulDataLen = dataLength;
+            return pData == NULL ? CKR_OK : CKR_BUFFER_TOO_SMALL;
+        }
+	}
+	catch (std::runtime_error) {
+		return CKR_DEVICE_ERROR;
+	}
+    *pulDataLen = dataLength;
+	return CKR_OK;
+}
+
+
 CK_DEFINE_FUNCTION(CK_RV, C_Decrypt)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
 	if (PKCS11_CK_OPERATION_DECRYPT != s->operation)
@@ -798,27 +1992,9 @@ CK_DEFINE_FUNCTION(CK_RV, C_Decrypt)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEn
 	if (NULL == pulDataLen)
 		return CKR_ARGUMENTS_BAD;
 
-	try {
-        CK_ULONG resLength;
-        uint8_t *serialized_attr;
-        size_t attrLen;
-        Attribute attr = Attribute(s->operationObject.pAttributes, s->operationObject.ulAttributeCount);
-        serialized_attr = attr.serialize(&attrLen);
-		CK_BYTE_PTR res = crypto->RSADecrypt(s->operationObject.pValue, s->operationObject.valueLength, serialized_attr, attrLen, (const CK_BYTE*)pEncryptedData, (CK_ULONG) ulEncryptedDataLen, &resLength);
-        if (res == NULL) {
-            return CKR_DEVICE_ERROR;
-        }
-        if (resLength > *pulDataLen) {
-            free(res);
-            return CKR_BUFFER_TOO_SMALL;
-        }
-        memcpy(pData, res, resLength);
-        *pulDataLen = resLength;
-        free(res);
-	}
-	catch (std::runtime_error) {
-		return CKR_DEVICE_ERROR;
-	}
+	CK_RV rv = decryptWithKey(s->operationRecord, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+	if (rv != CKR_OK) return rv;
+	if (pData == NULL) return CKR_OK;
 
 	s->operation = PKCS11_CK_OPERATION_NONE;
 
@@ -832,7 +2008,7 @@ CK_RV partProcess(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSuppliedPart, CK_ULON
 
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
 	if (operation != s->operation)
@@ -857,7 +2033,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptUpdate)(CK_SESSION_HANDLE hSession, CK_BYTE_P
 CK_DEFINE_FUNCTION(CK_RV, C_DecryptFinal)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen)
 {
 	CK_RV ret;
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 	if (PKCS11_CK_OPERATION_DECRYPT != s->operation)
 		return CKR_OPERATION_NOT_INITIALIZED;
@@ -869,41 +2045,87 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptFinal)(CK_SESSION_HANDLE hSession, CK_BYTE_PT
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_DigestInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism)
+// The running hash of a multi-part operation keeps an explicit midstate so
+// that C_GetOperationState can save it
+static CK_RV hashInit(hash_state_t *h, const EVP_MD *md)
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+    int rc;
+
+    switch (h->type = EVP_MD_type(md)) {
+        case NID_sha1: rc = SHA1_Init(&h->ctx.sha1); break;
+        case NID_sha224: rc = SHA224_Init(&h->ctx.sha256); break;
+        case NID_sha256: rc = SHA256_Init(&h->ctx.sha256); break;
+        case NID_sha384: rc = SHA384_Init(&h->ctx.sha512); break;
+        case NID_sha512: rc = SHA512_Init(&h->ctx.sha512); break;
+        default: return CKR_MECHANISM_INVALID;
+    }
+    return rc == 1 ? CKR_OK : CKR_DEVICE_ERROR;
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_Digest)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+static CK_RV hashUpdate(hash_state_t *h, const void *pData, size_t dataLen)
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+    int rc;
+
+    switch (h->type) {
+        case NID_sha1: rc = SHA1_Update(&h->ctx.sha1, pData, dataLen); break;
+        case NID_sha224: rc = SHA224_Update(&h->ctx.sha256, pData, dataLen); break;
+        case NID_sha256: rc = SHA256_Update(&h->ctx.sha256, pData, dataLen); break;
+        case NID_sha384: rc = SHA384_Update(&h->ctx.sha512, pData, dataLen); break;
+        case NID_sha512: rc = SHA512_Update(&h->ctx.sha512, pData, dataLen); break;
+        default: return CKR_DEVICE_ERROR;
+    }
+    return rc == 1 ? CKR_OK : CKR_DEVICE_ERROR;
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_DigestUpdate)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+// digest must hold EVP_MAX_MD_SIZE bytes
+static CK_RV hashFinal(hash_state_t *h, uint8_t *digest, CK_ULONG *pulDigestLen)
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+    int rc;
+
+    switch (h->type) {
+        case NID_sha1: rc = SHA1_Final(digest, &h->ctx.sha1); *pulDigestLen = SHA_DIGEST_LENGTH; break;
+        case NID_sha224: rc = SHA224_Final(digest, &h->ctx.sha256); *pulDigestLen = SHA224_DIGEST_LENGTH; break;
+        case NID_sha256: rc = SHA256_Final(digest, &h->ctx.sha256); *pulDigestLen = SHA256_DIGEST_LENGTH; break;
+        case NID_sha384: rc = SHA384_Final(digest, &h->ctx.sha512); *pulDigestLen = SHA384_DIGEST_LENGTH; break;
+        case NID_sha512: rc = SHA512_Final(digest, &h->ctx.sha512); *pulDigestLen = SHA512_DIGEST_LENGTH; break;
+        default: return CKR_DEVICE_ERROR;
+    }
+    return rc == 1 ? CKR_OK : CKR_DEVICE_ERROR;
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_DigestKey)(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey)
-{
-	return CKR_FUNCTION_NOT_SUPPORTED;
-}
+typedef const EVP_MD* (*md_func_t)(void);
+
+static const std::map<CK_MECHANISM_TYPE, md_func_t> allowedDigestMechanisms = {
+	{ CKM_SHA_1, EVP_sha1 },
+	{ CKM_SHA224, EVP_sha224 },
+	{ CKM_SHA256, EVP_sha256 },
+	{ CKM_SHA384, EVP_sha384 },
+	{ CKM_SHA512, EVP_sha512 },
+};
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_DigestFinal)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+static CK_RV digestInit(pkcs11_session_t *s, CK_MECHANISM_PTR pMechanism)
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+    auto it = allowedDigestMechanisms.find(pMechanism->mechanism);
+
+    if (it == allowedDigestMechanisms.end()) return CKR_MECHANISM_INVALID;
+    if ((NULL != pMechanism->pParameter) || (0 != pMechanism->ulParameterLen))
+        return CKR_MECHANISM_PARAM_INVALID;
+    s->operationMd = it->second();
+    s->operationMechanismType = pMechanism->mechanism;
+    s->operationKeyHandle = CK_INVALID_HANDLE;
+    return hashInit(&s->hash, s->operationMd);
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_SignInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+CK_DEFINE_FUNCTION(CK_RV, C_DigestInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
 	if (PKCS11_CK_OPERATION_NONE != s->operation)
@@ -912,278 +2134,811 @@ CK_DEFINE_FUNCTION(CK_RV, C_SignInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_P
 	if (NULL == pMechanism)
 		return CKR_ARGUMENTS_BAD;
 
-    pkcs11_object_t *o = &s->operationObject;
-    if (db->getObject(hKey, &o->pValue, o->valueLength, &o->pAttributes, o->ulAttributeCount)) {
-        return CKR_DEVICE_ERROR;
-    }
+    CK_RV rv = digestInit(s, pMechanism);
+    if (rv != CKR_OK) return rv;
+	s->operation = PKCS11_CK_OPERATION_DIGEST;
+	return CKR_OK;
+}
 
-    Attribute a = Attribute(o->pAttributes, o->ulAttributeCount);
-    CK_OBJECT_CLASS_PTR pObjectClass = a.getType<CK_OBJECT_CLASS>(CKA_CLASS);
-    CK_KEY_TYPE *pKeyType = a.getType<CK_KEY_TYPE>(CKA_KEY_TYPE);
 
-    if ((NULL != pMechanism->pParameter) || (0 != pMechanism->ulParameterLen))
-        return CKR_MECHANISM_PARAM_INVALID;
-    if (pObjectClass == NULL || *pObjectClass != CKO_PRIVATE_KEY) return CKR_OBJECT_HANDLE_INVALID;
-    if (pKeyType == NULL) return CKR_OBJECT_HANDLE_INVALID;
-	switch (pMechanism->mechanism)
-	{
-        case CKM_RSA_PKCS:
-            if (*pKeyType != CKK_RSA) return CKR_OBJECT_HANDLE_INVALID;
-            break;
-        case CKM_ECDSA:
-        case CKM_ECDSA_SHA1:
-            if (*pKeyType != CKK_EC) return CKR_OBJECT_HANDLE_INVALID;
-            break;
-        default:
-            return CKR_MECHANISM_INVALID;
-	}
-	s->operation = PKCS11_CK_OPERATION_SIGN;
-    s->operationMechanismType = pMechanism->mechanism;
-    // Implementing RSA_PSS requires paramaters if non default are required
-	return CKR_OK;
+// Ends the digest operation unless pDigest is NULL or too small
+static CK_RV digestFinal(pkcs11_session_t *s, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+{
+    CK_ULONG digestLen = EVP_MD_size(s->operationMd);
+
+    if (NULL == pDigest) {
+        *pulDigestLen = digestLen;
+        return CKR_OK;
+    }
+    if (*pulDigestLen < digestLen) {
+        *pulDigestLen = digestLen;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+    s->operation = PKCS11_CK_OPERATION_NONE;
+    return hashFinal(&s->hash, pDigest, pulDigestLen);
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_Sign)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+CK_DEFINE_FUNCTION(CK_RV, C_Digest)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
-	if (PKCS11_CK_OPERATION_SIGN != s->operation)
+	if (PKCS11_CK_OPERATION_DIGEST != s->operation)
 		return CKR_OPERATION_NOT_INITIALIZED;
 
-	if (NULL == pData)
-		return CKR_ARGUMENTS_BAD;
-
-	if (0 >= ulDataLen)
-		return CKR_ARGUMENTS_BAD;
-
-	if (NULL == pulSignatureLen)
+	if ((NULL == pData && ulDataLen != 0) || NULL == pulDigestLen)
 		return CKR_ARGUMENTS_BAD;
 
-	try {
-        CK_ULONG resLength;
-        uint8_t *serialized_attr;
-        size_t attrLen;
-        Attribute attr = Attribute(s->operationObject.pAttributes, s->operationObject.ulAttributeCount);
-        serialized_attr = attr.serialize(&attrLen);
-		CK_BYTE_PTR res = crypto->Sign(s->operationObject.pValue, s->operationObject.valueLength, serialized_attr, attrLen, pData, ulDataLen, &resLength, s->operationMechanismType);
-        if (res == NULL) {
-            return CKR_DEVICE_ERROR;
-        }
-        if (resLength > *pulSignatureLen) {
-            free(res);
-            return CKR_BUFFER_TOO_SMALL;
-        }
-        memcpy(pSignature, res, resLength);
-        *pulSignatureLen = resLength;
-        free(res);
-	}
-	catch (std::runtime_error) {
-		return CKR_DEVICE_ERROR;
+	if (NULL != pDigest && *pulDigestLen >= (CK_ULONG) EVP_MD_size(s->operationMd)) {
+		CK_RV rv = hashUpdate(&s->hash, pData, ulDataLen);
+		if (rv != CKR_OK) return rv;
 	}
-
-	s->operation = PKCS11_CK_OPERATION_NONE;
-	return CKR_OK;
+	return digestFinal(s, pDigest, pulDigestLen);
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_SignUpdate)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+CK_DEFINE_FUNCTION(CK_RV, C_DigestUpdate)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
-	if (PKCS11_CK_OPERATION_SIGN != s->operation)
+	if (PKCS11_CK_OPERATION_DIGEST != s->operation)
 		return CKR_OPERATION_NOT_INITIALIZED;
-	if (NULL == (s->part = (uint8_t *) realloc(s->part, s->partLen + ulPartLen)))
-		return CKR_DEVICE_MEMORY;
-	memcpy(s->part + s->partLen, pPart, ulPartLen);
-	s->partLen += ulPartLen;
-	return CKR_OK;
+	if (NULL == pPart && ulPartLen != 0)
+		return CKR_ARGUMENTS_BAD;
+	return hashUpdate(&s->hash, pPart, ulPartLen);
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_SignFinal)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+CK_DEFINE_FUNCTION(CK_RV, C_DigestKey)(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey)
 {
-	CK_RV ret;
-    pkcs11_session_t *s;
-    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_DigestFinal)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_DIGEST != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (NULL == pulDigestLen)
+		return CKR_ARGUMENTS_BAD;
+	return digestFinal(s, pDigest, pulDigestLen);
+}
+
+
+struct mechanismType {
+	int padding;
+    md_func_t mdf;
+} mechanismType_t;
+
+static const std::map<CK_MECHANISM_TYPE, mechanismType> allowedSignMechanisms = {
+	{ CKM_RSA_PKCS, { RSA_PKCS1_PADDING, NULL }},
+	{ CKM_SHA1_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha1 }},
+	{ CKM_SHA256_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha256 }},
+	{ CKM_SHA384_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha384 }},
+	{ CKM_SHA512_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha512 }},
+	{ CKM_ECDSA, { 0, NULL }},
+	{ CKM_ECDSA_SHA1, { 0, EVP_sha1 }},
+};
+
+
+// The hash of the hash-and-sign mechanisms is computed here, only the digest
+// enters the enclave. digest must hold EVP_MAX_MD_SIZE bytes; for the raw
+// mechanisms the data is passed through as is.
+static CK_RV prehash(CK_MECHANISM_TYPE mechanism, CK_BYTE_PTR pData, CK_ULONG ulDataLen, uint8_t *digest, CK_BYTE_PTR *ppOut, CK_ULONG *pulOutLen)
+{
+    auto it = allowedSignMechanisms.find(mechanism);
+    // Kept per thread, EVP_DigestInit_ex reuses it rather than allocating
+    static thread_local std::unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX *)> mdctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    unsigned int digestLen;
+
+    if (it == allowedSignMechanisms.end()) return CKR_MECHANISM_INVALID;
+    if (it->second.mdf == NULL) {
+        *ppOut = pData;
+        *pulOutLen = ulDataLen;
+        return CKR_OK;
+    }
+    if (!mdctx ||
+            1 != EVP_DigestInit_ex(mdctx.get(), it->second.mdf(), NULL) ||
+            1 != EVP_DigestUpdate(mdctx.get(), pData, ulDataLen) ||
+            1 != EVP_DigestFinal_ex(mdctx.get(), digest, &digestLen))
+        return CKR_DEVICE_ERROR;
+    *ppOut = digest;
+    *pulOutLen = digestLen;
+    return CKR_OK;
+}
+
+
+static CK_RV checkSignKey(CK_MECHANISM_TYPE mechanism, Attribute& a)
+{
+    CK_OBJECT_CLASS_PTR pObjectClass = a.getType<CK_OBJECT_CLASS>(CKA_CLASS);
+    CK_KEY_TYPE *pKeyType = a.getType<CK_KEY_TYPE>(CKA_KEY_TYPE);
+
+    if (pObjectClass == NULL || *pObjectClass != CKO_PRIVATE_KEY) return CKR_OBJECT_HANDLE_INVALID;
+    if (pKeyType == NULL) return CKR_OBJECT_HANDLE_INVALID;
+	switch (mechanism)
+	{
+        case CKM_RSA_PKCS:
+        case CKM_SHA1_RSA_PKCS:
+        case CKM_SHA256_RSA_PKCS:
+        case CKM_SHA384_RSA_PKCS:
+        case CKM_SHA512_RSA_PKCS:
+            if (*pKeyType != CKK_RSA) return CKR_OBJECT_HANDLE_INVALID;
+            break;
+        case CKM_ECDSA:
+        case CKM_ECDSA_SHA1:
+            if (*pKeyType != CKK_EC) return CKR_OBJECT_HANDLE_INVALID;
+            break;
+        default:
+            return CKR_MECHANISM_INVALID;
+	}
+    return CKR_OK;
+}
+
+
+// Loads and checks the key of a sign operation, common to C_SignInit and
+// C_MessageSignInit
+static CK_RV signInit(pkcs11_session_t *s, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    objectCachePut(s->operationRecord);
+    if ((s->operationRecord = objectCacheGet(hKey)) == NULL) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+    if ((s->operationRecord = migrateObject(s->operationRecord)) == NULL) {
+        return CKR_DEVICE_ERROR;
+    }
+    pkcs11_object_t *o = &s->operationRecord->object;
+
+    if ((NULL != pMechanism->pParameter) || (0 != pMechanism->ulParameterLen))
+        return CKR_MECHANISM_PARAM_INVALID;
+    Attribute a = Attribute(o->pAttributes, o->ulAttributeCount);
+    CK_RV rv = checkSignKey(pMechanism->mechanism, a);
+    if (rv != CKR_OK) return rv;
+    auto it = allowedSignMechanisms.find(pMechanism->mechanism);
+    s->operationMd = it->second.mdf ? it->second.mdf() : NULL;
+    if (s->operationMd && (rv = hashInit(&s->hash, s->operationMd)) != CKR_OK) return rv;
+    s->operationMechanismType = pMechanism->mechanism;
+    s->operationKeyHandle = hKey;
+    s->inMessage = CK_FALSE;
+    return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SignInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_NONE != s->operation)
+		return CKR_OPERATION_ACTIVE;
+
+	if (NULL == pMechanism)
+		return CKR_ARGUMENTS_BAD;
+
+    CK_RV rv = signInit(s, pMechanism, hKey);
+    if (rv != CKR_OK) return rv;
+	s->operation = PKCS11_CK_OPERATION_SIGN;
+    // Implementing RSA_PSS requires paramaters if non default are required
+	return CKR_OK;
+}
+
+
+// The private key step of a sign operation, pData is the digest for the
+// hash-and-sign mechanisms.
+static CK_RV signWithKey(object_record_t *r, CK_MECHANISM_TYPE mechanism, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+    pkcs11_object_t *o = &r->object;
+    size_t signatureLength = *pulSignatureLen;
+
+	try {
+		if (!crypto->Sign(o->pValue, o->valueLength, o->pSerialized, o->serializedLength, pData, ulDataLen, pSignature, &signatureLength, mechanism)) {
+            *pulSignatureLen = signatureLength;
+            return pSignature == NULL ? CKR_OK : CKR_BUFFER_TOO_SMALL;
+        }
+	}
+	catch (std::runtime_error) {
+		return CKR_DEVICE_ERROR;
+	}
+    *pulSignatureLen = signatureLength;
+	return CKR_OK;
+}
+
+
+static CK_RV signDigest(pkcs11_session_t *s, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	CK_RV rv = signWithKey(s->operationRecord, s->operationMechanismType, pData, ulDataLen, pSignature, pulSignatureLen);
+	if (rv != CKR_OK) return rv;
+
+	// A length query leaves the operation active
+	if (pSignature != NULL) s->operation = PKCS11_CK_OPERATION_NONE;
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_Sign)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
 	if (PKCS11_CK_OPERATION_SIGN != s->operation)
 		return CKR_OPERATION_NOT_INITIALIZED;
+
+	if (NULL == pData)
+		return CKR_ARGUMENTS_BAD;
+
+	if (0 >= ulDataLen)
+		return CKR_ARGUMENTS_BAD;
+
+	if (NULL == pulSignatureLen)
+		return CKR_ARGUMENTS_BAD;
+
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	CK_RV rv = prehash(s->operationMechanismType, pData, ulDataLen, digest, &pData, &ulDataLen);
+	if (rv != CKR_OK) return rv;
+
+	return signDigest(s, pData, ulDataLen, pSignature, pulSignatureLen);
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SignUpdate)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_SIGN != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (NULL == pPart && ulPartLen != 0)
+		return CKR_ARGUMENTS_BAD;
+	if (s->operationMd)
+		return hashUpdate(&s->hash, pPart, ulPartLen);
+	// The raw mechanisms sign at most a digest worth of data
+	if (NULL == (s->part = (uint8_t *) realloc(s->part, s->partLen + ulPartLen)))
+		return CKR_DEVICE_MEMORY;
+	memcpy(s->part + s->partLen, pPart, ulPartLen);
+	s->partLen += ulPartLen;
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SignFinal)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	CK_RV ret;
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+	if (PKCS11_CK_OPERATION_SIGN != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (s->operationMd) {
+		uint8_t digest[EVP_MAX_MD_SIZE];
+		CK_ULONG digestLen;
+		// Finished on a copy, a length query goes on with the same hash
+		hash_state_t h = s->hash;
+
+		if (NULL == pulSignatureLen)
+			return CKR_ARGUMENTS_BAD;
+		if ((ret = hashFinal(&h, digest, &digestLen)) != CKR_OK) return ret;
+		return signDigest(s, digest, digestLen, pSignature, pulSignatureLen);
+	}
 	ret = C_Sign(hSession, s->part, s->partLen, pSignature, pulSignatureLen);
 	if (s->part) free(s->part);
 	s->part = NULL;
 	s->partLen = 0;
-	return ret;
+	return ret;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SignRecoverInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SignRecover)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+// Starts the EVP_DigestVerify of a hash-and-sign mechanism on the session
+// key, again for every message of a message based verify
+static CK_RV verifyStart(pkcs11_session_t *s)
+{
+    auto it = allowedSignMechanisms.find(s->operationMechanismType);
+    EVP_PKEY_CTX *pkey_ctx;
+
+    if (s->operationMd == NULL) return CKR_OK;
+    if (s->mdCtx == NULL && (s->mdCtx = EVP_MD_CTX_new()) == NULL) return CKR_HOST_MEMORY;
+    EVP_MD_CTX_reset(s->mdCtx);
+    if (1 != EVP_DigestVerifyInit(s->mdCtx, &pkey_ctx, s->operationMd, NULL, s->operationKey)) return CKR_DEVICE_ERROR;
+    if (EVP_PKEY_id(s->operationKey) == EVP_PKEY_RSA && 0 >= EVP_PKEY_CTX_set_rsa_padding(pkey_ctx, it->second.padding))
+        return CKR_DEVICE_ERROR;
+    return CKR_OK;
+}
+
+
+// Loads and checks the key of a verify operation, common to C_VerifyInit
+// and C_MessageVerifyInit
+static CK_RV verifyInit(pkcs11_session_t *s, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	switch (pMechanism->mechanism)
+	{
+		case CKM_ECDSA:
+		case CKM_ECDSA_SHA1:
+			if ((NULL != pMechanism->pParameter) || (0 != pMechanism->ulParameterLen))
+				return CKR_MECHANISM_PARAM_INVALID;
+			break;
+		case CKM_RSA_PKCS:
+		case CKM_SHA1_RSA_PKCS:
+		case CKM_SHA256_RSA_PKCS:
+		case CKM_SHA384_RSA_PKCS:
+		case CKM_SHA512_RSA_PKCS:
+			break;
+		default:
+			return CKR_MECHANISM_INVALID;
+	}
+    CK_RV rv;
+    if (s->operationKey) EVP_PKEY_free(s->operationKey);
+    if (s->operationCtx) EVP_PKEY_CTX_free(s->operationCtx);
+    if ((rv = getPublicKey(hKey, false, &s->operationKey, &s->operationCtx)) != CKR_OK) return rv;
+    auto it = allowedSignMechanisms.find(pMechanism->mechanism);
+    int type = EVP_PKEY_id(s->operationKey);
+    bool ecMechanism = pMechanism->mechanism == CKM_ECDSA || pMechanism->mechanism == CKM_ECDSA_SHA1;
+    if (type != (ecMechanism ? EVP_PKEY_EC : EVP_PKEY_RSA)) return CKR_KEY_TYPE_INCONSISTENT;
+    s->operationMd = it->second.mdf ? it->second.mdf() : NULL;
+    s->operationMechanismType = pMechanism->mechanism;
+    s->operationKeyHandle = hKey;
+    s->inMessage = CK_FALSE;
+    return verifyStart(s);
+}
+
+
+// The raw mechanisms verify the data as collected
+static CK_RV verifyRaw(pkcs11_session_t *s, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	return 1 == EVP_PKEY_verify(s->operationCtx, pSignature, ulSignatureLen, pData, ulDataLen) ? CKR_OK : CKR_SIGNATURE_INVALID;
+}
+
+
+static CK_RV verifyFinal(pkcs11_session_t *s, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	return 1 == EVP_DigestVerifyFinal(s->mdCtx, pSignature, ulSignatureLen) ? CKR_OK : CKR_SIGNATURE_INVALID;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_NONE != s->operation)
+		return CKR_OPERATION_ACTIVE;
+
+	if (NULL == pMechanism)
+		return CKR_ARGUMENTS_BAD;
+
+    CK_RV rv = verifyInit(s, pMechanism, hKey);
+    if (rv != CKR_OK) return rv;
+	s->operation = PKCS11_CK_OPERATION_VERIFY;
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_Verify)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_VERIFY != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+
+	if (NULL == pData)
+		return CKR_ARGUMENTS_BAD;
+
+	if (0 >= ulSignatureLen)
+		return CKR_ARGUMENTS_BAD;
+
+	if (NULL == pSignature)
+		return CKR_ARGUMENTS_BAD;
+
+	s->operation = PKCS11_CK_OPERATION_NONE;
+	if (s->operationMd) {
+		if (1 != EVP_DigestVerifyUpdate(s->mdCtx, pData, ulDataLen)) return CKR_DEVICE_ERROR;
+		return verifyFinal(s, pSignature, ulSignatureLen);
+	}
+	return verifyRaw(s, pData, ulDataLen, pSignature, ulSignatureLen);
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyUpdate)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_VERIFY != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (NULL == pPart && ulPartLen != 0)
+		return CKR_ARGUMENTS_BAD;
+	if (s->operationMd)
+		return 1 == EVP_DigestVerifyUpdate(s->mdCtx, pPart, ulPartLen) ? CKR_OK : CKR_DEVICE_ERROR;
+	if (NULL == (s->part = (uint8_t *) realloc(s->part, s->partLen + ulPartLen)))
+		return CKR_DEVICE_MEMORY;
+	memcpy(s->part + s->partLen, pPart, ulPartLen);
+	s->partLen += ulPartLen;
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyFinal)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	CK_RV ret;
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+	if (PKCS11_CK_OPERATION_VERIFY != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (s->operationMd) {
+		if (NULL == pSignature)
+			return CKR_ARGUMENTS_BAD;
+		s->operation = PKCS11_CK_OPERATION_NONE;
+		return verifyFinal(s, pSignature, ulSignatureLen);
+	}
+	ret = C_Verify(hSession, s->part, s->partLen, pSignature, ulSignatureLen);
+	if (s->part) free(s->part);
+	s->part = NULL;
+	s->partLen = 0;
+	return ret;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_MessageSignInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_NONE != s->operation)
+		return CKR_OPERATION_ACTIVE;
+
+	if (NULL == pMechanism)
+		return CKR_ARGUMENTS_BAD;
+
+    CK_RV rv = signInit(s, pMechanism, hKey);
+    if (rv != CKR_OK) return rv;
+	s->operation = PKCS11_CK_OPERATION_MESSAGE_SIGN;
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SignMessage)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_MESSAGE_SIGN != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (s->inMessage)
+		return CKR_OPERATION_ACTIVE;
+
+	if (NULL == pData || 0 == ulDataLen || NULL == pulSignatureLen)
+		return CKR_ARGUMENTS_BAD;
+
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	CK_RV rv = prehash(s->operationMechanismType, pData, ulDataLen, digest, &pData, &ulDataLen);
+	if (rv != CKR_OK) return rv;
+
+	return signWithKey(s->operationRecord, s->operationMechanismType, pData, ulDataLen, pSignature, pulSignatureLen);
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SignMessageBegin)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_MESSAGE_SIGN != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (s->inMessage)
+		return CKR_OPERATION_ACTIVE;
+
+	if (s->operationMd) {
+		CK_RV rv = hashInit(&s->hash, s->operationMd);
+		if (rv != CKR_OK) return rv;
+	}
+	if (s->part) free(s->part);
+	s->part = NULL;
+	s->partLen = 0;
+	s->inMessage = CK_TRUE;
+	return CKR_OK;
+}
+
+
+// The last part is the one with pulSignatureLen set. It is only taken in
+// once the signature is returned, so it may be passed again after a length
+// query or CKR_BUFFER_TOO_SMALL.
+CK_DEFINE_FUNCTION(CK_RV, C_SignMessageNext)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen, CK_BYTE_PTR pDataPart, CK_ULONG ulDataPartLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_MESSAGE_SIGN != s->operation || !s->inMessage)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (NULL == pDataPart && ulDataPartLen != 0)
+		return CKR_ARGUMENTS_BAD;
+
+	if (NULL == pulSignatureLen) {
+		if (s->operationMd)
+			return hashUpdate(&s->hash, pDataPart, ulDataPartLen);
+		if (NULL == (s->part = (uint8_t *) realloc(s->part, s->partLen + ulDataPartLen)))
+			return CKR_DEVICE_MEMORY;
+		memcpy(s->part + s->partLen, pDataPart, ulDataPartLen);
+		s->partLen += ulDataPartLen;
+		return CKR_OK;
+	}
+
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	CK_BYTE_PTR pData = digest;
+	CK_ULONG ulDataLen;
+	CK_RV rv;
+	if (s->operationMd) {
+		hash_state_t h = s->hash;
+		if ((rv = hashUpdate(&h, pDataPart, ulDataPartLen)) != CKR_OK) return rv;
+		if ((rv = hashFinal(&h, digest, &ulDataLen)) != CKR_OK) return rv;
+		rv = signWithKey(s->operationRecord, s->operationMechanismType, pData, ulDataLen, pSignature, pulSignatureLen);
+	} else if (s->partLen == 0) {
+		rv = signWithKey(s->operationRecord, s->operationMechanismType, pDataPart, ulDataPartLen, pSignature, pulSignatureLen);
+	} else {
+		if (NULL == (pData = (CK_BYTE_PTR) malloc(s->partLen + ulDataPartLen)))
+			return CKR_DEVICE_MEMORY;
+		memcpy(pData, s->part, s->partLen);
+		if (ulDataPartLen) memcpy(pData + s->partLen, pDataPart, ulDataPartLen);
+		rv = signWithKey(s->operationRecord, s->operationMechanismType, pData, s->partLen + ulDataPartLen, pSignature, pulSignatureLen);
+		free(pData);
+	}
+	if (pSignature != NULL && rv != CKR_BUFFER_TOO_SMALL) {
+		if (s->part) free(s->part);
+		s->part = NULL;
+		s->partLen = 0;
+		s->inMessage = CK_FALSE;
+	}
+	return rv;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_MessageSignFinal)(CK_SESSION_HANDLE hSession)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_MESSAGE_SIGN != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (s->part) free(s->part);
+	s->part = NULL;
+	s->partLen = 0;
+	s->inMessage = CK_FALSE;
+	s->operation = PKCS11_CK_OPERATION_NONE;
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_MessageVerifyInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_NONE != s->operation)
+		return CKR_OPERATION_ACTIVE;
+
+	if (NULL == pMechanism)
+		return CKR_ARGUMENTS_BAD;
+
+    CK_RV rv = verifyInit(s, pMechanism, hKey);
+    if (rv != CKR_OK) return rv;
+	s->operation = PKCS11_CK_OPERATION_MESSAGE_VERIFY;
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessage)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_MESSAGE_VERIFY != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (s->inMessage)
+		return CKR_OPERATION_ACTIVE;
+
+	if (NULL == pData || NULL == pSignature || 0 == ulSignatureLen)
+		return CKR_ARGUMENTS_BAD;
+
+	if (s->operationMd) {
+		CK_RV rv = verifyStart(s);
+		if (rv != CKR_OK) return rv;
+		if (1 != EVP_DigestVerifyUpdate(s->mdCtx, pData, ulDataLen)) return CKR_DEVICE_ERROR;
+		return verifyFinal(s, pSignature, ulSignatureLen);
+	}
+	return verifyRaw(s, pData, ulDataLen, pSignature, ulSignatureLen);
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessageBegin)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (PKCS11_CK_OPERATION_MESSAGE_VERIFY != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (s->inMessage)
+		return CKR_OPERATION_ACTIVE;
+
+	CK_RV rv = verifyStart(s);
+	if (rv != CKR_OK) return rv;
+	if (s->part) free(s->part);
+	s->part = NULL;
+	s->partLen = 0;
+	s->inMessage = CK_TRUE;
+	return CKR_OK;
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_SignRecoverInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+// The last part is the one with pSignature set
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessageNext)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen, CK_BYTE_PTR pDataPart, CK_ULONG ulDataPartLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
-}
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
+	if (PKCS11_CK_OPERATION_MESSAGE_VERIFY != s->operation || !s->inMessage)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (NULL == pDataPart && ulDataPartLen != 0)
+		return CKR_ARGUMENTS_BAD;
 
-CK_DEFINE_FUNCTION(CK_RV, C_SignRecover)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
-{
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	if (s->operationMd) {
+		if (1 != EVP_DigestVerifyUpdate(s->mdCtx, pDataPart, ulDataPartLen)) return CKR_DEVICE_ERROR;
+	} else {
+		if (NULL == (s->part = (uint8_t *) realloc(s->part, s->partLen + ulDataPartLen + 1)))
+			return CKR_DEVICE_MEMORY;
+		if (ulDataPartLen) memcpy(s->part + s->partLen, pDataPart, ulDataPartLen);
+		s->partLen += ulDataPartLen;
+	}
+	if (NULL == pSignature) return CKR_OK;
+
+	CK_RV rv;
+	s->inMessage = CK_FALSE;
+	if (s->operationMd)
+		rv = verifyFinal(s, pSignature, ulSignatureLen);
+	else
+		rv = verifyRaw(s, s->part, s->partLen, pSignature, ulSignatureLen);
+	if (s->part) free(s->part);
+	s->part = NULL;
+	s->partLen = 0;
+	return rv;
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_VerifyInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+CK_DEFINE_FUNCTION(CK_RV, C_MessageVerifyFinal)(CK_SESSION_HANDLE hSession)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
-	if (PKCS11_CK_OPERATION_NONE != s->operation)
-		return CKR_OPERATION_ACTIVE;
+	if (PKCS11_CK_OPERATION_MESSAGE_VERIFY != s->operation)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (s->part) free(s->part);
+	s->part = NULL;
+	s->partLen = 0;
+	s->inMessage = CK_FALSE;
+	s->operation = PKCS11_CK_OPERATION_NONE;
+	return CKR_OK;
+}
 
-	if (NULL == pMechanism)
-		return CKR_ARGUMENTS_BAD;
 
-	switch (pMechanism->mechanism)
-	{
-		case CKM_ECDSA:
-			if ((NULL != pMechanism->pParameter) || (0 != pMechanism->ulParameterLen))
-				return CKR_MECHANISM_PARAM_INVALID;
-			break;
-		case CKM_RSA_PKCS:
-		case CKM_SHA1_RSA_PKCS:
-		case CKM_SHA256_RSA_PKCS:
-		case CKM_SHA384_RSA_PKCS:
-		case CKM_SHA512_RSA_PKCS:
-			break;
-		default:
-			return CKR_MECHANISM_INVALID;
-	}
-    pkcs11_object_t *o = &s->operationObject;
-    if (o->pValue) free(o->pValue);
-    if (o->pAttributes) free(o->pAttributes);
-    memset(o, 0, sizeof *o);
-    int rc;
-    if (0 > (rc =db->getObject(hKey, &o->pValue, o->valueLength, &o->pAttributes, o->ulAttributeCount))) {
-        return CKR_DEVICE_ERROR;
-    }
-	s->operation = PKCS11_CK_OPERATION_VERIFY;
-    s->operationMechanismType = pMechanism->mechanism;
-	return CKR_OK;
+CK_DEFINE_FUNCTION(CK_RV, C_MessageEncryptInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
 
-typedef const EVP_MD* (*md_func_t)(void);
+CK_DEFINE_FUNCTION(CK_RV, C_EncryptMessage)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen, CK_BYTE_PTR pAssociatedData, CK_ULONG ulAssociatedDataLen, CK_BYTE_PTR pPlaintext, CK_ULONG ulPlaintextLen, CK_BYTE_PTR pCiphertext, CK_ULONG_PTR pulCiphertextLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
 
-struct mechanismType {
-	int padding;
-    md_func_t mdf;
-} mechanismType_t;
 
-static std::map<CK_MECHANISM_TYPE, mechanismType> allowedSignMechanisms = {
-	{ CKM_RSA_PKCS, { RSA_PKCS1_PADDING, NULL }},
-	{ CKM_SHA1_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha1 }},
-	{ CKM_SHA256_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha256 }},
-	{ CKM_SHA384_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha384 }},
-	{ CKM_SHA512_RSA_PKCS, { RSA_PKCS1_PADDING, EVP_sha256 }},
-};
+CK_DEFINE_FUNCTION(CK_RV, C_EncryptMessageBegin)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen, CK_BYTE_PTR pAssociatedData, CK_ULONG ulAssociatedDataLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
 
-CK_DEFINE_FUNCTION(CK_RV, C_Verify)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+
+CK_DEFINE_FUNCTION(CK_RV, C_EncryptMessageNext)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen, CK_BYTE_PTR pPlaintextPart, CK_ULONG ulPlaintextPartLen, CK_BYTE_PTR pCiphertextPart, CK_ULONG_PTR pulCiphertextPartLen, CK_FLAGS flags)
 {
-	CK_RV ret = CKR_DEVICE_ERROR;
-    EVP_PKEY *pKey = NULL;
-	EVP_PKEY_CTX *pkey_ctx = NULL;
-	int type;
-	const uint8_t *endptr;
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
 
-	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-    pkcs11_session_t *s;
-    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+CK_DEFINE_FUNCTION(CK_RV, C_MessageEncryptFinal)(CK_SESSION_HANDLE hSession)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
 
-	if (PKCS11_CK_OPERATION_VERIFY != s->operation)
-		return CKR_OPERATION_NOT_INITIALIZED;
 
-	if (NULL == pData)
-		return CKR_ARGUMENTS_BAD;
+CK_DEFINE_FUNCTION(CK_RV, C_MessageDecryptInit)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
 
-	if (0 >= ulSignatureLen)
-		return CKR_ARGUMENTS_BAD;
 
-	if (NULL == pSignature)
-		return CKR_ARGUMENTS_BAD;
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptMessage)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen, CK_BYTE_PTR pAssociatedData, CK_ULONG ulAssociatedDataLen, CK_BYTE_PTR pCiphertext, CK_ULONG ulCiphertextLen, CK_BYTE_PTR pPlaintext, CK_ULONG_PTR pulPlaintextLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
 
-    Attribute attr = Attribute(s->operationObject.pAttributes, s->operationObject.ulAttributeCount);
 
-	if (*attr.getType<CK_OBJECT_CLASS>(CKA_CLASS) != CKO_PUBLIC_KEY) return CKR_KEY_HANDLE_INVALID;
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptMessageBegin)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen, CK_BYTE_PTR pAssociatedData, CK_ULONG ulAssociatedDataLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
 
-	CK_KEY_TYPE *pKeyType;
-	s->operation = PKCS11_CK_OPERATION_NONE;
-    pKeyType = attr.getType<CK_KEY_TYPE>(CKA_KEY_TYPE);
-	endptr = s->operationObject.pValue;
-	if (NULL == (pKey = d2i_PUBKEY(&pKey, &endptr,  s->operationObject.valueLength))) goto C_Verify_err;
-    type = EVP_PKEY_id(pKey);
-	if (NULL == (pkey_ctx = EVP_PKEY_CTX_new(pKey, NULL))) goto C_Verify_err;
-	if (EVP_PKEY_verify_init(pkey_ctx) != 1) goto C_Verify_err;
-	switch (*pKeyType) {
-		case CKK_RSA: {
-				ret = CKR_MECHANISM_INVALID;
-				auto it = allowedSignMechanisms.find(s->operationMechanismType);
-				if (it == allowedSignMechanisms.end()) goto C_Verify_err;
-				ret = CKR_DEVICE_ERROR;
-				if (0 >= EVP_PKEY_CTX_set_rsa_padding(pkey_ctx, it->second.padding)) goto C_Verify_err;
-				if (0 >= EVP_PKEY_CTX_set_signature_md(pkey_ctx, it->second.mdf)) goto C_Verify_err;
-				if (type != EVP_PKEY_RSA) goto C_Verify_err;
-			}
-			break;
-		case CKK_ECDSA:
-			if (type != EVP_PKEY_EC) goto C_Verify_err;
-			break;
-		default:
-			ret = CKR_KEY_HANDLE_INVALID;
-			goto C_Verify_err;
-	}
-	if (1 != EVP_PKEY_verify(pkey_ctx, pSignature, ulSignatureLen, pData, ulDataLen)) goto C_Verify_err;
-	ret = CKR_OK;
-C_Verify_err:
-	if (pKey) EVP_PKEY_free(pKey);
-	if (pkey_ctx) EVP_PKEY_CTX_free(pkey_ctx);
-    return ret;
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptMessageNext)(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen, CK_BYTE_PTR pCiphertextPart, CK_ULONG ulCiphertextPartLen, CK_BYTE_PTR pPlaintextPart, CK_ULONG_PTR pulPlaintextPartLen, CK_FLAGS flags)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_VerifyUpdate)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+CK_DEFINE_FUNCTION(CK_RV, C_MessageDecryptFinal)(CK_SESSION_HANDLE hSession)
 {
-	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
 
-    pkcs11_session_t *s;
-    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
-	if (PKCS11_CK_OPERATION_VERIFY != s->operation)
-		return CKR_OPERATION_NOT_INITIALIZED;
-	if (NULL == (s->part = (uint8_t *) realloc(s->part, s->partLen + ulPartLen)))
-		return CKR_DEVICE_MEMORY;
-	memcpy(s->part + s->partLen, pPart, ulPartLen);
-	s->partLen += ulPartLen;
-	return CKR_OK;
+CK_DEFINE_FUNCTION(CK_RV, C_LoginUser)(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, CK_UTF8CHAR_PTR pUsername, CK_ULONG ulUsernameLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
 
-CK_DEFINE_FUNCTION(CK_RV, C_VerifyFinal)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+CK_DEFINE_FUNCTION(CK_RV, C_SessionCancel)(CK_SESSION_HANDLE hSession, CK_FLAGS flags)
 {
-	CK_RV ret;
-    pkcs11_session_t *s;
-    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
-	if (PKCS11_CK_OPERATION_VERIFY != s->operation)
-		return CKR_OPERATION_NOT_INITIALIZED;
-	ret = C_Verify(hSession, s->part, s->partLen, pSignature, ulSignatureLen);
-	if (s->part) free(s->part);
-	s->part = NULL;
-	s->partLen = 0;
-	return ret;
+	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
 
@@ -1229,8 +2984,71 @@ CK_DEFINE_FUNCTION(CK_RV, C_GenerateKey)(CK_SESSION_HANDLE hSession, CK_MECHANIS
 }
 
 
+// Takes over pValue and pSerialized, they are freed on failure as well
+static CK_RV newSessionObject(CK_SESSION_HANDLE hSession, uint8_t *pValue, size_t valueLength, uint8_t *pSerialized, size_t serializedLength, CK_OBJECT_HANDLE_PTR phObject) {
+    object_record_t *r;
+    pkcs11_object_t *o;
+    SessionRef s;
+    CK_RV rv;
+
+    if ((r = new (std::nothrow) object_record_t()) == NULL) {
+        free(pValue);
+        free(pSerialized);
+        return CKR_HOST_MEMORY;
+    }
+    r->refs = 1;
+    o = &r->object;
+    o->pValue = pValue;
+    o->valueLength = valueLength;
+    o->pSerialized = pSerialized;
+    o->serializedLength = serializedLength;
+    try {
+        AttributeSerial attr(pSerialized, serializedLength);
+        CK_ATTRIBUTE_PTR pAttr = attr.attributes(o->ulAttributeCount);
+        if ((o->pAttributes = (CK_ATTRIBUTE_PTR) calloc(o->ulAttributeCount, sizeof *o->pAttributes)) == NULL)
+            goto newSessionObject_err;
+        for (CK_ULONG i = 0; i < o->ulAttributeCount; i++) {
+            o->pAttributes[i] = pAttr[i];
+            if ((o->pAttributes[i].pValue = malloc(pAttr[i].ulValueLen ? pAttr[i].ulValueLen : 1)) == NULL)
+                goto newSessionObject_err;
+            memcpy(o->pAttributes[i].pValue, pAttr[i].pValue, pAttr[i].ulValueLen);
+        }
+    }
+    catch (std::exception &) {
+        objectCachePut(r);
+        return CKR_DEVICE_ERROR;
+    }
+    // The reference keeps the session from being released before the
+    // object is in its list
+    if ((s = get_session(hSession)) == NULL) {
+        objectCachePut(r);
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    {
+        LibraryLock lock(sessionObjectsLock);
+        if ((rv = lock.rv()) != CKR_OK) {
+            objectCachePut(r);
+            return rv;
+        }
+        r->hObject = SESSION_OBJECT_FLAG | ++lastSessionObject;
+        r->owner = s;
+        r->next = s->sessionObjects;
+        if (r->next) r->next->prev = r;
+        s->sessionObjects = r;
+        sessionObjectIndex[r->hObject] = r;
+        rv = lock.unlock();
+    }
+    // Linked even when unlocking failed, the session releases it
+    *phObject = r->hObject;
+    return rv;
+newSessionObject_err:
+    objectCachePut(r);
+    return CKR_HOST_MEMORY;
+}
+
+
 CK_RV GenerateKeyPair(
-    pkcs11_session_t *session,
+    CK_SESSION_HANDLE hSession,
     Attribute pubAttr,
     Attribute privAttr,
 	CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount,
@@ -1245,50 +3063,74 @@ CK_RV GenerateKeyPair(
     uint8_t *privSerializedAttr, *publicSerializedAttr;
 
     CK_RV ret = CKR_OK;
-    CK_BBOOL *pToken;
+    CK_BBOOL *pToken = pubAttr.getType<CK_BBOOL>(CKA_TOKEN);
+    CK_BBOOL token = pToken != NULL && *pToken != CK_FALSE;
 
-    if ((pToken = pubAttr.getType<CK_BBOOL>(CKA_TOKEN)) == NULL) return CKR_ATTRIBUTE_VALUE_INVALID;
-    if (pToken == NULL || *pToken == CK_FALSE) {
-		// For now session objects not supported
-        return CKR_ATTRIBUTE_VALUE_INVALID;
-    }
+    // The pair is kept on the token or in the session as a whole
+    if ((pToken = privAttr.getType<CK_BBOOL>(CKA_TOKEN)) != NULL && (*pToken != CK_FALSE) != token)
+        return CKR_TEMPLATE_INCONSISTENT;
     publicSerializedAttr = pubAttr.serialize(&pubAttrLen);
     privSerializedAttr = privAttr.serialize(&privAttrLen);
+    if (publicSerializedAttr == NULL || privSerializedAttr == NULL)
+        ret = CKR_HOST_MEMORY;
 
 	try {
-		crypto->KeyGeneration(
+		if (ret == CKR_OK) crypto->KeyGeneration(
 			&pPublicKey, &publicKeyLength, &publicSerializedAttr, &pubAttrLen, &pPrivateKey, &privateKeyLength, &privSerializedAttr, &privAttrLen);
 	}
 	catch (std::exception e) {
-		return CKR_DEVICE_ERROR;
+		ret = CKR_DEVICE_ERROR;
 	}
+    if (ret != CKR_OK) {
+        free(publicSerializedAttr);
+        free(privSerializedAttr);
+        return ret;
+    }
+
+    if (!token) {
+        if ((ret = newSessionObject(hSession, pPublicKey, publicKeyLength, publicSerializedAttr, pubAttrLen, phPublicKey)) != CKR_OK) {
+            free(pPrivateKey);
+            free(privSerializedAttr);
+            return ret;
+        }
+        if ((ret = newSessionObject(hSession, pPrivateKey, privateKeyLength, privSerializedAttr, privAttrLen, phPrivateKey)) != CKR_OK) {
+            destroySessionObject(*phPublicKey);
+        }
+        return ret;
+    }
 
     int privHandle;
     CK_ATTRIBUTE_PTR pPrivAttributes;
     CK_ULONG privAttributesCnt;
-
-    AttributeSerial pubAttr2 = AttributeSerial(publicSerializedAttr, pubAttrLen);
-    AttributeSerial privAttr2 = AttributeSerial(privSerializedAttr, privAttrLen);
-
-    pPrivAttributes = privAttr2.attributes(privAttributesCnt);
-
     int pubHandle;
     CK_ATTRIBUTE_PTR pPubAttributes;
     CK_ULONG pubAttributesCnt;
 
-    pPubAttributes = pubAttr2.attributes(pubAttributesCnt);
-
-    if (0 > (pubHandle = db->setObject(CKO_PUBLIC_KEY, pPublicKey, publicKeyLength, pPubAttributes, pubAttributesCnt))) {
-        return CKR_DEVICE_ERROR;
+    // Sets past ATTRIBUTE_SERIAL_MAX go to the heap, which may fail
+    try {
+        AttributeSerial pubAttr2(publicSerializedAttr, pubAttrLen);
+        AttributeSerial privAttr2(privSerializedAttr, privAttrLen);
+
+        pPrivAttributes = privAttr2.attributes(privAttributesCnt);
+        pPubAttributes = pubAttr2.attributes(pubAttributesCnt);
+
+        if (0 > (pubHandle = db->setObject(CKO_PUBLIC_KEY, pPublicKey, publicKeyLength, pPubAttributes, pubAttributesCnt, publicSerializedAttr, pubAttrLen, 0))) {
+            ret = CKR_DEVICE_ERROR;
+        } else if (0 > (privHandle = db->setObject(CKO_PRIVATE_KEY, pPrivateKey, privateKeyLength, pPrivAttributes, privAttributesCnt, privSerializedAttr, privAttrLen, KEY_FORMAT_VERSION))) {
+            db->deleteObject(pubHandle);
+            ret = CKR_DEVICE_ERROR;
+        } else {
+            *phPublicKey = (CK_ULONG)pubHandle;
+            *phPrivateKey = (CK_ULONG)privHandle;
+        }
     }
-    *phPublicKey = (CK_ULONG)pubHandle;
-
-    pPrivAttributes = privAttr2.attributes(privAttributesCnt);
-
-    if (0 > (privHandle = db->setObject(CKO_PRIVATE_KEY, pPrivateKey, privateKeyLength, pPrivAttributes, privAttributesCnt))) {
-        return CKR_DEVICE_ERROR;
+    catch (std::runtime_error) {
+        ret = CKR_HOST_MEMORY;
     }
-    *phPrivateKey = (CK_ULONG)privHandle;
+    free(pPublicKey);
+    free(publicSerializedAttr);
+    free(pPrivateKey);
+    free(privSerializedAttr);
 	return ret;
 }
 
@@ -1307,7 +3149,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GenerateKeyPair)(CK_SESSION_HANDLE hSession, CK_MECH
 	if (NULL == phPrivateKey) return CKR_ARGUMENTS_BAD;
 
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
     Attribute pubAttr = Attribute(pPublicKeyTemplate, ulPublicKeyAttributeCount);
@@ -1365,7 +3207,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GenerateKeyPair)(CK_SESSION_HANDLE hSession, CK_MECH
 			return ret;
     }
     ret = GenerateKeyPair(
-        s, pubAttr.map(), privAttr.map(),
+        hSession, pubAttr.map(), privAttr.map(),
         pPublicKeyTemplate, ulPublicKeyAttributeCount,
         pPrivateKeyTemplate, ulPrivateKeyAttributeCount,
         phPublicKey, phPrivateKey);
@@ -1393,7 +3235,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_DeriveKey)(CK_SESSION_HANDLE hSession, CK_MECHANISM_
 CK_DEFINE_FUNCTION(CK_RV, C_SeedRandom)(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSeed, CK_ULONG ulSeedLen)
 {
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
 	return CKR_OK;
@@ -1405,7 +3247,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GenerateRandom)(CK_SESSION_HANDLE hSession, CK_BYTE_
 	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
 	if (NULL == RandomData) return CKR_ARGUMENTS_BAD;
 
-    pkcs11_session_t *s;
+    SessionRef s;
     if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
 
     if (crypto->GenerateRandom(RandomData, ulRandomLen)) {
@@ -1431,3 +3273,234 @@ CK_DEFINE_FUNCTION(CK_RV, C_WaitForSlotEvent)(CK_FLAGS flags, CK_SLOT_ID_PTR pSl
 {
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
+
+
+static CK_RV signBatchChunk(CK_SGX_SIGN_BATCH_ITEM_PTR pItems, CK_ULONG ulCount)
+{
+    std::map<CK_OBJECT_HANDLE, size_t> keyIndex;
+    std::vector<object_record_t *> objects;
+    std::vector<SignBatchKey> keys;
+    std::vector<SignBatchItem> items;
+    std::vector<CK_ULONG> itemIndex;
+    std::vector<uint8_t> digests(ulCount * EVP_MAX_MD_SIZE);
+    CK_RV rv = CKR_OK;
+
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        CK_SGX_SIGN_BATCH_ITEM_PTR p = pItems + i;
+        size_t k;
+
+        if (p->pData == NULL || p->ulDataLen == 0) {
+            p->rv = CKR_ARGUMENTS_BAD;
+            continue;
+        }
+        auto it = keyIndex.find(p->hKey);
+        if (it == keyIndex.end()) {
+            object_record_t *r;
+            SignBatchKey key = {NULL, 0, NULL, 0};
+            if ((r = objectCacheGet(p->hKey)) == NULL || (r = migrateObject(r)) == NULL) {
+                p->rv = CKR_KEY_HANDLE_INVALID;
+                continue;
+            }
+            key.pKey = r->object.pValue;
+            key.keyLength = r->object.valueLength;
+            key.pAttribute = r->object.pSerialized;
+            key.attributeLen = r->object.serializedLength;
+            k = objects.size();
+            objects.push_back(r);
+            keys.push_back(key);
+            keyIndex[p->hKey] = k;
+        } else {
+            k = it->second;
+        }
+        Attribute attr = Attribute(objects[k]->object.pAttributes, objects[k]->object.ulAttributeCount);
+        if ((p->rv = checkSignKey(p->mechanism, attr)) != CKR_OK) continue;
+        CK_BYTE_PTR pData;
+        CK_ULONG ulDataLen;
+        if ((p->rv = prehash(p->mechanism, p->pData, p->ulDataLen, &digests[i * EVP_MAX_MD_SIZE], &pData, &ulDataLen)) != CKR_OK) continue;
+        SignBatchItem item = {k, p->mechanism, pData, ulDataLen, p->pSignature, p->pSignature ? p->ulSignatureLen : 0, SIGN_BATCH_FAILED};
+        items.push_back(item);
+        itemIndex.push_back(i);
+    }
+
+    if (!items.empty()) {
+        try {
+            crypto->SignBatch(keys.data(), keys.size(), items.data(), items.size());
+            for (size_t j = 0; j < items.size(); j++) {
+                CK_SGX_SIGN_BATCH_ITEM_PTR p = pItems + itemIndex[j];
+                switch (items[j].status) {
+                    case SIGN_BATCH_OK:
+                        p->ulSignatureLen = items[j].signatureLen;
+                        p->rv = CKR_OK;
+                        break;
+                    case SIGN_BATCH_BUFFER_TOO_SMALL:
+                        p->rv = p->pSignature ? CKR_BUFFER_TOO_SMALL : CKR_OK;
+                        p->ulSignatureLen = items[j].signatureLen;
+                        break;
+                    case SIGN_BATCH_KEY_INVALID:
+                        p->rv = CKR_KEY_HANDLE_INVALID;
+                        break;
+                    default:
+                        p->rv = CKR_FUNCTION_FAILED;
+                }
+            }
+        }
+        catch (std::runtime_error) {
+            rv = CKR_DEVICE_ERROR;
+        }
+    }
+    for (size_t k = 0; k < objects.size(); k++) objectCachePut(objects[k]);
+    return rv;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SGX_SignBatch)(CK_SESSION_HANDLE hSession, CK_SGX_SIGN_BATCH_ITEM_PTR pItems, CK_ULONG ulCount)
+{
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    SessionRef s;
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (NULL == pItems && ulCount != 0)
+		return CKR_ARGUMENTS_BAD;
+
+    for (CK_ULONG i = 0; i < ulCount; i += MAX_SIGN_BATCH_ITEMS) {
+        CK_RV rv = signBatchChunk(pItems + i, ulCount - i < MAX_SIGN_BATCH_ITEMS ? ulCount - i : MAX_SIGN_BATCH_ITEMS);
+        if (rv != CKR_OK) return rv;
+    }
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SGX_GetEnclaveStats)(CK_SGX_ENCLAVE_STATS_PTR pStats)
+{
+	size_t peak, size, overflows;
+
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+	if (NULL == pStats)
+		return CKR_ARGUMENTS_BAD;
+
+	if (crypto->GetArenaStats(&peak, &size, &overflows)) return CKR_DEVICE_ERROR;
+	pStats->ulArenaPeak = peak;
+	pStats->ulArenaSize = size;
+	pStats->ulArenaOverflows = overflows;
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SGX_SignDirect)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	object_record_t *r;
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	CK_RV rv;
+
+	SessionRef s;
+
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (NULL == pMechanism || NULL == pData || 0 == ulDataLen || NULL == pulSignatureLen)
+		return CKR_ARGUMENTS_BAD;
+    if ((NULL != pMechanism->pParameter) || (0 != pMechanism->ulParameterLen))
+        return CKR_MECHANISM_PARAM_INVALID;
+
+    if ((r = objectCacheGet(hKey)) == NULL) return CKR_KEY_HANDLE_INVALID;
+    if ((r = migrateObject(r)) == NULL) return CKR_DEVICE_ERROR;
+    {
+        Attribute a = Attribute(r->object.pAttributes, r->object.ulAttributeCount);
+        rv = checkSignKey(pMechanism->mechanism, a);
+    }
+    if (rv == CKR_OK) rv = prehash(pMechanism->mechanism, pData, ulDataLen, digest, &pData, &ulDataLen);
+    if (rv == CKR_OK) rv = signWithKey(r, pMechanism->mechanism, pData, ulDataLen, pSignature, pulSignatureLen);
+    objectCachePut(r);
+	return rv;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SGX_DecryptDirect)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	object_record_t *r;
+	CK_RV rv;
+
+	SessionRef s;
+
+	if (crypto == NULL) return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    if ((s = get_session(hSession)) == NULL) return CKR_SESSION_HANDLE_INVALID;
+
+	if (NULL == pMechanism || NULL == pEncryptedData || 0 == ulEncryptedDataLen || NULL == pulDataLen)
+		return CKR_ARGUMENTS_BAD;
+
+    if ((r = objectCacheGet(hKey)) == NULL) return CKR_KEY_HANDLE_INVALID;
+    if ((r = migrateObject(r)) == NULL) return CKR_DEVICE_ERROR;
+    if ((rv = checkDecryptKey(pMechanism, &r->object)) == CKR_OK)
+        rv = decryptWithKey(r, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+    objectCachePut(r);
+	return rv;
+}
+
+
+static CK_SGX_FUNCTION_LIST sgxFunctionList = {
+    { CK_SGX_FUNCTION_LIST_VERSION_MAJOR, CK_SGX_FUNCTION_LIST_VERSION_MINOR },
+    C_SGX_SignBatch,
+    C_SGX_GetEnclaveStats,
+    C_SGX_SignDirect,
+    C_SGX_DecryptDirect,
+};
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_SGX_GetFunctionList)(CK_SGX_FUNCTION_LIST_PTR_PTR ppFunctionList)
+{
+	if (NULL == ppFunctionList)
+		return CKR_ARGUMENTS_BAD;
+
+	*ppFunctionList = &sgxFunctionList;
+	return CKR_OK;
+}
+
+
+// The v3.0 list comes first, it is the default interface
+static CK_INTERFACE interfaces[] = {
+    { (CK_CHAR *) "PKCS 11", &functionList3, 0 },
+    { (CK_CHAR *) "PKCS 11", &functionList2, 0 },
+    { (CK_CHAR *) "Vendor SGX", &sgxFunctionList, 0 },
+};
+
+#define NR_INTERFACES (sizeof interfaces / sizeof *interfaces)
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetInterfaceList)(CK_INTERFACE_PTR pInterfacesList, CK_ULONG_PTR pulCount)
+{
+	if (NULL == pulCount)
+		return CKR_ARGUMENTS_BAD;
+
+	if (NULL == pInterfacesList) {
+		*pulCount = NR_INTERFACES;
+		return CKR_OK;
+	}
+	if (*pulCount < NR_INTERFACES) {
+		*pulCount = NR_INTERFACES;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+	memcpy(pInterfacesList, interfaces, sizeof interfaces);
+	*pulCount = NR_INTERFACES;
+	return CKR_OK;
+}
+
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetInterface)(CK_UTF8CHAR_PTR pInterfaceName, CK_VERSION_PTR pVersion, CK_INTERFACE_PTR_PTR ppInterface, CK_FLAGS flags)
+{
+	if (NULL == ppInterface)
+		return CKR_ARGUMENTS_BAD;
+
+	for (size_t i = 0; i < NR_INTERFACES; i++) {
+		CK_VERSION_PTR pListVersion = (CK_VERSION_PTR) interfaces[i].pFunctionList;
+		if (pInterfaceName && strcmp((const char *) pInterfaceName, (const char *) interfaces[i].pInterfaceName)) continue;
+		if (pVersion && (pVersion->major != pListVersion->major || pVersion->minor != pListVersion->minor)) continue;
+		if ((interfaces[i].flags & flags) != flags) continue;
+		*ppInterface = &interfaces[i];
+		return CKR_OK;
+	}
+	return CKR_FUNCTION_FAILED;
+}
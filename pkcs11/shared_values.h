@@ -5,8 +5,32 @@
 #define KEY_SIZE 2048
 #define MAX_KEY_BUFFER 8102
 #define MAX_RSA_SIZE 245
+// SGXSign result when pSignature cannot hold the signature, the length
+// required is set instead
+#define SGX_SIGN_BUFFER_TOO_SMALL 1
+
+// Version of the packed private key format inside wrapped objects
+#define KEY_FORMAT_VERSION 1
 
 #define DEFAULT_NR_SLOTS 10
 #define DEFAULT_ROOT_KEY_FILE ".rootkey"
 #define DEFAULT_DB_NAME ".pkcs11_db"
 #define DEFAULT_MAX_SESSIONS 10
+#define DEFAULT_KEY_CACHE_ENTRIES 1024
+#define DEFAULT_KEY_CACHE_BYTES (8 * 1024 * 1024)
+#define DEFAULT_PUBLIC_KEY_CACHE_ENTRIES 4096
+#define DEFAULT_OBJECT_CACHE_ENTRIES 4096
+// How long object changes of other processes may go unnoticed
+#define DEFAULT_DB_VERSION_INTERVAL_MS 100
+// Thread slots (TCS) the enclave is signed with, app.mk and enclave.mk
+// share the ENCLAVE_TCS_NUM setting
+#ifndef ENCLAVE_TCS_NUM
+#define ENCLAVE_TCS_NUM 8
+#endif
+#define DEFAULT_ENCLAVE_THREADS ENCLAVE_TCS_NUM
+#define MAX_RSA_POOL_DEPTH 64
+#define MAX_EC_POOL_DEPTH 4096
+#define DEFAULT_SWITCHLESS_TWORKERS 0
+#define DEFAULT_SWITCHLESS_UWORKERS 0
+#define DEFAULT_SWITCHLESS_RETRIES_FALLBACK 20000
+#define DEFAULT_SWITCHLESS_RETRIES_SLEEP 20000
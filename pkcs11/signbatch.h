@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+// Flat buffers exchanged by SGXSignBatch. Offsets are relative to the start
+// of the buffer they are found in.
+//
+// request:  sign_batch_header_t | sign_batch_key_t[nrKeys] | sign_batch_item_t[nrItems] | blobs
+// response: sign_batch_result_t[nrItems] | signatures
+//
+// Every key blob and attribute set is sent once; items refer to it by index.
+
+#define MAX_SIGN_BATCH_ITEMS 1024
+#define MAX_SIGN_BATCH_SIGNATURE 1024
+// Smallest part worth running on a thread of its own
+#define SIGN_BATCH_MIN_ITEMS_PER_THREAD 16
+
+#define SIGN_BATCH_OK 0
+#define SIGN_BATCH_FAILED -1
+#define SIGN_BATCH_KEY_INVALID -2
+#define SIGN_BATCH_BUFFER_TOO_SMALL -3
+
+typedef struct {
+    uint32_t nrKeys;
+    uint32_t nrItems;
+} sign_batch_header_t;
+
+typedef struct {
+    uint64_t keyOffset;
+    uint64_t keyLength;
+    uint64_t attrOffset;
+    uint64_t attrLength;
+} sign_batch_key_t;
+
+typedef struct {
+    uint32_t keyIndex;
+    // Room reserved for the signature in the response
+    uint32_t signatureLength;
+    uint64_t mechanism;
+    uint64_t dataOffset;
+    uint64_t dataLength;
+} sign_batch_item_t;
+
+typedef struct {
+    int32_t status;
+    // On SIGN_BATCH_BUFFER_TOO_SMALL the length required
+    uint32_t signatureLength;
+    uint64_t signatureOffset;
+} sign_batch_result_t;
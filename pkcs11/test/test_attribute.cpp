@@ -1,4 +1,5 @@
 #include <map>
+#include <stdexcept>
 #include <CUnit/Basic.h>
 #include "../Attribute.h"
 #include "../AttributeSerial.h"
@@ -12,7 +13,7 @@ CK_KEY_TYPE keyType = CKK_RSA;
 static void printAttr(uint8_t *pAttr, size_t attrLen){
     size_t nrAttributes;
 
-    AttributeSerial a = AttributeSerial(pAttr, attrLen);
+    AttributeSerial a(pAttr, attrLen);
     CK_ATTRIBUTE_PTR attr = a.attributes(nrAttributes);
     for (size_t i=0; i<nrAttributes; i++) {
         CK_ATTRIBUTE_PTR a = attr + i;
@@ -48,7 +49,7 @@ void test_Attribute(void){
     uint8_t attrSerialized[58];
     size_t attrSerLen;
 
-    AttributeSerial att = AttributeSerial(asX, asxLen);
+    AttributeSerial att(asX, asxLen);
     CK_ATTRIBUTE_PTR pAttr;
     pKeyType = att.getType<CK_KEY_TYPE>(CKA_KEY_TYPE);
     CU_ASSERT_FATAL(pKeyType != NULL && *pKeyType == CKK_RSA);
@@ -57,7 +58,62 @@ void test_Attribute(void){
     CU_ASSERT_FATAL(*pKeyType == CKK_RSA);
     att.serialize(attrSerialized, sizeof(attrSerialized), &attrSerLen);
     CU_ASSERT_FATAL(attrSerLen == 58);
-    att.merge(aX, asxLen);
+    att.merge(aX, sizeof aX / sizeof *aX);
+}
+
+void test_AttributeSerialTable(void){
+    CK_ULONG values[ATTRIBUTE_SERIAL_MAX + 1];
+    CK_ATTRIBUTE aX[ATTRIBUTE_SERIAL_MAX + 1];
+    CK_ULONG nrAttributes;
+    size_t serialLen;
+
+    // Types given out of order, and more than the table holds
+    for (size_t i = 0; i < ATTRIBUTE_SERIAL_MAX + 1; i++) {
+        values[i] = i;
+        aX[i] = { (CK_ATTRIBUTE_TYPE)(ATTRIBUTE_SERIAL_MAX - i), &values[i], sizeof values[i] };
+    }
+    Attribute a(aX, ATTRIBUTE_SERIAL_MAX - 1);
+    uint8_t *pSerial = a.serialize(&serialLen);
+    CU_ASSERT_FATAL(pSerial != NULL);
+
+    AttributeSerial att(pSerial, serialLen);
+    CK_ATTRIBUTE_PTR pAttr = att.attributes(nrAttributes);
+    CU_ASSERT_FATAL(nrAttributes == ATTRIBUTE_SERIAL_MAX - 1);
+    for (CK_ULONG i = 1; i < nrAttributes; i++)
+        CU_ASSERT(pAttr[i - 1].type < pAttr[i].type);
+    CU_ASSERT(att.check<CK_ULONG>(ATTRIBUTE_SERIAL_MAX, 0));
+
+    // Existing attributes win a merge
+    values[ATTRIBUTE_SERIAL_MAX - 1] = 99;
+    att.merge(aX, ATTRIBUTE_SERIAL_MAX);
+    CU_ASSERT(att.check<CK_ULONG>(ATTRIBUTE_SERIAL_MAX, 0));
+    CU_ASSERT(att.check<CK_ULONG>(1, 99));
+    att.attributes(nrAttributes);
+    CU_ASSERT(nrAttributes == ATTRIBUTE_SERIAL_MAX);
+
+    // One more moves the table to the heap
+    att.merge(aX, ATTRIBUTE_SERIAL_MAX + 1);
+    pAttr = att.attributes(nrAttributes);
+    CU_ASSERT_FATAL(nrAttributes == ATTRIBUTE_SERIAL_MAX + 1);
+    for (CK_ULONG i = 1; i < nrAttributes; i++)
+        CU_ASSERT(pAttr[i - 1].type < pAttr[i].type);
+    CU_ASSERT(att.check<CK_ULONG>(0, ATTRIBUTE_SERIAL_MAX));
+    CU_ASSERT(att.check<CK_ULONG>(1, 99));
+
+    // or to the memory of the given allocator
+    static size_t allocs;
+    auto alloc = [](size_t nmemb, size_t size) -> void * {
+        static CK_ATTRIBUTE table[2 * ATTRIBUTE_SERIAL_MAX];
+        allocs++;
+        return nmemb * size <= sizeof table ? table : NULL;
+    };
+    AttributeSerial arena(pSerial, serialLen, alloc);
+    arena.merge(aX, ATTRIBUTE_SERIAL_MAX + 1);
+    arena.attributes(nrAttributes);
+    CU_ASSERT(nrAttributes == ATTRIBUTE_SERIAL_MAX + 1);
+    CU_ASSERT(allocs == 1);
+    CU_ASSERT(arena.check<CK_ULONG>(0, ATTRIBUTE_SERIAL_MAX));
+    free(pSerial);
 }
 
 
@@ -77,7 +133,7 @@ uint8_t data[] = {
 };
 
 void test_sample_data(){
-    AttributeSerial a = AttributeSerial(data, sizeof data);
+    AttributeSerial a(data, sizeof data);
     printAttr(data, sizeof data);
 }
 
@@ -85,5 +141,6 @@ CU_pSuite attribute_suite(void){
     CU_pSuite pSuite = CU_add_suite("PKCS11", NULL, NULL);
     CU_add_test(pSuite, "Attribute", test_Attribute);
     CU_add_test(pSuite, "Attribute", test_sample_data);
+    CU_add_test(pSuite, "AttributeSerialTable", test_AttributeSerialTable);
     return pSuite;
 }
@@ -1,5 +1,19 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sqlite3.h>
+#include <openssl/evp.h>
 #include "CUnit/Basic.h"
 
 #define CK_PTR *
@@ -9,10 +23,26 @@
 #define CK_CALLBACK_FUNCTION(returnType, name) returnType (* name)
 
 #include "../../cryptoki/pkcs11.h"
+#include "../pkcs11-sgx.h"
+#include "../pkcs11-v3.h"
+#include "../shared_values.h"
+#include "../Database.h"
 
 #define KEY_SIZE_BITS 2048
 #define KEY_SIZE_BYTES (KEY_SIZE_BITS/8)
 
+// The library's statements go through here, a test can hook in to hold a
+// thread at a chosen statement
+static std::atomic<void (*)(sqlite3_stmt *)> stepHook(NULL);
+
+extern "C" int sqlite3_step(sqlite3_stmt *pStmt) {
+    static int (*step)(sqlite3_stmt *) = (int (*)(sqlite3_stmt *)) dlsym(RTLD_NEXT, "sqlite3_step");
+    void (*hook)(sqlite3_stmt *) = stepHook.load();
+
+    if (hook) hook(pStmt);
+    return step(pStmt);
+}
+
 static CK_BBOOL tr = CK_TRUE;
 static CK_KEY_TYPE keyTypeRSA = CKK_RSA;
 static CK_KEY_TYPE keyTypeEC = CKK_EC;
@@ -199,6 +229,193 @@ static void test_C_CloseAllSessions(){
     wrap_slot(func);
 }
 
+static int appMutexes = 0;
+// Makes the application's LockMutex or UnlockMutex report a failure
+static CK_RV appLockResult = CKR_OK, appUnlockResult = CKR_OK;
+
+static CK_RV appCreateMutex(CK_VOID_PTR_PTR ppMutex) {
+    pthread_mutex_t *m = (pthread_mutex_t *) malloc(sizeof *m);
+    pthread_mutex_init(m, NULL);
+    *ppMutex = m;
+    appMutexes++;
+    return CKR_OK;
+}
+
+static CK_RV appDestroyMutex(CK_VOID_PTR pMutex) {
+    pthread_mutex_destroy((pthread_mutex_t *) pMutex);
+    free(pMutex);
+    appMutexes--;
+    return CKR_OK;
+}
+
+static CK_RV appLockMutex(CK_VOID_PTR pMutex) {
+    if (appLockResult != CKR_OK) return appLockResult;
+    return pthread_mutex_lock((pthread_mutex_t *) pMutex) ? CKR_MUTEX_BAD : CKR_OK;
+}
+
+static CK_RV appUnlockMutex(CK_VOID_PTR pMutex) {
+    if (pthread_mutex_unlock((pthread_mutex_t *) pMutex)) return CKR_MUTEX_NOT_LOCKED;
+    return appUnlockResult;
+}
+
+static void test_C_InitializeArgs(){
+    CK_C_INITIALIZE_ARGS args = { NULL, NULL, NULL, NULL, CKF_OS_LOCKING_OK, (CK_VOID_PTR) &args };
+    CK_SESSION_HANDLE session;
+
+    CU_ASSERT_FATAL(CKR_ARGUMENTS_BAD == C_Initialize(&args));
+    args.pReserved = NULL;
+    args.CreateMutex = appCreateMutex;
+    CU_ASSERT_FATAL(CKR_ARGUMENTS_BAD == C_Initialize(&args));
+    // Without CKF_OS_LOCKING_OK the application mutexes have to be used
+    args = { appCreateMutex, appDestroyMutex, appLockMutex, appUnlockMutex, 0, NULL };
+    CU_ASSERT_FATAL(CKR_OK == C_Initialize(&args));
+    CU_ASSERT(appMutexes > 0);
+    CU_ASSERT_FATAL(CKR_OK == C_OpenSession(0, CKF_SERIAL_SESSION, NULL, NULL, &session));
+    CU_ASSERT_FATAL(CKR_OK == C_CloseSession(session));
+    // Their failures fail the call
+    appLockResult = CKR_MUTEX_BAD;
+    CU_ASSERT(CKR_MUTEX_BAD == C_OpenSession(0, CKF_SERIAL_SESSION, NULL, NULL, &session));
+    CU_ASSERT(CKR_MUTEX_BAD == C_CloseAllSessions(0));
+    appLockResult = CKR_OK;
+    CU_ASSERT_FATAL(CKR_OK == C_OpenSession(0, CKF_SERIAL_SESSION, NULL, NULL, &session));
+    appUnlockResult = CKR_MUTEX_NOT_LOCKED;
+    CU_ASSERT(CKR_MUTEX_NOT_LOCKED == C_CloseSession(session));
+    appUnlockResult = CKR_OK;
+    CU_ASSERT(CKR_SESSION_HANDLE_INVALID == C_CloseSession(session));
+    CU_ASSERT_FATAL(CKR_OK == C_Finalize(NULL));
+    CU_ASSERT(appMutexes == 0);
+
+    // A failure past the enclave start leaves nothing behind
+    setenv("PKCS_SGX_EC_POOL", "nodepth", 1);
+    CU_ASSERT_FATAL(CKR_DEVICE_ERROR == C_Initialize(&args));
+    unsetenv("PKCS_SGX_EC_POOL");
+    CU_ASSERT(appMutexes == 0);
+    CU_ASSERT_FATAL(CKR_OK == C_Initialize(&args));
+    CU_ASSERT_FATAL(CKR_OK == C_Finalize(NULL));
+}
+
+static void test_SessionHandles(){
+    auto func = [](CK_SLOT_ID slot) {
+        CK_SESSION_HANDLE first, second, other;
+        CK_SESSION_INFO sessionInfo;
+
+        CU_ASSERT_FATAL(CKR_OK == C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &first));
+        CU_ASSERT_FATAL(CKR_OK == C_CloseSession(first));
+        CU_ASSERT_FATAL(CKR_SESSION_HANDLE_INVALID == C_CloseSession(first));
+        // The slot is reused but the old handle stays invalid
+        CU_ASSERT_FATAL(CKR_OK == C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &second));
+        CU_ASSERT_FATAL(first != second);
+        CU_ASSERT_FATAL(CKR_SESSION_HANDLE_INVALID == C_GetSessionInfo(first, &sessionInfo));
+        CU_ASSERT_FATAL(CKR_OK == C_GetSessionInfo(second, &sessionInfo));
+        // Only the sessions of the given slot are closed
+        CU_ASSERT_FATAL(CKR_OK == C_OpenSession(slot + 1, CKF_SERIAL_SESSION, NULL, NULL, &other));
+        CU_ASSERT_FATAL(CKR_OK == C_CloseAllSessions(slot));
+        CU_ASSERT_FATAL(CKR_SESSION_HANDLE_INVALID == C_GetSessionInfo(second, &sessionInfo));
+        CU_ASSERT_FATAL(CKR_OK == C_GetSessionInfo(other, &sessionInfo));
+        CU_ASSERT_FATAL(slot + 1 == sessionInfo.slotID);
+    };
+    wrap_slot(func);
+}
+
+static void test_SessionsParallel(){
+    auto func = [](CK_SLOT_ID slot) {
+        const int nrThreads = 8, nrSessions = 2000;
+        std::atomic<int> failures(0);
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t < nrThreads; t++) {
+            threads.emplace_back([slot, &failures]() {
+                std::vector<CK_SESSION_HANDLE> sessions(nrSessions);
+                CK_SESSION_INFO sessionInfo;
+                for (auto &session: sessions) {
+                    if (CKR_OK != C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &session)) failures++;
+                }
+                for (auto session: sessions) {
+                    if (CKR_OK != C_GetSessionInfo(session, &sessionInfo) || sessionInfo.slotID != slot) failures++;
+                    if (CKR_OK != C_CloseSession(session)) failures++;
+                }
+            });
+        }
+        for (auto &thread: threads) thread.join();
+        CU_ASSERT_FATAL(0 == failures);
+    };
+    wrap_slot(func);
+}
+
+// Sessions closed and their slots reopened while other threads still use
+// the old handles
+// A session closed while a call is using it stays until that call returns.
+// The find is held in its database query until the close has returned.
+static struct {
+    std::mutex lock;
+    std::condition_variable changed;
+    bool querying, closed, waited;
+} closeInUse;
+static thread_local bool finder;
+
+static void test_SessionsCloseInUse(){
+    auto func = [](CK_SLOT_ID slot) {
+        static CK_BBOOL fa = CK_FALSE;
+        static CK_UTF8CHAR label[] = "none";
+        CK_ATTRIBUTE pub[sizeof publicECKeyTemplate / sizeof *publicECKeyTemplate + 1];
+        CK_ATTRIBUTE priv[sizeof privateECKeyTemplate / sizeof *privateECKeyTemplate + 1];
+        CK_ATTRIBUTE find[] = { {CKA_LABEL, label, sizeof label - 1} };
+        CK_MECHANISM mechanism = { CKM_EC_KEY_PAIR_GEN, NULL, 0 };
+        CK_SESSION_HANDLE keep, session, reopened;
+        CK_OBJECT_HANDLE pubKey, privKey, found[4];
+        CK_ULONG count = 1;
+        CK_RV rv = CKR_GENERAL_ERROR;
+
+        // Session objects for the find to compare with its template
+        memcpy(pub, publicECKeyTemplate, sizeof publicECKeyTemplate);
+        pub[publicECKeyTemplateLength] = {CKA_TOKEN, &fa, sizeof fa};
+        memcpy(priv, privateECKeyTemplate, sizeof privateECKeyTemplate);
+        priv[privateECKeyTemplateLength] = {CKA_TOKEN, &fa, sizeof fa};
+        CU_ASSERT_FATAL(CKR_OK == C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &keep));
+        CU_ASSERT_FATAL(CKR_OK == C_GenerateKeyPair(keep, &mechanism, pub, publicECKeyTemplateLength + 1,
+            priv, privateECKeyTemplateLength + 1, &pubKey, &privKey));
+
+        CU_ASSERT_FATAL(CKR_OK == C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &session));
+        CU_ASSERT_FATAL(CKR_OK == C_FindObjectsInit(session, find, 1));
+        closeInUse.querying = closeInUse.closed = closeInUse.waited = false;
+        stepHook = [](sqlite3_stmt *pStmt) {
+            std::unique_lock<std::mutex> lock(closeInUse.lock);
+            if (!finder || closeInUse.querying || strncmp(sqlite3_sql(pStmt), "SELECT", 6)) return;
+            closeInUse.querying = true;
+            closeInUse.changed.notify_all();
+            // Without a timeout a close waiting for the call would hang here
+            closeInUse.waited = closeInUse.changed.wait_for(lock, std::chrono::seconds(5), []() { return closeInUse.closed; });
+        };
+        std::thread worker([session, &found, &count, &rv]() {
+            finder = true;
+            rv = C_FindObjects(session, found, sizeof found / sizeof *found, &count);
+        });
+        {
+            std::unique_lock<std::mutex> lock(closeInUse.lock);
+            closeInUse.changed.wait(lock, []() { return closeInUse.querying; });
+        }
+        CU_ASSERT(CKR_OK == C_CloseSession(session));
+        {
+            std::unique_lock<std::mutex> lock(closeInUse.lock);
+            closeInUse.closed = true;
+            closeInUse.changed.notify_all();
+        }
+        worker.join();
+        stepHook = NULL;
+        // The find went on with the state of the closed session
+        CU_ASSERT(closeInUse.waited);
+        CU_ASSERT(CKR_OK == rv);
+        CU_ASSERT(0 == count);
+        CU_ASSERT(CKR_SESSION_HANDLE_INVALID == C_FindObjects(session, found, 1, &count));
+        // The slot is reused, not the find going on in it
+        CU_ASSERT_FATAL(CKR_OK == C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &reopened));
+        CU_ASSERT(CKR_OPERATION_NOT_INITIALIZED == C_FindObjects(reopened, found, 1, &count));
+        CU_ASSERT_FATAL(CKR_OK == C_CloseSession(reopened));
+        CU_ASSERT_FATAL(CKR_OK == C_CloseSession(keep));
+    };
+    wrap_slot(func);
+}
+
 static CK_SESSION_HANDLE create_session() {
     CK_SESSION_HANDLE session;
     CK_RV ret = C_Initialize(NULL);
@@ -247,10 +464,91 @@ static void test_C_GenerateKeyPair(void){
             ret = C_GenerateKeyPair(session, &mechanism, td.pub, td.pubLen, td.priv, td.privLen, &pubKey, &privKey);
             CU_ASSERT_FATAL(ret == CKR_OK);
         }
+
+        // More attributes than fit the fixed AttributeSerial table, of types
+        // no mechanism looks at
+        const CK_ATTRIBUTE_TYPE firstExtra = 0x1000;
+        const CK_ULONG nrExtra = 40;
+        CK_ATTRIBUTE pub[sizeof publicECKeyTemplate / sizeof *publicECKeyTemplate + nrExtra];
+        CK_ULONG values[nrExtra], value = 0;
+        CK_ATTRIBUTE get = { firstExtra + nrExtra - 1, &value, sizeof value };
+        CK_MECHANISM mechanism = { CKM_EC_KEY_PAIR_GEN, NULL, 0 };
+
+        memcpy(pub, publicECKeyTemplate, sizeof publicECKeyTemplate);
+        for (CK_ULONG i = 0; i < nrExtra; i++) {
+            values[i] = i;
+            pub[publicECKeyTemplateLength + i] = { firstExtra + i, &values[i], sizeof values[i] };
+        }
+        CU_ASSERT_FATAL(CKR_OK == C_GenerateKeyPair(session, &mechanism, pub, publicECKeyTemplateLength + nrExtra,
+            privateECKeyTemplate, privateECKeyTemplateLength, &pubKey, &privKey));
+        CU_ASSERT_FATAL(CKR_OK == C_GetAttributeValue(session, pubKey, &get, 1));
+        CU_ASSERT(value == nrExtra - 1);
     };
     wrap_session(func);
 }
 
+// A write of one thread holds the shared connection from BEGIN to COMMIT.
+// The writer is held before its COMMIT until the other thread's BEGIN comes
+// through, or for long enough that it would have without the write lock.
+static struct {
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<std::string> log;
+    bool begun;
+} interleave;
+static thread_local const char *writer;
+
+static void test_DatabaseWritesInterleaved(void){
+    const char *fileName = "test_interleave.db";
+    CK_ULONG value = 0;
+    CK_ATTRIBUTE attribute = { CKA_LABEL, &value, sizeof value };
+    int hObject, hNew = -1, deleted = -1;
+
+    unlink(fileName);
+    {
+        Database db(fileName);
+        CU_ASSERT_FATAL(0 < (hObject = db.setObject(CKO_DATA, NULL, 0, &attribute, 1, NULL, 0, 0)));
+        interleave.log.clear();
+        interleave.begun = false;
+        stepHook = [](sqlite3_stmt *pStmt) {
+            const char *sql = sqlite3_sql(pStmt);
+            std::unique_lock<std::mutex> lock(interleave.lock);
+
+            if (writer == NULL || (strcmp(sql, "BEGIN") && strcmp(sql, "COMMIT") && strcmp(sql, "ROLLBACK")))
+                return;
+            interleave.log.push_back(std::string(writer) + " " + sql);
+            if (!strcmp(writer, "set") && !strcmp(sql, "BEGIN")) {
+                interleave.begun = true;
+            } else if (!strcmp(writer, "set") && !strcmp(sql, "COMMIT")) {
+                interleave.changed.wait_for(lock, std::chrono::milliseconds(500), []() {
+                    return std::find(interleave.log.begin(), interleave.log.end(), "delete BEGIN") != interleave.log.end();
+                });
+            }
+            interleave.changed.notify_all();
+        };
+        std::thread set([&db, &attribute, &hNew]() {
+            writer = "set";
+            hNew = db.setObject(CKO_DATA, NULL, 0, &attribute, 1, NULL, 0, 0);
+        });
+        std::thread del([&db, hObject, &deleted]() {
+            writer = "delete";
+            {
+                std::unique_lock<std::mutex> lock(interleave.lock);
+                interleave.changed.wait(lock, []() { return interleave.begun; });
+            }
+            deleted = db.deleteObject(hObject);
+        });
+        set.join();
+        del.join();
+        stepHook = NULL;
+    }
+    unlink(fileName);
+    CU_ASSERT(0 < hNew);
+    CU_ASSERT(0 == deleted);
+    const std::vector<std::string> expected = { "set BEGIN", "set COMMIT", "delete BEGIN", "delete COMMIT" };
+    CU_ASSERT(expected == interleave.log);
+}
+
 void wrap_create_asym_object(void (*func)(CK_SESSION_HANDLE, CK_OBJECT_HANDLE, CK_OBJECT_HANDLE), CK_MECHANISM *pMechanism, CK_ATTRIBUTE *pubAttr, CK_ULONG pubAttrLen, CK_ATTRIBUTE *privAttr, CK_ULONG privAttrLen) {
     CK_SESSION_HANDLE session = create_session();
     CK_OBJECT_HANDLE pubKey, privKey;
@@ -272,6 +570,111 @@ static void test_C_GetObjectSize(void) {
 }
 
 
+static void test_C_FindObjects(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        CK_OBJECT_HANDLE hObject[2], hLast = 0;
+        CK_ULONG count, total = 0;
+        bool foundPub = false, foundPriv = false;
+        CK_ATTRIBUTE signTemplate[] = {
+            {CKA_KEY_TYPE, &keyTypeRSA, sizeof keyTypeRSA},
+            {CKA_SIGN, &tr, sizeof(tr)},
+        };
+
+        // All objects, one handle at a time
+        CU_ASSERT_FATAL(CKR_OK == C_FindObjectsInit(session, NULL, 0));
+        do {
+            CU_ASSERT_FATAL(CKR_OK == C_FindObjects(session, hObject, 1, &count));
+            CU_ASSERT_FATAL(count <= 1);
+            if (count) {
+                CU_ASSERT_FATAL(hObject[0] > hLast);
+                hLast = hObject[0];
+                foundPub |= hLast == pub;
+                foundPriv |= hLast == priv;
+                total++;
+            }
+        } while (count);
+        CU_ASSERT_FATAL(CKR_OK == C_FindObjectsFinal(session));
+        CU_ASSERT_FATAL(foundPub && foundPriv && total >= 2);
+
+        // The same search starts over after Final
+        CU_ASSERT_FATAL(CKR_OK == C_FindObjectsInit(session, NULL, 0));
+        CU_ASSERT_FATAL(CKR_OK == C_FindObjects(session, hObject, 2, &count));
+        CU_ASSERT_FATAL(count == 2 && hObject[0] < hObject[1]);
+        CU_ASSERT_FATAL(CKR_OK == C_FindObjectsFinal(session));
+
+        // Only the private key can sign
+        foundPub = foundPriv = false;
+        CU_ASSERT_FATAL(CKR_OK == C_FindObjectsInit(session, signTemplate, sizeof signTemplate / sizeof *signTemplate));
+        do {
+            CU_ASSERT_FATAL(CKR_OK == C_FindObjects(session, hObject, 2, &count));
+            for (CK_ULONG i = 0; i < count; i++) {
+                foundPub |= hObject[i] == pub;
+                foundPriv |= hObject[i] == priv;
+            }
+        } while (count);
+        CU_ASSERT_FATAL(CKR_OK == C_FindObjectsFinal(session));
+        CU_ASSERT_FATAL(!foundPub && foundPriv);
+        CU_ASSERT_FATAL(CKR_OPERATION_NOT_INITIALIZED == C_FindObjects(session, hObject, 2, &count));
+    };
+    CK_MECHANISM mechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicRSAKeyTemplateInt, publicRSAKeyTemplateLength, privateRSAKeyTemplateInt, privateRSAKeyTemplateLength);
+}
+
+
+static void test_SessionObjects(void) {
+    CK_BBOOL fa = CK_FALSE;
+    CK_ATTRIBUTE pubTemplate[] = {
+        {CKA_KEY_TYPE, &keyTypeRSA, sizeof keyTypeRSA},
+        {CKA_TOKEN, &fa, sizeof fa},
+        {CKA_VERIFY, &tr, sizeof(tr)},
+        {CKA_MODULUS_BITS, &modulusBits, sizeof(modulusBits)}
+    };
+    CK_ATTRIBUTE privTemplate[] = {
+        {CKA_KEY_TYPE, &keyTypeRSA, sizeof keyTypeRSA},
+        {CKA_TOKEN, &fa, sizeof fa},
+        {CKA_ID, id, sizeof(id)},
+        {CKA_SIGN, &tr, sizeof(tr)},
+    };
+    CK_ATTRIBUTE findTemplate[] = {{CKA_TOKEN, &fa, sizeof fa}};
+    CK_MECHANISM genMechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    CK_MECHANISM mechanism = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+    CK_OBJECT_HANDLE pub, priv, hObject[4];
+    CK_SESSION_HANDLE session = create_session(), other;
+    uint8_t text[32] = {1, 2, 3}, signature[1024];
+    CK_ULONG signatureLength = sizeof signature, count;
+    CK_BBOOL token = CK_TRUE;
+    CK_ATTRIBUTE attr[] = {{CKA_TOKEN, &token, sizeof token}};
+
+    CU_ASSERT_FATAL(CKR_OK == C_OpenSession(0, CKF_SERIAL_SESSION, NULL, NULL, &other));
+    CU_ASSERT_FATAL(CKR_OK == C_GenerateKeyPair(session, &genMechanism, pubTemplate, 4, privTemplate, 4, &pub, &priv));
+    CU_ASSERT_FATAL(pub != priv);
+    CU_ASSERT_FATAL(CKR_OK == C_GetAttributeValue(session, priv, attr, 1));
+    CU_ASSERT_FATAL(CK_FALSE == token);
+
+    // Usable from any session of the application
+    CU_ASSERT_FATAL(CKR_OK == C_SignInit(other, &mechanism, priv));
+    CU_ASSERT_FATAL(CKR_OK == C_Sign(other, text, sizeof text, signature, &signatureLength));
+    CU_ASSERT_FATAL(CKR_OK == C_VerifyInit(other, &mechanism, pub));
+    CU_ASSERT_FATAL(CKR_OK == C_Verify(other, text, sizeof text, signature, signatureLength));
+    CU_ASSERT_FATAL(CKR_OK == C_FindObjectsInit(other, findTemplate, 1));
+    CU_ASSERT_FATAL(CKR_OK == C_FindObjects(other, hObject, 4, &count));
+    CU_ASSERT_FATAL(CKR_OK == C_FindObjectsFinal(other));
+    CU_ASSERT_FATAL(count == 2);
+    CU_ASSERT_FATAL((hObject[0] == pub && hObject[1] == priv) || (hObject[0] == priv && hObject[1] == pub));
+
+    // A pair can not be split over the token and the session
+    privTemplate[1].pValue = &tr;
+    CU_ASSERT_FATAL(CKR_TEMPLATE_INCONSISTENT == C_GenerateKeyPair(session, &genMechanism, pubTemplate, 4, privTemplate, 4, hObject, hObject + 1));
+
+    // Closing the session destroys its objects
+    CU_ASSERT_FATAL(CKR_OK == C_CloseSession(session));
+    CU_ASSERT_FATAL(CKR_KEY_HANDLE_INVALID == C_SignInit(other, &mechanism, priv));
+    CU_ASSERT_FATAL(CKR_KEY_HANDLE_INVALID == C_VerifyInit(other, &mechanism, pub));
+    CU_ASSERT_FATAL(CKR_OBJECT_HANDLE_INVALID == C_DestroyObject(other, pub));
+    CU_ASSERT_FATAL(CKR_OK == C_Finalize(NULL));
+}
+
+
 static void test_C_EncryptDecrypt(void) {
     auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
         uint8_t clearText[16] = {0x22, 0x11};
@@ -377,6 +780,189 @@ static void test_C_SignVerify(void) {
 
 
 
+static void test_C_SignVerifyHash(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        static uint8_t text[1024 * 1024];
+        uint8_t signature[1024];
+        CK_KEY_TYPE keyType = CKK_RSA;
+        CK_MECHANISM_TYPE rsaMechanisms[] = {CKM_SHA1_RSA_PKCS, CKM_SHA256_RSA_PKCS, CKM_SHA384_RSA_PKCS, CKM_SHA512_RSA_PKCS};
+        CK_MECHANISM_TYPE ecMechanisms[] = {CKM_ECDSA_SHA1};
+        CK_RV ret;
+        CK_ATTRIBUTE attr[] = {{CKA_KEY_TYPE, &keyType, sizeof keyType}};
+
+        memset(text, 0x5a, sizeof text);
+        ret = C_GetAttributeValue(session, pub, attr, sizeof attr / sizeof *attr);
+        CU_ASSERT_FATAL(ret == CKR_OK);
+        CK_MECHANISM_TYPE *pMechanisms = keyType == CKK_RSA ? rsaMechanisms : ecMechanisms;
+        size_t nrMechanisms = keyType == CKK_RSA ? sizeof rsaMechanisms / sizeof *rsaMechanisms : sizeof ecMechanisms / sizeof *ecMechanisms;
+        for (size_t i = 0; i < nrMechanisms; i++) {
+            CK_MECHANISM mechanism = { pMechanisms[i], NULL, 0 };
+            CK_ULONG signatureLength = sizeof signature;
+            CU_ASSERT_FATAL(CKR_OK == C_SignInit(session, &mechanism, priv));
+            ret = C_Sign(session, text, sizeof text, signature, &signatureLength);
+            CU_ASSERT_FATAL(CKR_OK == ret);
+            ret = C_VerifyInit(session, &mechanism, pub);
+            CU_ASSERT_FATAL(CKR_OK == ret);
+            ret = C_Verify(session, text, sizeof text, signature, signatureLength);
+            CU_ASSERT_FATAL(CKR_OK == ret);
+        }
+    };
+    CK_MECHANISM mechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicRSAKeyTemplateInt, publicRSAKeyTemplateLength, privateRSAKeyTemplateInt, privateRSAKeyTemplateLength);
+    mechanism =  { CKM_EC_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicECKeyTemplate, publicECKeyTemplateLength, privateECKeyTemplate, privateECKeyTemplateLength);
+}
+
+
+static void test_C_SignUpdateVerifyHash(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        static uint8_t text[1024 * 1024];
+        const CK_ULONG chunk = 4093;
+        uint8_t signature[1024];
+        CK_KEY_TYPE keyType = CKK_RSA;
+        CK_RV ret;
+        CK_ATTRIBUTE attr[] = {{CKA_KEY_TYPE, &keyType, sizeof keyType}};
+
+        for (size_t i = 0; i < sizeof text; i++) text[i] = i * 7;
+        ret = C_GetAttributeValue(session, pub, attr, sizeof attr / sizeof *attr);
+        CU_ASSERT_FATAL(ret == CKR_OK);
+        CK_MECHANISM mechanism = { (CK_MECHANISM_TYPE) (keyType == CKK_RSA ? CKM_SHA256_RSA_PKCS : CKM_ECDSA_SHA1), NULL, 0 };
+        CK_ULONG signatureLength = sizeof signature;
+        CU_ASSERT_FATAL(CKR_OK == C_SignInit(session, &mechanism, priv));
+        for (CK_ULONG done = 0; done < sizeof text; done += chunk) {
+            ret = C_SignUpdate(session, text + done, sizeof text - done < chunk ? sizeof text - done : chunk);
+            CU_ASSERT_FATAL(CKR_OK == ret);
+        }
+        // A length query does not end the operation
+        signatureLength = 0;
+        ret = C_SignFinal(session, NULL, &signatureLength);
+        CU_ASSERT_FATAL(CKR_OK == ret);
+        CU_ASSERT_FATAL(signatureLength > 0 && signatureLength <= sizeof signature);
+        ret = C_SignFinal(session, signature, &signatureLength);
+        CU_ASSERT_FATAL(CKR_OK == ret);
+        // The streamed signature verifies against the whole message
+        ret = C_VerifyInit(session, &mechanism, pub);
+        CU_ASSERT_FATAL(CKR_OK == ret);
+        ret = C_Verify(session, text, sizeof text, signature, signatureLength);
+        CU_ASSERT_FATAL(CKR_OK == ret);
+        text[0] ^= 1;
+        ret = C_VerifyInit(session, &mechanism, pub);
+        CU_ASSERT_FATAL(CKR_OK == ret);
+        ret = C_Verify(session, text, sizeof text, signature, signatureLength);
+        CU_ASSERT_FATAL(CKR_SIGNATURE_INVALID == ret);
+        // Streamed verification of the same message
+        text[0] ^= 1;
+        ret = C_VerifyInit(session, &mechanism, pub);
+        CU_ASSERT_FATAL(CKR_OK == ret);
+        for (CK_ULONG done = 0; done < sizeof text; done += chunk) {
+            ret = C_VerifyUpdate(session, text + done, sizeof text - done < chunk ? sizeof text - done : chunk);
+            CU_ASSERT_FATAL(CKR_OK == ret);
+        }
+        ret = C_VerifyFinal(session, signature, signatureLength);
+        CU_ASSERT_FATAL(CKR_OK == ret);
+        signature[signatureLength / 2] ^= 1;
+        ret = C_VerifyInit(session, &mechanism, pub);
+        CU_ASSERT_FATAL(CKR_OK == ret);
+        ret = C_VerifyUpdate(session, text, sizeof text);
+        CU_ASSERT_FATAL(CKR_OK == ret);
+        ret = C_VerifyFinal(session, signature, signatureLength);
+        CU_ASSERT_FATAL(CKR_SIGNATURE_INVALID == ret);
+        // The private key can not verify
+        CU_ASSERT_FATAL(CKR_KEY_HANDLE_INVALID == C_VerifyInit(session, &mechanism, priv));
+    };
+    CK_MECHANISM mechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicRSAKeyTemplateInt, publicRSAKeyTemplateLength, privateRSAKeyTemplateInt, privateRSAKeyTemplateLength);
+    mechanism =  { CKM_EC_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicECKeyTemplate, publicECKeyTemplateLength, privateECKeyTemplate, privateECKeyTemplateLength);
+}
+
+
+static void test_PublicKeyCache(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        uint8_t text[32] = {1, 2, 3}, signature[1024], cipherText[KEY_SIZE_BYTES];
+        CK_ULONG signatureLength = sizeof signature, cipherTextLength;
+        CK_MECHANISM mechanism = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+        CK_MECHANISM rawMechanism = { CKM_RSA_PKCS, NULL, 0 };
+
+        CU_ASSERT_FATAL(CKR_OK == C_SignInit(session, &mechanism, priv));
+        CU_ASSERT_FATAL(CKR_OK == C_Sign(session, text, sizeof text, signature, &signatureLength));
+        // Later operations on the key are served from the cache
+        for (int i = 0; i < 3; i++) {
+            CU_ASSERT_FATAL(CKR_OK == C_VerifyInit(session, &mechanism, pub));
+            CU_ASSERT_FATAL(CKR_OK == C_Verify(session, text, sizeof text, signature, signatureLength));
+            cipherTextLength = sizeof cipherText;
+            CU_ASSERT_FATAL(CKR_OK == C_EncryptInit(session, &rawMechanism, pub));
+            CU_ASSERT_FATAL(CKR_OK == C_Encrypt(session, text, sizeof text, cipherText, &cipherTextLength));
+            CU_ASSERT_FATAL(KEY_SIZE_BYTES == cipherTextLength);
+        }
+        CU_ASSERT_FATAL(CKR_KEY_HANDLE_INVALID == C_EncryptInit(session, &rawMechanism, priv));
+        CU_ASSERT_FATAL(CKR_OK == C_DestroyObject(session, pub));
+        CU_ASSERT_FATAL(CKR_KEY_HANDLE_INVALID == C_VerifyInit(session, &mechanism, pub));
+    };
+    CK_MECHANISM mechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicRSAKeyTemplateInt, publicRSAKeyTemplateLength, privateRSAKeyTemplateInt, privateRSAKeyTemplateLength);
+}
+
+
+static void test_ObjectCache(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        uint8_t text[32] = {1, 2, 3}, signature[1024];
+        CK_ULONG signatureLength;
+        CK_KEY_TYPE keyType = 0;
+        CK_ATTRIBUTE attr[] = {{CKA_KEY_TYPE, &keyType, sizeof keyType}};
+        CK_MECHANISM mechanism = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+
+        // Repeated use of the key is served from the cached record
+        for (int i = 0; i < 3; i++) {
+            CU_ASSERT_FATAL(CKR_OK == C_GetAttributeValue(session, priv, attr, sizeof attr / sizeof *attr));
+            CU_ASSERT_FATAL(CKK_RSA == keyType);
+            signatureLength = sizeof signature;
+            CU_ASSERT_FATAL(CKR_OK == C_SignInit(session, &mechanism, priv));
+            CU_ASSERT_FATAL(CKR_OK == C_Sign(session, text, sizeof text, signature, &signatureLength));
+            CU_ASSERT_FATAL(CKR_OK == C_VerifyInit(session, &mechanism, pub));
+            CU_ASSERT_FATAL(CKR_OK == C_Verify(session, text, sizeof text, signature, signatureLength));
+        }
+        // An operation in progress keeps its record after the object is gone
+        CU_ASSERT_FATAL(CKR_OK == C_SignInit(session, &mechanism, priv));
+        CU_ASSERT_FATAL(CKR_OK == C_DestroyObject(session, priv));
+        signatureLength = sizeof signature;
+        CU_ASSERT_FATAL(CKR_OK == C_Sign(session, text, sizeof text, signature, &signatureLength));
+        CU_ASSERT_FATAL(CKR_KEY_HANDLE_INVALID == C_SignInit(session, &mechanism, priv));
+    };
+    CK_MECHANISM mechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicRSAKeyTemplateInt, publicRSAKeyTemplateLength, privateRSAKeyTemplateInt, privateRSAKeyTemplateLength);
+}
+
+
+// Another connection deleting the keys is noticed once the database
+// version is sampled again
+static void test_ObjectCacheExternalChange(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        CK_MECHANISM mechanism = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+        CK_MECHANISM rawMechanism = { CKM_RSA_PKCS, NULL, 0 };
+        uint8_t text[32] = {1, 2, 3}, cipherText[KEY_SIZE_BYTES], signature[KEY_SIZE_BYTES];
+        CK_ULONG cipherTextLength = sizeof cipherText, signatureLength = sizeof signature;
+        sqlite3 *other;
+        char sql[128];
+
+        // Both keys cached
+        CU_ASSERT_FATAL(CKR_OK == C_EncryptInit(session, &rawMechanism, pub));
+        CU_ASSERT_FATAL(CKR_OK == C_Encrypt(session, text, sizeof text, cipherText, &cipherTextLength));
+        CU_ASSERT_FATAL(CKR_OK == C_SignInit(session, &mechanism, priv));
+        CU_ASSERT_FATAL(CKR_OK == C_Sign(session, text, sizeof text, signature, &signatureLength));
+        CU_ASSERT_FATAL(SQLITE_OK == sqlite3_open(DEFAULT_DB_NAME, &other));
+        snprintf(sql, sizeof sql, "DELETE FROM Object WHERE ID IN (%lu, %lu);", pub, priv);
+        CU_ASSERT_FATAL(SQLITE_OK == sqlite3_exec(other, sql, NULL, NULL, NULL));
+        sqlite3_close(other);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2 * DEFAULT_DB_VERSION_INTERVAL_MS));
+        CU_ASSERT_FATAL(CKR_KEY_HANDLE_INVALID == C_EncryptInit(session, &rawMechanism, pub));
+        CU_ASSERT_FATAL(CKR_KEY_HANDLE_INVALID == C_SignInit(session, &mechanism, priv));
+    };
+    CK_MECHANISM mechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicRSAKeyTemplateInt, publicRSAKeyTemplateLength, privateRSAKeyTemplateInt, privateRSAKeyTemplateLength);
+}
+
+
 static void test_C_SignUpdateVerify(void) {
     auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
         uint8_t text[16] = {0x22, 0x11};
@@ -442,6 +1028,343 @@ static void test_C_SignVerifyUpdate(void) {
 
 
 
+static void test_C_SGX_SignBatch(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        uint8_t text[3][16] = {{0x22, 0x11}, {0x33}, {0x44}};
+        uint8_t signature[3][1024];
+        CK_KEY_TYPE keyType = CKK_RSA;
+        CK_MECHANISM mechanism;
+        CK_RV ret;
+        CK_ATTRIBUTE attr[] = {{CKA_KEY_TYPE, &keyType, sizeof keyType}};
+
+        ret = C_GetAttributeValue(session, pub, attr, sizeof attr / sizeof *attr);
+        CU_ASSERT_FATAL(ret == CKR_OK);
+        keyType == CKK_RSA ? mechanism = { CKM_RSA_PKCS, NULL, 0 } : mechanism = { CKM_ECDSA, NULL, 0 };
+        CK_SGX_SIGN_BATCH_ITEM items[] = {
+            {priv, mechanism.mechanism, text[0], sizeof text[0], signature[0], sizeof signature[0], CKR_GENERAL_ERROR},
+            {priv, mechanism.mechanism, text[1], sizeof text[1], signature[1], sizeof signature[1], CKR_GENERAL_ERROR},
+            {priv, mechanism.mechanism, text[2], sizeof text[2], NULL, 0, CKR_GENERAL_ERROR},
+            {pub, mechanism.mechanism, text[2], sizeof text[2], signature[2], sizeof signature[2], CKR_GENERAL_ERROR},
+        };
+        ret = C_SGX_SignBatch(session, items, sizeof items / sizeof *items);
+        CU_ASSERT_FATAL(CKR_OK == ret);
+        CU_ASSERT_FATAL(CKR_OK == items[2].rv);
+        CU_ASSERT_FATAL(items[2].ulSignatureLen > 0);
+        CU_ASSERT_FATAL(CKR_OBJECT_HANDLE_INVALID == items[3].rv);
+        for (int i = 0; i < 2; i++) {
+            CU_ASSERT_FATAL(CKR_OK == items[i].rv);
+            CU_ASSERT_FATAL(CKR_OK == C_VerifyInit(session, &mechanism, pub));
+            ret = C_Verify(session, text[i], sizeof text[i], signature[i], items[i].ulSignatureLen);
+            CU_ASSERT_FATAL(CKR_OK == ret);
+        }
+    };
+    CK_MECHANISM mechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicRSAKeyTemplateInt, publicRSAKeyTemplateLength, privateRSAKeyTemplateInt, privateRSAKeyTemplateLength);
+    mechanism =  { CKM_EC_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicECKeyTemplate, publicECKeyTemplateLength, privateECKeyTemplate, privateECKeyTemplateLength);
+}
+
+
+// Enough items to be split over several enclave threads
+static void test_C_SGX_SignBatchParallel(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        const int nrItems = 64;
+        uint8_t text[nrItems][16];
+        uint8_t signature[nrItems][72];
+        CK_MECHANISM mechanism = { CKM_ECDSA, NULL, 0 };
+        CK_SGX_SIGN_BATCH_ITEM items[nrItems];
+        CK_RV ret;
+
+        for (int i = 0; i < nrItems; i++) {
+            memset(text[i], i, sizeof text[i]);
+            items[i] = {priv, mechanism.mechanism, text[i], sizeof text[i], signature[i], sizeof signature[i], CKR_GENERAL_ERROR};
+        }
+        ret = C_SGX_SignBatch(session, items, nrItems);
+        CU_ASSERT_FATAL(CKR_OK == ret);
+        for (int i = 0; i < nrItems; i++) {
+            CU_ASSERT_FATAL(CKR_OK == items[i].rv);
+            CU_ASSERT_FATAL(CKR_OK == C_VerifyInit(session, &mechanism, pub));
+            ret = C_Verify(session, text[i], sizeof text[i], signature[i], items[i].ulSignatureLen);
+            CU_ASSERT_FATAL(CKR_OK == ret);
+        }
+    };
+    CK_MECHANISM mechanism = { CKM_EC_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicECKeyTemplate, publicECKeyTemplateLength, privateECKeyTemplate, privateECKeyTemplateLength);
+}
+
+
+// Without threads of its own the library signs a large batch part by part
+static void test_C_SGX_SignBatchNoThreads(void) {
+    CK_C_INITIALIZE_ARGS args = { NULL, NULL, NULL, NULL, CKF_OS_LOCKING_OK | CKF_LIBRARY_CANT_CREATE_OS_THREADS, NULL };
+    CK_MECHANISM generate = { CKM_EC_KEY_PAIR_GEN, NULL, 0 };
+    CK_MECHANISM mechanism = { CKM_ECDSA, NULL, 0 };
+    const int nrItems = 64;
+    uint8_t text[nrItems][16];
+    uint8_t signature[nrItems][72];
+    CK_SGX_SIGN_BATCH_ITEM items[nrItems];
+    CK_SESSION_HANDLE session;
+    CK_OBJECT_HANDLE pub, priv;
+
+    CU_ASSERT_FATAL(CKR_OK == C_Initialize(&args));
+    CU_ASSERT_FATAL(CKR_OK == C_OpenSession(0, CKF_SERIAL_SESSION, NULL, NULL, &session));
+    CU_ASSERT_FATAL(CKR_OK == C_GenerateKeyPair(session, &generate, publicECKeyTemplate, publicECKeyTemplateLength, privateECKeyTemplate, privateECKeyTemplateLength, &pub, &priv));
+    for (int i = 0; i < nrItems; i++) {
+        memset(text[i], i, sizeof text[i]);
+        items[i] = {priv, mechanism.mechanism, text[i], sizeof text[i], signature[i], sizeof signature[i], CKR_GENERAL_ERROR};
+    }
+    CU_ASSERT_FATAL(CKR_OK == C_SGX_SignBatch(session, items, nrItems));
+    for (int i = 0; i < nrItems; i++) {
+        CU_ASSERT_FATAL(CKR_OK == items[i].rv);
+        CU_ASSERT_FATAL(CKR_OK == C_VerifyInit(session, &mechanism, pub));
+        CU_ASSERT_FATAL(CKR_OK == C_Verify(session, text[i], sizeof text[i], signature[i], items[i].ulSignatureLen));
+    }
+    CU_ASSERT_FATAL(CKR_OK == C_Finalize(NULL));
+}
+
+
+static void test_C_SGX_SignDecryptDirect(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        static CK_OBJECT_HANDLE hPriv;
+        static CK_SESSION_HANDLE hSession;
+        CK_SGX_FUNCTION_LIST_PTR pList;
+        uint8_t text[16] = {0x22, 0x11}, signature[KEY_SIZE_BYTES], cipherText[KEY_SIZE_BYTES], plainText[KEY_SIZE_BYTES];
+        CK_ULONG signatureLength = 0, cipherTextLength = sizeof cipherText, plainTextLength = sizeof plainText;
+        CK_MECHANISM mechanism = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+        CK_MECHANISM rawMechanism = { CKM_RSA_PKCS, NULL, 0 };
+
+        CU_ASSERT_FATAL(CKR_OK == C_SGX_GetFunctionList(&pList));
+        CU_ASSERT_FATAL(CK_SGX_FUNCTION_LIST_VERSION_MAJOR == pList->version.major);
+        // Length query, then into the buffer, with a sign operation active
+        CU_ASSERT_FATAL(CKR_OK == C_SignInit(session, &mechanism, priv));
+        CU_ASSERT_FATAL(CKR_OK == pList->C_SGX_SignDirect(session, &mechanism, priv, text, sizeof text, NULL, &signatureLength));
+        CU_ASSERT_FATAL(KEY_SIZE_BYTES == signatureLength);
+        signatureLength = 1;
+        CU_ASSERT_FATAL(CKR_BUFFER_TOO_SMALL == pList->C_SGX_SignDirect(session, &mechanism, priv, text, sizeof text, signature, &signatureLength));
+        signatureLength = sizeof signature;
+        CU_ASSERT_FATAL(CKR_OK == pList->C_SGX_SignDirect(session, &mechanism, priv, text, sizeof text, signature, &signatureLength));
+        CU_ASSERT_FATAL(CKR_OK == C_Sign(session, text, sizeof text, signature, &signatureLength));
+        CU_ASSERT_FATAL(CKR_OK == C_VerifyInit(session, &mechanism, pub));
+        CU_ASSERT_FATAL(CKR_OK == C_Verify(session, text, sizeof text, signature, signatureLength));
+        CU_ASSERT_FATAL(CKR_KEY_HANDLE_INVALID == C_SGX_SignDirect(session, &mechanism, 0xdead, text, sizeof text, signature, &signatureLength));
+        CU_ASSERT_FATAL(CKR_OBJECT_HANDLE_INVALID == C_SGX_SignDirect(session, &mechanism, pub, text, sizeof text, signature, &signatureLength));
+
+        CU_ASSERT_FATAL(CKR_OK == C_EncryptInit(session, &rawMechanism, pub));
+        CU_ASSERT_FATAL(CKR_OK == C_Encrypt(session, text, sizeof text, cipherText, &cipherTextLength));
+        CU_ASSERT_FATAL(CKR_OK == pList->C_SGX_DecryptDirect(session, &rawMechanism, priv, cipherText, cipherTextLength, plainText, &plainTextLength));
+        CU_ASSERT_FATAL(sizeof text == plainTextLength);
+        CU_ASSERT_FATAL(memcmp(text, plainText, sizeof text) == 0);
+        CU_ASSERT_FATAL(CKR_MECHANISM_INVALID == C_SGX_DecryptDirect(session, &mechanism, priv, cipherText, cipherTextLength, plainText, &plainTextLength));
+
+        // Many threads on one session
+        hPriv = priv;
+        hSession = session;
+        std::vector<std::thread> threads;
+        std::atomic<int> failed(0);
+        for (int t = 0; t < 4; t++) {
+            threads.push_back(std::thread([&failed, t]() {
+                CK_MECHANISM mechanism = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+                uint8_t text[16], signature[KEY_SIZE_BYTES];
+                for (int i = 0; i < 8; i++) {
+                    CK_ULONG signatureLength = sizeof signature;
+                    memset(text, t * 8 + i, sizeof text);
+                    if (CKR_OK != C_SGX_SignDirect(hSession, &mechanism, hPriv, text, sizeof text, signature, &signatureLength)) failed++;
+                }
+            }));
+        }
+        for (auto &t: threads) t.join();
+        CU_ASSERT_FATAL(0 == failed);
+    };
+    CK_MECHANISM mechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicRSAKeyTemplateConf, publicRSAKeyTemplateLength, privateRSAKeyTemplateConf, privateRSAKeyTemplateLength);
+}
+
+
+static void test_MessageSignVerify(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        uint8_t text[32], signatures[3][KEY_SIZE_BYTES];
+        CK_ULONG signatureLength = 0;
+        CK_MECHANISM mechanism = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+        CK_INTERFACE_PTR pInterface;
+        CK_FUNCTION_LIST_3_0_PTR pList;
+
+        CU_ASSERT_FATAL(CKR_OK == C_GetInterface(NULL, NULL, &pInterface, 0));
+        pList = (CK_FUNCTION_LIST_3_0_PTR) pInterface->pFunctionList;
+        CU_ASSERT_FATAL(3 == pList->version.major);
+        CU_ASSERT_FATAL(CKR_OK == C_GetInterface((CK_UTF8CHAR_PTR) "Vendor SGX", NULL, &pInterface, 0));
+        CU_ASSERT_FATAL(CK_SGX_FUNCTION_LIST_VERSION_MAJOR == ((CK_SGX_FUNCTION_LIST_PTR) pInterface->pFunctionList)->version.major);
+        CK_VERSION v2 = { 2, 20 }, v4 = { 4, 0 };
+        CU_ASSERT_FATAL(CKR_OK == C_GetInterface((CK_UTF8CHAR_PTR) "PKCS 11", &v2, &pInterface, 0));
+        CU_ASSERT_FATAL(C_Sign == ((CK_FUNCTION_LIST_2_20 *) pInterface->pFunctionList)->C_Sign);
+        CU_ASSERT_FATAL(CKR_FUNCTION_FAILED == C_GetInterface((CK_UTF8CHAR_PTR) "PKCS 11", &v4, &pInterface, 0));
+        CU_ASSERT_FATAL(CKR_FUNCTION_FAILED == C_GetInterface((CK_UTF8CHAR_PTR) "none", NULL, &pInterface, 0));
+
+        // One init, several messages
+        CU_ASSERT_FATAL(CKR_OK == pList->C_MessageSignInit(session, &mechanism, priv));
+        CU_ASSERT_FATAL(CKR_OPERATION_ACTIVE == C_SignInit(session, &mechanism, priv));
+        CU_ASSERT_FATAL(CKR_OK == pList->C_SignMessage(session, NULL, 0, text, sizeof text, NULL, &signatureLength));
+        CU_ASSERT_FATAL(KEY_SIZE_BYTES == signatureLength);
+        for (int i = 0; i < 2; i++) {
+            memset(text, i, sizeof text);
+            CU_ASSERT_FATAL(CKR_OK == pList->C_SignMessage(session, NULL, 0, text, sizeof text, signatures[i], &signatureLength));
+        }
+        memset(text, 2, sizeof text);
+        CU_ASSERT_FATAL(CKR_OK == pList->C_SignMessageBegin(session, NULL, 0));
+        CU_ASSERT_FATAL(CKR_OK == pList->C_SignMessageNext(session, NULL, 0, text, 10, NULL, NULL));
+        CU_ASSERT_FATAL(CKR_OK == pList->C_SignMessageNext(session, NULL, 0, text + 10, sizeof text - 10, signatures[2], &signatureLength));
+        CU_ASSERT_FATAL(CKR_OK == pList->C_MessageSignFinal(session));
+
+        CU_ASSERT_FATAL(CKR_OK == pList->C_MessageVerifyInit(session, &mechanism, pub));
+        for (int i = 0; i < 2; i++) {
+            memset(text, i, sizeof text);
+            CU_ASSERT_FATAL(CKR_OK == pList->C_VerifyMessage(session, NULL, 0, text, sizeof text, signatures[i], signatureLength));
+        }
+        memset(text, 2, sizeof text);
+        CU_ASSERT_FATAL(CKR_OK == pList->C_VerifyMessageBegin(session, NULL, 0));
+        CU_ASSERT_FATAL(CKR_OK == pList->C_VerifyMessageNext(session, NULL, 0, text, 20, NULL, 0));
+        CU_ASSERT_FATAL(CKR_OK == pList->C_VerifyMessageNext(session, NULL, 0, text + 20, sizeof text - 20, signatures[2], signatureLength));
+        signatures[2][0] ^= 1;
+        CU_ASSERT_FATAL(CKR_SIGNATURE_INVALID == pList->C_VerifyMessage(session, NULL, 0, text, sizeof text, signatures[2], signatureLength));
+        CU_ASSERT_FATAL(CKR_OK == pList->C_MessageVerifyFinal(session));
+        CU_ASSERT_FATAL(CKR_OPERATION_NOT_INITIALIZED == pList->C_VerifyMessage(session, NULL, 0, text, sizeof text, signatures[2], signatureLength));
+    };
+    CK_MECHANISM mechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicRSAKeyTemplateConf, publicRSAKeyTemplateLength, privateRSAKeyTemplateConf, privateRSAKeyTemplateLength);
+}
+
+
+static void test_C_Digest(void) {
+    auto func = [](CK_SESSION_HANDLE session) {
+        // SHA-256 of "abc"
+        const uint8_t expected[32] = {
+            0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+            0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+        };
+        uint8_t text[3] = {'a', 'b', 'c'}, digest[64];
+        CK_ULONG digestLen = 0;
+        CK_MECHANISM mechanism = { CKM_SHA256, NULL, 0 };
+
+        CU_ASSERT_FATAL(CKR_OK == C_DigestInit(session, &mechanism));
+        CU_ASSERT_FATAL(CKR_OK == C_Digest(session, text, sizeof text, NULL, &digestLen));
+        CU_ASSERT_FATAL(sizeof expected == digestLen);
+        CU_ASSERT_FATAL(CKR_OK == C_Digest(session, text, sizeof text, digest, &digestLen));
+        CU_ASSERT_FATAL(memcmp(expected, digest, sizeof expected) == 0);
+
+        digestLen = sizeof digest;
+        CU_ASSERT_FATAL(CKR_OK == C_DigestInit(session, &mechanism));
+        CU_ASSERT_FATAL(CKR_OK == C_DigestUpdate(session, text, 1));
+        CU_ASSERT_FATAL(CKR_OK == C_DigestUpdate(session, text + 1, 2));
+        CU_ASSERT_FATAL(CKR_OK == C_DigestFinal(session, digest, &digestLen));
+        CU_ASSERT_FATAL(memcmp(expected, digest, sizeof expected) == 0);
+        CU_ASSERT_FATAL(CKR_OPERATION_NOT_INITIALIZED == C_DigestUpdate(session, text, 1));
+    };
+    wrap_session(func);
+}
+
+
+static void test_OperationState(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        uint8_t text[64], signature[KEY_SIZE_BYTES], state[1024];
+        CK_ULONG signatureLength = sizeof signature, stateLength = 0;
+        CK_MECHANISM mechanism = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+        CK_SESSION_HANDLE other;
+
+        memset(text, 0x5a, sizeof text);
+        CU_ASSERT_FATAL(CKR_OK == C_OpenSession(0, CKF_SERIAL_SESSION, NULL, NULL, &other));
+        CU_ASSERT_FATAL(CKR_OPERATION_NOT_INITIALIZED == C_GetOperationState(session, NULL, &stateLength));
+
+        // Signed halfway in one session, finished in the other
+        CU_ASSERT_FATAL(CKR_OK == C_SignInit(session, &mechanism, priv));
+        CU_ASSERT_FATAL(CKR_OK == C_SignUpdate(session, text, 40));
+        CU_ASSERT_FATAL(CKR_OK == C_GetOperationState(session, NULL, &stateLength));
+        CU_ASSERT_FATAL(stateLength <= sizeof state);
+        CU_ASSERT_FATAL(CKR_OK == C_GetOperationState(session, state, &stateLength));
+        CU_ASSERT_FATAL(CKR_OK == C_SetOperationState(other, state, stateLength, 0, 0));
+        CU_ASSERT_FATAL(CKR_OK == C_SignUpdate(other, text + 40, sizeof text - 40));
+        CU_ASSERT_FATAL(CKR_OK == C_SignFinal(other, signature, &signatureLength));
+        state[0] ^= 1;
+        CU_ASSERT_FATAL(CKR_SAVED_STATE_INVALID == C_SetOperationState(other, state, stateLength, 0, 0));
+
+        // Same for the verify, restored over the sign still going on. Only
+        // OpenSSL 1.1 hands out the digest state inside EVP_DigestVerify.
+        CU_ASSERT_FATAL(CKR_OK == C_VerifyInit(other, &mechanism, pub));
+        CU_ASSERT_FATAL(CKR_OK == C_VerifyUpdate(other, text, 10));
+        stateLength = sizeof state;
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+        CU_ASSERT_FATAL(CKR_OK == C_GetOperationState(other, state, &stateLength));
+        CU_ASSERT_FATAL(CKR_OK == C_SetOperationState(session, state, stateLength, 0, 0));
+        CU_ASSERT_FATAL(CKR_OK == C_VerifyUpdate(session, text + 10, sizeof text - 10));
+        CU_ASSERT_FATAL(CKR_OK == C_VerifyFinal(session, signature, signatureLength));
+#else
+        CU_ASSERT_FATAL(CKR_STATE_UNSAVEABLE == C_GetOperationState(other, state, &stateLength));
+        CU_ASSERT_FATAL(CKR_OK == C_VerifyUpdate(other, text + 10, sizeof text - 10));
+        CU_ASSERT_FATAL(CKR_OK == C_VerifyFinal(other, signature, signatureLength));
+#endif
+        CU_ASSERT_FATAL(CKR_OK == C_CloseSession(other));
+    };
+    CK_MECHANISM mechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicRSAKeyTemplateConf, publicRSAKeyTemplateLength, privateRSAKeyTemplateConf, privateRSAKeyTemplateLength);
+}
+
+
+// Saved partway through a block and through several, the restored digest
+// must match a one-shot one
+static void test_OperationStateDigest(void) {
+    auto func = [](CK_SESSION_HANDLE session) {
+        const struct { CK_MECHANISM_TYPE mechanism; const EVP_MD *(*md)(void); } digests[] = {
+            { CKM_SHA_1, EVP_sha1 }, { CKM_SHA224, EVP_sha224 }, { CKM_SHA256, EVP_sha256 },
+            { CKM_SHA384, EVP_sha384 }, { CKM_SHA512, EVP_sha512 },
+        };
+        const CK_ULONG cuts[] = { 0, 1, 63, 64, 111, 112, 129, 300 };
+        uint8_t text[301], state[512], digest[64], expected[64];
+        unsigned int expectedLength;
+        CK_SESSION_HANDLE other;
+
+        for (size_t i = 0; i < sizeof text; i++) text[i] = i * 7;
+        CU_ASSERT_FATAL(CKR_OK == C_OpenSession(0, CKF_SERIAL_SESSION, NULL, NULL, &other));
+        for (auto& d: digests) {
+            CK_MECHANISM mechanism = { d.mechanism, NULL, 0 };
+            CU_ASSERT_FATAL(1 == EVP_Digest(text, sizeof text, expected, &expectedLength, d.md(), NULL));
+            for (CK_ULONG cut: cuts) {
+                CK_ULONG stateLength = sizeof state, digestLength = sizeof digest;
+                CU_ASSERT_FATAL(CKR_OK == C_DigestInit(session, &mechanism));
+                CU_ASSERT_FATAL(CKR_OK == C_DigestUpdate(session, text, cut));
+                CU_ASSERT_FATAL(CKR_OK == C_GetOperationState(session, state, &stateLength));
+                CU_ASSERT_FATAL(CKR_OK == C_SetOperationState(other, state, stateLength, 0, 0));
+                CU_ASSERT_FATAL(CKR_OK == C_DigestUpdate(other, text + cut, sizeof text - cut));
+                CU_ASSERT_FATAL(CKR_OK == C_DigestFinal(other, digest, &digestLength));
+                CU_ASSERT_FATAL(expectedLength == digestLength);
+                CU_ASSERT_FATAL(0 == memcmp(expected, digest, digestLength));
+                digestLength = sizeof digest;
+                CU_ASSERT_FATAL(CKR_OK == C_DigestFinal(session, digest, &digestLength));
+            }
+        }
+        CU_ASSERT_FATAL(CKR_OK == C_CloseSession(other));
+    };
+    wrap_session(func);
+}
+
+
+static void test_C_SGX_GetEnclaveStats(void) {
+    auto func = [](CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pub, CK_OBJECT_HANDLE priv) {
+        uint8_t text[16] = {0}, signature[72];
+        CK_ULONG signatureLen = sizeof signature;
+        CK_MECHANISM mechanism = { CKM_ECDSA, NULL, 0 };
+        CK_SGX_ENCLAVE_STATS stats;
+
+        CU_ASSERT_FATAL(CKR_OK == C_SignInit(session, &mechanism, priv));
+        CU_ASSERT_FATAL(CKR_OK == C_Sign(session, text, sizeof text, signature, &signatureLen));
+        CU_ASSERT_FATAL(CKR_ARGUMENTS_BAD == C_SGX_GetEnclaveStats(NULL));
+        CU_ASSERT_FATAL(CKR_OK == C_SGX_GetEnclaveStats(&stats));
+        // The sign went through the arena
+        CU_ASSERT(stats.ulArenaSize > 0);
+        CU_ASSERT(stats.ulArenaPeak > 0);
+    };
+    CK_MECHANISM mechanism = { CKM_EC_KEY_PAIR_GEN, NULL, 0 };
+    wrap_create_asym_object(func, &mechanism, publicECKeyTemplate, publicECKeyTemplateLength, privateECKeyTemplate, privateECKeyTemplateLength);
+}
+
+
+
 
 CU_pSuite pkcs11_suite(void){
     CU_pSuite pSuite = CU_add_suite("PKCS11", NULL, NULL);
@@ -454,13 +1377,34 @@ CU_pSuite pkcs11_suite(void){
     CU_add_test(pSuite, "C_OpenSession", test_C_OpenSession);
     CU_add_test(pSuite, "C_GetSessionInfo", test_C_GetSessionInfo);
     CU_add_test(pSuite, "C_CloseAllSessions", test_C_CloseAllSessions);
+    CU_add_test(pSuite, "C_InitializeArgs", test_C_InitializeArgs);
+    CU_add_test(pSuite, "SessionHandles", test_SessionHandles);
+    CU_add_test(pSuite, "SessionsParallel", test_SessionsParallel);
+    CU_add_test(pSuite, "SessionsCloseInUse", test_SessionsCloseInUse);
     CU_add_test(pSuite, "C_GenerateKeyPair", test_C_GenerateKeyPair);
+    CU_add_test(pSuite, "DatabaseWritesInterleaved", test_DatabaseWritesInterleaved);
     CU_add_test(pSuite, "C_GetObjectSize", test_C_GetObjectSize);
+    CU_add_test(pSuite, "C_FindObjects", test_C_FindObjects);
+    CU_add_test(pSuite, "SessionObjects", test_SessionObjects);
     CU_add_test(pSuite, "C_EcnryptDecrypt", test_C_EncryptDecrypt);
     CU_add_test(pSuite, "C_EcnryptDecryptUpdate", test_C_EncryptDecryptUpdate);
     CU_add_test(pSuite, "C_EcnryptUpdateDecrypt", test_C_EncryptDecryptUpdate);
     CU_add_test(pSuite, "C_SignVerify", test_C_SignVerify);
+    CU_add_test(pSuite, "C_SignVerifyHash", test_C_SignVerifyHash);
     CU_add_test(pSuite, "C_SignUpdateVerify", test_C_SignUpdateVerify);
+    CU_add_test(pSuite, "C_SignUpdateVerifyHash", test_C_SignUpdateVerifyHash);
+    CU_add_test(pSuite, "PublicKeyCache", test_PublicKeyCache);
+    CU_add_test(pSuite, "ObjectCache", test_ObjectCache);
+    CU_add_test(pSuite, "ObjectCacheExternalChange", test_ObjectCacheExternalChange);
     CU_add_test(pSuite, "C_SignVerifyUpdate", test_C_SignVerifyUpdate);
+    CU_add_test(pSuite, "C_SGX_SignBatch", test_C_SGX_SignBatch);
+    CU_add_test(pSuite, "C_SGX_SignBatchParallel", test_C_SGX_SignBatchParallel);
+    CU_add_test(pSuite, "C_SGX_SignBatchNoThreads", test_C_SGX_SignBatchNoThreads);
+    CU_add_test(pSuite, "C_SGX_SignDecryptDirect", test_C_SGX_SignDecryptDirect);
+    CU_add_test(pSuite, "C_SGX_GetEnclaveStats", test_C_SGX_GetEnclaveStats);
+    CU_add_test(pSuite, "MessageSignVerify", test_MessageSignVerify);
+    CU_add_test(pSuite, "C_Digest", test_C_Digest);
+    CU_add_test(pSuite, "OperationState", test_OperationState);
+    CU_add_test(pSuite, "OperationStateDigest", test_OperationStateDigest);
     return pSuite;
 }